@@ -6,11 +6,14 @@
 //
 
 #include "Client.hpp"
+#include "Manager/ClientManager.hpp"
+#include "Manager/ClientNotifier.hpp"
 #include <libgeneral/macros.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
+#include <errno.h>
 #include "Muxer.hpp"
 #include "MUXException.hpp"
 #include "sysconf/sysconf.hpp"
@@ -21,6 +24,7 @@ Client::Client(Muxer *mux, ClientManager *parent, int fd, uint64_t number)
 , _fd(fd), _number(number), _recvbuffer(NULL), _recvBytesCnt(0)
 , _proto_version(0),
 _isListening(false), _info{}
+, _notifyQueueDead(false), _notifyOutOff(0), _notifyStats{}
 {
     debug("[Client] initializing Client %d",_fd);
     const int bufsize = Client::bufsize;
@@ -45,6 +49,11 @@ _isListening(false), _info{}
 Client::~Client(){
     debug("[Client] destroying Client %d",_fd);
     stopLoop();
+    {
+        std::unique_lock<std::mutex> ul(_notifyLck);
+        _notifyQueueDead = true;
+    }
+    if (_isListening) _parent->_notifier->remove(_number);
     {
         std::unique_lock<std::mutex> ul(_parent->_childrenLck);
         _parent->_children.erase(this);
@@ -84,16 +93,19 @@ bool Client::loopEvent(){
 #pragma mark private member function
 void Client::update_client_info(const plist_t dict){
     plist_t node = NULL;
-    if ((node = plist_dict_get_item(dict, "ClientVersionString")) && (plist_get_node_type(node) == PLIST_STRING)) {
-        plist_get_string_val(node, &_info.clientVersionString);
+    const char *str = NULL;
+    uint64_t str_len = 0;
+    std::unique_lock<std::mutex> ul(_infoLck);
+    if ((node = plist_dict_get_item(dict, "ClientVersionString")) && (str = plist_get_string_ptr(node, &str_len))) {
+        _info.clientVersionString.assign(str, str_len);
     }
 
-    if ((node = plist_dict_get_item(dict, "BundleID")) && (plist_get_node_type(node) == PLIST_STRING)) {
-        plist_get_string_val(node, &_info.bundleID);
+    if ((node = plist_dict_get_item(dict, "BundleID")) && (str = plist_get_string_ptr(node, &str_len))) {
+        _info.bundleID.assign(str, str_len);
     }
 
-    if ((node = plist_dict_get_item(dict, "ProgName")) && (plist_get_node_type(node) == PLIST_STRING)) {
-        plist_get_string_val(node, &_info.progName);
+    if ((node = plist_dict_get_item(dict, "ProgName")) && (str = plist_get_string_ptr(node, &str_len))) {
+        _info.progName.assign(str, str_len);
     }
 
     if ((node = plist_dict_get_item(dict, "kLibUSBMuxVersion")) && (plist_get_node_type(node) == PLIST_UINT)) {
@@ -101,6 +113,21 @@ void Client::update_client_info(const plist_t dict){
     }
 }
 
+void Client::update_client_info(const client_command_request &req){
+    auto update = [this](std::string &dst, std::string_view src){
+        if (!src.size() || dst == src) return; //unchanged, don't take the lock
+        std::unique_lock<std::mutex> ul(_infoLck);
+        dst = src;
+    };
+    update(_info.clientVersionString, req.clientVersionString);
+    update(_info.bundleID, req.bundleID);
+    update(_info.progName, req.progName);
+    if (req.hasLibUSBMuxVersion && _info.kLibUSBMuxVersion != req.kLibUSBMuxVersion) {
+        std::unique_lock<std::mutex> ul(_infoLck);
+        _info.kLibUSBMuxVersion = req.kLibUSBMuxVersion;
+    }
+}
+
 void Client::readData(){
     ssize_t got = 0;
     size_t readsize = Client::bufsize-_recvBytesCnt;
@@ -133,8 +160,6 @@ void Client::processData(const usbmuxd_header *hdr){
     uint16_t portnum = 0;
     uint32_t device_id = 0;
 
-    std::string message;
-
     debug("Client command in fd %d len %d ver %d msg %d tag %d", _fd, hdr->length, hdr->version, hdr->message, hdr->tag);
 
     if((hdr->version != 0) && (hdr->version != 1)) {
@@ -152,206 +177,230 @@ void Client::processData(const usbmuxd_header *hdr){
             });
             const char *payload = NULL; //not alloced
             uint32_t payload_size = 0;
+            const char *messageType = NULL; //not alloced
+            uint64_t messageType_len = 0;
+            client_command command = CMD_UNKNOWN;
 
             _proto_version = 1;
             payload = (char*)(hdr) + sizeof(struct usbmuxd_header);
             payload_size = hdr->length - sizeof(struct usbmuxd_header);
 
+            {
+                client_command_request req;
+                if (scan_client_command(payload, payload_size, req)) {
+                    //fast path, no need to build a plist tree for these
+                    update_client_info(req);
+                    _msgCounts[req.command].add(); //the scanner only accepts commands handled below
+                    switch (req.command) {
+                        case CMD_LISTEN:
+                            goto PLIST_CLIENT_LISTEN_LOC;
+                        case CMD_CONNECT:
+                            device_id = req.deviceID;
+                            portnum = ntohs(req.portNumber);
+                            goto PLIST_CLIENT_CONNECTION_LOC;
+                        case CMD_LISTDEVICES:
+                            _mux->send_deviceList(_selfref.lock(), hdr->tag);
+                            return;
+                        case CMD_READBUID:
+                            send_buid(hdr->tag);
+                            return;
+                        default:
+                            break; //not handled by fast path
+                    }
+                }
+            }
+
             plist_from_xml(payload, payload_size, &p_recieved);
 
             {
                 plist_t p_messageType = NULL;
-                const char *str = NULL;
-                uint64_t str_len = 0;
 
                 retassure(p_messageType = plist_dict_get_item(p_recieved, "MessageType"), "Failed to get MessageType from recieved plist");
 
-                retassure(str = plist_get_string_ptr(p_messageType, &str_len), "Failed to get str ptr from MessageType");
-
-                message = std::string(str,str_len);
+                retassure(messageType = plist_get_string_ptr(p_messageType, &messageType_len), "Failed to get str ptr from MessageType");
             }
 
             update_client_info(p_recieved);
 
-            if (message == "Listen") {
-                goto PLIST_CLIENT_LISTEN_LOC;
-            } else if (message == "Connect") {
-
-                // get device id
-                try {
-                    plist_t p_intval = NULL;
-                    uint64_t tmpDeviceID = 0;
-                    assure(p_intval = plist_dict_get_item(p_recieved, "DeviceID"));
-                    assure(plist_get_node_type(p_intval) == PLIST_UINT);
-
-                    plist_get_uint_val(p_intval, &tmpDeviceID);
-                    device_id = (uint32_t)tmpDeviceID;
-                } catch (tihmstar::exception &e) {
-                    error("Received connect request without device_id!");
-                    send_result(hdr->tag, RESULT_BADDEV);
-                    return;
-                }
+            command = lookup_client_command(messageType, messageType_len);
+            _msgCounts[command].add();
 
-                // get port number
-                try {
-                    plist_t p_intval = NULL;
-                    uint64_t tmpPortNumber = 0;
-                    assure(p_intval = plist_dict_get_item(p_recieved, "PortNumber"));
-                    assure(plist_get_node_type(p_intval) == PLIST_UINT);
-
-                    plist_get_uint_val(p_intval, &tmpPortNumber);
-                    portnum = ntohs((uint16_t)tmpPortNumber);
-                } catch (tihmstar::exception &e) {
-                    error("Received connect request without port number!");
-                    send_result(hdr->tag, RESULT_BADDEV);
-                    return;
+            switch (command) {
+                case CMD_LISTEN:
+                    goto PLIST_CLIENT_LISTEN_LOC;
+                case CMD_CONNECT:
+                {
+                    // get device id
+                    try {
+                        plist_t p_intval = NULL;
+                        uint64_t tmpDeviceID = 0;
+                        assure(p_intval = plist_dict_get_item(p_recieved, "DeviceID"));
+                        assure(plist_get_node_type(p_intval) == PLIST_UINT);
+
+                        plist_get_uint_val(p_intval, &tmpDeviceID);
+                        device_id = (uint32_t)tmpDeviceID;
+                    } catch (tihmstar::exception &e) {
+                        error("Received connect request without device_id!");
+                        send_result(hdr->tag, RESULT_BADDEV);
+                        return;
+                    }
+
+                    // get port number
+                    try {
+                        plist_t p_intval = NULL;
+                        uint64_t tmpPortNumber = 0;
+                        assure(p_intval = plist_dict_get_item(p_recieved, "PortNumber"));
+                        assure(plist_get_node_type(p_intval) == PLIST_UINT);
+
+                        plist_get_uint_val(p_intval, &tmpPortNumber);
+                        portnum = ntohs((uint16_t)tmpPortNumber);
+                    } catch (tihmstar::exception &e) {
+                        error("Received connect request without port number!");
+                        send_result(hdr->tag, RESULT_BADDEV);
+                        return;
+                    }
+
+                    goto PLIST_CLIENT_CONNECTION_LOC;
                 }
-
-                goto PLIST_CLIENT_CONNECTION_LOC;
-            } else if (message == "ListDevices") {
-                _mux->send_deviceList(_selfref.lock(), hdr->tag);
-                return;
-            } else if (message == "ReadBUID") {
-                plist_t p_rsp = NULL;
-                cleanup([&]{
-                    safeFreeCustom(p_rsp, plist_free);
-                });
-                std::string buid = sysconf_get_system_buid();
-                p_rsp = plist_new_dict();
-                plist_dict_set_item(p_rsp, "BUID", plist_new_string(buid.c_str()));
-                send_plist_pkt(hdr->tag, p_rsp);
-                return;
-            } else if (message == "ReadPairRecord") {
-                plist_t p_devrecord = NULL;
-                plist_t p_rsp = NULL;
-                cleanup([&]{
-                    safeFreeCustom(p_devrecord, plist_free);
-                    safeFreeCustom(p_rsp, plist_free);
-                });
-                std::string record_id;
-                plist_t p_recordid = NULL;
-
-                // get pair record id
-                try {
-                    const char *str = NULL;
-                    uint64_t str_len = 0;
-
-                    assure(p_recordid = plist_dict_get_item(p_recieved, "PairRecordID"));
-                    retassure(str = plist_get_string_ptr(p_recordid, &str_len), "Failed to get str ptr from PairRecordID");
-
-                    record_id = std::string(str,str_len);
-                } catch (tihmstar::exception &e) {
-                    error("Reading record id failed!");
-                    send_result(hdr->tag, EINVAL);
+                case CMD_LISTDEVICES:
+                    _mux->send_deviceList(_selfref.lock(), hdr->tag);
                     return;
-                }
-
-                try {
-                    p_devrecord = sysconf_get_device_record(record_id.c_str());
-                } catch (tihmstar::exception &e) {
-                    info("no record data found for device %s",record_id.c_str());
-                    send_result(hdr->tag, ENOENT);
+                case CMD_READBUID:
+                    send_buid(hdr->tag);
                     return;
-                }
-
-                p_rsp = plist_new_dict();
+                case CMD_READPAIRRECORD:
                 {
-                    char *plistbin = NULL;
+                    plist_t p_rsp = NULL;
                     cleanup([&]{
-                        safeFree(plistbin);
+                        safeFreeCustom(p_rsp, plist_free);
                     });
-                    uint32_t plistbin_len = 0;
-                    plist_to_bin(p_devrecord, &plistbin, &plistbin_len);
-                    plist_dict_set_item(p_rsp, "PairRecordData", plist_new_data(plistbin, plistbin_len));
-                }
-                send_plist_pkt(hdr->tag, p_rsp);
-                return;
-            } else if (message == "SavePairRecord") {
-                plist_t p_parsedPairRecord = NULL;
-                cleanup([&]{
-                    safeFreeCustom(p_parsedPairRecord, plist_free);
-                });
-                plist_t p_pairRecord = NULL;
-                std::string record_id;
-
-                // get pair record id
-                try {
-                    const char *str = NULL;
-                    uint64_t str_len = 0;
+                    std::shared_ptr<const std::string> devrecord_bin;
+                    std::string record_id;
                     plist_t p_recordid = NULL;
-                    assure(p_recordid = plist_dict_get_item(p_recieved, "PairRecordID"));
-
-                    retassure(str = plist_get_string_ptr(p_recordid, &str_len), "Failed to get str ptr for PairRecordID");
-                    record_id = std::string(str,str_len);
 
-                    assure(p_pairRecord = plist_dict_get_item(p_recieved, "PairRecordData"));
-                } catch (tihmstar::exception &e) {
-                    error("Reading record id or record data failed!");
-                    send_result(hdr->tag, EINVAL);
+                    // get pair record id
+                    try {
+                        const char *str = NULL;
+                        uint64_t str_len = 0;
+
+                        assure(p_recordid = plist_dict_get_item(p_recieved, "PairRecordID"));
+                        retassure(str = plist_get_string_ptr(p_recordid, &str_len), "Failed to get str ptr from PairRecordID");
+
+                        record_id = std::string(str,str_len);
+                    } catch (tihmstar::exception &e) {
+                        error("Reading record id failed!");
+                        send_result(hdr->tag, EINVAL);
+                        return;
+                    }
+
+                    try {
+                        devrecord_bin = sysconf_get_device_record_bin(record_id.c_str());
+                    } catch (tihmstar::exception &e) {
+                        info("no record data found for device %s",record_id.c_str());
+                        send_result(hdr->tag, ENOENT);
+                        return;
+                    }
+
+                    p_rsp = plist_new_dict();
+                    plist_dict_set_item(p_rsp, "PairRecordData", plist_new_data(devrecord_bin->data(), devrecord_bin->size()));
+                    send_plist_pkt(hdr->tag, p_rsp);
                     return;
                 }
-
+                case CMD_SAVEPAIRRECORD:
                 {
-                    const char *pairRecord = NULL;
-                    uint64_t pairRecord_len = 0;
-                    retassure(pairRecord = plist_get_data_ptr(p_pairRecord, &pairRecord_len), "Failed to get data ptr for PairRecordData");
-                    plist_from_memory(pairRecord, (uint32_t)pairRecord_len, &p_parsedPairRecord, NULL);
-                }
-                retassure(p_parsedPairRecord, "Failed to plist-parse received PairRecordData");
-
-
-                sysconf_set_device_record(record_id.c_str(), p_parsedPairRecord);
-
-                try{
-                    plist_t p_intval = NULL;
-                    uint64_t intval = 0;
-
-                    assure(p_intval = plist_dict_get_item(p_recieved, "DeviceID"));
-                    assure(plist_get_node_type(p_intval) == PLIST_UINT);
-
-                    plist_get_uint_val(p_intval, &intval);
-                    _mux->notify_device_paired((int)intval);
-                }catch (tihmstar::exception &e){
-                    debug("Failed to notify about successfully pairing of '%s'",record_id.c_str());
+                    plist_t p_parsedPairRecord = NULL;
+                    cleanup([&]{
+                        safeFreeCustom(p_parsedPairRecord, plist_free);
+                    });
+                    plist_t p_pairRecord = NULL;
+                    std::string record_id;
+
+                    // get pair record id
+                    try {
+                        const char *str = NULL;
+                        uint64_t str_len = 0;
+                        plist_t p_recordid = NULL;
+                        assure(p_recordid = plist_dict_get_item(p_recieved, "PairRecordID"));
+
+                        retassure(str = plist_get_string_ptr(p_recordid, &str_len), "Failed to get str ptr for PairRecordID");
+                        record_id = std::string(str,str_len);
+
+                        assure(p_pairRecord = plist_dict_get_item(p_recieved, "PairRecordData"));
+                    } catch (tihmstar::exception &e) {
+                        error("Reading record id or record data failed!");
+                        send_result(hdr->tag, EINVAL);
+                        return;
+                    }
+
+                    {
+                        const char *pairRecord = NULL;
+                        uint64_t pairRecord_len = 0;
+                        retassure(pairRecord = plist_get_data_ptr(p_pairRecord, &pairRecord_len), "Failed to get data ptr for PairRecordData");
+                        plist_from_memory(pairRecord, (uint32_t)pairRecord_len, &p_parsedPairRecord, NULL);
+                    }
+                    retassure(p_parsedPairRecord, "Failed to plist-parse received PairRecordData");
+
+
+                    sysconf_set_device_record(record_id.c_str(), p_parsedPairRecord);
+
+                    try{
+                        plist_t p_intval = NULL;
+                        uint64_t intval = 0;
+
+                        assure(p_intval = plist_dict_get_item(p_recieved, "DeviceID"));
+                        assure(plist_get_node_type(p_intval) == PLIST_UINT);
+
+                        plist_get_uint_val(p_intval, &intval);
+                        _mux->notify_device_paired((int)intval);
+                    }catch (tihmstar::exception &e){
+                        debug("Failed to notify about successfully pairing of '%s'",record_id.c_str());
+                    }
+
+                    send_result(hdr->tag, RESULT_OK);
+                    return;
                 }
-
-                send_result(hdr->tag, RESULT_OK);
-                return;
-            } else if (message == "DeletePairRecord") {
-                std::string record_id;
-                // get pair record id
-                try {
-                    const char *str = NULL;
-                    uint64_t str_len = 0;
-                    plist_t p_recordid = NULL;
-
-                    assure(p_recordid = plist_dict_get_item(p_recieved, "PairRecordID"));
-
-                    retassure(str = plist_get_string_ptr(p_recordid, &str_len), "Failed to get str ptr for PairRecordID");
-                    record_id = std::string(str,str_len);
-                } catch (tihmstar::exception &e) {
-                    error("Reading record id failed!");
-                    send_result(hdr->tag, EINVAL);
+                case CMD_DELETEPAIRRECORD:
+                {
+                    std::string record_id;
+                    // get pair record id
+                    try {
+                        const char *str = NULL;
+                        uint64_t str_len = 0;
+                        plist_t p_recordid = NULL;
+
+                        assure(p_recordid = plist_dict_get_item(p_recieved, "PairRecordID"));
+
+                        retassure(str = plist_get_string_ptr(p_recordid, &str_len), "Failed to get str ptr for PairRecordID");
+                        record_id = std::string(str,str_len);
+                    } catch (tihmstar::exception &e) {
+                        error("Reading record id failed!");
+                        send_result(hdr->tag, EINVAL);
+                        return;
+                    }
+                    sysconf_remove_device_record(record_id.c_str());
+                    send_result(hdr->tag, RESULT_OK);
                     return;
                 }
-                sysconf_remove_device_record(record_id.c_str());
-                send_result(hdr->tag, RESULT_OK);
-                return;
-            }else if (message == "ListListeners") {
-                _mux->send_listenerList(_selfref.lock(), hdr->tag);
-                return;
-            }else{
-                error("Unexpected command '%s' received!", message.c_str());
-                send_result(hdr->tag, RESULT_BADCOMMAND);
-                return;
+                case CMD_LISTLISTENERS:
+                    _mux->send_listenerList(_selfref.lock(), hdr->tag);
+                    return;
+                case CMD_GETSTATISTICS:
+                    _mux->send_statistics(_selfref.lock(), hdr->tag);
+                    return;
+                default:
+                    error("Unexpected command '%.*s' received!", (int)messageType_len, messageType);
+                    send_result(hdr->tag, RESULT_BADCOMMAND);
+                    return;
             }
             assert(0); //should not be reached?!
         }
         case MESSAGE_LISTEN:
+            _msgCounts[CMD_LISTEN].add();
             goto PLIST_CLIENT_LISTEN_LOC;
         case MESSAGE_CONNECT:
         {
             const struct usbmuxd_connect_request *conn_req = NULL; //not allocated
+            _msgCounts[CMD_CONNECT].add();
 
             conn_req = (usbmuxd_connect_request*)hdr;
             portnum = conn_req->port;
@@ -359,6 +408,7 @@ void Client::processData(const usbmuxd_header *hdr){
             goto PLIST_CLIENT_CONNECTION_LOC;
         }
         default:
+            _msgCounts[CMD_UNKNOWN].add();
             error("Client %d invalid command %d", _fd, hdr->message);
             send_result(hdr->tag, RESULT_BADCOMMAND);
             return;
@@ -383,6 +433,7 @@ PLIST_CLIENT_CONNECTION_LOC:
 PLIST_CLIENT_LISTEN_LOC:
     send_result(hdr->tag, RESULT_OK);
     debug("Client %d now LISTENING", _fd);
+    _parent->_notifier->add(_number, _selfref.lock()); //register before anyone can queue for us
     _isListening = true;
     _mux->notify_alldevices(_selfref.lock()); //inform client about all connected devices
     return;
@@ -391,6 +442,17 @@ PLIST_CLIENT_LISTEN_LOC:
 void Client::writeData(struct usbmuxd_header *hdr, void *buf, size_t buflen){
     std::unique_lock<std::mutex> ul(_wlock);
 
+    if (_notifyOutOff < _notifyOut.size()) {
+        //don't cut into a notification which the ClientNotifier only got halfway out
+        size_t remaining = _notifyOut.size() - _notifyOutOff;
+        assure(send(_fd, _notifyOut.data()+_notifyOutOff, remaining, 0) == remaining);
+        _notifyOut.clear();
+        _notifyOutOff = 0;
+        {
+            std::unique_lock<std::mutex> nl(_notifyLck);
+            _notifyStats.sent++;
+        }
+    }
     assure(send(_fd, hdr, sizeof(usbmuxd_header), 0) == sizeof(usbmuxd_header));
     assure(send(_fd, buf, buflen, 0) == buflen);
 }
@@ -434,7 +496,137 @@ void Client::send_result(uint32_t tag, uint32_t result){
     }
 }
 
+void Client::send_buid(uint32_t tag){
+    plist_t p_rsp = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_rsp, plist_free);
+    });
+    std::string buid = sysconf_get_system_buid();
+    p_rsp = plist_new_dict();
+    plist_dict_set_item(p_rsp, "BUID", plist_new_string(buid.c_str()));
+    send_plist_pkt(tag, p_rsp);
+}
+
+#pragma mark notification queue
+/*
+    Called by the ClientNotifier, sends queued notifications until the socket would block.
+ */
+Client::notify_flush_result Client::flush_notifications() noexcept{
+    std::unique_lock<std::mutex> wl(_wlock, std::try_to_lock);
+    if (!wl.owns_lock()) return NOTIFY_FLUSH_BUSY;
+    while (true) {
+        ssize_t didSend = 0;
+        if (_notifyOutOff == _notifyOut.size()) {
+            notification n;
+            {
+                std::unique_lock<std::mutex> ul(_notifyLck);
+                if (_notifyQueueDead || !_notifyQueue.size()) return NOTIFY_FLUSH_DONE;
+                n = _notifyQueue.front();
+                _notifyQueue.pop_front();
+                _notifyStats.depth = _notifyQueue.size();
+            }
+            struct usbmuxd_header hdr{
+                .length = (uint32_t)(sizeof(hdr) + n.payload->size()),
+                .version = _proto_version,
+                .message = MESSAGE_PLIST,
+                .tag = 0
+            };
+            _notifyOut.assign((const char*)&hdr, sizeof(hdr));
+            _notifyOut.append(*n.payload);
+            _notifyOutOff = 0;
+        }
+        if ((didSend = send(_fd, _notifyOut.data()+_notifyOutOff, _notifyOut.size()-_notifyOutOff, MSG_DONTWAIT)) == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return NOTIFY_FLUSH_PENDING;
+            debug("Failed to deliver notification to client %d with error=%d (%s)",_fd,errno,strerror(errno));
+            return NOTIFY_FLUSH_FAILED;
+        }
+        _notifyOutOff += didSend;
+        if (_notifyOutOff == _notifyOut.size()) {
+            _notifyOut.clear();
+            _notifyOutOff = 0;
+            std::unique_lock<std::mutex> ul(_notifyLck);
+            _notifyStats.sent++;
+        }
+    }
+}
+
+/*
+    Drops queued notifications which became meaningless before the client got to see them.
+    Needs to be called with _notifyLck held. Returns the number of dropped notifications.
+ */
+size_t Client::compact_notifications() noexcept{
+    size_t oldDepth = _notifyQueue.size();
+    size_t j = 0;
+    while (j < _notifyQueue.size()) {
+        if (_notifyQueue[j].type != NOTIFY_DETACHED) {
+            j++;
+            continue;
+        }
+        int deviceID = _notifyQueue[j].deviceID;
+        bool didDropAttach = false;
+        for (size_t i = 0; i < j;) {
+            if (_notifyQueue[i].deviceID == deviceID && _notifyQueue[i].type != NOTIFY_DETACHED) {
+                //attach or paired for a device which is already gone again
+                didDropAttach |= (_notifyQueue[i].type == NOTIFY_ATTACHED);
+                _notifyQueue.erase(_notifyQueue.begin()+i);
+                j--;
+            }else{
+                i++;
+            }
+        }
+        if (didDropAttach) {
+            //client never learned about this device, so it doesn't need to learn that it left either
+            _notifyQueue.erase(_notifyQueue.begin()+j);
+        }else{
+            j++;
+        }
+    }
+    return oldDepth - _notifyQueue.size();
+}
+
+bool Client::queue_notification(const notification &n) noexcept{
+    {
+        std::unique_lock<std::mutex> ul(_notifyLck);
+        bool wasEmpty = !_notifyQueue.size();
+        if (_notifyQueueDead) return false;
+        if (_notifyQueue.size() >= Client::notifyQueueMaxDepth) {
+            size_t dropped = compact_notifications();
+            _notifyStats.compacted += dropped;
+            debug("Client %d notification queue full, compacted %zu entries",_fd,dropped);
+        }
+        if (_notifyQueue.size() < Client::notifyQueueMaxDepth) {
+            _notifyQueue.push_back(n);
+            _notifyStats.enqueued++;
+            _notifyStats.depth = _notifyQueue.size();
+            if (_notifyStats.depth > _notifyStats.maxDepth) _notifyStats.maxDepth = _notifyStats.depth;
+            ul.unlock();
+            //a non-empty queue means the notifier already knows about us
+            if (wasEmpty) _parent->_notifier->signal(_number);
+            return true;
+        }
+    }
+    warning("Client %d is not consuming notifications (%zu queued), disconnecting it",_fd,Client::notifyQueueMaxDepth);
+    kill();
+    return false;
+}
+
 #pragma mark public member function
+Client::cinfo Client::getClientInfo(){
+    std::unique_lock<std::mutex> ul(_infoLck);
+    return _info;
+}
+
+Client::notifystats Client::getNotifyStats() noexcept{
+    std::unique_lock<std::mutex> ul(_notifyLck);
+    return _notifyStats;
+}
+
+uint64_t Client::getMessageCount(client_command cmd) noexcept{
+    if (cmd >= client_command_count) return 0;
+    return _msgCounts[cmd].get();
+}
+
 void Client::kill() noexcept{
     debug("[Client] killing Client %d",_fd);
     std::shared_ptr<Client> selfref = _selfref.lock();
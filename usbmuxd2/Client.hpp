@@ -9,22 +9,51 @@
 #define Client_hpp
 
 #include "usbmuxd2-proto.h"
-#include "Manager/ClientManager.hpp"
 #include <libgeneral/Manager.hpp>
 #include <libgeneral/Event.hpp>
 #include <plist/plist.h>
 #include <memory>
+#include <deque>
+#include <string>
+#include <mutex>
+#include "ClientCommand.hpp"
+#include "StatCounter.hpp"
 
 class Muxer;
+class ClientManager;
 class Client : public tihmstar::Manager{
 public:
     static constexpr int bufsize = 0x20000;
+    static constexpr size_t notifyQueueMaxDepth = 0x200;
     struct cinfo{
-        char *bundleID;
-        char *clientVersionString;
-        char *progName;
+        std::string bundleID;
+        std::string clientVersionString;
+        std::string progName;
         uint64_t kLibUSBMuxVersion;
     };
+    enum notification_type {
+        NOTIFY_ATTACHED,
+        NOTIFY_DETACHED,
+        NOTIFY_PAIRED
+    };
+    struct notification{
+        notification_type type;
+        int deviceID;
+        std::shared_ptr<const std::string> payload; //serialized once, shared between all listeners
+    };
+    struct notifystats{
+        size_t depth;
+        size_t maxDepth;
+        uint64_t enqueued;
+        uint64_t sent;
+        uint64_t compacted;
+    };
+    enum notify_flush_result {
+        NOTIFY_FLUSH_DONE,     //nothing left to send
+        NOTIFY_FLUSH_PENDING,  //socket is full, wait until it is writable
+        NOTIFY_FLUSH_BUSY,     //client thread holds the write lock
+        NOTIFY_FLUSH_FAILED
+    };
     enum state {
         CLIENT_COMMAND,        // waiting for command
         CLIENT_LISTEN,         // listening for devices
@@ -43,9 +72,19 @@ private:
     uint32_t _proto_version;
     bool _isListening;
     uint32_t _connectTag;
-    cinfo _info;
+    cinfo _info; //written by the client thread only, others read it through getClientInfo()
+    std::mutex _infoLck;
     std::mutex _wlock;
 
+    std::deque<notification> _notifyQueue;
+    std::mutex _notifyLck;
+    bool _notifyQueueDead;
+    std::string _notifyOut; //packet currently being sent by the ClientNotifier, guarded by _wlock
+    size_t _notifyOutOff;
+    notifystats _notifyStats;
+
+    StatCounter _msgCounts[client_command_count]; //unknown commands are counted as CMD_UNKNOWN
+
 #pragma mark inheritance function
     virtual void stopAction() noexcept override;
     virtual void afterLoop() noexcept override;
@@ -54,6 +93,7 @@ private:
 
 #pragma mark private member function
     void update_client_info(const plist_t dict);
+    void update_client_info(const client_command_request &req);
 
     void readData();
     void recv_data();
@@ -64,6 +104,11 @@ private:
     void send_pkt(uint32_t tag, usbmuxd_msgtype msg, void *payload, int payload_length);
     void send_plist_pkt(uint32_t tag, plist_t plist);
     void send_result(uint32_t tag, uint32_t result);
+    void send_buid(uint32_t tag);
+
+    notify_flush_result flush_notifications() noexcept;
+    size_t compact_notifications() noexcept;
+    bool queue_notification(const notification &n) noexcept;
 
 public:
     Client(Muxer *mux, ClientManager *parent, int fd, uint64_t number);
@@ -73,12 +118,18 @@ public:
     void kill() noexcept;
     void deconstruct() noexcept;
 
-    const cinfo &getClientInfo(){return _info;};
+    cinfo getClientInfo();
+    notifystats getNotifyStats() noexcept;
+    uint64_t getMessageCount(client_command cmd) noexcept;
 
 #pragma mark friends
     friend class ClientManager;
+    friend class ClientNotifier;
     friend class Muxer;
     friend class TCP;
+    friend class WIFIDevice;
+    friend class MetricsExporter;
+    friend class BenchPeer;
 };
 
 #endif /* Client_hpp */
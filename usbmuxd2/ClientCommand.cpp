@@ -0,0 +1,144 @@
+//
+//  ClientCommand.cpp
+//  usbmuxd2
+//
+
+#include "ClientCommand.hpp"
+
+struct cursor{
+    const char *cur;
+    const char *end;
+};
+
+static void skipWhitespace(cursor &c) noexcept{
+    while (c.cur < c.end && (*c.cur == ' ' || *c.cur == '\t' || *c.cur == '\n' || *c.cur == '\r')) c.cur++;
+}
+
+static bool consume(cursor &c, const char *token, size_t tokenLen) noexcept{
+    if ((size_t)(c.end - c.cur) < tokenLen || memcmp(c.cur, token, tokenLen) != 0) return false;
+    c.cur += tokenLen;
+    return true;
+}
+#define consumeToken(c, token) consume(c, token, sizeof(token)-1)
+
+/*
+    reads text up to the next tag, refuses anything containing entities
+ */
+static bool readText(cursor &c, std::string_view &text) noexcept{
+    const char *start = c.cur;
+    while (c.cur < c.end && *c.cur != '<') {
+        if (*c.cur == '&') return false;
+        c.cur++;
+    }
+    if (c.cur == c.end) return false;
+    text = std::string_view(start, c.cur - start);
+    return true;
+}
+
+static bool parseUInt(std::string_view text, uint64_t &val) noexcept{
+    uint64_t ret = 0;
+    if (!text.size() || text.size() > 19) return false;
+    for (char d : text) {
+        if (d < '0' || d > '9') return false;
+        ret = ret*10 + (d - '0');
+    }
+    val = ret;
+    return true;
+}
+
+static bool keyIs(std::string_view key, const char *name, size_t nameLen) noexcept{
+    return key.size() == nameLen && memcmp(key.data(), name, nameLen) == 0;
+}
+#define isKey(key, name) keyIs(key, name, sizeof(name)-1)
+
+bool scan_client_command(const char *xml, size_t xmlLen, client_command_request &req) noexcept{
+    cursor c{xml, xml+xmlLen};
+    std::string_view messageType{};
+
+    req = {};
+
+    //skip over xml header and doctype, the first dict is the top level one
+    {
+        static constexpr const char dictTag[] = "<dict>";
+        const char *dict = NULL;
+        for (const char *p = c.cur; p + sizeof(dictTag)-1 <= c.end; p++) {
+            if (*p == '<' && memcmp(p, dictTag, sizeof(dictTag)-1) == 0) {
+                dict = p;
+                break;
+            }
+        }
+        if (!dict) return false;
+        c.cur = dict + sizeof(dictTag)-1;
+    }
+
+    while (true) {
+        std::string_view key{};
+        std::string_view strval{};
+        uint64_t intval = 0;
+        bool isString = false;
+        bool isInteger = false;
+
+        skipWhitespace(c);
+        if (consumeToken(c, "</dict>")) break;
+        if (!consumeToken(c, "<key>")) return false;
+        if (!readText(c, key)) return false;
+        if (!consumeToken(c, "</key>")) return false;
+        skipWhitespace(c);
+
+        if (consumeToken(c, "<string>")) {
+            if (!readText(c, strval)) return false;
+            if (!consumeToken(c, "</string>")) return false;
+            isString = true;
+        }else if (consumeToken(c, "<string/>")) {
+            isString = true;
+        }else if (consumeToken(c, "<integer>")) {
+            std::string_view num{};
+            if (!readText(c, num)) return false;
+            if (!consumeToken(c, "</integer>")) return false;
+            if (!parseUInt(num, intval)) return false;
+            isInteger = true;
+        }else if (consumeToken(c, "<true/>") || consumeToken(c, "<false/>")) {
+            //not interested in any bool values
+        }else{
+            //nested containers, data, dates,... are left to libplist
+            return false;
+        }
+
+        if (isKey(key, "MessageType")) {
+            if (!isString) return false;
+            messageType = strval;
+        }else if (isKey(key, "DeviceID")) {
+            if (!isInteger || intval > UINT32_MAX) return false;
+            req.deviceID = (uint32_t)intval;
+            req.hasDeviceID = true;
+        }else if (isKey(key, "PortNumber")) {
+            if (!isInteger || intval > UINT16_MAX) return false;
+            req.portNumber = (uint16_t)intval;
+            req.hasPortNumber = true;
+        }else if (isKey(key, "BundleID")) {
+            if (isString) req.bundleID = strval;
+        }else if (isKey(key, "ClientVersionString")) {
+            if (isString) req.clientVersionString = strval;
+        }else if (isKey(key, "ProgName")) {
+            if (isString) req.progName = strval;
+        }else if (isKey(key, "kLibUSBMuxVersion")) {
+            if (isInteger) {
+                req.kLibUSBMuxVersion = intval;
+                req.hasLibUSBMuxVersion = true;
+            }
+        }
+    }
+
+    req.command = lookup_client_command(messageType.data(), messageType.size());
+    switch (req.command) {
+        case CMD_LISTEN:
+        case CMD_LISTDEVICES:
+        case CMD_READBUID:
+            return true;
+        case CMD_CONNECT:
+            //let the slow path deal with reporting malformed requests
+            return req.hasDeviceID && req.hasPortNumber;
+        default:
+            return false;
+    }
+}
@@ -0,0 +1,117 @@
+//
+//  ClientCommand.hpp
+//  usbmuxd2
+//
+
+#ifndef ClientCommand_hpp
+#define ClientCommand_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string_view>
+
+enum client_command {
+    CMD_UNKNOWN = 0,
+    CMD_LISTEN,
+    CMD_CONNECT,
+    CMD_LISTDEVICES,
+    CMD_READBUID,
+    CMD_READPAIRRECORD,
+    CMD_SAVEPAIRRECORD,
+    CMD_DELETEPAIRRECORD,
+    CMD_LISTLISTENERS,
+    CMD_GETSTATISTICS
+};
+constexpr size_t client_command_count = CMD_GETSTATISTICS+1;
+
+struct client_command_request{
+    client_command command;
+    bool hasDeviceID;
+    uint32_t deviceID;
+    bool hasPortNumber;
+    uint16_t portNumber;    // as sent by the client (network byte order)
+    bool hasLibUSBMuxVersion;
+    uint64_t kLibUSBMuxVersion;
+    std::string_view bundleID;  // points into the scanned buffer
+    std::string_view clientVersionString;  // points into the scanned buffer
+    std::string_view progName;  // points into the scanned buffer
+};
+
+#pragma mark command table
+/*
+    Perfect hash over all known MessageType strings.
+    (2*firstChar + length) % 16 happens to be collision free for the current set,
+    which is verified at compile time below.
+ */
+namespace client_command_table {
+    struct entry{
+        const char *name;
+        size_t len;
+        client_command command;
+    };
+
+    constexpr size_t size = 16;
+
+    constexpr size_t hash(const char *str, size_t len) noexcept{
+        return (2*(uint8_t)str[0] + len) % size;
+    }
+
+    constexpr entry commands[] = {
+        {"Listen",          sizeof("Listen")-1,             CMD_LISTEN},
+        {"Connect",         sizeof("Connect")-1,            CMD_CONNECT},
+        {"ListDevices",     sizeof("ListDevices")-1,        CMD_LISTDEVICES},
+        {"ReadBUID",        sizeof("ReadBUID")-1,           CMD_READBUID},
+        {"ReadPairRecord",  sizeof("ReadPairRecord")-1,     CMD_READPAIRRECORD},
+        {"SavePairRecord",  sizeof("SavePairRecord")-1,     CMD_SAVEPAIRRECORD},
+        {"DeletePairRecord",sizeof("DeletePairRecord")-1,   CMD_DELETEPAIRRECORD},
+        {"ListListeners",   sizeof("ListListeners")-1,      CMD_LISTLISTENERS},
+        {"GetStatistics",   sizeof("GetStatistics")-1,      CMD_GETSTATISTICS},
+    };
+
+    struct table{
+        entry slots[size];
+    };
+
+    constexpr table build() noexcept{
+        table ret{};
+        for (auto &c : commands) ret.slots[hash(c.name, c.len)] = c;
+        return ret;
+    }
+
+    constexpr table slots = build();
+
+    constexpr bool isPerfect() noexcept{
+        for (auto &c : commands) {
+            if (slots.slots[hash(c.name, c.len)].command != c.command) return false;
+        }
+        return true;
+    }
+    static_assert(isPerfect(), "client command hash has collisions, pick a different hash function");
+};
+
+inline client_command lookup_client_command(const char *str, size_t len) noexcept{
+    if (!len) return CMD_UNKNOWN;
+    const client_command_table::entry &e = client_command_table::slots.slots[client_command_table::hash(str, len)];
+    if (e.len != len || memcmp(e.name, str, len) != 0) return CMD_UNKNOWN;
+    return e.command;
+}
+
+inline const char *client_command_name(client_command cmd) noexcept{
+    for (auto &c : client_command_table::commands) {
+        if (c.command == cmd) return c.name;
+    }
+    return "Unknown";
+}
+
+#pragma mark scanner
+/*
+    Allocation-free scanner for the XML plists sent by libusbmuxd.
+    Only recognizes flat dicts with string/integer/bool values.
+    Returns false if the message is not one of the hot commands
+    (Listen, ListDevices, ReadBUID, Connect) or anything about it looks unusual.
+    In that case the caller should fall back to libplist.
+ */
+bool scan_client_command(const char *xml, size_t xmlLen, client_command_request &req) noexcept;
+
+#endif /* ClientCommand_hpp */
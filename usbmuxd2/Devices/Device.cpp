@@ -27,3 +27,7 @@ void Device::kill() noexcept{
 const char *Device::getSerial() noexcept{
     return _serial;
 }
+
+Device::mux_conn_type Device::getConnType() noexcept{
+    return _conntype;
+}
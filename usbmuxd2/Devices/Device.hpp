@@ -37,7 +37,9 @@ public:
 #pragma mark provider
     virtual void kill() noexcept;
     const char *getSerial() noexcept;
+    mux_conn_type getConnType() noexcept;
     
     friend Muxer;
+    friend class DeviceRegistry;
 };
 #endif /* Device_hpp */
@@ -0,0 +1,65 @@
+//
+//  DeviceIDAllocator.cpp
+//  usbmuxd2
+//
+
+#include "DeviceIDAllocator.hpp"
+#include <libgeneral/macros.h>
+
+#pragma mark DeviceIDAllocator
+DeviceIDAllocator::DeviceIDAllocator(uint32_t reuseDelaySec)
+: _reuseDelay(std::chrono::seconds(reuseDelaySec))
+, _nextFresh(1) //there can be no device with ID 1 or 0
+, _inUseCnt(0)
+{
+    //
+}
+
+DeviceIDAllocator::~DeviceIDAllocator(){
+    //
+}
+
+#pragma mark private
+bool DeviceIDAllocator::isInUse(uint32_t id) const noexcept{
+    return (_inUse[id >> 6] >> (id & 63)) & 1;
+}
+
+void DeviceIDAllocator::setInUse(uint32_t id, bool inUse) noexcept{
+    if (inUse) {
+        _inUse[id >> 6] |= (1ULL << (id & 63));
+    } else {
+        _inUse[id >> 6] &= ~(1ULL << (id & 63));
+    }
+}
+
+#pragma mark public
+uint32_t DeviceIDAllocator::allocate() noexcept{
+    uint32_t id = 0;
+    if (_freeList.size() && (_nextFresh > maxID || _freeList.front().when + _reuseDelay <= std::chrono::steady_clock::now())) {
+        //the oldest released id is either old enough, or we ran out of fresh ones and must reuse it early
+        id = _freeList.front().id;
+        _freeList.pop_front();
+    } else if (_nextFresh <= maxID) {
+        id = _nextFresh++;
+        if ((id >> 6) >= _inUse.size()) _inUse.push_back(0);
+    } else {
+        return 0;
+    }
+    setInUse(id, true);
+    _inUseCnt++;
+    return id;
+}
+
+void DeviceIDAllocator::release(uint32_t id) noexcept{
+    if (!id || id >= _nextFresh || !isInUse(id)) {
+        warning("DeviceIDAllocator: ignoring release of id %u which is not in use",id);
+        return;
+    }
+    setInUse(id, false);
+    _inUseCnt--;
+    _freeList.push_back({id, std::chrono::steady_clock::now()});
+}
+
+size_t DeviceIDAllocator::inUseCnt() const noexcept{
+    return _inUseCnt;
+}
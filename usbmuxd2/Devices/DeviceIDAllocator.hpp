@@ -0,0 +1,53 @@
+//
+//  DeviceIDAllocator.hpp
+//  usbmuxd2
+//
+
+#ifndef DeviceIDAllocator_hpp
+#define DeviceIDAllocator_hpp
+
+#include <stdint.h>
+#include <chrono>
+#include <deque>
+#include <vector>
+
+/*
+    Hands out base ids for devices, the muxer derives the actual device id
+    as (base << 1) | isWifi, so USB and WiFi connections of the same device share one base.
+
+    Released ids are kept back for reuseDelay before they are handed out again,
+    so clients don't confuse a newly attached device with one that just left.
+    allocate() and release() are O(1).
+    Not thread safe, the owner is expected to serialize access.
+ */
+class DeviceIDAllocator{
+public:
+    static constexpr uint32_t maxID = INT32_MAX/2;
+private:
+    struct released{
+        uint32_t id;
+        std::chrono::steady_clock::time_point when;
+    };
+    std::chrono::steady_clock::duration _reuseDelay;
+    uint32_t _nextFresh;            //lowest id which was never handed out
+    std::deque<released> _freeList; //ordered by release time
+    std::vector<uint64_t> _inUse;   //bitmap over [0,_nextFresh)
+    size_t _inUseCnt;
+
+    bool isInUse(uint32_t id) const noexcept;
+    void setInUse(uint32_t id, bool inUse) noexcept;
+
+public:
+    DeviceIDAllocator(uint32_t reuseDelaySec);
+    ~DeviceIDAllocator();
+
+    /*
+        Returns 0 if no id is available.
+     */
+    uint32_t allocate() noexcept;
+    void release(uint32_t id) noexcept;
+
+    size_t inUseCnt() const noexcept;
+};
+
+#endif /* DeviceIDAllocator_hpp */
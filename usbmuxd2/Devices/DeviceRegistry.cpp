@@ -0,0 +1,138 @@
+//
+//  DeviceRegistry.cpp
+//  usbmuxd2
+//
+
+#include "DeviceRegistry.hpp"
+#include "USBDevice.hpp"
+#include <libgeneral/macros.h>
+#include <string.h>
+
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#   include "WIFIDevice.hpp"
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+
+#define WIFIPAIR_PREFIX "WIFIPAIR"
+
+template <typename M>
+static void eraseIfMatches(M &map, const typename M::key_type &key, const std::shared_ptr<Device> &dev) noexcept{
+    auto range = map.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == dev) {
+            map.erase(it);
+            return;
+        }
+    }
+}
+
+#pragma mark DeviceRegistry
+DeviceRegistry::DeviceRegistry(){
+    //
+}
+
+DeviceRegistry::~DeviceRegistry(){
+    //
+}
+
+#pragma mark private
+std::unordered_map<std::string_view, std::shared_ptr<Device>> &DeviceRegistry::serialIndex(Device::mux_conn_type type) noexcept{
+    return (type == Device::MUXCONN_WIFI) ? _bySerialWIFI : _bySerialUSB;
+}
+
+const std::unordered_map<std::string_view, std::shared_ptr<Device>> &DeviceRegistry::serialIndex(Device::mux_conn_type type) const noexcept{
+    return (type == Device::MUXCONN_WIFI) ? _bySerialWIFI : _bySerialUSB;
+}
+
+#pragma mark public
+void DeviceRegistry::insert(std::shared_ptr<Device> dev){
+    assure(dev);
+    {
+        auto old = _byID.find(dev->_id);
+        if (old != _byID.end()) {
+            std::shared_ptr<Device> odev = old->second;
+            warning("DeviceRegistry: replacing device %s with id %d",odev->_serial,odev->_id);
+            erase(odev);
+        }
+    }
+
+    _byID[dev->_id] = dev;
+    serialIndex(dev->_conntype)[std::string_view(dev->_serial)] = dev;
+
+    if (dev->_conntype == Device::MUXCONN_USB) {
+        _byUSBLocation[((USBDevice*)dev.get())->usb_location()] = dev;
+    }
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+    else if (dev->_conntype == Device::MUXCONN_WIFI) {
+        WIFIDevice *wifidev = (WIFIDevice*)dev.get();
+        std::string_view serviceName = wifidev->_serviceName;
+        _byMacAddr[serviceName.substr(0,serviceName.find("@"))] = dev;
+        _byServiceInstance[WIFIDevice::serviceInstance(serviceName)] = dev;
+        for (auto &ip : wifidev->_ipaddr) {
+            _byIPAddr.emplace(std::string_view(ip), dev);
+        }
+    }
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+}
+
+bool DeviceRegistry::erase(std::shared_ptr<Device> dev) noexcept{
+    {
+        auto it = _byID.find(dev->_id);
+        if (it == _byID.end() || it->second != dev) return false;
+        _byID.erase(it);
+    }
+
+    eraseIfMatches(serialIndex(dev->_conntype), std::string_view(dev->_serial), dev);
+
+    if (dev->_conntype == Device::MUXCONN_USB) {
+        eraseIfMatches(_byUSBLocation, ((USBDevice*)dev.get())->usb_location(), dev);
+    }
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+    else if (dev->_conntype == Device::MUXCONN_WIFI) {
+        WIFIDevice *wifidev = (WIFIDevice*)dev.get();
+        std::string_view serviceName = wifidev->_serviceName;
+        eraseIfMatches(_byMacAddr, serviceName.substr(0,serviceName.find("@")), dev);
+        eraseIfMatches(_byServiceInstance, WIFIDevice::serviceInstance(serviceName), dev);
+        for (auto &ip : wifidev->_ipaddr) {
+            eraseIfMatches(_byIPAddr, std::string_view(ip), dev);
+        }
+    }
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+    return true;
+}
+
+#pragma mark lookups
+std::shared_ptr<Device> DeviceRegistry::findByID(int id) const noexcept{
+    auto it = _byID.find(id);
+    return (it != _byID.end()) ? it->second : nullptr;
+}
+
+std::shared_ptr<Device> DeviceRegistry::findBySerial(const char *serial, Device::mux_conn_type type) const noexcept{
+    auto &index = serialIndex(type);
+    auto it = index.find(std::string_view(serial));
+    return (it != index.end()) ? it->second : nullptr;
+}
+
+std::shared_ptr<Device> DeviceRegistry::findByUSBLocation(uint32_t location) const noexcept{
+    auto it = _byUSBLocation.find(location);
+    return (it != _byUSBLocation.end()) ? it->second : nullptr;
+}
+
+std::shared_ptr<Device> DeviceRegistry::findByMacAddr(std::string_view macaddr) const noexcept{
+    auto it = _byMacAddr.find(macaddr);
+    return (it != _byMacAddr.end()) ? it->second : nullptr;
+}
+
+std::shared_ptr<Device> DeviceRegistry::findByServiceInstance(std::string_view instance) const noexcept{
+    auto it = _byServiceInstance.find(instance);
+    return (it != _byServiceInstance.end()) ? it->second : nullptr;
+}
+
+std::shared_ptr<Device> DeviceRegistry::findByIPAddr(std::string_view ipaddr, bool pairingOnly) const noexcept{
+    auto range = _byIPAddr.equal_range(ipaddr);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (!pairingOnly || strncmp(it->second->_serial, WIFIPAIR_PREFIX, sizeof(WIFIPAIR_PREFIX)-1) == 0) {
+            return it->second;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,69 @@
+//
+//  DeviceRegistry.hpp
+//  usbmuxd2
+//
+
+#ifndef DeviceRegistry_hpp
+#define DeviceRegistry_hpp
+
+#include "Device.hpp"
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/*
+    Set of all attached devices with hash indexes for every lookup the muxer does.
+    Not thread safe, the owner is expected to guard access.
+    String keys point into the indexed devices, which are immutable once registered.
+ */
+class DeviceRegistry{
+public:
+    typedef std::unordered_map<int, std::shared_ptr<Device>> idmap;
+private:
+    idmap _byID;
+    std::unordered_map<std::string_view, std::shared_ptr<Device>> _bySerialUSB;
+    std::unordered_map<std::string_view, std::shared_ptr<Device>> _bySerialWIFI;
+    std::unordered_map<uint32_t, std::shared_ptr<Device>> _byUSBLocation;
+    std::unordered_map<std::string_view, std::shared_ptr<Device>> _byMacAddr;
+    std::unordered_map<std::string_view, std::shared_ptr<Device>> _byServiceInstance;
+    std::unordered_multimap<std::string_view, std::shared_ptr<Device>> _byIPAddr;
+
+    std::unordered_map<std::string_view, std::shared_ptr<Device>> &serialIndex(Device::mux_conn_type type) noexcept;
+    const std::unordered_map<std::string_view, std::shared_ptr<Device>> &serialIndex(Device::mux_conn_type type) const noexcept;
+
+public:
+    DeviceRegistry();
+    ~DeviceRegistry();
+
+    /*
+        Registers dev under its current id, replacing any entry with the same id.
+     */
+    void insert(std::shared_ptr<Device> dev);
+    bool erase(std::shared_ptr<Device> dev) noexcept;
+
+#pragma mark lookups
+    std::shared_ptr<Device> findByID(int id) const noexcept;
+    std::shared_ptr<Device> findBySerial(const char *serial, Device::mux_conn_type type) const noexcept;
+    std::shared_ptr<Device> findByUSBLocation(uint32_t location) const noexcept;
+    std::shared_ptr<Device> findByMacAddr(std::string_view macaddr) const noexcept;
+    /*
+        Returns the WiFi device which was created from the DNS-SD service instance
+        (service name without type and domain, as it appears in the resolved fullname).
+     */
+    std::shared_ptr<Device> findByServiceInstance(std::string_view instance) const noexcept;
+    /*
+        Returns a WiFi device advertising ipaddr.
+        If pairingOnly is set only temporary "WIFIPAIR" devices are considered.
+     */
+    std::shared_ptr<Device> findByIPAddr(std::string_view ipaddr, bool pairingOnly = false) const noexcept;
+
+#pragma mark iteration
+    size_t size() const noexcept {return _byID.size();};
+    idmap::const_iterator begin() const noexcept {return _byID.begin();};
+    idmap::const_iterator end() const noexcept {return _byID.end();};
+};
+
+#endif /* DeviceRegistry_hpp */
@@ -0,0 +1,248 @@
+//
+//  HeartbeatLoop.cpp
+//  usbmuxd2
+//
+
+#include <libgeneral/macros.h>
+
+#ifdef HAVE_LIBIMOBILEDEVICE
+#include "HeartbeatLoop.hpp"
+#include "WIFIDevice.hpp"
+#include <plist/plist.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#pragma mark HeartbeatLoop
+HeartbeatLoop::HeartbeatLoop()
+: _nextKey(1), _wakePipe{-1,-1}, _wheel(std::chrono::milliseconds(tickMs), wheelSlots)
+{
+    plist_t p_polo = NULL;
+    char *xml = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_polo, plist_free);
+        safeFree(xml);
+    });
+    uint32_t xmlSize = 0;
+    uint32_t belen = 0;
+
+    assure(p_polo = plist_new_dict());
+    plist_dict_set_item(p_polo, "Command", plist_new_string("Polo"));
+    plist_to_xml(p_polo, &xml, &xmlSize);
+    assure(xml);
+    belen = htonl(xmlSize);
+    _polo.append((char*)&belen, sizeof(belen));
+    _polo.append(xml, xmlSize);
+
+    assure(!pipe(_wakePipe));
+    fcntl(_wakePipe[0], F_SETFL, fcntl(_wakePipe[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(_wakePipe[1], F_SETFL, fcntl(_wakePipe[1], F_GETFL, 0) | O_NONBLOCK);
+}
+
+HeartbeatLoop::~HeartbeatLoop(){
+    info("[destroying] HeartbeatLoop");
+    stopLoop();
+    adopt_changes();
+    for (auto &e : _entries) free_entry(e.second);
+    _entries.clear();
+    safeClose(_wakePipe[0]);
+    safeClose(_wakePipe[1]);
+}
+
+#pragma mark private
+void HeartbeatLoop::stopAction() noexcept{
+    safeClose(_wakePipe[1]);
+}
+
+void HeartbeatLoop::wakeup() noexcept{
+    char c = 0;
+    if (_wakePipe[1] != -1) write(_wakePipe[1], &c, 1);
+}
+
+void HeartbeatLoop::adopt_changes() noexcept{
+    std::vector<std::pair<uint64_t, entry>> incoming;
+    std::vector<uint64_t> removals;
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        incoming.swap(_incoming);
+        removals.swap(_removals);
+    }
+    for (auto &i : incoming) {
+        entry &e = _entries[i.first] = i.second;
+        try {
+            e.timer = _wheel.schedule(std::chrono::milliseconds(heartbeatTimeoutMs), i.first);
+        } catch (...) {
+            kill_entry(i.first, "failed to schedule heartbeat timeout");
+        }
+    }
+    for (uint64_t key : removals) {
+        auto it = _entries.find(key);
+        if (it == _entries.end()) continue; //already gone
+        _wheel.cancel(it->second.timer);
+        free_entry(it->second);
+        _entries.erase(it);
+    }
+}
+
+void HeartbeatLoop::free_entry(entry &e) noexcept{
+    safeFreeCustom(e.conn, idevice_disconnect);
+    safeFreeCustom(e.idev, idevice_free);
+    e.fd = -1;
+}
+
+void HeartbeatLoop::kill_entry(uint64_t key, const char *reason) noexcept{
+    auto it = _entries.find(key);
+    if (it == _entries.end()) return;
+    error("[HeartbeatLoop] %s: %s",it->second.serial.c_str(),reason);
+    _wheel.cancel(it->second.timer);
+    if (std::shared_ptr<WIFIDevice> dev = it->second.dev.lock()) {
+        dev->kill();
+    }
+    free_entry(it->second);
+    _entries.erase(it);
+}
+
+bool HeartbeatLoop::send_polo(entry &e) noexcept{
+    uint32_t didSend = 0;
+    while (didSend < _polo.size()) {
+        uint32_t sent = 0;
+        if (idevice_connection_send(e.conn, _polo.data()+didSend, (uint32_t)(_polo.size()-didSend), &sent) != IDEVICE_E_SUCCESS || !sent) return false;
+        didSend += sent;
+    }
+    return true;
+}
+
+bool HeartbeatLoop::handle_input(uint64_t key, entry &e) noexcept{
+    //the connection may be SSL wrapped, keep reading until the library has nothing buffered either
+    while (true) {
+        char buf[0x1000];
+        uint32_t got = 0;
+        uint32_t msgLen = 0;
+        size_t want = 0;
+        idevice_error_t err = IDEVICE_E_SUCCESS;
+
+        if (e.rxbuf.size() >= sizeof(msgLen)) {
+            memcpy(&msgLen, e.rxbuf.data(), sizeof(msgLen));
+            msgLen = ntohl(msgLen);
+            if (msgLen > maxMessageSize) {
+                error("[HeartbeatLoop] %s: heartbeat message too large (%u bytes)",e.serial.c_str(),msgLen);
+                return false;
+            }
+            want = sizeof(msgLen) + msgLen - e.rxbuf.size();
+        } else {
+            want = sizeof(msgLen) - e.rxbuf.size();
+        }
+
+        if (want) {
+            err = idevice_connection_receive_timeout(e.conn, buf, (uint32_t)((want < sizeof(buf)) ? want : sizeof(buf)), &got, 1);
+            if (!got) return err == IDEVICE_E_TIMEOUT;
+            e.rxbuf.append(buf, got);
+            continue;
+        }
+
+        //got one full message
+        {
+            plist_t p_msg = NULL;
+            cleanup([&]{
+                safeFreeCustom(p_msg, plist_free);
+            });
+            plist_from_memory(e.rxbuf.data()+sizeof(msgLen), msgLen, &p_msg, NULL);
+            e.rxbuf.clear();
+            if (!p_msg) {
+                error("[HeartbeatLoop] %s: failed to parse heartbeat message",e.serial.c_str());
+                return false;
+            }
+        }
+        if (!send_polo(e)) return false;
+        _wheel.cancel(e.timer);
+        e.timer = 0;
+        try {
+            e.timer = _wheel.schedule(std::chrono::milliseconds(heartbeatTimeoutMs), key);
+        } catch (...) {
+            return false;
+        }
+    }
+}
+
+bool HeartbeatLoop::loopEvent(){
+    int timeout = -1;
+    std::vector<uint64_t> expired;
+
+    adopt_changes();
+
+    _pfds.clear();
+    _pfdKeys.clear();
+    _pfds.push_back({.fd = _wakePipe[0], .events = POLLIN});
+    _pfdKeys.push_back(0);
+    for (auto &e : _entries) {
+        _pfds.push_back({.fd = e.second.fd, .events = POLLIN});
+        _pfdKeys.push_back(e.first);
+    }
+
+    timeout = _wheel.timeUntilNextTickMs(TimerWheel::clock::now());
+    if (poll(_pfds.data(), (nfds_t)_pfds.size(), timeout) == -1) {
+        retassure(errno == EINTR, "[HeartbeatLoop] poll failed with error=%d (%s)",errno,strerror(errno));
+        return true;
+    }
+
+    if (_pfds[0].revents) {
+        char buf[0x100];
+        ssize_t cnt = 0;
+        while ((cnt = read(_wakePipe[0], buf, sizeof(buf))) > 0);
+        if (cnt == 0) return false; //we are being stopped
+    }
+
+    for (size_t i = 1; i < _pfds.size(); i++) {
+        uint64_t key = _pfdKeys[i];
+        if (!_pfds[i].revents) continue;
+        auto it = _entries.find(key);
+        if (it == _entries.end()) continue;
+        if (!handle_input(key, it->second)) kill_entry(key, "heartbeat connection failed");
+    }
+
+    _wheel.advance(TimerWheel::clock::now(), expired);
+    for (uint64_t key : expired) {
+        auto it = _entries.find(key);
+        if (it == _entries.end()) continue;
+        it->second.timer = 0; //already fired
+        kill_entry(key, "no heartbeat received in time");
+    }
+    return true;
+}
+
+#pragma mark public
+uint64_t HeartbeatLoop::add(std::shared_ptr<WIFIDevice> dev, idevice_t idev, idevice_connection_t conn){
+    entry e = {};
+    uint64_t key = 0;
+    cleanup([&]{
+        free_entry(e);
+    });
+    e.dev = dev;
+    e.serial = dev->getSerial();
+    e.idev = idev;
+    e.conn = conn;
+    retassure(idevice_connection_get_fd(conn, &e.fd) == IDEVICE_E_SUCCESS, "[HeartbeatLoop] failed to get fd of heartbeat connection");
+
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        key = _nextKey++;
+        _incoming.push_back({key, e});
+    }
+    //ownership moved to the loop
+    e.idev = NULL;
+    e.conn = NULL;
+    wakeup();
+    return key;
+}
+
+void HeartbeatLoop::remove(uint64_t key) noexcept{
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _removals.push_back(key);
+    }
+    wakeup();
+}
+
+#endif //HAVE_LIBIMOBILEDEVICE
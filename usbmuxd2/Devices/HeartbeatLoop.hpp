@@ -0,0 +1,80 @@
+//
+//  HeartbeatLoop.hpp
+//  usbmuxd2
+//
+
+#ifndef HeartbeatLoop_hpp
+#define HeartbeatLoop_hpp
+
+#include "../TimerWheel.hpp"
+#include <libgeneral/Manager.hpp>
+#include <libimobiledevice/libimobiledevice.h>
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <poll.h>
+
+class WIFIDevice;
+
+/*
+    Answers the heartbeat service of all WiFi devices on a single thread.
+    Each device's heartbeat connection is polled for "Marco" requests, which are answered with "Polo".
+    Missing heartbeats are detected with a timer wheel, the device is killed
+    if it stays silent for longer than heartbeatTimeoutMs.
+ */
+class HeartbeatLoop : public tihmstar::Manager{
+public:
+    static constexpr int heartbeatTimeoutMs = 15000;
+    static constexpr int tickMs = 500;
+    static constexpr size_t wheelSlots = 64;
+    static constexpr uint32_t maxMessageSize = 0x10000;
+private:
+    struct entry{
+        std::weak_ptr<WIFIDevice> dev;
+        std::string serial;
+        idevice_t idev;
+        idevice_connection_t conn;
+        int fd;
+        TimerWheel::timer_id timer;
+        std::string rxbuf;
+    };
+    std::mutex _lck;
+    std::vector<std::pair<uint64_t, entry>> _incoming;
+    std::vector<uint64_t> _removals;
+    uint64_t _nextKey;
+    int _wakePipe[2];
+
+    //only touched by the loop thread
+    std::map<uint64_t, entry> _entries;
+    std::vector<struct pollfd> _pfds;
+    std::vector<uint64_t> _pfdKeys;
+    TimerWheel _wheel;
+    std::string _polo; //framed response, serialized once
+
+    virtual void stopAction() noexcept override;
+    virtual bool loopEvent() override;
+
+    void wakeup() noexcept;
+    void adopt_changes() noexcept;
+    void free_entry(entry &e) noexcept;
+    void kill_entry(uint64_t key, const char *reason) noexcept;
+    bool handle_input(uint64_t key, entry &e) noexcept;
+    bool send_polo(entry &e) noexcept;
+
+public:
+    HeartbeatLoop();
+    HeartbeatLoop(const HeartbeatLoop &) = delete;
+    virtual ~HeartbeatLoop() override;
+
+    /*
+        Takes ownership of idev and conn, returns a key for remove().
+     */
+    uint64_t add(std::shared_ptr<WIFIDevice> dev, idevice_t idev, idevice_connection_t conn);
+    void remove(uint64_t key) noexcept;
+};
+
+#endif /* HeartbeatLoop_hpp */
@@ -0,0 +1,257 @@
+//
+//  LibUSBTransport.cpp
+//  usbmuxd2
+//
+
+#include "LibUSBTransport.hpp"
+#include "USBDevice.hpp"
+#include "../Manager/USBDeviceManager.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <limits.h>
+#include <stdlib.h>
+
+#pragma mark libusb_callback implementations
+void tx_callback(struct libusb_transfer *xfer) noexcept{
+    std::shared_ptr<USBDevice> dev = *(std::shared_ptr<USBDevice> *)xfer->user_data;
+    LibUSBTransport *transport = (LibUSBTransport*)dev->_transport;
+
+    if(xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        switch(xfer->status) {
+            case LIBUSB_TRANSFER_COMPLETED: //shut up compiler
+            case LIBUSB_TRANSFER_ERROR:
+                // funny, this happens when we disconnect the device while waiting for a transfer, sometimes
+                info("Device %d-%d TX aborted due to error or disconnect", dev->_bus, dev->_address);
+                break;
+            case LIBUSB_TRANSFER_TIMED_OUT:
+                error("TX transfer timed out for device %d-%d", dev->_bus, dev->_address);
+                break;
+            case LIBUSB_TRANSFER_CANCELLED:
+                debug("Device %d-%d TX transfer cancelled", dev->_bus, dev->_address);
+                break;
+            case LIBUSB_TRANSFER_STALL:
+                error("TX transfer stalled for device %d-%d", dev->_bus, dev->_address);
+                break;
+            case LIBUSB_TRANSFER_NO_DEVICE:
+                // other times, this happens, and also even when we abort the transfer after device removal
+                info("Device %d-%d TX aborted due to disconnect", dev->_bus, dev->_address);
+                break;
+            case LIBUSB_TRANSFER_OVERFLOW:
+                error("TX transfer overflow for device %d-%d", dev->_bus, dev->_address);
+                break;
+                // and nothing happens (this never gets called) if the device is freed after a disconnect! (bad)
+            default:
+                // this should never be reached.
+                break;
+        }
+        dev->kill();
+    }
+
+    transport->free_transfer(xfer, false, xfer->status == LIBUSB_TRANSFER_COMPLETED);
+}
+
+void rx_callback(struct libusb_transfer *xfer) noexcept{
+    std::shared_ptr<USBDevice> dev = *(std::shared_ptr<USBDevice> *)xfer->user_data;
+    LibUSBTransport *transport = (LibUSBTransport*)dev->_transport;
+//    debug("RX callback dev %d-%d len %d status %d", dev->_bus, dev->_address, xfer->actual_length, xfer->status);
+    if(xfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        dev->_arrived.post({xfer->buffer, (uint32_t)xfer->actual_length, xfer, std::chrono::steady_clock::now(), transport->_rxSeq});
+        transport->_rxSeq++;
+        return;
+    }
+    switch(xfer->status) {
+        case LIBUSB_TRANSFER_ERROR:
+            // funny, this happens when we disconnect the device while waiting for a transfer, sometimes
+            info("Device %d-%d RX aborted due to error or disconnect", dev->_bus, dev->_address);
+            break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            error("RX transfer timed out for device %d-%d", dev->_bus, dev->_address);
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+            debug("Device %d-%d RX transfer cancelled", dev->_bus, dev->_address);
+            break;
+        case LIBUSB_TRANSFER_STALL:
+            error("RX transfer stalled for device %d-%d", dev->_bus, dev->_address);
+            break;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            // other times, this happens, and also even when we abort the transfer after device removal
+            info("Device %d-%d RX aborted due to disconnect", dev->_bus, dev->_address);
+            break;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            error("RX transfer overflow for device %d-%d", dev->_bus, dev->_address);
+            break;
+        case LIBUSB_TRANSFER_COMPLETED: //shut up compiler
+        default:
+            // this should never be reached.
+            break;
+    }
+
+    debug("freing rx xfer for USBDevice(%s)",dev->_serial);
+    transport->free_transfer(xfer, true);
+    dev->kill();
+}
+
+#pragma mark LibUSBTransport
+LibUSBTransport::LibUSBTransport(USBDevice *dev, libusb_device_handle *handle, uint8_t interface, uint8_t ep_in, uint8_t ep_out, int wMaxPacketSize)
+: USBTransport(dev), _handle(handle), _interface(interface), _ep_in(ep_in), _ep_out(ep_out), _wMaxPacketSize(wMaxPacketSize)
+{
+    //
+}
+
+LibUSBTransport::~LibUSBTransport(){
+    if (_handle){
+        libusb_release_interface(_handle, _interface);
+        safeFreeCustom(_handle, libusb_close);
+    }
+}
+
+#pragma mark private
+void LibUSBTransport::free_transfer(struct libusb_transfer *xfer, bool isRX, bool completed) noexcept{
+    if (isRX) {
+        guardWrite(_rx_xfers_Guard);
+        if (_rx_xfers.erase(xfer)) _rxInFlight.sub();
+    }else{
+        std::chrono::steady_clock::time_point submittedAt{};
+        {
+            guardWrite(_tx_xfers_Guard);
+            auto it = _tx_xfers.find(xfer);
+            if (it != _tx_xfers.end()) {
+                submittedAt = it->second;
+                _tx_xfers.erase(it);
+                _txInFlight.sub();
+            }
+        }
+        if (completed && submittedAt.time_since_epoch().count()) _dev->_latencies.txCompletion.recordSince(submittedAt);
+    }
+    safeFree(xfer->buffer);
+    {
+        std::shared_ptr<USBDevice> *userarg = (std::shared_ptr<USBDevice> *)xfer->user_data;xfer->user_data = NULL;
+        safeDelete(userarg);
+    }
+    libusb_free_transfer(xfer);
+}
+
+void LibUSBTransport::start_rx_transfer(){
+    void *buf = NULL;
+    struct libusb_transfer *xfer = NULL;
+    std::shared_ptr<USBDevice> *devrefarg = nullptr;
+    cleanup([&](){ //cleanup only code
+        safeDelete(devrefarg);
+        safeFree(buf);
+        if (xfer) free_transfer(xfer, true);
+    });
+    int ret = 0;
+
+    assure(buf = malloc(USB_MRU));
+    assure(xfer = libusb_alloc_transfer(0));
+    xfer->user_data = NULL;
+
+    devrefarg = new std::shared_ptr<USBDevice>{_dev->_selfref.lock()};
+    libusb_fill_bulk_transfer(xfer, _handle, _ep_in, (unsigned char *)buf, USB_MRU, rx_callback, devrefarg, 0);
+    buf = NULL; //owned by xfer now
+    devrefarg = nullptr; //owned by xfer now
+
+    {
+        guardWrite(_rx_xfers_Guard);
+        _rx_xfers.insert(xfer); //transfer ownsership of transfer to device
+        _rxInFlight.add();
+    }
+    retassure(!((ret = libusb_submit_transfer(xfer)),ret),"Failed to submit RX transfer to device %d-%d: %d", _dev->_bus, _dev->_address, ret);
+    xfer = NULL;
+}
+
+#pragma mark public
+libusb_device_handle *LibUSBTransport::handle() noexcept{
+    return _handle;
+}
+
+int LibUSBTransport::start_rx(int count){
+    int started = 0;
+    for (int i = 0; i < count; i++) {
+        try {
+            start_rx_transfer();
+            started++;
+        } catch (tihmstar::exception &e) {
+            warning("Failed to start RX loop number %d", i);
+        }
+    }
+    return started;
+}
+
+void LibUSBTransport::rx_done(rx_buffer rx) noexcept{
+    struct libusb_transfer *xfer = (struct libusb_transfer *)rx.handle;
+    int ret = 0;
+    if ((ret = libusb_submit_transfer(xfer)) < 0) {
+        error("Failed to re-submit RX transfer to device %d-%d: %d", _dev->_bus, _dev->_address, ret);
+        free_transfer(xfer, true);
+        _dev->kill();
+    }
+}
+
+/*
+ always frees buf
+ */
+void LibUSBTransport::submit_tx(void *buf, size_t length){
+    struct libusb_transfer *xfer = NULL;
+    std::shared_ptr<USBDevice> *txcbargref = nullptr;
+    cleanup([&]{
+        safeDelete(txcbargref);
+        safeFree(buf);
+        if (xfer) free_transfer(xfer, false);
+    });
+    int ret = 0;
+
+    assure(length<=INT_MAX); //sanity check
+    assure(xfer = libusb_alloc_transfer(0));
+    xfer->user_data = NULL;
+
+    txcbargref = new std::shared_ptr<USBDevice>(_dev->_selfref.lock());
+    libusb_fill_bulk_transfer(xfer, _handle, _ep_out, (unsigned char *)buf, (int)length, tx_callback, txcbargref, 0);
+    buf = NULL;
+    txcbargref = nullptr;
+
+    {
+        guardWrite(_tx_xfers_Guard);
+        _tx_xfers[xfer] = std::chrono::steady_clock::now();
+        _txInFlight.add();
+    }
+    retassure((ret = libusb_submit_transfer(xfer)) >=0, "Failed to submit TX transfer len %zu to device %d-%d: %d", length, _dev->_bus, _dev->_address, ret);
+    xfer = NULL;
+}
+
+void LibUSBTransport::submit_zlp(){
+    debug("Send ZLP");
+    // Send Zero Length Packet
+    void *buf = NULL;
+    assure(buf = malloc(1));
+    submit_tx(buf, 0);
+}
+
+int LibUSBTransport::maxPacketSize() const noexcept{
+    return _wMaxPacketSize;
+}
+
+void LibUSBTransport::cancel() noexcept{
+    //cancel all rx transfers
+    {
+        guardRead(_rx_xfers_Guard);
+        for (auto xfer : _rx_xfers) {
+            debug("cancelling _rx_xfers(%p)",xfer);
+            libusb_cancel_transfer(xfer);
+        }
+    }
+
+    //cancel all tx transfers
+    {
+        guardRead(_tx_xfers_Guard);
+        for (auto &xfer : _tx_xfers) {
+            debug("cancelling _tx_xfers(%p)",xfer.first);
+            libusb_cancel_transfer(xfer.first);
+        }
+    }
+}
+
+bool LibUSBTransport::idle() noexcept{
+    return _rx_xfers.size() == 0 && _tx_xfers.size() == 0;
+}
@@ -0,0 +1,56 @@
+//
+//  LibUSBTransport.hpp
+//  usbmuxd2
+//
+
+#ifndef LibUSBTransport_hpp
+#define LibUSBTransport_hpp
+
+#include "USBTransport.hpp"
+#include <libusb.h>
+#include <libgeneral/GuardAccess.hpp>
+#include <chrono>
+#include <map>
+#include <set>
+
+/*
+    Bulk transfers on the mux interface of a real device.
+ */
+class LibUSBTransport : public USBTransport{
+    libusb_device_handle *_handle;
+    uint8_t _interface, _ep_in, _ep_out;
+    int _wMaxPacketSize;
+
+    std::set<struct libusb_transfer *> _rx_xfers;
+    tihmstar::GuardAccess _rx_xfers_Guard;
+    std::map<struct libusb_transfer *, std::chrono::steady_clock::time_point> _tx_xfers; //submission time
+    tihmstar::GuardAccess _tx_xfers_Guard;
+
+    void start_rx_transfer();
+    /*
+        completed records the TX latency, it is only set by tx_callback.
+     */
+    void free_transfer(struct libusb_transfer *xfer, bool isRX, bool completed = false) noexcept;
+
+public:
+    /*
+        Takes ownership of handle, interface must already be claimed.
+     */
+    LibUSBTransport(USBDevice *dev, libusb_device_handle *handle, uint8_t interface, uint8_t ep_in, uint8_t ep_out, int wMaxPacketSize);
+    virtual ~LibUSBTransport() override;
+
+    libusb_device_handle *handle() noexcept;
+
+    virtual int start_rx(int count) override;
+    virtual void rx_done(rx_buffer rx) noexcept override;
+    virtual void submit_tx(void *buf, size_t length) override;
+    virtual void submit_zlp() override;
+    virtual int maxPacketSize() const noexcept override;
+    virtual void cancel() noexcept override;
+    virtual bool idle() noexcept override;
+
+    friend void rx_callback(struct libusb_transfer *xfer) noexcept;
+    friend void tx_callback(struct libusb_transfer *xfer) noexcept;
+};
+
+#endif /* LibUSBTransport_hpp */
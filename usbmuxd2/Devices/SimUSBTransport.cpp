@@ -0,0 +1,336 @@
+//
+//  SimUSBTransport.cpp
+//  usbmuxd2
+//
+
+#include "SimUSBTransport.hpp"
+#include "USBDevice.hpp"
+#include "../Manager/USBDeviceManager.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN(a,b) ((a) > (b) ? (b) : (a))
+
+static constexpr uint32_t maxSegmentSize = USB_MRU - sizeof(USBDevice::mux_header_v2) - sizeof(tcphdr);
+static constexpr uint32_t maxSplitSegmentSize = DEV_MRU - sizeof(USBDevice::mux_header_v2) - sizeof(tcphdr);
+
+#pragma mark SimUSBTransport
+SimUSBTransport::SimUSBTransport(USBDevice *dev, const params &p)
+: USBTransport(dev), _params(p), _stop(false), _cancelled(false)
+, _expectZLP(false), _rxSlots(0), _linkFree{}, _reorderCnt(0)
+, _version(0), _tx_seq(0), _rx_seq(0)
+{
+    retassure(_params.version == 1 || _params.version == 2, "[SimUSB] unsupported mux version %d", _params.version);
+    retassure(!_params.split || _params.version >= 2, "[SimUSB] mux v1 doesn't support split packets");
+    _thread = std::thread([this]{
+        device_runloop();
+    });
+}
+
+SimUSBTransport::~SimUSBTransport(){
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _stop = true;
+        _cond.notify_all();
+    }
+    _thread.join();
+    for (auto &p : _outgoing) free(p.data);
+    for (auto &p : _incoming) free(p.data);
+    for (auto data : _posted) free(data);
+}
+
+#pragma mark private
+void SimUSBTransport::device_runloop() noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    while (!_stop) {
+        if (_incoming.size()) {
+            hostpacket p = _incoming.front();
+            _incoming.pop_front();
+            _txInFlight.sub();
+            _dev->_latencies.txCompletion.recordSince(p.submittedAt); //the device picking it up is our transfer completion
+            try {
+                handle_host_packet(p.data, p.length);
+            } catch (tihmstar::exception &e) {
+                error("[SimUSB] %s: failed to handle host packet with error=%d (%s)",_dev->_serial,e.code(),e.what());
+            }
+            free(p.data);
+            continue;
+        }
+        if (deliver()) continue;
+        if (!_cancelled && _rxSlots && _outgoing.size()) {
+            _cond.wait_until(ul, _outgoing.front().due);
+        } else {
+            _cond.wait(ul);
+        }
+    }
+}
+
+bool SimUSBTransport::deliver() noexcept{
+    clock::time_point now;
+    size_t pick = 0;
+    packet p = {};
+    if (_cancelled || !_rxSlots || !_outgoing.size()) return false;
+    now = clock::now();
+    if (_outgoing.front().due > now) return false;
+
+    /*
+        The host can only restore the order of v2 packets, and only if another IN transfer is
+        available to pick up the packet it is waiting for.
+     */
+    if (_params.reorder && _rxSlots >= 2 && _outgoing.size() >= 2
+        && _outgoing[0].sequenced && _outgoing[1].sequenced && _outgoing[1].due <= now
+        && (++_reorderCnt & 3) == 0) {
+        pick = 1;
+    }
+    p = _outgoing[pick];
+    _outgoing.erase(_outgoing.begin() + pick);
+
+    _rxSlots--;
+    _posted.insert(p.data);
+    try {
+        _dev->_arrived.post({p.data, p.length, p.data, now, _rxSeq});
+        _rxSeq++;
+    } catch (...) {
+        //device is going away
+        _posted.erase(p.data);
+        free(p.data);
+    }
+    return true;
+}
+
+void SimUSBTransport::queue_packet(int proto, const void *hdr, size_t hdrlen, const void *payload, size_t payload_length){
+    USBDevice::mux_header *mhdr = NULL;
+    unsigned char *buf = NULL;
+    cleanup([&]{
+        safeFree(buf);
+    });
+    size_t mux_header_size = 0;
+    size_t buflen = 0;
+    packet p = {};
+    clock::time_point now = clock::now();
+
+    if (_cancelled) return;
+    mux_header_size = (_version < 2) ? sizeof(USBDevice::mux_header_v1) : sizeof(USBDevice::mux_header_v2);
+    buflen = mux_header_size + hdrlen + payload_length;
+    assure(buflen <= ((_params.split && _version >= 2) ? DEV_MRU : USB_MRU));
+    assure(buf = (unsigned char *)malloc(buflen));
+
+    mhdr = (USBDevice::mux_header *)buf;
+    mhdr->protocol = htonl(proto);
+    mhdr->length = htonl((uint32_t)buflen);
+    if (_version >= 2) {
+        mhdr->v2.magic = htonl(0xfeedface);
+        mhdr->v2.tx_seq = htons(_tx_seq++);
+        mhdr->v2.rx_seq = htons(_rx_seq);
+    }
+    if (hdrlen) memcpy(buf + mux_header_size, hdr, hdrlen);
+    if (payload_length) memcpy(buf + mux_header_size + hdrlen, payload, payload_length);
+
+    p.sequenced = _version >= 2;
+    p.due = now + std::chrono::microseconds(_params.latencyUs);
+    if (_params.bandwidth) {
+        if (_linkFree < now) _linkFree = now;
+        _linkFree += std::chrono::nanoseconds(buflen * 1000000000ULL / _params.bandwidth);
+        if (p.due < _linkFree) p.due = _linkFree;
+    }
+    if (buflen <= USB_MRU) {
+        p.data = buf; buf = NULL;
+        p.length = (uint32_t)buflen;
+        _outgoing.push_back(p);
+        return;
+    }
+
+    /*
+        Like a real device, send a full USB_MRU transfer followed by the rest.
+        Only the first part has a header, so the parts must never be reordered.
+     */
+    p.sequenced = false;
+    for (size_t off = 0; off < buflen; off += USB_MRU) {
+        packet part = p;
+        part.length = (uint32_t)MIN(buflen - off, (size_t)USB_MRU);
+        assure(part.data = (unsigned char *)malloc(part.length));
+        memcpy(part.data, buf + off, part.length);
+        _outgoing.push_back(part);
+    }
+}
+
+void SimUSBTransport::send_tcp(uint16_t sport, uint16_t dport, uint32_t seq, uint32_t ack, uint8_t flags, const void *payload, uint32_t payload_length){
+    tcphdr th = {};
+    th.th_sport = htons(sport);
+    th.th_dport = htons(dport);
+    th.th_seq = htonl(seq);
+    th.th_ack = htonl(ack);
+    th.th_flags = flags;
+    th.th_off = sizeof(th) / 4;
+    th.th_win = htons((uint16_t)MIN(_params.window >> 8, 0xffff));
+    queue_packet(USBDevice::MUX_PROTO_TCP, &th, sizeof(th), payload, payload_length);
+}
+
+void SimUSBTransport::flush_conn(uint16_t hostPort, tcpconn &c){
+    while (c.pending.size()) {
+        uint32_t inflight = c.seq - c.hostAcked;
+        uint32_t chunk = 0;
+        if (inflight >= c.hostWin) break; //wait for the host to ACK
+        chunk = MIN((uint32_t)MIN(c.pending.size(), (size_t)(_params.split ? maxSplitSegmentSize : maxSegmentSize)), c.hostWin - inflight);
+        send_tcp(c.port, hostPort, c.seq, c.ack, TH_ACK, c.pending.data(), chunk);
+        c.seq += chunk;
+        c.pending.erase(0, chunk);
+    }
+}
+
+void SimUSBTransport::handle_host_tcp(struct tcphdr *th, unsigned char *payload, uint32_t payload_length){
+    uint16_t hostPort = ntohs(th->th_sport);
+    uint16_t port = ntohs(th->th_dport);
+    auto it = _conns.find(hostPort);
+
+    if (th->th_flags & (TH_RST | TH_FIN)) {
+        //the host closes connections with RST
+        _conns.erase(hostPort);
+        return;
+    }
+
+    if (th->th_flags == TH_SYN) {
+        tcpconn c = {};
+        uint32_t iss = (uint32_t)random();
+        c.port = port;
+        c.seq = iss + 1;
+        c.ack = ntohl(th->th_seq) + 1;
+        c.hostAcked = c.seq;
+        c.hostWin = ntohs(th->th_win) << 8;
+        _conns[hostPort] = c;
+        send_tcp(port, hostPort, iss, c.ack, TH_SYN | TH_ACK);
+        return;
+    }
+
+    if (it == _conns.end()) {
+        send_tcp(port, hostPort, ntohl(th->th_ack), ntohl(th->th_seq) + payload_length, TH_RST);
+        return;
+    }
+
+    {
+        tcpconn &c = it->second;
+        size_t pending = 0;
+        c.hostAcked = ntohl(th->th_ack);
+        c.hostWin = ntohs(th->th_win) << 8;
+        if (payload_length) {
+            if (ntohl(th->th_seq) != c.ack) {
+                warning("[SimUSB] %s: dropping out of order segment seq=%u expected=%u",_dev->_serial,ntohl(th->th_seq),c.ack);
+                return;
+            }
+            c.ack += payload_length;
+            c.pending.append((char*)payload, payload_length);
+        }
+        pending = c.pending.size();
+        flush_conn(hostPort, c);
+        if (payload_length && c.pending.size() == pending) {
+            //nothing went out to carry the ACK
+            send_tcp(c.port, hostPort, c.seq, c.ack, TH_ACK);
+        }
+    }
+}
+
+void SimUSBTransport::handle_host_packet(unsigned char *buf, size_t length){
+    USBDevice::mux_header *mhdr = (USBDevice::mux_header *)buf;
+    size_t mux_header_size = (_version < 2) ? sizeof(USBDevice::mux_header_v1) : sizeof(USBDevice::mux_header_v2);
+
+    retassure(length >= mux_header_size && ntohl(mhdr->length) == length, "[SimUSB] host packet size mismatch (got %zu)", length);
+    if (_version >= 2) {
+        retassure(ntohl(mhdr->v2.magic) == 0xfeedface, "[SimUSB] bad magic in host packet");
+        _rx_seq = ntohs(mhdr->v2.tx_seq);
+    }
+
+    switch (ntohl(mhdr->protocol)) {
+        case USBDevice::MUX_PROTO_VERSION:
+        {
+            USBDevice::mux_version_header vh = {};
+            retassure(length >= mux_header_size + sizeof(vh), "[SimUSB] version packet is too small (%zu)", length);
+            vh.major = htonl(_params.version);
+            vh.minor = htonl(0);
+            //the version reply always uses a v1 header
+            queue_packet(USBDevice::MUX_PROTO_VERSION, NULL, 0, &vh, sizeof(vh));
+            _version = _params.version;
+        }
+            break;
+        case USBDevice::MUX_PROTO_SETUP:
+            _tx_seq = 0;
+            break;
+        case USBDevice::MUX_PROTO_TCP:
+            retassure(length >= mux_header_size + sizeof(tcphdr), "[SimUSB] TCP packet is too small (%zu)", length);
+            handle_host_tcp((struct tcphdr *)(buf + mux_header_size), buf + mux_header_size + sizeof(tcphdr), (uint32_t)(length - mux_header_size - sizeof(tcphdr)));
+            break;
+        default:
+            warning("[SimUSB] %s: ignoring host packet with protocol 0x%x",_dev->_serial,ntohl(mhdr->protocol));
+            break;
+    }
+}
+
+#pragma mark public
+int SimUSBTransport::start_rx(int count){
+    std::unique_lock<std::mutex> ul(_lck);
+    _rxSlots += count;
+    _rxInFlight.add(count);
+    _cond.notify_all();
+    return count;
+}
+
+void SimUSBTransport::rx_done(rx_buffer rx) noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    if (_posted.erase(rx.data)) free(rx.data);
+    if (!_cancelled) {
+        _rxSlots++;
+        _cond.notify_all();
+    }
+}
+
+/*
+ always frees buf
+ */
+void SimUSBTransport::submit_tx(void *buf, size_t length){
+    std::unique_lock<std::mutex> ul(_lck);
+    if (_cancelled) {
+        free(buf);
+        reterror("[SimUSB] transport was cancelled");
+    }
+    if (!length) {
+        _expectZLP = false;
+        free(buf);
+        return;
+    }
+    if (_expectZLP) {
+        warning("[SimUSB] %s: host didn't send a ZLP after a packet of a multiple of %d bytes",_dev->_serial,wMaxPacketSize);
+    }
+    _expectZLP = (length % wMaxPacketSize) == 0;
+    _incoming.push_back({(unsigned char *)buf, length, clock::now()});
+    _txInFlight.add();
+    _cond.notify_all();
+}
+
+void SimUSBTransport::submit_zlp(){
+    submit_tx(malloc(1), 0);
+}
+
+int SimUSBTransport::maxPacketSize() const noexcept{
+    return wMaxPacketSize;
+}
+
+void SimUSBTransport::cancel() noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    _cancelled = true;
+    for (auto &p : _outgoing) free(p.data);
+    _outgoing.clear();
+    for (auto &p : _incoming) free(p.data);
+    _incoming.clear();
+    _rxInFlight.set(0);
+    _txInFlight.set(0);
+    _cond.notify_all();
+}
+
+bool SimUSBTransport::idle() noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    return _incoming.empty();
+}
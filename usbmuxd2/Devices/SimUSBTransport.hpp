@@ -0,0 +1,105 @@
+//
+//  SimUSBTransport.hpp
+//  usbmuxd2
+//
+
+#ifndef SimUSBTransport_hpp
+#define SimUSBTransport_hpp
+
+#include "USBTransport.hpp"
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+/*
+    Plays the device side of the mux protocol in-process, no hardware involved.
+    Answers the version handshake and accepts TCP connections on any port, echoing back all data.
+    Device to host packets can be delayed, paced to a bandwidth and (v2 only) reordered or split across IN transfers.
+    Packets are only delivered while the host has IN transfers available, like on a real bus.
+ */
+class SimUSBTransport : public USBTransport{
+public:
+    static constexpr int wMaxPacketSize = 512;
+    struct params{
+        int devices;
+        int version;        //mux version the device answers with (1 or 2)
+        uint32_t window;    //TCP receive window advertised to the host (bytes)
+        uint32_t latencyUs; //delay of every device to host packet
+        uint64_t bandwidth; //device to host bytes per second, 0 is unlimited
+        bool reorder;       //swap adjacent device to host packets
+        bool split;         //v2 only, send TCP segments too large for one IN transfer, so the host has to reassemble them
+    };
+private:
+    typedef std::chrono::steady_clock clock;
+    struct packet{
+        unsigned char *data;
+        uint32_t length;
+        clock::time_point due;
+        bool sequenced; //v2 packet, the host restores the order
+    };
+    struct hostpacket{
+        unsigned char *data;
+        size_t length;
+        clock::time_point submittedAt;
+    };
+    struct tcpconn{
+        uint16_t port;      //our side of the connection
+        uint32_t seq;       //next byte we send
+        uint32_t ack;       //next byte we expect
+        uint32_t hostAcked;
+        uint32_t hostWin;
+        std::string pending; //received, not yet echoed
+    };
+    params _params;
+    std::mutex _lck;
+    std::condition_variable _cond;
+    std::thread _thread;
+    bool _stop;
+    bool _cancelled;
+
+    //host -> device
+    std::deque<hostpacket> _incoming;
+    bool _expectZLP;
+
+    //device -> host
+    std::deque<packet> _outgoing;
+    std::set<unsigned char *> _posted;
+    int _rxSlots;
+    clock::time_point _linkFree;
+    uint32_t _reorderCnt;
+
+    //device mux state, only touched by the device thread
+    int _version;
+    uint16_t _tx_seq;
+    uint16_t _rx_seq;
+    std::map<uint16_t, tcpconn> _conns;
+
+    void device_runloop() noexcept;
+    void handle_host_packet(unsigned char *buf, size_t length);
+    void handle_host_tcp(struct tcphdr *th, unsigned char *payload, uint32_t payload_length);
+    void send_tcp(uint16_t sport, uint16_t dport, uint32_t seq, uint32_t ack, uint8_t flags, const void *payload = NULL, uint32_t payload_length = 0);
+    void flush_conn(uint16_t hostPort, tcpconn &c);
+    void queue_packet(int proto, const void *hdr, size_t hdrlen, const void *payload, size_t payload_length);
+    bool deliver() noexcept;
+
+public:
+    SimUSBTransport(USBDevice *dev, const params &p);
+    virtual ~SimUSBTransport() override;
+
+    virtual int start_rx(int count) override;
+    virtual void rx_done(rx_buffer rx) noexcept override;
+    virtual void submit_tx(void *buf, size_t length) override;
+    virtual void submit_zlp() override;
+    virtual int maxPacketSize() const noexcept override;
+    virtual void cancel() noexcept override;
+    virtual bool idle() noexcept override;
+};
+
+#endif /* SimUSBTransport_hpp */
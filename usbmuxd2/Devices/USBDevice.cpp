@@ -15,66 +15,16 @@
 
 #include <string.h>
 
-#pragma mark libusb_callback implementations
-void tx_callback(struct libusb_transfer *xfer) noexcept{
-    std::shared_ptr<USBDevice> dev = *(std::shared_ptr<USBDevice> *)xfer->user_data;
-
-    if(xfer->status != LIBUSB_TRANSFER_COMPLETED) {
-        switch(xfer->status) {
-            case LIBUSB_TRANSFER_COMPLETED: //shut up compiler
-            case LIBUSB_TRANSFER_ERROR:
-                // funny, this happens when we disconnect the device while waiting for a transfer, sometimes
-                info("Device %d-%d TX aborted due to error or disconnect", dev->_bus, dev->_address);
-                break;
-            case LIBUSB_TRANSFER_TIMED_OUT:
-                error("TX transfer timed out for device %d-%d", dev->_bus, dev->_address);
-                break;
-            case LIBUSB_TRANSFER_CANCELLED:
-                debug("Device %d-%d TX transfer cancelled", dev->_bus, dev->_address);
-                break;
-            case LIBUSB_TRANSFER_STALL:
-                error("TX transfer stalled for device %d-%d", dev->_bus, dev->_address);
-                break;
-            case LIBUSB_TRANSFER_NO_DEVICE:
-                // other times, this happens, and also even when we abort the transfer after device removal
-                info("Device %d-%d TX aborted due to disconnect", dev->_bus, dev->_address);
-                break;
-            case LIBUSB_TRANSFER_OVERFLOW:
-                error("TX transfer overflow for device %d-%d", dev->_bus, dev->_address);
-                break;
-                // and nothing happens (this never gets called) if the device is freed after a disconnect! (bad)
-            default:
-                // this should never be reached.
-                break;
-        }
-        dev->kill();
-    }
-
-    //remove transfer
-    {
-        guardWrite(dev->_tx_xfers_Guard);
-        dev->_tx_xfers.erase(xfer);
-    }
-
-    safeFree(xfer->buffer);
-    {
-        std::shared_ptr<USBDevice> *userarg = (std::shared_ptr<USBDevice> *)xfer->user_data;xfer->user_data = NULL;
-        safeDelete(userarg);
-    }
-    libusb_free_transfer(xfer);
-}
-
 #pragma mark USBDevice
 USBDevice::USBDevice(Muxer *mux, USBDeviceManager *parent, uint16_t pid)
 : Device(mux, MUXCONN_USB), _selfref{}, _parent(parent)
 , _pid(pid)
 , _bus(0), _address(0)
-, _interface(0), _ep_in(0), _ep_out(0)
 , _devdesc{}
-, _wMaxPacketSize(0), _speed(0)
-, _state{}, _usbdev(NULL), _nextPort(0)
+, _speed(0)
+, _transport(NULL), _rxLoops(0), _rxNextSeq(0), _rxStopped(false), _nextPort(0)
+, _state{}
 , _muxdev{}, _usbLck{}
-, _rx_xfers{}, _tx_xfers{}
 {
     retassure(_muxdev.pktbuf = (uint8_t*)malloc(DEV_MRU), "Failed to alloc pktbuf");
     _conReaperThread = std::thread([this]{
@@ -84,7 +34,13 @@ USBDevice::USBDevice(Muxer *mux, USBDeviceManager *parent, uint16_t pid)
 }
 
 USBDevice::~USBDevice(){
-    _arrived_xfer.kill();
+    _arrived.kill();
+    {
+        //receivers waiting for a transfer which will never be parsed
+        std::unique_lock<std::mutex> ul(_usbLck);
+        _rxStopped = true;
+        _data_in_event.notifyAll();
+    }
     while (_receivers.size()) {
         auto r = *_receivers.begin();
         _receivers.erase(r);
@@ -104,17 +60,14 @@ USBDevice::~USBDevice(){
     _conReaperThread.join();
     
     safeFree(_muxdev.pktbuf);
-    //free resources
-    if (_usbdev){
-        libusb_release_interface(_usbdev, _interface);
-        safeFreeCustom(_usbdev, libusb_close);
-    }
     assert(isDeviceReadyForDestruction());
+    //free resources
+    safeDelete(_transport);
 }
 
 #pragma mark private
 bool USBDevice::isDeviceReadyForDestruction(){
-    return _rx_xfers.size() == 0 && _tx_xfers.size() == 0;
+    return !_transport || _transport->idle();
 }
 
 void USBDevice::addReceiver(){
@@ -152,23 +105,8 @@ void USBDevice::deconstruct() noexcept{
     debug("[Deconstructing] USBDevice %s",_serial);
     std::shared_ptr<USBDevice> selfref = _selfref.lock();
     _mux->delete_device(selfref);
-    //cancel all rx transfers
-    {
-        guardRead(_rx_xfers_Guard);
-        for (auto xfer : _rx_xfers) {
-            debug("cancelling _rx_xfers(%p)",xfer);
-            libusb_cancel_transfer(xfer);
-        }
-    }
-
-    //cancel all tx transfers
-    {
-        guardRead(_tx_xfers_Guard);
-        for (auto xfer : _tx_xfers) {
-            debug("cancelling _tx_xfers(%p)",xfer);
-            libusb_cancel_transfer(xfer);
-        }
-    }
+    //cancel all transfers
+    if (_transport) _transport->cancel();
     
     //cancel all TCP connections
     {
@@ -226,6 +164,25 @@ void USBDevice::closeConnection(uint16_t sport){
 
 
 #pragma mark members
+void USBDevice::start_mux(int rxLoops){
+    // Spin up parallel usb data retrieval loops
+    // Old usbmuxds used only 1 rx loop, but that leaves the
+    // USB port sleeping most of the time
+    assure(_transport);
+    _rxLoops = _transport->start_rx(rxLoops);
+    // Ensure we have at least 1 RX loop going
+    retassure(_rxLoops, "Failed to start any RX loop for device %d-%d", _bus, _address);
+    if (_rxLoops != rxLoops) {
+        warning("Failed to start all %d RX loops. Going on with %d loops. This may have negative impact on device read speed.", rxLoops, _rxLoops);
+    } else {
+        debug("All %d RX loops started successfully", rxLoops);
+    }
+    for (int i = 0; i < _rxLoops; i++) {
+        addReceiver();
+    }
+    mux_init();
+}
+
 uint32_t USBDevice::usb_location(){
     return (_bus << 16) | _address;
 }
@@ -310,82 +267,91 @@ void USBDevice::send_packet(enum mux_protocol proto, const void *data, size_t le
  always frees buf
  */
 void USBDevice::usb_send(void *buf, size_t length){
-    struct libusb_transfer *xfer = NULL;
-    std::shared_ptr<USBDevice> *txcbargref = nullptr;
-    cleanup([&]{
-        safeDelete(txcbargref);
-        safeFree(buf);
-        if (xfer) {
-            {
-                guardWrite(_tx_xfers_Guard);
-                _tx_xfers.erase(xfer);
-            }
-            safeFree(xfer->buffer);
-            {
-                std::shared_ptr<USBDevice> *userdata = (std::shared_ptr<USBDevice> *)xfer->user_data; xfer->user_data = NULL;
-                safeDelete(userdata);
-            }
-            libusb_free_transfer(xfer);
-        }
-    });
-    int ret = 0;
-
-    assure(length<=INT_MAX); //sanity check
-    assure(xfer = libusb_alloc_transfer(0));
-    xfer->user_data = NULL;
-
-    txcbargref = new std::shared_ptr<USBDevice>(_selfref.lock());
-    libusb_fill_bulk_transfer(xfer, _usbdev, _ep_out, (unsigned char *)buf, (int)length, tx_callback, txcbargref, 0);
-    buf = NULL;
-    txcbargref = nullptr;
-
-    {
-        guardWrite(_tx_xfers_Guard);
-        _tx_xfers.insert(xfer);
-    }
-    retassure((ret = libusb_submit_transfer(xfer)) >=0, "Failed to submit TX transfer %p len %zu to device %d-%d: %d", buf, length, _bus, _address, ret);
-    xfer = NULL;
-    if (length % _wMaxPacketSize == 0 && length >= _wMaxPacketSize) {
-        debug("Send ZLP");
-        // Send Zero Length Packet
-        assure(buf = malloc(1));
-        assure(xfer = libusb_alloc_transfer(0));
-        xfer->user_data = NULL;
-
-        txcbargref = new std::shared_ptr<USBDevice>(_selfref.lock());
-        libusb_fill_bulk_transfer(xfer, _usbdev, _ep_out, (unsigned char *)buf, 0, tx_callback, txcbargref, 0);
-        buf = NULL;
-        txcbargref = nullptr;
-
-        {
-            guardWrite(_tx_xfers_Guard);
-            _tx_xfers.insert(xfer);
-        }
-        retassure((ret = libusb_submit_transfer(xfer)) >=0, "Failed to submit TX ZLP transfer to device %d-%d: %d", _bus, _address, ret);
-        xfer = NULL;
+    int wMaxPacketSize = _transport->maxPacketSize();
+    _transport->submit_tx(buf, length);
+    _txPackets.add();
+    _txBytes.add(length);
+    if (length % wMaxPacketSize == 0 && length >= wMaxPacketSize) {
+        _transport->submit_zlp();
     }
 }
 
-void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
+void USBDevice::device_data_input(unsigned char *buffer, uint32_t length, std::chrono::steady_clock::time_point completedAt, uint64_t rxSeq){
     mux_header *mhdr = NULL;
     unsigned char *payload = NULL;
     uint32_t payload_length = 0;
     int mux_header_size = 0;
-
-    if(!length)
-        return;
-
-    // sanity check (should never happen with current USB implementation)
-    retassure((length <= USB_MRU) && (length <= DEV_MRU),"Too much data received from USB (%u), file a bug", length);
+    uint8_t *reassembled = NULL;
+    cleanup([&]{
+        safeFree(reassembled);
+    });
 
 //    debug("Mux data input for device %s: len %u", _serial, length);
-    mhdr = (mux_header *)buffer;
 
     {
         std::unique_lock<std::mutex> ul(_usbLck);
+        /*
+            Receivers run in parallel, but transfers are looked at in the order they completed.
+            The continuation of a split packet has no mux header, its position is all that identifies it.
+         */
+        if (rxSeq == UINT64_MAX) rxSeq = _rxNextSeq;
+        while (rxSeq != _rxNextSeq) {
+            if (_rxStopped) return;
+            uint64_t wevent = _data_in_event.getNextEvent();
+            ul.unlock();
+            _data_in_event.waitForEvent(wevent);
+            ul.lock();
+        }
+        {
+            cleanup([&]{
+                _rxNextSeq++;
+                _data_in_event.notifyAll();
+            });
+
+            if(!length)
+                return;
+
+            // sanity check (should never happen with current USB implementation)
+            retassure((length <= USB_MRU) && (length <= DEV_MRU),"Too much data received from USB (%u), file a bug", length);
+
+            // handle broken up transfers
+            if(_muxdev.pktlen) {
+                if (_muxdev.version < 2){
+                    error("Mux v1 doesn't support broken up transfers!");
+                    reterror("Mux v1 doesn't support broken up transfers!");
+                }
+
+                //check rx/tx
+                retassure((length + _muxdev.pktlen) <= DEV_MRU, "Incoming split packet is too large (%u so far), dropping!", length + _muxdev.pktlen);
+
+                memcpy(_muxdev.pktbuf + _muxdev.pktlen, buffer, length);
+                _muxdev.pktlen += (uint32_t)length;
+                mhdr = (mux_header *)_muxdev.pktbuf;
+
+                if((length == USB_MRU) && (_muxdev.pktlen < ntohl(mhdr->length))) {
+                    debug("Appended mux data to buffer (total size: %u)", _muxdev.pktlen);
+                    return;
+                }
+                //hand the packet to this receiver, the next split packet gets a new buffer
+                buffer = reassembled = _muxdev.pktbuf; _muxdev.pktbuf = NULL;
+                length = _muxdev.pktlen;
+                _muxdev.pktlen = 0;
+                debug("Gathered mux data from buffer (total size: %u)", length);
+                _splitReassemblies.add();
+            }else if((length == USB_MRU) && (length < ntohl(((mux_header *)buffer)->length))) {
+                //the header is checked once the packet is complete
+                if (!_muxdev.pktbuf) retassure(_muxdev.pktbuf = (uint8_t*)malloc(DEV_MRU), "Failed to alloc pktbuf");
+                memcpy(_muxdev.pktbuf, buffer, length);
+                _muxdev.pktlen = (uint32_t)length;
+                debug("Copied mux data to buffer (size: %u)", _muxdev.pktlen);
+                return;
+            }
+        }
+
+        mhdr = (mux_header *)buffer;
         mux_header_size = ((_muxdev.version < 2) ? sizeof(struct mux_header_v1) : sizeof(struct mux_header_v2));
 #ifdef XCODE
-        assert(ntohl(mhdr->length) <= USB_MRU);
+        assert(ntohl(mhdr->length) <= DEV_MRU);
 #endif
         retassure(ntohl(mhdr->length) == length, "Incoming packet size mismatch (dev %s, expected %d, got %u)", _serial, ntohl(mhdr->length), length);
         if (_muxdev.version >= 2) {
@@ -395,7 +361,7 @@ void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
             uint16_t txseq = ntohs(mhdr->v2.tx_seq);
 //            debug("----- MUX txseq=%d -- _muxdev.tx_seq=%d _muxdev.rx_seq=%d",txseq,_muxdev.tx_seq,_muxdev.rx_seq);
             if ((uint16_t)(_muxdev.rx_seq+1) != txseq) {
-                while ((uint16_t)(_muxdev.rx_seq+1) < txseq || (uint16_t)(_muxdev.rx_seq+1+_rx_xfers.size()) < txseq + _rx_xfers.size()) {
+                while ((uint16_t)(_muxdev.rx_seq+1) < txseq || (uint16_t)(_muxdev.rx_seq+1+_rxLoops) < txseq + _rxLoops) {
                     uint64_t wevent = _data_in_event.getNextEvent();
                     ul.unlock();
                     _data_in_event.waitForEvent(wevent);
@@ -404,42 +370,14 @@ void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
             }
             if ((uint16_t)(_muxdev.rx_seq+1) != txseq){
                 debug("Discarding duplicated MUX packet txseq=%d -- _muxdev.tx_seq=%d _muxdev.rx_seq=%d",txseq,_muxdev.tx_seq,_muxdev.rx_seq);
+                _duplicates.add();
                 return;
             }
             _muxdev.rx_seq = txseq;
         }
-        
-        // handle broken up transfers
-        if(_muxdev.pktlen) {
-            if (_muxdev.version < 2){
-                error("Mux v1 doesn't support broken up transfers!");
-                reterror("Mux v1 doesn't support broken up transfers!");
-            }
-
-            //check rx/tx
-            retassure((length + _muxdev.pktlen) <= DEV_MRU, "Incoming split packet is too large (%u so far), dropping!", length + _muxdev.pktlen);
-
-            memcpy(_muxdev.pktbuf + _muxdev.pktlen, buffer, length);
-
-            if((length < USB_MRU) || (ntohl(mhdr->length) == (length + _muxdev.pktlen))) {
-                buffer = _muxdev.pktbuf;
-                length += _muxdev.pktlen;
-                _muxdev.pktlen = 0;
-                debug("Gathered mux data from buffer (total size: %u)", length);
-            } else {
-                _muxdev.pktlen += (uint32_t)length;
-                debug("Appended mux data to buffer (total size: %u)", _muxdev.pktlen);
-                return;
-            }
-        }else{
-            if((length == USB_MRU) && (length < ntohl(mhdr->length))) {
-                memcpy(_muxdev.pktbuf, buffer, length);
-                _muxdev.pktlen = (uint32_t)length;
-                debug("Copied mux data to buffer (size: %u)", _muxdev.pktlen);
-                return;
-            }
-        }
     }
+    _rxPackets.add();
+    _rxBytes.add(length);
 
     switch(ntohl(mhdr->protocol)) {
         case MUX_PROTO_VERSION:
@@ -480,7 +418,7 @@ void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
                 error("no connection found with snum=%d",dport);
             }else{
                try {
-                   connect->handle_input(tcp_header, payload, payload_length);
+                   connect->handle_input(tcp_header, payload, payload_length, completedAt);
                } catch (tihmstar::exception &e) {
                    error("failed to handle input on snum=%d device(%d)=%s with error=%d (%s)",dport,_id,_serial,e.code(),e.what());
                    throw;
@@ -548,3 +486,32 @@ void USBDevice::device_control_input(unsigned char *payload, uint32_t payload_le
         }
     }
 }
+
+USBDevice::usbstats USBDevice::getStats() noexcept{
+    usbstats ret{};
+    ret.rxBytes = _rxBytes.get();
+    ret.rxPackets = _rxPackets.get();
+    ret.txBytes = _txBytes.get();
+    ret.txPackets = _txPackets.get();
+    ret.splitReassemblies = _splitReassemblies.get();
+    ret.duplicates = _duplicates.get();
+    if (_transport) {
+        ret.rxInFlight = _transport->rxInFlight();
+        ret.txInFlight = _transport->txInFlight();
+    }
+    return ret;
+}
+
+std::vector<std::shared_ptr<TCP>> USBDevice::getConnections() noexcept{
+    std::vector<std::shared_ptr<TCP>> ret;
+    guardRead(_conns_Guard);
+    ret.reserve(_conns.size());
+    for (auto &c : _conns) {
+        ret.push_back(c.second);
+    }
+    return ret;
+}
+
+USBDevice::latencies &USBDevice::getLatencies() noexcept{
+    return _latencies;
+}
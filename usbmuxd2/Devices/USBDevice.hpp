@@ -10,12 +10,16 @@
 
 #include "Device.hpp"
 #include "USBDevice_receiver.hpp"
+#include "USBTransport.hpp"
+#include "../StatCounter.hpp"
+#include "../LatencyHistogram.hpp"
 #include <libusb.h>
 #include <libgeneral/Manager.hpp>
 #include <libgeneral/GuardAccess.hpp>
 #include <libgeneral/DeliveryEvent.hpp>
 #include <set>
 #include <map>
+#include <vector>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
@@ -70,18 +74,35 @@ public:
         MUX_PROTO_SETUP = 2,
         MUX_PROTO_TCP = IPPROTO_TCP,
     };
+    struct usbstats{
+        uint64_t rxBytes;
+        uint64_t rxPackets;
+        uint64_t txBytes;
+        uint64_t txPackets;
+        uint64_t splitReassemblies;
+        uint64_t duplicates;        //v2 packets discarded because their sequence number was already seen
+        uint64_t rxInFlight;
+        uint64_t txInFlight;
+    };
+    struct latencies{
+        LatencyHistogram connect;       //SYN until the device accepted
+        LatencyHistogram rxToClient;    //IN transfer completion until the payload was sent to the client
+        LatencyHistogram clientToUSB;   //recv() from the client until the packet was submitted to the transport
+        LatencyHistogram txCompletion;  //OUT transfer submission until it completed
+    };
 private:
     std::weak_ptr<USBDevice> _selfref;
     USBDeviceManager *_parent; //not owned
     uint16_t _pid;
     uint8_t _bus, _address;
-    uint8_t _interface, _ep_in, _ep_out;
 
     struct libusb_device_descriptor _devdesc;
-    int _wMaxPacketSize;
     uint64_t _speed;
     
-    libusb_device_handle *_usbdev;
+    USBTransport *_transport;
+    int _rxLoops; //IN transfers in flight, bounds how far packets can arrive out of order
+    uint64_t _rxNextSeq; //rx_buffer::seq of the next transfer to be parsed, guarded by _usbLck
+    bool _rxStopped;
     uint16_t _nextPort;
     
     mux_dev_state _state;
@@ -91,19 +112,23 @@ private:
 
     std::set<USBDevice_receiver*> _receivers;
     
-    std::set<struct libusb_transfer *> _rx_xfers;
-    tihmstar::GuardAccess _rx_xfers_Guard;
-    std::set<struct libusb_transfer *> _tx_xfers;
-    tihmstar::GuardAccess _tx_xfers_Guard;
     std::map<uint16_t,std::shared_ptr<TCP>> _conns;
     tihmstar::GuardAccess _conns_Guard;
     tihmstar::Event _conns_close_event;
 
-    tihmstar::DeliveryEvent<struct libusb_transfer *> _arrived_xfer;
+    tihmstar::DeliveryEvent<USBTransport::rx_buffer> _arrived;
 
     std::thread _conReaperThread;
     tihmstar::DeliveryEvent<uint16_t> _reapConnections;
 
+    StatCounter _rxBytes;
+    StatCounter _rxPackets;
+    StatCounter _txBytes;
+    StatCounter _txPackets;
+    StatCounter _splitReassemblies;
+    StatCounter _duplicates;
+    latencies _latencies;
+
 private:
     bool isDeviceReadyForDestruction();
     void addReceiver();
@@ -120,6 +145,10 @@ public:
     void closeConnection(uint16_t sport);
 
 #pragma mark members
+    /*
+        Starts receiving on the transport and sends the version packet.
+     */
+    void start_mux(int rxLoops);
     uint32_t usb_location();
     uint64_t getSpeed();
     uint16_t getPid();
@@ -128,17 +157,29 @@ public:
     void send_packet(enum mux_protocol proto, const void *data, size_t length, tcphdr *header = NULL);
     void usb_send(void *buf, size_t length);
     
-    void device_data_input(unsigned char *buffer, uint32_t length);
+    /*
+        completedAt is when the transport received buffer, used for latency stats if set.
+        rxSeq is the transport's rx_buffer::seq, callers feeding transfers one at a time can leave it out.
+     */
+    void device_data_input(unsigned char *buffer, uint32_t length, std::chrono::steady_clock::time_point completedAt = {}, uint64_t rxSeq = UINT64_MAX);
     void device_version_input(struct mux_version_header *vh);
     void device_control_input(unsigned char *payload, uint32_t payload_length);
-    
+
+    usbstats getStats() noexcept;
+    std::vector<std::shared_ptr<TCP>> getConnections() noexcept;
+    /*
+        Recorded by the transport and every TCP connection of this device.
+     */
+    latencies &getLatencies() noexcept;
     
 #pragma mark friends
     friend USBDevice_receiver;
     friend USBDeviceManager;
+    friend class LibUSBTransport;
+    friend class SimUSBTransport;
+    friend class BenchPeer;
     friend void usb_get_langid_callback(struct libusb_transfer *transfer) noexcept;
     friend void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept;
-    friend void usb_start_rx_loop(std::shared_ptr<USBDevice> dev);
     friend void rx_callback(struct libusb_transfer *xfer) noexcept;
     friend void tx_callback(struct libusb_transfer *xfer) noexcept;
 };
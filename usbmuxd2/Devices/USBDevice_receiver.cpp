@@ -20,15 +20,15 @@ USBDevice_receiver::~USBDevice_receiver(){
 }
 
 bool USBDevice_receiver::loopEvent(){
-    struct libusb_transfer *xfer = _parent->_arrived_xfer.wait();
+    USBTransport::rx_buffer rx = _parent->_arrived.wait();
     cleanup([&]{
         /*
-            Always re-submit transfer and let USBDeviceManager properly delete it in case something went wrong
+            Always hand the buffer back and let the transport properly delete it in case something went wrong
          */
-        libusb_submit_transfer(xfer);
+        _parent->_transport->rx_done(rx);
     });
     try {
-        _parent->device_data_input(xfer->buffer, xfer->actual_length);
+        _parent->device_data_input(rx.data, rx.length, rx.completedAt, rx.seq);
         return true;
     } catch (tihmstar::exception &e) {
         error("failed to device_data_input usbdev=%s error=%s code=%d",_parent->_serial,e.what(),e.code());
@@ -0,0 +1,25 @@
+//
+//  USBTransport.cpp
+//  usbmuxd2
+//
+
+#include "USBTransport.hpp"
+
+#pragma mark USBTransport
+USBTransport::USBTransport(USBDevice *dev)
+: _dev(dev), _rxSeq(0)
+{
+    //
+}
+
+USBTransport::~USBTransport(){
+    //
+}
+
+uint64_t USBTransport::rxInFlight() const noexcept{
+    return _rxInFlight.get();
+}
+
+uint64_t USBTransport::txInFlight() const noexcept{
+    return _txInFlight.get();
+}
@@ -0,0 +1,67 @@
+//
+//  USBTransport.hpp
+//  usbmuxd2
+//
+
+#ifndef USBTransport_hpp
+#define USBTransport_hpp
+
+#include "../StatCounter.hpp"
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+
+class USBDevice;
+
+/*
+    Moves mux packets between a USBDevice and whatever sits on the other end of the cable.
+    Completed IN transfers are posted to the device's _arrived queue and handed back
+    with rx_done() once they were consumed, which makes them available for the next packet.
+ */
+class USBTransport{
+public:
+    struct rx_buffer{
+        unsigned char *data;
+        uint32_t length;
+        void *handle; //owned by the transport
+        std::chrono::steady_clock::time_point completedAt;
+        uint64_t seq; //completion order, the continuation of a split packet can only be told apart by it
+    };
+protected:
+    USBDevice *_dev; //not owned, the device owns its transport
+    StatCounter _rxInFlight; //maintained by the implementation
+    StatCounter _txInFlight;
+    uint64_t _rxSeq; //seq of the next posted rx_buffer, only touched by whoever completes IN transfers
+
+public:
+    USBTransport(USBDevice *dev);
+    USBTransport(const USBTransport &) = delete;
+    virtual ~USBTransport();
+
+    /*
+        Starts count parallel IN transfers, returns how many are in flight.
+     */
+    virtual int start_rx(int count) = 0;
+    virtual void rx_done(rx_buffer rx) noexcept = 0;
+
+    /*
+        Always takes ownership of buf (malloc'ed), even if submitting fails.
+     */
+    virtual void submit_tx(void *buf, size_t length) = 0;
+    virtual void submit_zlp() = 0;
+    virtual int maxPacketSize() const noexcept = 0;
+
+    /*
+        Aborts all transfers, no packets are posted to the device afterwards.
+     */
+    virtual void cancel() noexcept = 0;
+    virtual bool idle() noexcept = 0;
+
+    /*
+        Transfers currently owned by the transport, readable without locking.
+     */
+    uint64_t rxInFlight() const noexcept;
+    uint64_t txInFlight() const noexcept;
+};
+
+#endif /* USBTransport_hpp */
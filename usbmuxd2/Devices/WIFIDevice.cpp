@@ -10,6 +10,7 @@
 
 #ifdef HAVE_LIBIMOBILEDEVICE
 #include "WIFIDevice.hpp"
+#include "HeartbeatLoop.hpp"
 #include "../Muxer.hpp"
 #include "../sysconf/sysconf.hpp"
 
@@ -19,16 +20,30 @@
 #   include "../Manager/WIFIDeviceManager-mDNS.hpp"
 #endif //HAVE_AVAHI
 
+#include "../Client.hpp"
+
+#include <libimobiledevice/heartbeat.h>
+#include <libimobiledevice/lockdown.h>
+
 #include <plist/plist.h>
 
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <chrono>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
 
 WIFIDevice::WIFIDevice(Muxer *mux, WIFIDeviceManager *parent, std::string uuid, std::vector<std::string> ipaddr, std::string serviceName, uint32_t interfaceIndex)
-: Device(mux,Device::MUXCONN_WIFI), _parent(parent), _ipaddr(ipaddr), _serviceName(serviceName), _interfaceIndex(interfaceIndex), _hbclient(NULL), _hbrsp(NULL),
-    _idev(NULL)
+: Device(mux,Device::MUXCONN_WIFI), _parent(parent), _ipaddr(ipaddr), _serviceName(serviceName), _interfaceIndex(interfaceIndex), _preferredFamily(AF_UNSPEC),
+    _hbloop(NULL), _hbkey(0)
 {
     strncpy(_serial, uuid.c_str(), sizeof(_serial));
 }
@@ -41,35 +56,6 @@ WIFIDevice::~WIFIDevice() {
         _parent->_childrenEvent.notifyAll();
         _parent = NULL;
     }
-#ifdef HAVE_LIBIMOBILEDEVICE
-    safeFreeCustom(_hbclient, heartbeat_client_free);
-    safeFreeCustom(_idev, idevice_free);
-#endif //HAVE_LIBIMOBILEDEVICE
-    safeFreeCustom(_hbrsp, plist_free);
-}
-
-bool WIFIDevice::loopEvent(){
-#ifndef HAVE_LIBIMOBILEDEVICE
-    reterror("Compiled without libimobiledevice");
-#else
-    plist_t hbeat = NULL;
-    cleanup([&]{
-        safeFreeCustom(hbeat, plist_free);
-    });
-    heartbeat_error_t hret = HEARTBEAT_E_SUCCESS;
-
-    retassure((hret = heartbeat_receive_with_timeout(_hbclient,&hbeat,15000)) == HEARTBEAT_E_SUCCESS, "[WIFIDevice] failed to recv heartbeat with error=%d",hret);
-    retassure((hret = heartbeat_send(_hbclient,_hbrsp)) == HEARTBEAT_E_SUCCESS,"[WIFIDevice] failed to send heartbeat");
-    return true;
-#endif //HAVE_LIBIMOBILEDEVICE
-}
-
-void WIFIDevice::beforeLoop(){
-    retassure(_hbclient, "Not starting loop, because we don't have a _hbclient");
-}
-
-void WIFIDevice::afterLoop() noexcept{
-    kill();
 }
 
 void WIFIDevice::kill() noexcept{
@@ -81,32 +67,189 @@ void WIFIDevice::kill() noexcept{
 void WIFIDevice::deconstruct() noexcept{
     debug("[Deconstructing] WIFIDevice %s",_serial);
     std::shared_ptr<WIFIDevice> selfref = _selfref.lock();
-    stopLoop();
+    if (_hbloop && _hbkey) _hbloop->remove(_hbkey);
+    _hbkey = 0;
     _mux->delete_device(selfref);
 }
 
-void WIFIDevice::startLoop(){
+std::string_view WIFIDevice::serviceInstance(std::string_view serviceName) noexcept{
+    return serviceName.substr(0,serviceName.find("._"));
+}
+
+void WIFIDevice::startHeartbeat(HeartbeatLoop *hbloop){
 #ifndef HAVE_LIBIMOBILEDEVICE
     reterror("Compiled without libimobiledevice");
 #else
-    heartbeat_error_t hret = HEARTBEAT_E_SUCCESS;
-    _loopState = tihmstar::LOOP_STOPPED;
-    
-    assure(_hbrsp = plist_new_dict());
-    plist_dict_set_item(_hbrsp, "Command", plist_new_string("Polo"));
-    
-    assure(!idevice_new_with_options(&_idev,_serial, IDEVICE_LOOKUP_NETWORK));
-
-    retassure((hret = heartbeat_client_start_service(_idev, &_hbclient, "usbmuxd2")) == HEARTBEAT_E_SUCCESS,"[WIFIDevice] Failed to start heartbeat service with error=%d",hret);
-
-    _loopState = tihmstar::LOOP_UNINITIALISED;
-    Manager::startLoop();
+    idevice_t idev = NULL;
+    lockdownd_client_t lockdown = NULL;
+    lockdownd_service_descriptor_t service = NULL;
+    idevice_connection_t conn = NULL;
+    cleanup([&]{
+        safeFreeCustom(conn, idevice_disconnect);
+        safeFreeCustom(service, lockdownd_service_descriptor_free);
+        safeFreeCustom(lockdown, lockdownd_client_free);
+        safeFreeCustom(idev, idevice_free);
+    });
+    lockdownd_error_t lret = LOCKDOWN_E_SUCCESS;
+    idevice_error_t iret = IDEVICE_E_SUCCESS;
+    assure(hbloop);
+
+    assure(!idevice_new_with_options(&idev,_serial, IDEVICE_LOOKUP_NETWORK));
+    retassure((lret = lockdownd_client_new_with_handshake(idev, &lockdown, "usbmuxd2")) == LOCKDOWN_E_SUCCESS, "[WIFIDevice] Failed to connect to lockdown with error=%d",lret);
+    retassure((lret = lockdownd_start_service(lockdown, HEARTBEAT_SERVICE_NAME, &service)) == LOCKDOWN_E_SUCCESS && service, "[WIFIDevice] Failed to start heartbeat service with error=%d",lret);
+    retassure((iret = idevice_connect(idev, service->port, &conn)) == IDEVICE_E_SUCCESS, "[WIFIDevice] Failed to connect to heartbeat service with error=%d",iret);
+    if (service->ssl_enabled) {
+        retassure((iret = idevice_connection_enable_ssl(conn)) == IDEVICE_E_SUCCESS, "[WIFIDevice] Failed to enable SSL on heartbeat connection with error=%d",iret);
+    }
+
+    {
+        //the loop owns the connection from here on, even if add fails
+        idevice_t i = idev; idev = NULL;
+        idevice_connection_t c = conn; conn = NULL;
+        _hbloop = hbloop;
+        _hbkey = hbloop->add(_selfref.lock(), i, c);
+    }
 #endif //HAVE_LIBIMOBILEDEVICE
 }
 
+/*
+    Starts a non-blocking connect, returns -1 if the address is unusable or the connect failed right away.
+ */
+static int start_connect_attempt(const std::string &ip, const std::string &port, uint32_t interfaceIndex, int *family) noexcept{
+    struct addrinfo hints = {};
+    struct addrinfo *res = NULL;
+    int fd = -1;
+    cleanup([&]{
+        safeFreeCustom(res, freeaddrinfo);
+        safeClose(fd);
+    });
+
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(ip.c_str(), port.c_str(), &hints, &res) || !res) {
+        debug("[WIFIDevice] can't parse address %s",ip.c_str());
+        return -1;
+    }
+    if (res->ai_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)res->ai_addr;
+        //link-local addresses are useless without the interface we saw them on
+        if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr) && !sin6->sin6_scope_id) sin6->sin6_scope_id = interfaceIndex;
+    }
+
+    if ((fd = socket(res->ai_family, SOCK_STREAM, 0)) == -1) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    if (connect(fd, res->ai_addr, res->ai_addrlen) == -1 && errno != EINPROGRESS) {
+        debug("[WIFIDevice] connect to [%s]:%s failed with error=%d (%s)",ip.c_str(),port.c_str(),errno,strerror(errno));
+        return -1;
+    }
+    *family = res->ai_family;
+    {
+        int ret = fd; fd = -1;
+        return ret;
+    }
+}
+
+std::vector<std::string> WIFIDevice::ordered_addresses() const noexcept{
+    std::vector<std::string> ret;
+    std::vector<const std::string*> preferred;
+    std::vector<const std::string*> other;
+    bool preferV4 = _preferredFamily == AF_INET;
+
+    //RFC 8305: interleave the families, starting with the one which worked last time (IPv6 by default)
+    for (auto &ip : _ipaddr) {
+        bool isV4 = ip.find(":") == std::string::npos;
+        ((isV4 == preferV4) ? preferred : other).push_back(&ip);
+    }
+    for (size_t i = 0; i < preferred.size() || i < other.size(); i++) {
+        if (i < preferred.size()) ret.push_back(*preferred[i]);
+        if (i < other.size()) ret.push_back(*other[i]);
+    }
+    return ret;
+}
+
+int WIFIDevice::open_connection(uint16_t dport){
+    struct attempt{
+        int fd;
+        int family;
+        const std::string *ip;
+    };
+    std::vector<attempt> attempts;
+    std::vector<struct pollfd> pfds;
+    cleanup([&]{
+        for (auto &a : attempts) safeClose(a.fd);
+    });
+    std::string port = std::to_string(dport);
+    std::vector<std::string> addrs = ordered_addresses();
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(connectTimeoutMs);
+    size_t next = 0;
+
+    while (true) {
+        int64_t remainingMs = 0;
+        int waitMs = 0;
+        int cnt = 0;
+
+        //start the next attempt, without waiting if the previous one failed right away
+        while (next < addrs.size()) {
+            attempt a = {.fd = -1, .family = AF_UNSPEC, .ip = &addrs[next++]};
+            if ((a.fd = start_connect_attempt(*a.ip, port, _interfaceIndex, &a.family)) == -1) continue;
+            attempts.push_back(a);
+            break;
+        }
+        if (!attempts.size() && next >= addrs.size()) break;
+
+        remainingMs = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (remainingMs <= 0) break;
+        waitMs = (int)((next < addrs.size() && remainingMs > connectionAttemptDelayMs) ? connectionAttemptDelayMs : remainingMs);
+
+        pfds.clear();
+        for (auto &a : attempts) pfds.push_back({.fd = a.fd, .events = POLLOUT});
+        if ((cnt = poll(pfds.data(), (nfds_t)pfds.size(), waitMs)) == -1) {
+            retassure(errno == EINTR, "poll failed with error=%d (%s)",errno,strerror(errno));
+            continue;
+        }
+        if (!cnt) continue; //stagger timer fired
+
+        for (ssize_t i = (ssize_t)pfds.size()-1; i >= 0; i--) {
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+            attempt a = attempts[i];
+            if (!pfds[i].revents) continue;
+            if (getsockopt(a.fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+                debug("[WIFIDevice] %s: connect to [%s]:%u failed with error=%d (%s)",_serial,a.ip->c_str(),dport,err,strerror(err));
+                close(a.fd);
+                attempts.erase(attempts.begin()+i);
+                continue;
+            }
+            {
+                int yes = 1;
+                setsockopt(a.fd, IPPROTO_TCP, TCP_NODELAY, (void*)&yes, sizeof(int));
+            }
+            debug("[WIFIDevice] %s: connected to [%s]:%u",_serial,a.ip->c_str(),dport);
+            _preferredFamily = a.family;
+            attempts.erase(attempts.begin()+i); //the other attempts get closed by cleanup
+            return a.fd;
+        }
+    }
+    reterror("Failed to connect to %s port %u",_serial,dport);
+}
 
 void WIFIDevice::start_connect(uint16_t dport, std::shared_ptr<Client> cli){
-    reterror("Legacy connection proxying is currently not implemented");
+    int dfd = -1;
+    cleanup([&]{
+        safeClose(dfd);
+    });
+
+    dfd = open_connection(dport);
+    info("WIFI Connected to device %s port %u",_serial,dport);
+    cli->send_result(cli->_connectTag, RESULT_OK);
+
+    {
+        int cfd = cli->_fd; cli->_fd = -1; //disown client, the relay takes care of this fd now
+        int fd = dfd; dfd = -1;
+        _mux->start_relay(cfd, fd, _id);
+    }
 }
 
 #endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
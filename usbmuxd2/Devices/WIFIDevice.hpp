@@ -9,29 +9,32 @@
 #define WIFIDevice_hpp
 
 #include "Device.hpp"
-#include <libgeneral/Manager.hpp>
 #include <libimobiledevice/libimobiledevice.h>
-#include <libimobiledevice/heartbeat.h>
-#include <libimobiledevice/lockdown.h>
 #include <plist/plist.h>
 
+#include <atomic>
 #include <iostream>
+#include <string_view>
 #include <vector>
 
 class WIFIDeviceManager;
-class WIFIDevice : public Device, tihmstar::Manager {
+class HeartbeatLoop;
+class WIFIDevice : public Device {
+public:
+    static constexpr int connectTimeoutMs = 5000;
+    static constexpr int connectionAttemptDelayMs = 250; //RFC 8305 recommended value
+private:
     WIFIDeviceManager *_parent;
     std::weak_ptr<WIFIDevice> _selfref;
     std::vector<std::string> _ipaddr;
     std::string _serviceName;
     uint32_t _interfaceIndex;
-    heartbeat_client_t _hbclient;
-    plist_t _hbrsp;
-    idevice_t _idev;
+    std::atomic_int _preferredFamily; //address family which connected last time
+    HeartbeatLoop *_hbloop; //not owned
+    uint64_t _hbkey;
 
-    virtual bool loopEvent() override;
-    virtual void beforeLoop() override;
-    virtual void afterLoop() noexcept override;
+    std::vector<std::string> ordered_addresses() const noexcept;
+    int open_connection(uint16_t dport);
 
 public:
     WIFIDevice(Muxer *mux, WIFIDeviceManager *parent, std::string uuid, std::vector<std::string> ipaddr, std::string serviceName, uint32_t interfaceIndex = 0);
@@ -41,11 +44,17 @@ public:
 
     virtual void kill() noexcept override;
     void deconstruct() noexcept;
-    void startLoop();
+    void startHeartbeat(HeartbeatLoop *hbloop);
     virtual void start_connect(uint16_t dport, std::shared_ptr<Client> cli) override;
 
+    /*
+        Strips service type and domain from a service name ("<instance>._<type>._tcp...").
+     */
+    static std::string_view serviceInstance(std::string_view serviceName) noexcept;
+
     friend class Muxer;
     friend class WIFIDeviceManager;
+    friend class DeviceRegistry;
 };
 
 #endif /* WIFIDevice_hpp */
@@ -0,0 +1,82 @@
+//
+//  LatencyHistogram.cpp
+//  usbmuxd2
+//
+
+#include "LatencyHistogram.hpp"
+#include <math.h>
+
+#pragma mark LatencyHistogram
+LatencyHistogram::LatencyHistogram()
+: _max(0)
+{
+    //
+}
+
+void LatencyHistogram::record(uint64_t ns) noexcept{
+    uint64_t curMax = _max.load(std::memory_order_relaxed);
+    _counts[bucketIndex(ns)].add();
+    _sum.add(ns);
+    while (ns > curMax && !_max.compare_exchange_weak(curMax, ns, std::memory_order_relaxed));
+}
+
+void LatencyHistogram::recordSince(std::chrono::steady_clock::time_point start) noexcept{
+    record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+LatencyHistogram::snapshot LatencyHistogram::getSnapshot() const{
+    snapshot ret{};
+    ret.counts.resize(bucketCount);
+    for (size_t i = 0; i < bucketCount; i++) {
+        ret.counts[i] = _counts[i].get();
+        ret.count += ret.counts[i];
+    }
+    ret.sum = _sum.get();
+    ret.max = _max.load(std::memory_order_relaxed);
+    return ret;
+}
+
+#pragma mark static
+size_t LatencyHistogram::bucketIndex(uint64_t ns) noexcept{
+    int e = 0;
+    if (ns < (1ULL << subBucketBits)) return (size_t)ns;
+    if (ns >= (1ULL << maxBits)) return bucketCount-1;
+    e = 63 - __builtin_clzll(ns);
+    return ((size_t)(e - subBucketBits + 1) << subBucketBits) + (size_t)(ns >> (e - subBucketBits)) - (1ULL << subBucketBits);
+}
+
+uint64_t LatencyHistogram::bucketLowerBound(size_t idx) noexcept{
+    size_t magnitude = idx >> subBucketBits;
+    if (magnitude < 2) return idx;
+    return ((1ULL << subBucketBits) + (idx & ((1ULL << subBucketBits)-1))) << (magnitude-1);
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t idx) noexcept{
+    if (idx >= bucketCount-1) return UINT64_MAX;
+    return bucketLowerBound(idx+1)-1;
+}
+
+#pragma mark snapshot
+uint64_t LatencyHistogram::snapshot::valueAtQuantile(double q) const noexcept{
+    uint64_t target = 0;
+    uint64_t seen = 0;
+    if (!count) return 0;
+    target = (uint64_t)ceil(q * count);
+    if (target < 1) target = 1;
+    if (target > count) target = count;
+    for (size_t i = 0; i < counts.size(); i++) {
+        if ((seen += counts[i]) >= target) {
+            uint64_t ret = bucketUpperBound(i);
+            return ret < max ? ret : max;
+        }
+    }
+    return max;
+}
+
+uint64_t LatencyHistogram::snapshot::countBelow(uint64_t limit) const noexcept{
+    uint64_t ret = 0;
+    for (size_t i = 0; i < counts.size() && bucketUpperBound(i) < limit; i++) {
+        ret += counts[i];
+    }
+    return ret;
+}
@@ -0,0 +1,65 @@
+//
+//  LatencyHistogram.hpp
+//  usbmuxd2
+//
+
+#ifndef LatencyHistogram_hpp
+#define LatencyHistogram_hpp
+
+#include "StatCounter.hpp"
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+/*
+    HDR style histogram of nanosecond latencies.
+    Every power of two is split into 2^subBucketBits linear buckets, so any recorded value
+    is off by at most 1/2^subBucketBits (~3%) while the whole range fits into ~9KB.
+    record() is a couple of relaxed atomic adds and safe to call from any thread.
+ */
+class LatencyHistogram{
+public:
+    static constexpr int subBucketBits = 5;
+    static constexpr int maxBits = 40; //values from 2^40ns (~18 minutes) on share the last bucket
+    static constexpr size_t bucketCount = (size_t)(maxBits - subBucketBits + 1) << subBucketBits;
+
+    struct snapshot{
+        std::vector<uint64_t> counts;
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+
+        /*
+            Upper bound of the bucket holding the q-th quantile (0 <= q <= 1).
+         */
+        uint64_t valueAtQuantile(double q) const noexcept;
+        /*
+            Number of recorded values below limit, exact if limit is a power of two.
+         */
+        uint64_t countBelow(uint64_t limit) const noexcept;
+    };
+private:
+    StatCounter _counts[bucketCount];
+    StatCounter _sum;
+    std::atomic<uint64_t> _max;
+
+public:
+    LatencyHistogram();
+    LatencyHistogram(const LatencyHistogram &) = delete;
+
+    void record(uint64_t ns) noexcept;
+    void recordSince(std::chrono::steady_clock::time_point start) noexcept;
+
+    /*
+        Counters are read one by one, so concurrent record() calls may be half visible.
+     */
+    snapshot getSnapshot() const;
+
+    static size_t bucketIndex(uint64_t ns) noexcept;
+    static uint64_t bucketLowerBound(size_t idx) noexcept;
+    static uint64_t bucketUpperBound(size_t idx) noexcept;
+};
+
+#endif /* LatencyHistogram_hpp */
@@ -12,22 +12,29 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include "Client.hpp"
+#include "ClientNotifier.hpp"
 #include <memory>
 #include <poll.h>
+#include <fcntl.h>
+#include <chrono>
+#include <inttypes.h>
 
 #ifdef SOCKET_PATH
-static const char *socket_path = SOCKET_PATH;
+static const char *default_socket_path = SOCKET_PATH;
 #else
-static const char *socket_path = "/var/run/usbmuxd";
+static const char *default_socket_path = "/var/run/usbmuxd";
 #endif
 
 #pragma mark ClientManager
-ClientManager::ClientManager(Muxer *mux)
+ClientManager::ClientManager(Muxer *mux, int listenBacklog, const char *socketPath)
 : _mux(mux)
-, _clientNumber(0), _listenfd(-1)
-,_wakePipe{}
+, _clientNumber(0), _listenfd(-1), _listenBacklog(listenBacklog)
+,_wakePipe{}, _notifier(nullptr), _stats{}
 {
     struct sockaddr_un bind_addr = {};
+    const char *socket_path = socketPath ? socketPath : default_socket_path;
+    
+    retassure(strlen(socket_path) < sizeof(bind_addr.sun_path), "socket path '%s' is too long", socket_path);
     
     retassure(unlink(socket_path) != 1 || errno == ENOENT, "unlink(%s) failed: %s", socket_path, strerror(errno));
     
@@ -37,11 +44,20 @@ ClientManager::ClientManager(Muxer *mux)
     strcpy(bind_addr.sun_path, socket_path);
     retassure(!bind(_listenfd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)), "bind() failed: %s", strerror(errno));
     
-    retassure(!listen(_listenfd, 5), "listen() failed: %s", strerror(errno));
+    if (_listenBacklog <= 0) _listenBacklog = defaultListenBacklog;
+    retassure(!listen(_listenfd, _listenBacklog), "listen() failed: %s", strerror(errno));
+    debug("[ClientManager] listening on %s with backlog %d",socket_path,_listenBacklog);
+
+    //accept_client drains the queue until EAGAIN, so the listening socket must never block
+    retassure(fcntl(_listenfd, F_SETFL, fcntl(_listenfd, F_GETFL, 0) | O_NONBLOCK) != -1, "failed to set O_NONBLOCK on listen socket: %s", strerror(errno));
+    fcntl(_listenfd, F_SETFD, FD_CLOEXEC);
     
     assure(!chmod(socket_path, 0666));
     
     assure(!pipe(_wakePipe));
+
+    _notifier = new ClientNotifier();
+    _notifier->startLoop();
     
     _cliReaperThread = std::thread([this]{
         reaper_runloop();
@@ -69,6 +85,14 @@ ClientManager::~ClientManager(){
     }
     _reapClients.kill();
     _cliReaperThread.join();
+    safeDelete(_notifier);
+
+    {
+        acceptstats stats = getAcceptStats();
+        info("[ClientManager] accepted %" PRIu64 " clients in %" PRIu64 " wakeups (max batch %" PRIu64 ", %" PRIu64 " backlog overflows, %" PRIu64 " errors), avg accept latency %" PRIu64 "us max %" PRIu64 "us",
+             stats.accepted, stats.wakeups, stats.maxBatch, stats.backlogOverflows, stats.acceptErrors,
+             stats.accepted ? stats.latencyTotalUs/stats.accepted : 0, stats.latencyMaxUs);
+    }
 
     if (_listenfd > 0) {
         int cfd = _listenfd; _listenfd = -1;
@@ -82,14 +106,54 @@ void ClientManager::stopAction() noexcept{
 }
 
 bool ClientManager::loopEvent(){
-    int cfd = 0;
-    
-    cfd = accept_client();
-    if (cfd == -1) return true;
-    try {
-        handle_client(cfd); //always consumes cfd
-    } catch (tihmstar::exception &e) {
-        error("failed to handle client %d with error=%d",cfd,e.code());
+    std::chrono::steady_clock::time_point wakeup;
+    uint64_t batch = 0;
+
+    if (!wait_for_clients()) return true;
+    wakeup = std::chrono::steady_clock::now();
+
+    //drain everything that queued up while we were asleep
+    while (true) {
+        int cfd = -1;
+        try {
+            cfd = accept_client();
+        } catch (tihmstar::exception &e) {
+            error("failed to accept client with error=%d (%s)",e.code(),e.what());
+            {
+                std::unique_lock<std::mutex> ul(_statsLck);
+                _stats.acceptErrors++;
+            }
+            usleep(10000); //out of fds or similar, don't spin on a listen socket which stays readable
+            break;
+        }
+        if (cfd == -1) break;
+        batch++;
+        try {
+            handle_client(cfd); //always consumes cfd
+        } catch (tihmstar::exception &e) {
+            error("failed to handle client %d with error=%d",cfd,e.code());
+        }
+        {
+            uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - wakeup).count();
+            _acceptLatency.recordSince(wakeup);
+            std::unique_lock<std::mutex> ul(_statsLck);
+            _stats.accepted++;
+            _stats.latencyTotalUs += latency;
+            if (latency > _stats.latencyMaxUs) _stats.latencyMaxUs = latency;
+        }
+    }
+
+    {
+        uint64_t overflows = 0;
+        std::unique_lock<std::mutex> ul(_statsLck);
+        _stats.wakeups++;
+        if (batch > _stats.maxBatch) _stats.maxBatch = batch;
+        if (batch >= (uint64_t)_listenBacklog) overflows = ++_stats.backlogOverflows;
+        ul.unlock();
+        if (overflows && !(overflows & (overflows-1))) {
+            //only report on powers of two, so a storm of clients doesn't also turn into a storm of log messages
+            warning("[ClientManager] drained a full listen backlog of %d connections (%" PRIu64 " times so far), consider raising --listen-backlog",_listenBacklog,overflows);
+        }
     }
     return true;
 }
@@ -114,12 +178,8 @@ void ClientManager::reaper_runloop(){
     }
 }
 
-int ClientManager::accept_client(){
-    struct sockaddr_un addr = {};
+bool ClientManager::wait_for_clients(){
     int err = 0;
-    int cfd = 0;
-    socklen_t len = 0;
-    len = sizeof(struct sockaddr_un);
     struct pollfd pfd[2] = {
         {
             .fd = _listenfd,
@@ -132,12 +192,34 @@ int ClientManager::accept_client(){
     };
     if ((err = poll(pfd,2,-1)) == -1){
         retassure(errno == EINTR, "[CLIENTMANAGER] poll failed errno=%d (%s)",errno,strerror(errno));
-        return -1;
+        return false;
     }
     retassure(!(pfd[1].revents & POLLHUP), "graceful kill requested");
     retassure(pfd[0].revents & POLLIN, "poll returned, but there is no POLLIN event on client");
-    retassure((cfd = accept(_listenfd, (struct sockaddr *)&addr, &len))>=0, "accept() failed (%s)", strerror(errno));
-    
+    return true;
+}
+
+int ClientManager::accept_client(){
+    struct sockaddr_un addr = {};
+    int cfd = -1;
+    socklen_t len = sizeof(struct sockaddr_un);
+
+    /*
+        Client sockets stay blocking, Client::recv_data relies on that.
+     */
+#ifdef __linux__
+    cfd = accept4(_listenfd, (struct sockaddr *)&addr, &len, SOCK_CLOEXEC);
+#else
+    if ((cfd = accept(_listenfd, (struct sockaddr *)&addr, &len)) >= 0) {
+        fcntl(cfd, F_SETFD, FD_CLOEXEC);
+        //accepted sockets inherit O_NONBLOCK from the listening socket on BSD
+        fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL, 0) & ~O_NONBLOCK);
+    }
+#endif
+    if (cfd == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) return -1;
+        reterror("accept() failed (%s)", strerror(errno));
+    }
     return cfd;
 }
 
@@ -164,3 +246,17 @@ void ClientManager::handle_client(int client_fd){
     //transfer ownership to muxer
     _mux->add_client(client); client = NULL;
 }
+
+#pragma mark public
+const char *ClientManager::defaultSocketPath() noexcept{
+    return default_socket_path;
+}
+
+ClientManager::acceptstats ClientManager::getAcceptStats() noexcept{
+    std::unique_lock<std::mutex> ul(_statsLck);
+    return _stats;
+}
+
+const LatencyHistogram &ClientManager::getAcceptLatency() noexcept{
+    return _acceptLatency;
+}
@@ -9,19 +9,39 @@
 #define ClientManager_hpp
 
 #include "Muxer.hpp"
+#include "LatencyHistogram.hpp"
 #include <libgeneral/Manager.hpp>
 #include <libgeneral/DeliveryEvent.hpp>
 
+class ClientNotifier;
+
 class ClientManager : public tihmstar::Manager{
+public:
+    static constexpr int defaultListenBacklog = 128;
+    struct acceptstats{
+        uint64_t accepted;
+        uint64_t acceptErrors;
+        uint64_t wakeups;
+        uint64_t maxBatch;
+        uint64_t backlogOverflows;  //wakeups which drained a full backlog, further connects were likely refused
+        uint64_t latencyTotalUs;    //time from poll wakeup until the client was handed to the muxer
+        uint64_t latencyMaxUs;
+    };
+private:
     Muxer *_mux; //not owned
     uint64_t _clientNumber;
     int _listenfd;
+    int _listenBacklog;
     int _wakePipe[2];
     std::set<Client *> _children; //raw ptr to shared objec
     std::mutex _childrenLck;
     tihmstar::Event _childrenEvent;
     std::thread _cliReaperThread;
     tihmstar::DeliveryEvent<std::shared_ptr<Client>> _reapClients;
+    ClientNotifier *_notifier; //delivers notifications to all listening clients
+    std::mutex _statsLck;
+    acceptstats _stats;
+    LatencyHistogram _acceptLatency;
     
     virtual void stopAction() noexcept override;
     virtual bool loopEvent() override;
@@ -29,12 +49,21 @@ class ClientManager : public tihmstar::Manager{
 
     void reaper_runloop();
 
+    bool wait_for_clients();
     int accept_client();
     void handle_client(int client_fd);    
 public:
-    ClientManager(Muxer *mux);
+    /*
+        socketPath defaults to the system wide usbmuxd socket.
+     */
+    ClientManager(Muxer *mux, int listenBacklog = defaultListenBacklog, const char *socketPath = nullptr);
     virtual ~ClientManager() override;
 
+    acceptstats getAcceptStats() noexcept;
+    const LatencyHistogram &getAcceptLatency() noexcept;
+
+    static const char *defaultSocketPath() noexcept;
+
     friend Client;
 };
 
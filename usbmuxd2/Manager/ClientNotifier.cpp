@@ -0,0 +1,159 @@
+//
+//  ClientNotifier.cpp
+//  usbmuxd2
+//
+
+#include "ClientNotifier.hpp"
+#include "../Client.hpp"
+#include <libgeneral/macros.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#pragma mark ClientNotifier
+ClientNotifier::ClientNotifier()
+: _wakePipe{-1,-1}
+{
+    assure(!pipe(_wakePipe));
+    fcntl(_wakePipe[0], F_SETFL, fcntl(_wakePipe[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(_wakePipe[1], F_SETFL, fcntl(_wakePipe[1], F_GETFL, 0) | O_NONBLOCK);
+}
+
+ClientNotifier::~ClientNotifier(){
+    info("[destroying] ClientNotifier");
+    stopLoop();
+    _entries.clear();
+    safeClose(_wakePipe[0]);
+    safeClose(_wakePipe[1]);
+}
+
+#pragma mark private
+void ClientNotifier::stopAction() noexcept{
+    safeClose(_wakePipe[1]);
+}
+
+void ClientNotifier::wakeup() noexcept{
+    char c = 0;
+    if (_wakePipe[1] != -1) write(_wakePipe[1], &c, 1);
+}
+
+void ClientNotifier::adopt_changes() noexcept{
+    std::vector<std::pair<uint64_t, entry>> incoming;
+    std::vector<uint64_t> signaled;
+    std::vector<uint64_t> removals;
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        incoming.swap(_incoming);
+        signaled.swap(_signaled);
+        removals.swap(_removals);
+    }
+    for (auto &i : incoming) {
+        _entries[i.first] = i.second;
+    }
+    for (uint64_t key : signaled) {
+        auto it = _entries.find(key);
+        if (it == _entries.end()) continue; //already gone
+        it->second.armed = true;
+    }
+    for (uint64_t key : removals) {
+        _entries.erase(key);
+    }
+}
+
+bool ClientNotifier::flush(entry &e) noexcept{
+    std::shared_ptr<Client> cli = e.cli.lock();
+    if (!cli) return false;
+    switch (cli->flush_notifications()) {
+        case Client::NOTIFY_FLUSH_DONE:
+            e.armed = false;
+            break;
+        case Client::NOTIFY_FLUSH_PENDING:
+            break;
+        case Client::NOTIFY_FLUSH_BUSY:
+            //the client thread is writing a response, don't spin on a writable socket meanwhile
+            e.busy = true;
+            break;
+        case Client::NOTIFY_FLUSH_FAILED:
+            cli->kill();
+            return false;
+    }
+    return true;
+}
+
+bool ClientNotifier::loopEvent(){
+    int timeout = -1;
+    std::vector<uint64_t> dead;
+
+    adopt_changes();
+
+    _pfds.clear();
+    _pfdKeys.clear();
+    _pfds.push_back({.fd = _wakePipe[0], .events = POLLIN});
+    _pfdKeys.push_back(0);
+    for (auto &e : _entries) {
+        if (!e.second.armed) continue;
+        if (e.second.busy) {
+            timeout = busyRetryMs;
+            continue;
+        }
+        _pfds.push_back({.fd = e.second.fd, .events = POLLOUT});
+        _pfdKeys.push_back(e.first);
+    }
+
+    if (poll(_pfds.data(), (nfds_t)_pfds.size(), timeout) == -1) {
+        retassure(errno == EINTR, "[ClientNotifier] poll failed with error=%d (%s)",errno,strerror(errno));
+        return true;
+    }
+
+    if (_pfds[0].revents) {
+        char buf[0x100];
+        ssize_t cnt = 0;
+        while ((cnt = read(_wakePipe[0], buf, sizeof(buf))) > 0);
+        if (cnt == 0) return false; //we are being stopped
+    }
+
+    for (auto &e : _entries) {
+        if (!e.second.busy) continue;
+        e.second.busy = false;
+        if (!flush(e.second)) dead.push_back(e.first);
+    }
+
+    for (size_t i = 1; i < _pfds.size(); i++) {
+        uint64_t key = _pfdKeys[i];
+        if (!_pfds[i].revents) continue;
+        auto it = _entries.find(key);
+        if (it == _entries.end()) continue;
+        if (!flush(it->second)) dead.push_back(key);
+    }
+
+    for (uint64_t key : dead) {
+        _entries.erase(key);
+    }
+    return true;
+}
+
+#pragma mark public
+void ClientNotifier::add(uint64_t key, std::shared_ptr<Client> cli){
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _incoming.push_back({key, {.cli = cli, .fd = cli->_fd, .armed = false, .busy = false}});
+    }
+    wakeup();
+}
+
+void ClientNotifier::signal(uint64_t key) noexcept{
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _signaled.push_back(key);
+    }
+    wakeup();
+}
+
+void ClientNotifier::remove(uint64_t key) noexcept{
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _removals.push_back(key);
+    }
+    wakeup();
+}
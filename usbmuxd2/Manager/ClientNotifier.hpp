@@ -0,0 +1,63 @@
+//
+//  ClientNotifier.hpp
+//  usbmuxd2
+//
+
+#ifndef ClientNotifier_hpp
+#define ClientNotifier_hpp
+
+#include <libgeneral/Manager.hpp>
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <poll.h>
+
+class Client;
+
+/*
+    Delivers the queued notifications of all listening clients on a single thread.
+    Sockets are written without blocking, a client which doesn't read stays in the
+    poll set until its socket becomes writable again and never holds up the others.
+ */
+class ClientNotifier : public tihmstar::Manager{
+public:
+    static constexpr int busyRetryMs = 10;
+private:
+    struct entry{
+        std::weak_ptr<Client> cli;
+        int fd;
+        bool armed;     //client has something left to send
+        bool busy;      //client thread held the write lock, retry after busyRetryMs
+    };
+    std::mutex _lck;
+    std::vector<std::pair<uint64_t, entry>> _incoming;
+    std::vector<uint64_t> _signaled;
+    std::vector<uint64_t> _removals;
+    int _wakePipe[2];
+
+    //only touched by the loop thread
+    std::map<uint64_t, entry> _entries;
+    std::vector<struct pollfd> _pfds;
+    std::vector<uint64_t> _pfdKeys;
+
+    virtual void stopAction() noexcept override;
+    virtual bool loopEvent() override;
+
+    void wakeup() noexcept;
+    void adopt_changes() noexcept;
+    bool flush(entry &e) noexcept;
+
+public:
+    ClientNotifier();
+    ClientNotifier(const ClientNotifier &) = delete;
+    virtual ~ClientNotifier() override;
+
+    void add(uint64_t key, std::shared_ptr<Client> cli);
+    void signal(uint64_t key) noexcept;
+    void remove(uint64_t key) noexcept;
+};
+
+#endif /* ClientNotifier_hpp */
@@ -0,0 +1,62 @@
+//
+//  ResolverCache.cpp
+//  usbmuxd2
+//
+
+#include "ResolverCache.hpp"
+
+#pragma mark ResolverCache
+ResolverCache::ResolverCache(uint32_t maxTTL)
+: _maxTTL(maxTTL), _pruneAt(16)
+{
+    //
+}
+
+ResolverCache::~ResolverCache(){
+    //
+}
+
+#pragma mark private
+void ResolverCache::prune(clock::time_point now) noexcept{
+    for (auto it = _entries.begin(); it != _entries.end();) {
+        if (it->second.expires <= now) {
+            it = _entries.erase(it);
+        }else{
+            ++it;
+        }
+    }
+    //amortize the sweep over the inserts it took to get here
+    _pruneAt = (_entries.size() < 8) ? 16 : _entries.size()*2;
+}
+
+#pragma mark public
+void ResolverCache::insert(const std::string &instance, const std::string &serviceName, const std::vector<std::string> &addrs, uint32_t interfaceIndex, uint32_t ttl) noexcept{
+    clock::time_point now = clock::now();
+    if (ttl > _maxTTL) ttl = _maxTTL;
+    if (!ttl || !addrs.size()) return;
+    try {
+        _entries[instance] = {serviceName, addrs, interfaceIndex, now + std::chrono::seconds(ttl)};
+    } catch (...) {
+        return; //caching is best effort
+    }
+    if (_entries.size() >= _pruneAt) prune(now);
+}
+
+bool ResolverCache::lookup(const std::string &instance, entry &out) noexcept{
+    auto it = _entries.find(instance);
+    if (it == _entries.end()) return false;
+    if (it->second.expires <= clock::now()) {
+        _entries.erase(it);
+        return false;
+    }
+    try {
+        out = it->second;
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
+void ResolverCache::erase(const std::string &instance) noexcept{
+    _entries.erase(instance);
+}
@@ -0,0 +1,50 @@
+//
+//  ResolverCache.hpp
+//  usbmuxd2
+//
+
+#ifndef ResolverCache_hpp
+#define ResolverCache_hpp
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+    Remembers what DNS-SD service instances resolved to, so that a service which
+    reappears within the TTL of its records can be added without resolving it again.
+    Not thread safe, the owning manager only touches it from its loop thread.
+ */
+class ResolverCache{
+public:
+    typedef std::chrono::steady_clock clock;
+    struct entry{
+        std::string serviceName;
+        std::vector<std::string> addrs;
+        uint32_t interfaceIndex;
+        clock::time_point expires;
+    };
+private:
+    std::unordered_map<std::string, entry> _entries;
+    uint32_t _maxTTL; //seconds, 0 disables the cache
+    size_t _pruneAt;
+
+    void prune(clock::time_point now) noexcept;
+
+public:
+    ResolverCache(uint32_t maxTTL);
+    ~ResolverCache();
+
+    /*
+        ttl is capped at maxTTL.
+     */
+    void insert(const std::string &instance, const std::string &serviceName, const std::vector<std::string> &addrs, uint32_t interfaceIndex, uint32_t ttl) noexcept;
+    bool lookup(const std::string &instance, entry &out) noexcept;
+    void erase(const std::string &instance) noexcept;
+
+    uint32_t maxTTL() const noexcept {return _maxTTL;};
+};
+
+#endif /* ResolverCache_hpp */
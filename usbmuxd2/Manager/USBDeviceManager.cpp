@@ -7,6 +7,7 @@
 
 #include "USBDeviceManager.hpp"
 #include "../Devices/USBDevice.hpp"
+#include "../Devices/LibUSBTransport.hpp"
 
 #include <unistd.h>
 #include <string.h>
@@ -15,8 +16,6 @@
 int usb_hotplug_cb(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data) noexcept;
 void usb_get_langid_callback(struct libusb_transfer *transfer) noexcept;
 void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept;
-void rx_callback(struct libusb_transfer *xfer) noexcept;
-void usb_start_rx_loop(std::shared_ptr<USBDevice> dev);
 
 #pragma mark libusb_callback implementations
 
@@ -73,7 +72,7 @@ void usb_get_langid_callback(struct libusb_transfer *transfer) noexcept{
                                   (uint16_t)((LIBUSB_DT_STRING << 8) | usbdev->_devdesc.iSerialNumber),
                                   langid, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
 
-        libusb_fill_control_transfer(transfer, usbdev->_usbdev, transfer->buffer, usb_get_serial_callback, transfer->user_data, 1000);
+        libusb_fill_control_transfer(transfer, ((LibUSBTransport*)usbdev->_transport)->handle(), transfer->buffer, usb_get_serial_callback, transfer->user_data, 1000);
 
         retassure((ret = libusb_submit_transfer(transfer)) >= 0, "Could not request transfer for device %d-%d (%d)", usbdev->_bus, usbdev->_address, ret);
     } catch (tihmstar::exception &e) {
@@ -128,28 +127,7 @@ void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept{
 
         info("Got serial '%s' for device %d-%d", usbdev->_serial, usbdev->_bus, usbdev->_address);
 
-        // Spin up NUM_RX_LOOPS parallel usb data retrieval loops
-        // Old usbmuxds used only 1 rx loop, but that leaves the
-        // USB port sleeping most of the time
-        {
-            int rx_loops = 0;
-            for (; rx_loops < NUM_RX_LOOPS; rx_loops++) {
-                try {
-                    usb_start_rx_loop(usbdev);
-                } catch (tihmstar::exception &e) {
-                    warning("Failed to start RX loop number %d", NUM_RX_LOOPS - rx_loops);
-                }
-            }
-            // Ensure we have at least 1 RX loop going
-            retassure(rx_loops, "Failed to start any RX loop for device %d-%d", usbdev->_bus, usbdev->_address);
-            if (rx_loops != NUM_RX_LOOPS) {
-                warning("Failed to start all %d RX loops. Going on with %d loops. This may have negative impact on device read speed.", NUM_RX_LOOPS, rx_loops);
-            } else {
-                debug("All %d RX loops started successfully", NUM_RX_LOOPS);
-            }
-        }
-
-        usbdev->mux_init();
+        usbdev->start_mux(NUM_RX_LOOPS);
 
     } catch (tihmstar::exception &e) {
         error("[usb_get_serial_callback] Failed with error=%d (%s)",e.code(),e.what());
@@ -166,108 +144,32 @@ void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept{
     safeFreeCustom(transfer, libusb_free_transfer);
 }
 
-// Start a read-callback loop for this device
-void usb_start_rx_loop(std::shared_ptr<USBDevice> dev){
-    void *buf = NULL;
-    struct libusb_transfer *xfer = NULL;
-    std::shared_ptr<USBDevice> *devrefarg = nullptr;
-    cleanup([&](){ //cleanup only code
-        safeDelete(devrefarg);
-        safeFree(buf);
-        if (xfer) {
-            {
-                guardWrite(dev->_rx_xfers_Guard);
-                dev->_rx_xfers.erase(xfer);
-            }
-            safeFree(xfer->buffer);
-            {
-                std::shared_ptr<USBDevice>* ud = (std::shared_ptr<USBDevice>*)xfer->user_data;xfer->user_data = NULL;
-                safeDelete(ud);
-            }
-            libusb_free_transfer(xfer);
-        }
-    });
-    int ret = 0;
-
-    assure(buf = malloc(USB_MRU));
-    assure(xfer = libusb_alloc_transfer(0));
-    xfer->user_data = NULL;
-
-    devrefarg = new std::shared_ptr<USBDevice>{dev};
-    libusb_fill_bulk_transfer(xfer, dev->_usbdev, dev->_ep_in, (unsigned char *)buf, USB_MRU, rx_callback, devrefarg, 0);
-    buf = NULL; //owned by xfer now
-    devrefarg = nullptr; //owned by xfer now
-
-    {
-        guardWrite(dev->_rx_xfers_Guard);
-        dev->_rx_xfers.insert(xfer); //transfer ownsership of transfer to device
-    }
-    retassure(!((ret = libusb_submit_transfer(xfer)),ret),"Failed to submit RX transfer to device %d-%d: %d", dev->_bus, dev->_address, ret);
-    xfer = NULL;
-    dev->addReceiver();
-}
-
-void rx_callback(struct libusb_transfer *xfer) noexcept{
-    std::shared_ptr<USBDevice> dev = *(std::shared_ptr<USBDevice> *)xfer->user_data;
-//    debug("RX callback dev %d-%d len %d status %d", dev->_bus, dev->_address, xfer->actual_length, xfer->status);
-    if(xfer->status == LIBUSB_TRANSFER_COMPLETED) {
-        dev->_arrived_xfer.post(xfer);
-        return;
-    }
-    switch(xfer->status) {
-        case LIBUSB_TRANSFER_ERROR:
-            // funny, this happens when we disconnect the device while waiting for a transfer, sometimes
-            info("Device %d-%d RX aborted due to error or disconnect", dev->_bus, dev->_address);
-            break;
-        case LIBUSB_TRANSFER_TIMED_OUT:
-            error("RX transfer timed out for device %d-%d", dev->_bus, dev->_address);
-            break;
-        case LIBUSB_TRANSFER_CANCELLED:
-            debug("Device %d-%d RX transfer cancelled", dev->_bus, dev->_address);
-            break;
-        case LIBUSB_TRANSFER_STALL:
-            error("RX transfer stalled for device %d-%d", dev->_bus, dev->_address);
-            break;
-        case LIBUSB_TRANSFER_NO_DEVICE:
-            // other times, this happens, and also even when we abort the transfer after device removal
-            info("Device %d-%d RX aborted due to disconnect", dev->_bus, dev->_address);
-            break;
-        case LIBUSB_TRANSFER_OVERFLOW:
-            error("RX transfer overflow for device %d-%d", dev->_bus, dev->_address);
-            break;
-        case LIBUSB_TRANSFER_COMPLETED: //shut up compiler
-        default:
-            // this should never be reached.
-            break;
-    }
-error:
-    //remove transfer
-    {
-        guardWrite(dev->_rx_xfers_Guard);
-        dev->_rx_xfers.erase(xfer);
-    }
-
-    debug("freing rx xfer for USBDevice(%s)",dev->_serial);
-    safeFree(xfer->buffer);
-    {
-        std::shared_ptr<USBDevice> *cbargref = (std::shared_ptr<USBDevice> *)xfer->user_data; xfer->user_data = NULL;
-        safeDelete(cbargref);
-    }
-    libusb_free_transfer(xfer);
-
-    dev->kill();
-}
-
 #pragma mark USBDeviceManager
-USBDeviceManager::USBDeviceManager(Muxer *parent)
+USBDeviceManager::USBDeviceManager(Muxer *parent, const SimUSBTransport::params *simulate)
 : DeviceManager(parent)
-, _ctx(NULL), _usb_hotplug_cb_handle(0)
+, _ctx(NULL), _usb_hotplug_cb_handle(0), _simulated(simulate != nullptr), _simParams{}
 {
     bool didInit = false;
     cleanup([&]{
         if (!didInit) this->~USBDeviceManager();
     });
     int err = 0;
+    if (_simulated) {
+        info("USBDeviceManager simulating %d v%d devices",simulate->devices,simulate->version);
+        _simParams = *simulate;
+        didInit = true;
+        _devReaperThread = std::thread([this]{
+            reaper_runloop();
+        });
+        for (int i = 0; i < simulate->devices; i++) {
+            try {
+                sim_device_add(i, *simulate);
+            } catch (tihmstar::exception &e) {
+                error("failed to add simulated device %d error=%s code=%d",i,e.what(),e.code());
+            }
+        }
+        return;
+    }
     info("USBDeviceManager libusb 1.0");
     retassure(libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG), "libusb does not support hotplug events");
 
@@ -307,12 +209,14 @@ USBDeviceManager::~USBDeviceManager(){
 #pragma mark inheritance override
 bool USBDeviceManager::loopEvent(){
     int err = 0;
+    if (_simulated) return false; //simulated devices run on their own
     retassure(!(err = libusb_handle_events(_ctx)), "libusb_handle_events_completed failed: %d", err);
     return true;
 }
 
 void USBDeviceManager::stopAction() noexcept{
     int err = 0;
+    if (_simulated) return;
     /*
         re-registering the event handler, triggers an event
      */
@@ -368,6 +272,10 @@ void USBDeviceManager::device_add(libusb_device *dev){
     uint8_t address = 0;
     struct libusb_device_descriptor devdesc = {};
     int current_config = 0;
+    uint8_t interface = 0;
+    uint8_t ep_in = 0;
+    uint8_t ep_out = 0;
+    int wMaxPacketSize = 0;
     std::shared_ptr<USBDevice> newDevice;
     
     bus = libusb_get_bus_number(dev);
@@ -439,17 +347,17 @@ void USBDeviceManager::device_add(libusb_device *dev){
         }
         if((intf->endpoint[0].bEndpointAddress & 0x80) == LIBUSB_ENDPOINT_OUT &&
            (intf->endpoint[1].bEndpointAddress & 0x80) == LIBUSB_ENDPOINT_IN) {
-            newDevice->_interface = intf->bInterfaceNumber;
-            newDevice->_ep_out = intf->endpoint[0].bEndpointAddress;
-            newDevice->_ep_in = intf->endpoint[1].bEndpointAddress;
-            debug("Found interface %d with endpoints %02x/%02x for device %d-%d", newDevice->_interface, newDevice->_ep_out, newDevice->_ep_in, bus, address);
+            interface = intf->bInterfaceNumber;
+            ep_out = intf->endpoint[0].bEndpointAddress;
+            ep_in = intf->endpoint[1].bEndpointAddress;
+            debug("Found interface %d with endpoints %02x/%02x for device %d-%d", interface, ep_out, ep_in, bus, address);
             goto found_device;
         } else if((intf->endpoint[1].bEndpointAddress & 0x80) == LIBUSB_ENDPOINT_OUT &&
                   (intf->endpoint[0].bEndpointAddress & 0x80) == LIBUSB_ENDPOINT_IN) {
-            newDevice->_interface = intf->bInterfaceNumber;
-            newDevice->_ep_out = intf->endpoint[1].bEndpointAddress;
-            newDevice->_ep_in = intf->endpoint[0].bEndpointAddress;
-            warning("Found interface %d with swapped endpoints %02x/%02x for device %d-%d", newDevice->_interface, newDevice->_ep_out, newDevice->_ep_in, bus, address);
+            interface = intf->bInterfaceNumber;
+            ep_out = intf->endpoint[1].bEndpointAddress;
+            ep_in = intf->endpoint[0].bEndpointAddress;
+            warning("Found interface %d with swapped endpoints %02x/%02x for device %d-%d", interface, ep_out, ep_in, bus, address);
             goto found_device;
         } else {
             warning("Endpoint type mismatch for interface %d of device %d-%d", intf->bInterfaceNumber, bus, address);
@@ -458,7 +366,7 @@ void USBDeviceManager::device_add(libusb_device *dev){
     reterror("Could not find a suitable USB interface for device %d-%d", bus, address);
 found_device:;
     
-    retassure(!(err = libusb_claim_interface(handle, newDevice->_interface)), "Could not claim interface %d for device %d-%d: %d", newDevice->_interface, bus, address, err);
+    retassure(!(err = libusb_claim_interface(handle, interface)), "Could not claim interface %d for device %d-%d: %d", interface, bus, address, err);
     retassure(transfer = libusb_alloc_transfer(0), "Failed to allocate transfer for device %d-%d", bus, address);
 
     newDevice->_serial[0] = 0;
@@ -466,15 +374,15 @@ found_device:;
     newDevice->_address = address;
     newDevice->_devdesc = devdesc;
     newDevice->_speed = 480000000;
-    newDevice->_usbdev = handle; handle = NULL; //transfering ownership here!
-    newDevice->_wMaxPacketSize = libusb_get_max_packet_size(dev, newDevice->_ep_out);
+    wMaxPacketSize = libusb_get_max_packet_size(dev, ep_out);
 
-    if (newDevice->_wMaxPacketSize <= 0) {
+    if (wMaxPacketSize <= 0) {
         error("Could not determine wMaxPacketSize for device %d-%d, setting to 64", newDevice->_bus, newDevice->_address);
-        newDevice->_wMaxPacketSize = 64;
+        wMaxPacketSize = 64;
     } else {
-        debug("Using wMaxPacketSize=%d for device %d-%d", newDevice->_wMaxPacketSize, newDevice->_bus, newDevice->_address);
+        debug("Using wMaxPacketSize=%d for device %d-%d", wMaxPacketSize, newDevice->_bus, newDevice->_address);
     }
+    newDevice->_transport = new LibUSBTransport(newDevice.get(), handle, interface, ep_in, ep_out, wMaxPacketSize); handle = NULL; //transfering ownership here!
     
     switch (libusb_get_device_speed(dev)) {
         case LIBUSB_SPEED_LOW:
@@ -507,7 +415,7 @@ found_device:;
 
     libusb_fill_control_setup(transfer_buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8, 0, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
 
-    libusb_fill_control_transfer(transfer, newDevice->_usbdev, transfer_buffer, usb_get_langid_callback, transferdevref, 1000);
+    libusb_fill_control_transfer(transfer, ((LibUSBTransport*)newDevice->_transport)->handle(), transfer_buffer, usb_get_langid_callback, transferdevref, 1000);
 
     retassure(!(err = libusb_submit_transfer(transfer)), "Could not request transfer for device %d-%d (%d)", newDevice->_bus, newDevice->_address, err);
 
@@ -518,6 +426,32 @@ found_device:;
     add_constructing(bus, address);
 }
 
+void USBDeviceManager::sim_device_add(int num, const SimUSBTransport::params &params){
+    std::shared_ptr<USBDevice> newDevice;
+
+    newDevice = std::make_shared<USBDevice>(_mux,this,PID_RANGE_LOW);
+    newDevice->_selfref = newDevice;
+    {
+        std::unique_lock<std::mutex> ul(_childrenLck);
+        _children.insert(newDevice.get());
+    }
+    snprintf(newDevice->_serial, sizeof(newDevice->_serial), "SIMULATED-%014d", num);
+    newDevice->_bus = SIM_USB_BUS;
+    newDevice->_address = (uint8_t)(num + 1);
+    newDevice->_devdesc.idVendor = VID_APPLE;
+    newDevice->_devdesc.idProduct = PID_RANGE_LOW;
+    newDevice->_speed = 480000000;
+    newDevice->_transport = new SimUSBTransport(newDevice.get(), params);
+    info("Adding simulated device '%s' at %d-%d", newDevice->_serial, newDevice->_bus, newDevice->_address);
+
+    try {
+        newDevice->start_mux(NUM_RX_LOOPS);
+    } catch (...) {
+        newDevice->kill();
+        throw;
+    }
+}
+
 void USBDeviceManager::reaper_runloop(){
     while (true) {
         std::shared_ptr<USBDevice>dev;
@@ -533,5 +467,26 @@ void USBDeviceManager::reaper_runloop(){
 
 
 #pragma mark public
+void USBDeviceManager::sim_attach(int num){
+    retassure(_simulated, "not simulating USB devices");
+    retassure(num >= 0 && num < 0xff, "simulated device number %d out of range", num);
+    {
+        std::unique_lock<std::mutex> ul(_childrenLck);
+        for (auto c : _children) {
+            retassure(c->_bus != SIM_USB_BUS || c->_address != num + 1, "simulated device %d is still attached", num);
+        }
+    }
+    sim_device_add(num, _simParams);
+}
+
+void USBDeviceManager::sim_detach(int num) noexcept{
+    if (!_simulated) return;
+    //unplugging drops the device from the registry right away, the transfers die after
+    _mux->delete_device(SIM_USB_BUS, (uint8_t)(num + 1));
+    std::unique_lock<std::mutex> ul(_childrenLck);
+    for (auto c : _children) {
+        if (c->_bus == SIM_USB_BUS && c->_address == num + 1) c->kill();
+    }
+}
 
 
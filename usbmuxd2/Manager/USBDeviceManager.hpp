@@ -9,6 +9,7 @@
 #define USBDeviceManager_hpp
 
 #include "DeviceManager.hpp"
+#include "../Devices/SimUSBTransport.hpp"
 #include <libgeneral/Event.hpp>
 #include <libgeneral/DeliveryEvent.hpp>
 #include <libusb.h>
@@ -37,11 +38,15 @@
 
 #define NUM_RX_LOOPS 3
 
+#define SIM_USB_BUS 0xff
+
 class USBDevice_receiver;
 class USBDevice;
 class USBDeviceManager : public DeviceManager{
     libusb_context *_ctx;
     libusb_hotplug_callback_handle _usb_hotplug_cb_handle;
+    bool _simulated;
+    SimUSBTransport::params _simParams;
     
     std::set<uint16_t> _constructing;
     tihmstar::GuardAccess _constructingGuard;
@@ -62,12 +67,23 @@ private:
     bool is_constructing(uint8_t bus, uint8_t addr);
 
     void device_add(libusb_device *dev);
+    void sim_device_add(int num, const SimUSBTransport::params &params);
 
     void reaper_runloop();
     
 public:
-    USBDeviceManager(Muxer *parent);
+    /*
+        If simulate is set, no hardware is touched and simulate->devices simulated devices are attached instead.
+     */
+    USBDeviceManager(Muxer *parent, const SimUSBTransport::params *simulate = nullptr);
     virtual ~USBDeviceManager() override;
+
+#pragma mark simulation
+    /*
+        Hotplugs simulated device num like a cable would, only available when simulating.
+     */
+    void sim_attach(int num);
+    void sim_detach(int num) noexcept;
     
 #pragma mark friends
     friend USBDevice_receiver;
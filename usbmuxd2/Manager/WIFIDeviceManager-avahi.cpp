@@ -17,6 +17,7 @@
 #include <avahi-common/error.h>
 #include <avahi-common/malloc.h>
 #include <avahi-common/address.h>
+#include <avahi-common/timeval.h>
 
 #include <string.h>
 
@@ -27,11 +28,12 @@ void avahi_browse_callback(AvahiServiceBrowser *b, AvahiIfIndex interface, Avahi
 void avahi_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, AvahiProtocol protocol,
        AvahiResolverEvent event, const char *name, const char *type, const char *domain, const char *host_name,
        const AvahiAddress *address, uint16_t port, AvahiStringList *txt, AvahiLookupResultFlags flags, void* userdata) noexcept;
+void avahi_removal_timeout_callback(AvahiTimeout *t, void *userdata) noexcept;
 
 #pragma mark WIFIDeviceManager
 
-WIFIDeviceManager::WIFIDeviceManager(Muxer *mux)
-: DeviceManager(mux)
+WIFIDeviceManager::WIFIDeviceManager(Muxer *mux, uint32_t removalGraceMs, uint32_t resolveCacheTTL)
+: DeviceManager(mux), _removalGraceMs(removalGraceMs), _resolved(resolveCacheTTL), _removalTimeout(NULL)
 {
    int err = 0;
    debug("WIFIDeviceManager avahi-client");
@@ -42,6 +44,11 @@ WIFIDeviceManager::WIFIDeviceManager(Muxer *mux)
        "Failed to start avahi_client with error=%d. Is the daemon running?",err);
    assure(!err);
 
+   {
+       const AvahiPoll *api = avahi_simple_poll_get(_simple_poll);
+       assure(_removalTimeout = api->timeout_new(api, NULL, avahi_removal_timeout_callback, this));
+   }
+
    assure(_avahi_sb = avahi_service_browser_new(_avahi_client, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, "_apple-mobdev2._tcp", NULL, (AvahiLookupFlags)0, avahi_browse_callback, this));
    assure(_avahi_sb2 = avahi_service_browser_new(_avahi_client, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, "_remotepairing-manual-pairing._tcp", NULL, (AvahiLookupFlags)0, avahi_browse_callback, this));
    debug("WIFIDeviceManager created avahi service_browser");
@@ -70,6 +77,10 @@ WIFIDeviceManager::~WIFIDeviceManager(){
 
     safeFreeCustom(_avahi_sb,avahi_service_browser_free);
     safeFreeCustom(_avahi_sb2,avahi_service_browser_free);
+    if (_removalTimeout) {
+        avahi_simple_poll_get(_simple_poll)->timeout_free(_removalTimeout);
+        _removalTimeout = NULL;
+    }
     safeFreeCustom(_avahi_client,avahi_client_free);
     safeFreeCustom(_simple_poll,avahi_simple_poll_free);
 }
@@ -104,6 +115,88 @@ void WIFIDeviceManager::reaper_runloop(){
     }
 }
 
+void WIFIDeviceManager::service_resolved(const std::string &serviceName, const std::vector<std::string> &addrs, uint32_t interfaceIndex) noexcept{
+    bool notifyadd = true;
+    std::string macAddr{serviceName.substr(0,serviceName.find("@"))};
+    std::string uuid;
+    if (strstr(serviceName.c_str(), "_remotepairing-manual-pairing._tcp")) {
+        uuid = "WIFIPAIR-"+serviceName.substr(0,serviceName.find("."));
+        if (_mux->have_wifi_device_with_ip(addrs)) return;
+        notifyadd = false;
+    }else{
+        try{
+            uuid = sysconf_udid_for_macaddr(macAddr);
+        }catch (tihmstar::exception &e){
+            debug("failed to find uuid for mac=%s with error=%d (%s)",macAddr.c_str(),e.code(),e.what());
+            return;
+        }
+        if (_mux->have_wifi_device_with_mac(macAddr)) return;
+        _mux->delete_wifi_pairing_device_with_ip(addrs);
+    }
+
+    try{
+        device_add(std::make_shared<WIFIDevice>(_mux, this, uuid, addrs, serviceName, interfaceIndex), notifyadd);
+    } catch (tihmstar::exception &e){
+        error("failed to construct device with error=%d (%s)",e.code(),e.what());
+    }
+}
+
+void WIFIDeviceManager::service_added(const std::string &instance) noexcept{
+    _advertised[instance]++;
+    if (_pendingRemovals.erase(instance)) {
+        debug("WiFi service '%s' came back within grace period",instance.c_str());
+    }
+}
+
+void WIFIDeviceManager::service_removed(const std::string &instance) noexcept{
+    auto it = _advertised.find(instance);
+    if (it != _advertised.end()) {
+        if (--it->second > 0) return; //still announced on another interface
+        _advertised.erase(it);
+    }
+    _pendingRemovals[instance] = std::chrono::steady_clock::now() + std::chrono::milliseconds(_removalGraceMs);
+    arm_removal_timeout();
+}
+
+int WIFIDeviceManager::expire_removals() noexcept{
+    auto now = std::chrono::steady_clock::now();
+    int64_t next = -1;
+    for (auto it = _pendingRemovals.begin(); it != _pendingRemovals.end();) {
+        if (it->second > now) {
+            //round up, so we don't wake up right before the deadline
+            int64_t left = std::chrono::duration_cast<std::chrono::milliseconds>(it->second - now).count() + 1;
+            if (next == -1 || left < next) next = left;
+            ++it;
+            continue;
+        }
+        std::string_view mac{it->first};
+        mac = mac.substr(0,mac.find("@"));
+        bool superseded = false;
+        for (auto &a : _advertised) {
+            if (std::string_view(a.first).substr(0,a.first.find("@")) == mac) {
+                superseded = true; //device re-announced itself under a new instance
+                break;
+            }
+        }
+        if (!superseded && _mux->kill_wifi_device_with_service(it->first)) {
+            info("WiFi service '%s' went away, removing device",it->first.c_str());
+        }
+        it = _pendingRemovals.erase(it);
+    }
+    return (int)next;
+}
+
+void WIFIDeviceManager::arm_removal_timeout() noexcept{
+    const AvahiPoll *api = avahi_simple_poll_get(_simple_poll);
+    int next = expire_removals();
+    if (next < 0) {
+        api->timeout_update(_removalTimeout, NULL);
+    }else{
+        struct timeval tv = {};
+        api->timeout_update(_removalTimeout, avahi_elapse_time(&tv, (unsigned)next, 0));
+    }
+}
+
 #pragma mark avahi_callback implementations
 
 void avahi_client_callback(AvahiClient *c, AvahiClientState state, void *userdata) noexcept{
@@ -130,11 +223,21 @@ void avahi_browse_callback(AvahiServiceBrowser *b, AvahiIfIndex interface, Avahi
           function we free it. If the server is terminated before
           the callback function is called the server will free
           the resolver for us. */
+       devmgr->service_added(name);
+       {
+           ResolverCache::entry cached;
+           if (devmgr->_resolved.lookup(name, cached)) {
+               debug("(Browser) using cached resolve of '%s'\n", name);
+               devmgr->service_resolved(cached.serviceName, cached.addrs, cached.interfaceIndex);
+               break;
+           }
+       }
        if (!(avahi_service_resolver_new(devmgr->_avahi_client, interface, protocol, name, type, domain, AVAHI_PROTO_UNSPEC, (AvahiLookupFlags)0, avahi_resolve_callback, userdata)))
            debug("Failed to resolve service '%s': %s\n", name, avahi_strerror(avahi_client_errno(devmgr->_avahi_client)));
        break;
    case AVAHI_BROWSER_REMOVE:
        debug("(Browser) REMOVE: service '%s' of type '%s' in domain '%s'\n", name, type, domain);
+       devmgr->service_removed(name);
        break;
    case AVAHI_BROWSER_ALL_FOR_NOW:
    case AVAHI_BROWSER_CACHE_EXHAUSTED:
@@ -147,10 +250,7 @@ void avahi_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, Ava
         AvahiResolverEvent event, const char *name, const char *type, const char *domain, const char *host_name,
         const AvahiAddress *address, uint16_t port, AvahiStringList *txt, AvahiLookupResultFlags flags, void* userdata) noexcept{
     char addr[AVAHI_ADDRESS_STR_MAX] = {};
-    int err = 0;
     WIFIDeviceManager *devmgr = (WIFIDeviceManager*)userdata;
-    char *t = NULL;
-    std::shared_ptr<WIFIDevice> dev = nullptr;
 
     /* Called whenever a service has been resolved successfully or timed out */
     switch (event) {
@@ -158,47 +258,16 @@ void avahi_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, Ava
             debug("(Resolver) Failed to resolve service '%s' of type '%s' in domain '%s': %s\n", name, type, domain, avahi_strerror(avahi_client_errno(avahi_service_resolver_get_client(r))));
             break;
         case AVAHI_RESOLVER_FOUND: {
-            // TODO: inform muxer about devices leaving
             debug("Service '%s' of type '%s' in domain '%s':\n", name, type, domain);
             avahi_address_snprint(addr, sizeof(addr), address);
-            t = avahi_string_list_to_string(txt);
             std::string serviceName{name};
-            std::string macAddr{serviceName.substr(0,serviceName.find("@"))};
-            std::string uuid;
             serviceName += ".";
             serviceName += type;
 
-
             std::vector<std::string> addrs{addr};
-            bool notifyadd = true;
-            if (strstr(serviceName.c_str(), "_remotepairing-manual-pairing._tcp")) {
-                uuid = "WIFIPAIR-"+serviceName.substr(0,serviceName.find("."));
-                macAddr = {};
-                if (devmgr->_mux->have_wifi_device_with_ip(addrs)) goto error;
-                notifyadd = false;
-            }else{
-                try{
-                    uuid = sysconf_udid_for_macaddr(macAddr);
-                }catch (tihmstar::exception &e){
-                    debug("failed to find uuid for mac=%s with error=%d (%s)",macAddr.c_str(),e.code(),e.what());
-                    break;
-                }
-
-                if (devmgr->_mux->have_wifi_device_with_mac(macAddr)) goto error;
-                devmgr->_mux->delete_wifi_pairing_device_with_ip(addrs);
-                notifyadd = true;
-            }
-
-            {
-                std::shared_ptr<WIFIDevice> dev = nullptr;
-                try{
-                    dev = std::make_shared<WIFIDevice>(devmgr->_mux, devmgr, uuid, addrs, serviceName, interface);
-                    devmgr->device_add(dev, notifyadd); dev = NULL;
-                } catch (tihmstar::exception &e){
-                    creterror("failed to construct device with error=%d (%s)",e.code(),e.what());
-                }
-            }
-
+            //avahi doesn't tell us the record TTLs, assume the longest we allow
+            devmgr->_resolved.insert(name, serviceName, addrs, (uint32_t)interface, devmgr->_resolved.maxTTL());
+            devmgr->service_resolved(serviceName, addrs, (uint32_t)interface);
             break;
         }
         default:
@@ -206,14 +275,12 @@ void avahi_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, Ava
             break;
     }
 
-error:
     avahi_service_resolver_free(r);
-    if (t){
-        avahi_free(t);
-    }
-    if (dev){
-        dev->kill();
-    }
+}
+
+void avahi_removal_timeout_callback(AvahiTimeout *t, void *userdata) noexcept{
+    WIFIDeviceManager *devmgr = (WIFIDeviceManager*)userdata;
+    devmgr->arm_removal_timeout();
 }
 
 #endif //HAVE_WIFI_SUPPORT
@@ -12,6 +12,7 @@
 
 #include "../Muxer.hpp"
 #include "DeviceManager.hpp"
+#include "ResolverCache.hpp"
 #include "../Devices/WIFIDevice.hpp"
 
 #include <libgeneral/DeliveryEvent.hpp>
@@ -20,6 +21,9 @@
 #include <avahi-client/client.h>
 #include <avahi-client/lookup.h>
 
+#include <chrono>
+#include <map>
+
 class WIFIDeviceManager : public DeviceManager{
 private:
     std::set<WIFIDevice *> _children;  //raw ptr to shared objec
@@ -28,17 +32,35 @@ private:
     std::thread _devReaperThread;
     tihmstar::DeliveryEvent<std::shared_ptr<WIFIDevice>> _reapDevices;
 
+    /*
+        Services are keyed by instance name. A service is considered gone once every interface withdrew it,
+        its device is killed when the service didn't come back within the grace period.
+     */
+    uint32_t _removalGraceMs;
+    std::map<std::string, int> _advertised; //instance -> number of announcements
+    std::map<std::string, std::chrono::steady_clock::time_point> _pendingRemovals;
+    ResolverCache _resolved;
+
     AvahiSimplePoll *_simple_poll;
     AvahiClient *_avahi_client;
     AvahiServiceBrowser *_avahi_sb;
     AvahiServiceBrowser *_avahi_sb2;
+    AvahiTimeout *_removalTimeout;
 
     virtual bool loopEvent() override;
     virtual void stopAction() noexcept override;
 
     void reaper_runloop();
+    void service_added(const std::string &instance) noexcept;
+    void service_removed(const std::string &instance) noexcept;
+    void service_resolved(const std::string &serviceName, const std::vector<std::string> &addrs, uint32_t interfaceIndex) noexcept;
+    /*
+        Kills devices whose grace period ran out, returns ms until the next one is due or -1.
+     */
+    int expire_removals() noexcept;
+    void arm_removal_timeout() noexcept;
 public:
-    WIFIDeviceManager(Muxer *mux);
+    WIFIDeviceManager(Muxer *mux, uint32_t removalGraceMs, uint32_t resolveCacheTTL);
     virtual ~WIFIDeviceManager() override;
 
     void device_add(std::shared_ptr<WIFIDevice> dev, bool notify = true);
@@ -50,6 +72,7 @@ public:
     friend void avahi_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, AvahiProtocol protocol,
         AvahiResolverEvent event, const char *name, const char *type, const char *domain, const char *host_name,
         const AvahiAddress *address, uint16_t port, AvahiStringList *txt, AvahiLookupResultFlags flags, void* userdata) noexcept;
+    friend void avahi_removal_timeout_callback(AvahiTimeout *t, void *userdata) noexcept;
 };
 
 
@@ -16,8 +16,13 @@
 #include "../Devices/WIFIDevice.hpp"
 #include <arpa/inet.h>
 #include <netdb.h>
-#include <sys/select.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#ifdef __linux__
+#   include <sys/epoll.h>
+#endif
 
 #pragma mark definitions
 
@@ -36,68 +41,56 @@
 #define kDNSServiceProtocol_IPv6 0x02
 
 
+#pragma mark helpers
+/*
+    Escapes a service instance name the way it appears in the fullname handed to resolve_reply.
+ */
+static std::string escape_instance_name(const char *name){
+    std::string ret;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+        if (*c == '.' || *c == '\\') {
+            ret += '\\';
+            ret += (char)*c;
+        }else if (*c <= ' ') {
+            char buf[5] = {};
+            snprintf(buf, sizeof(buf), "\\%03u", *c);
+            ret += buf;
+        }else{
+            ret += (char)*c;
+        }
+    }
+    return ret;
+}
+
 #pragma mark callbacks
 void getaddr_reply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceIndex, DNSServiceErrorType errorCode, const char *hostname, const struct sockaddr *address, uint32_t ttl, void *context) noexcept{
-    int err = 0;
     WIFIDeviceManager *devmgr = (WIFIDeviceManager *)context;
     
-    std::vector<std::string> &addrs = devmgr->_clientAddrs[sdRef];
+    WIFIDeviceManager::pending_addrinfo &pending = devmgr->_clientAddrs[sdRef];
 
-    std::string ipaddr;
-    ipaddr.resize(INET6_ADDRSTRLEN+1);
-    if (address->sa_family == AF_INET6) {
-        ipaddr = inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)address)->sin6_addr), ipaddr.data(), (socklen_t)ipaddr.size());
-    }else{
-        ipaddr = inet_ntop(AF_INET, &(((struct sockaddr_in *)address)->sin_addr), ipaddr.data(), (socklen_t)ipaddr.size());
-    }
-    addrs.push_back(ipaddr);
-
-
-    if (!(flags & kDNSServiceFlagsMoreComing)) {
-        bool notifyadd = true;
-        std::string serviceName = addrs.front();
-        addrs.erase(addrs.begin());
-        
-        std::string macAddr{serviceName.substr(0,serviceName.find("@"))};
-        std::string uuid;
-        if (strstr(serviceName.c_str(), "_remotepairing-manual-pairing._tcp")) {
-            uuid = "WIFIPAIR-"+serviceName.substr(0,serviceName.find("."));
-            macAddr = {};
-            if (devmgr->_mux->have_wifi_device_with_ip(addrs)) goto error;
-            notifyadd = false;
+    if (!errorCode && address) {
+        std::string ipaddr;
+        ipaddr.resize(INET6_ADDRSTRLEN+1);
+        if (address->sa_family == AF_INET6) {
+            ipaddr = inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)address)->sin6_addr), ipaddr.data(), (socklen_t)ipaddr.size());
         }else{
-            try{
-                uuid = sysconf_udid_for_macaddr(macAddr);
-            }catch (tihmstar::exception &e){
-                creterror("failed to find uuid for mac=%s with error=%d (%s)",macAddr.c_str(),e.code(),e.what());
-            }
-            if (devmgr->_mux->have_wifi_device_with_mac(macAddr)) goto error;
-            devmgr->_mux->delete_wifi_pairing_device_with_ip(addrs);
-            notifyadd = true;
-        }
-    
-        {
-            std::shared_ptr<WIFIDevice> dev = nullptr;
-            try{
-                dev = std::make_shared<WIFIDevice>(devmgr->_mux, devmgr, uuid, addrs, serviceName, interfaceIndex);
-                devmgr->device_add(dev, notifyadd); dev = NULL;
-            } catch (tihmstar::exception &e){
-                creterror("failed to construct device with error=%d (%s)",e.code(),e.what());
-            }
+            ipaddr = inet_ntop(AF_INET, &(((struct sockaddr_in *)address)->sin_addr), ipaddr.data(), (socklen_t)ipaddr.size());
         }
+        pending.addrs.push_back(ipaddr);
+        if (ttl < pending.ttl) pending.ttl = ttl;
     }
-    
-error:
+
     if (!(flags & kDNSServiceFlagsMoreComing)) {
+        if (pending.addrs.size()) {
+            devmgr->_resolved.insert(std::string(WIFIDevice::serviceInstance(pending.serviceName)), pending.serviceName, pending.addrs, interfaceIndex, pending.ttl);
+            devmgr->service_resolved(pending.serviceName, pending.addrs, interfaceIndex);
+        }
         devmgr->_clientAddrs.erase(sdRef);
         DNSServiceRef sdResolv = devmgr->_linkedClients[sdRef];
         devmgr->_linkedClients.erase(sdRef);
         devmgr->_removeClients.push_back(sdRef); //idk why, but order is important!
         devmgr->_removeClients.push_back(sdResolv);
     }
-    if (err) {
-        error("getaddr_reply failed with error=%d",err);
-    }
 }
 
 void resolve_reply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceIndex, DNSServiceErrorType errorCode, const char *fullname, const char *hosttarget, uint16_t port, uint16_t txtLen, const unsigned char *txtRecord, void *context) noexcept{
@@ -105,19 +98,15 @@ void resolve_reply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfac
     WIFIDeviceManager *devmgr = (WIFIDeviceManager *)context;
     DNSServiceErrorType res = 0;
     DNSServiceRef resolvClient = NULL;
-    int resolvfd = -1;
 
     cassure(!(res = DNSServiceGetAddrInfo(&resolvClient, 0, kDNSServiceInterfaceIndexAny, kDNSServiceProtocol_IPv4 | kDNSServiceProtocol_IPv6, hosttarget, getaddr_reply, context)));
-    
-    cassure((resolvfd = DNSServiceRefSockFD(resolvClient))>0);
-    devmgr->_pfds.push_back({
-        .fd = resolvfd,
-        .events = POLLIN
-    });
+    try {
+        devmgr->add_resolve_client(resolvClient);
+    } catch (tihmstar::exception &e) {
+        creterror("failed to watch addrinfo client with error=%d (%s)",e.code(),e.what());
+    }
 
-    devmgr->_clientAddrs[resolvClient] = {fullname};
-    
-    devmgr->_resolveClients.push_back(resolvClient);
+    devmgr->_clientAddrs[resolvClient] = {fullname, {}, UINT32_MAX};
     devmgr->_linkedClients[resolvClient] = sdRef;
     
 error:
@@ -131,29 +120,34 @@ void browse_reply(DNSServiceRef sdref, const DNSServiceFlags flags, uint32_t ifI
     DNSServiceErrorType res = 0;
     WIFIDeviceManager *devmgr = (WIFIDeviceManager *)context;
     DNSServiceRef resolvClient = NULL;
-    int resolvfd = -1;
 
-    if (!(flags & kDNSServiceFlagsAdd)) {
-//        debug("ignoring event=%d. We only care about Add events at the moment",flags);
-        return;
-    }
-    
     const char *op = (flags & kDNSServiceFlagsAdd) ? "Add" : "Rmv";
     debug("%s %8X %3d %-20s %-20s %s",
            op, flags, ifIndex, replyDomain, replyType, replyName);
-    
-    cassure(!(res = DNSServiceResolve(&resolvClient, 0, kDNSServiceInterfaceIndexAny, replyName, replyType, replyDomain, resolve_reply, context)));
 
-    cassure((resolvfd = DNSServiceRefSockFD(resolvClient))>0);
-    devmgr->_pfds.push_back({
-        .fd = resolvfd,
-        .events = POLLIN
-    });
+    if (!(flags & kDNSServiceFlagsAdd)) {
+        devmgr->service_removed(escape_instance_name(replyName));
+        return;
+    }
+    {
+        std::string instance = escape_instance_name(replyName);
+        ResolverCache::entry cached;
+        devmgr->service_added(instance);
+        if (devmgr->_resolved.lookup(instance, cached)) {
+            debug("using cached resolve of '%s'",replyName);
+            devmgr->service_resolved(cached.serviceName, cached.addrs, cached.interfaceIndex);
+            return;
+        }
+    }
 
-error:
-    if (resolvClient){
-        devmgr->_resolveClients.push_back(resolvClient);
+    cassure(!(res = DNSServiceResolve(&resolvClient, 0, kDNSServiceInterfaceIndexAny, replyName, replyType, replyDomain, resolve_reply, context)));
+    try {
+        devmgr->add_resolve_client(resolvClient);
+    } catch (tihmstar::exception &e) {
+        creterror("failed to watch resolve client with error=%d (%s)",e.code(),e.what());
     }
+
+error:
     if (err) {
         error("browse_reply failed with error=%d",err);
     }
@@ -162,23 +156,33 @@ error:
 
 #pragma mark WIFIDevice
 
-WIFIDeviceManager::WIFIDeviceManager(Muxer *mux)
-: DeviceManager(mux), _client(NULL), _clientPairing(NULL), _dns_sd_fd(-1), _dns_sd_pairing_fd(-1), _wakePipe{}
+WIFIDeviceManager::WIFIDeviceManager(Muxer *mux, uint32_t removalGraceMs, uint32_t resolveCacheTTL)
+: DeviceManager(mux), _removalGraceMs(removalGraceMs), _resolved(resolveCacheTTL), _client(NULL), _clientPairing(NULL), _dns_sd_fd(-1), _dns_sd_pairing_fd(-1), _wakePipe{-1,-1}
+#ifdef __linux__
+, _epollfd(-1)
+#else
+, _pfdsDirty(true)
+#endif
 {
     int err = 0;
     debug("WIFIDeviceManager mDNS-client");
+#ifdef __linux__
+    retassure((_epollfd = epoll_create1(EPOLL_CLOEXEC)) != -1, "epoll_create1 failed with error=%d (%s)",errno,strerror(errno));
+#endif
+    assure(!pipe(_wakePipe));
+    watch_fd(_wakePipe[0]);
+
     assure(!(err = DNSServiceBrowse(&_client, 0, kDNSServiceInterfaceIndexAny, "_apple-mobdev2._tcp", "", browse_reply, this)));
     assure(!(err = DNSServiceBrowse(&_clientPairing, 0, kDNSServiceInterfaceIndexAny, "_remotepairing-manual-pairing._tcp", "", browse_reply, this)));
 
     assure((_dns_sd_fd = DNSServiceRefSockFD(_client))>0);
-    _pfds.push_back({.fd = _dns_sd_fd, .events = POLLIN});
+    watch_fd(_dns_sd_fd);
+    _fdClients[_dns_sd_fd] = _client;
 
     assure((_dns_sd_pairing_fd = DNSServiceRefSockFD(_clientPairing))>0);
-    _pfds.push_back({.fd = _dns_sd_pairing_fd, .events = POLLIN});
+    watch_fd(_dns_sd_pairing_fd);
+    _fdClients[_dns_sd_pairing_fd] = _clientPairing;
 
-    assure(!pipe(_wakePipe));
-    _pfds.push_back({.fd = _wakePipe[0], .events = POLLIN});
-    
     _devReaperThread = std::thread([this]{
         reaper_runloop();
     });
@@ -200,15 +204,18 @@ WIFIDeviceManager::~WIFIDeviceManager(){
     }
     _reapDevices.kill();
     _devReaperThread.join();
-    {
-        for (auto rc : _resolveClients) 
-            safeFreeCustom(rc, DNSServiceRefDeallocate);
-        _resolveClients.clear();
+    for (auto &rc : _resolveClients) {
+        DNSServiceRefDeallocate(rc.first);
     }
+    _resolveClients.clear();
+    _fdClients.clear();
     safeFreeCustom(_client, DNSServiceRefDeallocate);
     safeFreeCustom(_clientPairing, DNSServiceRefDeallocate);
     safeClose(_wakePipe[0]);
     safeClose(_wakePipe[1]);
+#ifdef __linux__
+    safeClose(_epollfd);
+#endif
 }
 
 void WIFIDeviceManager::device_add(std::shared_ptr<WIFIDevice> dev, bool notify){
@@ -217,57 +224,96 @@ void WIFIDeviceManager::device_add(std::shared_ptr<WIFIDevice> dev, bool notify)
     _mux->add_device(dev, notify);
 }
 
+#pragma mark private
+void WIFIDeviceManager::watch_fd(int fd){
+#ifdef __linux__
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    retassure(!epoll_ctl(_epollfd, EPOLL_CTL_ADD, fd, &ev), "failed to watch fd=%d with error=%d (%s)",fd,errno,strerror(errno));
+#else
+    _pfdsDirty = true;
+#endif
+}
+
+void WIFIDeviceManager::unwatch_fd(int fd) noexcept{
+#ifdef __linux__
+    epoll_ctl(_epollfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    _pfdsDirty = true;
+#endif
+}
+
+void WIFIDeviceManager::add_resolve_client(DNSServiceRef ref){
+    int fd = -1;
+    cleanup([&]{
+        safeFreeCustom(ref, DNSServiceRefDeallocate);
+    });
+    retassure((fd = DNSServiceRefSockFD(ref)) > 0, "failed to get fd of DNSServiceRef");
+    watch_fd(fd);
+    _fdClients[fd] = ref;
+    _resolveClients[ref] = fd;
+    ref = NULL;
+}
+
+void WIFIDeviceManager::remove_resolve_client(DNSServiceRef ref) noexcept{
+    auto it = _resolveClients.find(ref);
+    if (it == _resolveClients.end()) return; //already gone
+    unwatch_fd(it->second);
+    _fdClients.erase(it->second);
+    _resolveClients.erase(it);
+    DNSServiceRefDeallocate(ref);
+}
+
 bool WIFIDeviceManager::loopEvent(){
-    int res = 0;
-    res = poll(_pfds.data(), (int)_pfds.size(), -1);
-    if (res > 0){
-        cleanup([&]{
-            for (auto &rc : _removeClients) {
-                const auto target = std::remove(_resolveClients.begin(), _resolveClients.end(), rc);
-                if (target != _resolveClients.end()){
-                    DNSServiceRef tgt = *target;
-                    _resolveClients.erase(target, _resolveClients.end());
-                    DNSServiceRefDeallocate(tgt);
-                }
-            }
-            _removeClients.clear();
-            _pfds.clear();
-            {
-                _pfds.push_back({.fd = _dns_sd_fd, .events = POLLIN});
-                _pfds.push_back({.fd = _dns_sd_pairing_fd, .events = POLLIN});
-                _pfds.push_back({.fd = _wakePipe[0], .events = POLLIN});
-            }
-            for (auto c : _resolveClients) {
-                int cfd = DNSServiceRefSockFD(c);
-                if (cfd != -1){
-                    _pfds.push_back({.fd = cfd, .events = POLLIN});
-                }else{
-                    _removeClients.push_back(c);
-                }
-            }
-        });
-        DNSServiceErrorType err = 0;
-        auto cpy_pfds = _pfds;
-        for (auto pfd : cpy_pfds) {
-            if (pfd.revents & POLLIN) {
-                pfd.revents &= ~POLLIN;
-                if (pfd.fd == DNSServiceRefSockFD(_client)) {
-                    assure(!(err |= DNSServiceProcessResult(_client)));
-                }else if (pfd.fd == DNSServiceRefSockFD(_clientPairing)) {
-                    assure(!(err |= DNSServiceProcessResult(_clientPairing)));
-                }else{
-                    for (auto rc : _resolveClients) {
-                        int rcfd = DNSServiceRefSockFD(rc);
-                        if (rcfd == pfd.fd) {
-                            assure(!(err |= DNSServiceProcessResult(rc)));
-                            break;
-                        }
-                    }
-                }
-            }
+    int timeout = expire_removals();
+    cleanup([&]{
+        for (auto rc : _removeClients) {
+            remove_resolve_client(rc);
+        }
+        _removeClients.clear();
+    });
+
+    _readyFds.clear();
+#ifdef __linux__
+    {
+        struct epoll_event events[maxEvents];
+        int res = epoll_wait(_epollfd, events, maxEvents, timeout);
+        if (res == -1) {
+            retassure(errno == EINTR, "epoll_wait failed with error=%d (%s)",errno,strerror(errno));
+            return true;
+        }
+        for (int i = 0; i < res; i++) {
+            _readyFds.push_back(events[i].data.fd);
+        }
+    }
+#else
+    if (_pfdsDirty) {
+        _pfds.clear();
+        _pfds.push_back({.fd = _wakePipe[0], .events = POLLIN});
+        for (auto &c : _fdClients) {
+            _pfds.push_back({.fd = c.first, .events = POLLIN});
+        }
+        _pfdsDirty = false;
+    }
+    if (poll(_pfds.data(), (nfds_t)_pfds.size(), timeout) == -1) {
+        retassure(errno == EINTR, "poll failed with error=%d (%s)",errno,strerror(errno));
+        return true;
+    }
+    for (auto &pfd : _pfds) {
+        if (pfd.revents) _readyFds.push_back(pfd.fd);
+    }
+#endif
+
+    for (int fd : _readyFds) {
+        if (fd == _wakePipe[0]) {
+            char buf[0x10];
+            if (read(_wakePipe[0], buf, sizeof(buf)) <= 0) return false; //we are being stopped
+            continue;
         }
-    }else if (res != 0){
-        reterror("poll() returned %d errno %d %s\n", res, errno, strerror(errno));
+        auto c = _fdClients.find(fd);
+        if (c == _fdClients.end()) continue;
+        assure(!DNSServiceProcessResult(c->second));
     }
     return true;
 }
@@ -289,4 +335,74 @@ void WIFIDeviceManager::reaper_runloop(){
     }
 }
 
+void WIFIDeviceManager::service_resolved(const std::string &serviceName, const std::vector<std::string> &addrs, uint32_t interfaceIndex) noexcept{
+    bool notifyadd = true;
+    std::string macAddr{serviceName.substr(0,serviceName.find("@"))};
+    std::string uuid;
+    if (strstr(serviceName.c_str(), "_remotepairing-manual-pairing._tcp")) {
+        uuid = "WIFIPAIR-"+serviceName.substr(0,serviceName.find("."));
+        if (_mux->have_wifi_device_with_ip(addrs)) return;
+        notifyadd = false;
+    }else{
+        try{
+            uuid = sysconf_udid_for_macaddr(macAddr);
+        }catch (tihmstar::exception &e){
+            error("failed to find uuid for mac=%s with error=%d (%s)",macAddr.c_str(),e.code(),e.what());
+            return;
+        }
+        if (_mux->have_wifi_device_with_mac(macAddr)) return;
+        _mux->delete_wifi_pairing_device_with_ip(addrs);
+    }
+
+    try{
+        device_add(std::make_shared<WIFIDevice>(_mux, this, uuid, addrs, serviceName, interfaceIndex), notifyadd);
+    } catch (tihmstar::exception &e){
+        error("failed to construct device with error=%d (%s)",e.code(),e.what());
+    }
+}
+
+void WIFIDeviceManager::service_added(const std::string &instance) noexcept{
+    _advertised[instance]++;
+    if (_pendingRemovals.erase(instance)) {
+        debug("WiFi service '%s' came back within grace period",instance.c_str());
+    }
+}
+
+void WIFIDeviceManager::service_removed(const std::string &instance) noexcept{
+    auto it = _advertised.find(instance);
+    if (it != _advertised.end()) {
+        if (--it->second > 0) return; //still announced on another interface
+        _advertised.erase(it);
+    }
+    _pendingRemovals[instance] = std::chrono::steady_clock::now() + std::chrono::milliseconds(_removalGraceMs);
+}
+
+int WIFIDeviceManager::expire_removals() noexcept{
+    auto now = std::chrono::steady_clock::now();
+    int64_t next = -1;
+    for (auto it = _pendingRemovals.begin(); it != _pendingRemovals.end();) {
+        if (it->second > now) {
+            //round up, so we don't wake up right before the deadline
+            int64_t left = std::chrono::duration_cast<std::chrono::milliseconds>(it->second - now).count() + 1;
+            if (next == -1 || left < next) next = left;
+            ++it;
+            continue;
+        }
+        std::string_view mac{it->first};
+        mac = mac.substr(0,mac.find("@"));
+        bool superseded = false;
+        for (auto &a : _advertised) {
+            if (std::string_view(a.first).substr(0,a.first.find("@")) == mac) {
+                superseded = true; //device re-announced itself under a new instance
+                break;
+            }
+        }
+        if (!superseded && _mux->kill_wifi_device_with_service(it->first)) {
+            info("WiFi service '%s' went away, removing device",it->first.c_str());
+        }
+        it = _pendingRemovals.erase(it);
+    }
+    return (int)next;
+}
+
 #endif //HAVE_WIFI_MDNS
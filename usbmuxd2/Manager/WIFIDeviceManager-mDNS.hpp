@@ -11,13 +11,18 @@
 
 #include "../Muxer.hpp"
 #include "DeviceManager.hpp"
+#include "ResolverCache.hpp"
 #include "../Devices/WIFIDevice.hpp"
 
 #include <libgeneral/DeliveryEvent.hpp>
 
+#include <chrono>
 #include <map>
+#include <unordered_map>
 
-#include <poll.h>
+#ifndef __linux__
+#   include <poll.h>
+#endif
 
 extern "C"{
     typedef uint32_t DNSServiceFlags;
@@ -94,30 +99,67 @@ extern "C"{
 };
 
 class WIFIDeviceManager : public DeviceManager{
+public:
+    static constexpr int maxEvents = 64;
 private:
     std::set<WIFIDevice *> _children;  //raw ptr to shared objec
     std::mutex _childrenLck;
     tihmstar::Event _childrenEvent;
     std::thread _devReaperThread;
     tihmstar::DeliveryEvent<std::shared_ptr<WIFIDevice>> _reapDevices;
+
+    /*
+        Services are keyed by instance name. A service is considered gone once every interface withdrew it,
+        its device is killed when the service didn't come back within the grace period.
+     */
+    uint32_t _removalGraceMs;
+    std::map<std::string, int> _advertised; //instance -> number of announcements
+    std::map<std::string, std::chrono::steady_clock::time_point> _pendingRemovals;
+    ResolverCache _resolved;
     
     DNSServiceRef _client;
     DNSServiceRef _clientPairing;
     int _dns_sd_fd;
     int _dns_sd_pairing_fd;
     int _wakePipe[2];
-    std::vector<DNSServiceRef> _resolveClients;
-    std::vector<DNSServiceRef> _removeClients;
-    std::vector<struct pollfd> _pfds;
-    std::map<DNSServiceRef, DNSServiceRef> _linkedClients;
-    std::map<DNSServiceRef, std::vector<std::string>> _clientAddrs;
+    std::unordered_map<int, DNSServiceRef> _fdClients;       //every watched socket, including both browse clients
+    std::unordered_map<DNSServiceRef, int> _resolveClients;  //owned, mapped to their socket
+    std::vector<DNSServiceRef> _removeClients;               //released once the current events are handled
+    std::unordered_map<DNSServiceRef, DNSServiceRef> _linkedClients;
+    struct pending_addrinfo{
+        std::string serviceName;
+        std::vector<std::string> addrs;
+        uint32_t ttl; //lowest of all records
+    };
+    std::unordered_map<DNSServiceRef, pending_addrinfo> _clientAddrs;
+    std::vector<int> _readyFds;
+#ifdef __linux__
+    int _epollfd;
+#else
+    std::vector<struct pollfd> _pfds; //rebuilt from _fdClients when it changed
+    bool _pfdsDirty;
+#endif
 
     virtual bool loopEvent() override;
     virtual void stopAction() noexcept override;
 
     void reaper_runloop();
+    void watch_fd(int fd);
+    void unwatch_fd(int fd) noexcept;
+    /*
+        Takes ownership of ref.
+     */
+    void add_resolve_client(DNSServiceRef ref);
+    void remove_resolve_client(DNSServiceRef ref) noexcept;
+    void service_added(const std::string &instance) noexcept;
+    void service_removed(const std::string &instance) noexcept;
+    void service_resolved(const std::string &serviceName, const std::vector<std::string> &addrs, uint32_t interfaceIndex) noexcept;
+    /*
+        Kills devices whose grace period ran out, returns ms until the next one is due or -1.
+     */
+    int expire_removals() noexcept;
 public:
-    WIFIDeviceManager(Muxer *mux);
+    WIFIDeviceManager(Muxer *mux, uint32_t removalGraceMs, uint32_t resolveCacheTTL);
     virtual ~WIFIDeviceManager() override;
         
     void device_add(std::shared_ptr<WIFIDevice> dev, bool notify = true);
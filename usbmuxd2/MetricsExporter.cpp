@@ -0,0 +1,399 @@
+//
+//  MetricsExporter.cpp
+//  usbmuxd2
+//
+
+#include "MetricsExporter.hpp"
+#include "LatencyHistogram.hpp"
+#include "Muxer.hpp"
+#include "Client.hpp"
+#include "TCP.hpp"
+#include "Relay.hpp"
+#include "Devices/USBDevice.hpp"
+#include "Manager/ClientManager.hpp"
+#include "sysconf/PreflightPool.hpp"
+#include <libgeneral/macros.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <vector>
+
+#define METRICS_BACKLOG 16
+#define METRICS_IO_TIMEOUT 1 //seconds a scraper may take to send its request or read the reply
+#define METRICS_MAX_REQUEST 0x1000
+
+static const char *tcpStates[] = {"Connecting", "Connected", "Refused", "Dying"};
+#define TCP_STATES_CNT (sizeof(tcpStates)/sizeof(*tcpStates))
+
+struct devmetrics{
+    std::string labels;
+    std::shared_ptr<USBDevice> dev;
+    USBDevice::usbstats stats;
+    uint64_t conns[TCP_STATES_CNT];
+};
+
+static const struct{
+    const char *name;
+    const char *help;
+    uint64_t USBDevice::usbstats::*field;
+} deviceCounters[] = {
+    {"usbmuxd_device_received_bytes",       "Bytes received from the device.",                          &USBDevice::usbstats::rxBytes},
+    {"usbmuxd_device_sent_bytes",           "Bytes sent to the device.",                                &USBDevice::usbstats::txBytes},
+    {"usbmuxd_device_received_packets",     "Mux packets received from the device.",                    &USBDevice::usbstats::rxPackets},
+    {"usbmuxd_device_sent_packets",         "Mux packets sent to the device.",                          &USBDevice::usbstats::txPackets},
+    {"usbmuxd_device_split_reassemblies",   "Mux packets which arrived split over several transfers.",  &USBDevice::usbstats::splitReassemblies},
+    {"usbmuxd_device_duplicate_packets",    "Mux v2 packets discarded as duplicates.",                  &USBDevice::usbstats::duplicates},
+};
+
+static const struct{
+    const char *name;
+    const char *help;
+    LatencyHistogram USBDevice::latencies::*hist;
+} deviceLatencies[] = {
+    {"usbmuxd_tcp_connect_latency_seconds",           "Time from SYN until the device accepted the connection.",             &USBDevice::latencies::connect},
+    {"usbmuxd_device_rx_to_client_latency_seconds",   "Time from USB IN transfer completion until the payload was sent to the client.", &USBDevice::latencies::rxToClient},
+    {"usbmuxd_device_client_to_usb_latency_seconds",  "Time from receiving client data until it was submitted to the device.", &USBDevice::latencies::clientToUSB},
+    {"usbmuxd_device_tx_completion_latency_seconds",  "Time from USB OUT transfer submission until it completed.",          &USBDevice::latencies::txCompletion},
+};
+
+#pragma mark helpers
+static std::string escape_label(const char *str){
+    std::string ret;
+    if (!str) return ret;
+    for (; *str; str++) {
+        switch (*str) {
+            case '\\':
+                ret += "\\\\";
+                break;
+            case '"':
+                ret += "\\\"";
+                break;
+            case '\n':
+                ret += "\\n";
+                break;
+            default:
+                ret += *str;
+                break;
+        }
+    }
+    return ret;
+}
+
+static void write_family(std::string &out, const char *name, const char *type, const char *unit, const char *help){
+    out += "# TYPE "; out += name; out += " "; out += type; out += "\n";
+    if (unit) {
+        out += "# UNIT "; out += name; out += " "; out += unit; out += "\n";
+    }
+    out += "# HELP "; out += name; out += " "; out += help; out += "\n";
+}
+
+static void write_sample(std::string &out, const char *name, const char *suffix, const std::string &labels, uint64_t val){
+    char buf[0x20] = {};
+    out += name;
+    if (suffix) out += suffix;
+    if (labels.size()) {
+        out += "{"; out += labels; out += "}";
+    }
+    snprintf(buf, sizeof(buf), " %" PRIu64 "\n", val);
+    out += buf;
+}
+
+static bool write_all(int fd, const char *buf, size_t len) noexcept{
+    while (len) {
+        ssize_t didWrite = write(fd, buf, len);
+        if (didWrite <= 0) {
+            if (didWrite < 0 && errno == EINTR) continue;
+            return false;
+        }
+        buf += didWrite;
+        len -= didWrite;
+    }
+    return true;
+}
+
+#pragma mark MetricsExporter
+MetricsExporter::MetricsExporter(Muxer *mux, const char *listenOn)
+: _mux(mux), _listenfd(-1), _wakePipe{-1,-1}
+{
+    bool isPort = *listenOn != '\0';
+    for (const char *c = listenOn; *c; c++) {
+        if (*c < '0' || *c > '9') isPort = false;
+    }
+
+    if (isPort) {
+        struct sockaddr_in bind_addr = {};
+        int port = atoi(listenOn);
+        int one = 1;
+        retassure(port > 0 && port <= 0xffff, "invalid metrics port '%s'", listenOn);
+        retassure((_listenfd = socket(AF_INET, SOCK_STREAM, 0)) >= 0, "socket() failed: %s", strerror(errno));
+        setsockopt(_listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        bind_addr.sin_family = AF_INET;
+        bind_addr.sin_port = htons(port);
+        bind_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); //never expose the counters to the network
+        retassure(!bind(_listenfd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)), "bind() to 127.0.0.1:%d failed: %s", port, strerror(errno));
+    }else{
+        struct sockaddr_un bind_addr = {};
+        retassure(strlen(listenOn) < sizeof(bind_addr.sun_path), "socket path '%s' is too long", listenOn);
+        retassure(unlink(listenOn) != -1 || errno == ENOENT, "unlink(%s) failed: %s", listenOn, strerror(errno));
+        retassure((_listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0, "socket() failed: %s", strerror(errno));
+        bind_addr.sun_family = AF_UNIX;
+        strcpy(bind_addr.sun_path, listenOn);
+        retassure(!bind(_listenfd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)), "bind() failed: %s", strerror(errno));
+        _unixPath = listenOn;
+        assure(!chmod(listenOn, 0666));
+    }
+    retassure(!listen(_listenfd, METRICS_BACKLOG), "listen() failed: %s", strerror(errno));
+    fcntl(_listenfd, F_SETFL, fcntl(_listenfd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(_listenfd, F_SETFD, FD_CLOEXEC);
+    assure(!pipe(_wakePipe));
+    info("[MetricsExporter] serving metrics on %s%s", isPort ? "127.0.0.1:" : "", listenOn);
+}
+
+MetricsExporter::~MetricsExporter(){
+    stopLoop();
+    safeClose(_listenfd);
+    safeClose(_wakePipe[0]);
+    safeClose(_wakePipe[1]);
+    if (_unixPath.size()) unlink(_unixPath.c_str());
+}
+
+#pragma mark private
+void MetricsExporter::stopAction() noexcept{
+    safeClose(_wakePipe[1]);
+}
+
+bool MetricsExporter::loopEvent(){
+    int cfd = -1;
+    struct pollfd pfd[2] = {
+        {
+            .fd = _listenfd,
+            .events = POLLIN
+        },
+        {
+            .fd = _wakePipe[0],
+            .events = POLLIN
+        }
+    };
+    if (poll(pfd,2,-1) == -1){
+        retassure(errno == EINTR, "[MetricsExporter] poll failed errno=%d (%s)",errno,strerror(errno));
+        return true;
+    }
+    retassure(!(pfd[1].revents & POLLHUP), "graceful kill requested");
+    if (!(pfd[0].revents & POLLIN)) return true;
+
+    if ((cfd = accept(_listenfd, NULL, NULL)) == -1) return true; //scraper gave up already
+    //accepted sockets inherit O_NONBLOCK from the listening socket on BSD
+    fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL, 0) & ~O_NONBLOCK);
+    fcntl(cfd, F_SETFD, FD_CLOEXEC);
+    serve(cfd);
+    return true;
+}
+
+void MetricsExporter::serve(int cfd) noexcept{
+    cleanup([&]{
+        safeClose(cfd);
+    });
+    char req[METRICS_MAX_REQUEST+1] = {};
+    size_t reqLen = 0;
+    const char *status = "200 OK";
+    std::string body;
+    std::string rsp;
+
+    {
+        struct timeval tv = {.tv_sec = METRICS_IO_TIMEOUT};
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    //we only care about the request line, but read the whole header so the scraper doesn't see a reset
+    while (reqLen < METRICS_MAX_REQUEST && !strstr(req, "\r\n\r\n")) {
+        ssize_t didRead = read(cfd, req+reqLen, METRICS_MAX_REQUEST-reqLen);
+        if (didRead <= 0) {
+            if (didRead < 0 && errno == EINTR) continue;
+            return;
+        }
+        reqLen += didRead;
+        req[reqLen] = '\0';
+    }
+
+    try {
+        if (strncmp(req, "GET ", 4)) {
+            status = "405 Method Not Allowed";
+        }else if (strncmp(req+4, "/metrics", 8) && strncmp(req+4, "/ ", 2)) {
+            status = "404 Not Found";
+        }else{
+            write_metrics(body);
+        }
+    } catch (...) {
+        error("[MetricsExporter] failed to collect metrics");
+        status = "500 Internal Server Error";
+        body.clear();
+    }
+
+    try {
+        char buf[0x100] = {};
+        snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\n"
+                 "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n", status, body.size());
+        rsp = buf;
+        rsp += body;
+    } catch (...) {
+        return;
+    }
+    if (!write_all(cfd, rsp.data(), rsp.size())) {
+        debug("[MetricsExporter] scraper went away before reading the reply");
+    }
+}
+
+void MetricsExporter::write_metrics(std::string &out){
+    std::vector<devmetrics> devs;
+    uint64_t usbCnt = 0;
+    uint64_t wifiCnt = 0;
+
+    {
+        //the snapshot stays valid no matter what happens to the registry meanwhile
+        std::shared_ptr<const DeviceRegistry> devices = _mux->_devices.get();
+        for (auto &d : *devices) {
+            if (d.second->getConnType() != Device::MUXCONN_USB) {
+                wifiCnt++;
+                continue;
+            }
+            usbCnt++;
+            devmetrics m{};
+            m.dev = std::static_pointer_cast<USBDevice>(d.second);
+            m.labels = "device=\"" + std::to_string(d.first) + "\",serial=\"" + escape_label(m.dev->getSerial()) + "\"";
+            m.stats = m.dev->getStats();
+            for (auto &c : m.dev->getConnections()) {
+                const TCP::tcpstats cstats = c->getStats();
+                for (size_t i = 0; i < TCP_STATES_CNT; i++) {
+                    if (!strcmp(cstats.state, tcpStates[i])) m.conns[i]++;
+                }
+            }
+            devs.push_back(m);
+        }
+    }
+
+    write_family(out, "usbmuxd_devices", "gauge", NULL, "Attached devices by connection type.");
+    write_sample(out, "usbmuxd_devices", NULL, "type=\"usb\"", usbCnt);
+    write_sample(out, "usbmuxd_devices", NULL, "type=\"network\"", wifiCnt);
+
+    for (auto &c : deviceCounters) {
+        write_family(out, c.name, "counter", strstr(c.name, "_bytes") ? "bytes" : NULL, c.help);
+        for (auto &d : devs) {
+            write_sample(out, c.name, "_total", d.labels, d.stats.*c.field);
+        }
+    }
+
+    write_family(out, "usbmuxd_device_transfers_in_flight", "gauge", NULL, "USB transfers currently submitted to the device.");
+    for (auto &d : devs) {
+        write_sample(out, "usbmuxd_device_transfers_in_flight", NULL, d.labels + ",direction=\"rx\"", d.stats.rxInFlight);
+        write_sample(out, "usbmuxd_device_transfers_in_flight", NULL, d.labels + ",direction=\"tx\"", d.stats.txInFlight);
+    }
+
+    write_family(out, "usbmuxd_tcp_connections", "gauge", NULL, "TCP connections to the device by state.");
+    for (auto &d : devs) {
+        for (size_t i = 0; i < TCP_STATES_CNT; i++) {
+            write_sample(out, "usbmuxd_tcp_connections", NULL, d.labels + ",state=\"" + tcpStates[i] + "\"", d.conns[i]);
+        }
+    }
+
+    for (auto &l : deviceLatencies) {
+        write_family(out, l.name, "histogram", "seconds", l.help);
+        for (auto &d : devs) {
+            write_histogram(out, l.name, d.labels, d.dev->getLatencies().*l.hist);
+        }
+    }
+
+    {
+        std::shared_ptr<const std::set<std::shared_ptr<Client>>> clients = _mux->_clients.get();
+        uint64_t listening = 0;
+        for (auto &c : *clients) {
+            if (c->_isListening) listening++;
+        }
+        write_family(out, "usbmuxd_clients", "gauge", NULL, "Connected clients.");
+        write_sample(out, "usbmuxd_clients", NULL, "", clients->size());
+        write_family(out, "usbmuxd_listening_clients", "gauge", NULL, "Clients subscribed to device notifications.");
+        write_sample(out, "usbmuxd_listening_clients", NULL, "", listening);
+
+        write_family(out, "usbmuxd_client_notification_queue_depth", "gauge", NULL, "Notifications waiting to be sent to a listening client.");
+        for (auto &c : *clients) {
+            if (!c->_isListening) continue;
+            const Client::notifystats nstats = c->getNotifyStats();
+            write_sample(out, "usbmuxd_client_notification_queue_depth", NULL,
+                         "client=\"" + std::to_string(c->_number) + "\",prog=\"" + escape_label(c->getClientInfo().progName.c_str()) + "\"", nstats.depth);
+        }
+    }
+
+    if (_mux->_climgr) {
+        const ClientManager::acceptstats stats = _mux->_climgr->getAcceptStats();
+        write_family(out, "usbmuxd_accepted_clients", "counter", NULL, "Client connections accepted.");
+        write_sample(out, "usbmuxd_accepted_clients", "_total", "", stats.accepted);
+        write_family(out, "usbmuxd_accept_errors", "counter", NULL, "Failed accept() calls.");
+        write_sample(out, "usbmuxd_accept_errors", "_total", "", stats.acceptErrors);
+        write_family(out, "usbmuxd_accept_latency_seconds", "histogram", "seconds", "Time from poll wakeup until a client was handed to the muxer.");
+        write_histogram(out, "usbmuxd_accept_latency_seconds", "", _mux->_climgr->getAcceptLatency());
+    }
+
+    if (_mux->_preflight) {
+        const PreflightPool::preflightstats stats = _mux->_preflight->getStats();
+        write_family(out, "usbmuxd_preflights", "counter", NULL, "Preflights by outcome.");
+        write_sample(out, "usbmuxd_preflights", "_total", "result=\"completed\"", stats.completed);
+        write_sample(out, "usbmuxd_preflights", "_total", "result=\"failed\"", stats.failed);
+        write_sample(out, "usbmuxd_preflights", "_total", "result=\"cancelled\"", stats.cancelled);
+        write_sample(out, "usbmuxd_preflights", "_total", "result=\"deduped\"", stats.deduped);
+        write_family(out, "usbmuxd_preflight_duration_seconds", "histogram", "seconds", "Time from queueing a preflight until it completed or failed.");
+        write_histogram(out, "usbmuxd_preflight_duration_seconds", "", _mux->_preflight->getDurations());
+    }
+
+    if (_mux->_relay) {
+        const Relay::relaystats stats = _mux->_relay->getStats();
+        write_family(out, "usbmuxd_relay_connections_opened", "counter", NULL, "Connections to network devices opened by the relay.");
+        write_sample(out, "usbmuxd_relay_connections_opened", "_total", "", stats.opened);
+        write_family(out, "usbmuxd_relay_connections_closed", "counter", NULL, "Connections to network devices closed by the relay.");
+        write_sample(out, "usbmuxd_relay_connections_closed", "_total", "", stats.closed);
+        write_family(out, "usbmuxd_relay_bytes", "counter", "bytes", "Bytes relayed between clients and network devices.");
+        write_sample(out, "usbmuxd_relay_bytes", "_total", "", stats.bytes);
+        write_family(out, "usbmuxd_relay_wakeups", "counter", NULL, "Times the relay thread returned from poll().");
+        write_sample(out, "usbmuxd_relay_wakeups", "_total", "", stats.wakeups);
+    }
+
+    out += "# EOF\n";
+}
+
+#pragma mark static
+void MetricsExporter::write_histogram(std::string &out, const char *name, const std::string &labels, const LatencyHistogram &hist){
+    /*
+        Power of two bounds line up with the histogram's buckets, so every count is exact.
+        le is inclusive in OpenMetrics while the counts are for values below the bound,
+        which is 1ns off and irrelevant at these scales.
+     */
+    constexpr int minBucketBits = 10; //~1us
+    constexpr int maxBucketBits = 36; //~69s
+    const LatencyHistogram::snapshot snap = hist.getSnapshot();
+    const std::string prefix = labels.size() ? labels + "," : "";
+    char buf[0x40] = {};
+
+    for (int i = minBucketBits; i <= maxBucketBits; i++) {
+        snprintf(buf, sizeof(buf), "le=\"%.9g\"", (double)(1ULL << i) / 1e9);
+        write_sample(out, name, "_bucket", prefix + buf, snap.countBelow(1ULL << i));
+    }
+    write_sample(out, name, "_bucket", prefix + "le=\"+Inf\"", snap.count);
+    write_sample(out, name, "_count", labels, snap.count);
+    out += name; out += "_sum";
+    if (labels.size()) {
+        out += "{"; out += labels; out += "}";
+    }
+    snprintf(buf, sizeof(buf), " %.9g\n", (double)snap.sum / 1e9);
+    out += buf;
+}
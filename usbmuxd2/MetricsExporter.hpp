@@ -0,0 +1,44 @@
+//
+//  MetricsExporter.hpp
+//  usbmuxd2
+//
+
+#ifndef MetricsExporter_hpp
+#define MetricsExporter_hpp
+
+#include <libgeneral/Manager.hpp>
+
+#include <stdint.h>
+#include <string>
+
+class Muxer;
+class LatencyHistogram;
+
+/*
+    Serves the daemon's counters as OpenMetrics text over plain HTTP for Prometheus style scrapers.
+    Scrapes are answered one at a time on the exporter's own thread and only read
+    snapshots and atomic counters, so they never hold up devices or clients.
+ */
+class MetricsExporter : public tihmstar::Manager{
+    Muxer *_mux; //not owned
+    int _listenfd;
+    int _wakePipe[2];
+    std::string _unixPath; //empty when listening on TCP
+
+    virtual void stopAction() noexcept override;
+    virtual bool loopEvent() override;
+
+    void serve(int cfd) noexcept;
+    void write_metrics(std::string &out);
+
+    static void write_histogram(std::string &out, const char *name, const std::string &labels, const LatencyHistogram &hist);
+public:
+    /*
+        listenOn is either a port number, which is bound on 127.0.0.1 only, or the path of a unix socket.
+     */
+    MetricsExporter(Muxer *mux, const char *listenOn);
+    MetricsExporter(const MetricsExporter &) = delete;
+    virtual ~MetricsExporter() override;
+};
+
+#endif /* MetricsExporter_hpp */
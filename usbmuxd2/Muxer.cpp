@@ -10,12 +10,18 @@
 #include "Manager/USBDeviceManager.hpp"
 #include "Manager/ClientManager.hpp"
 #include "Client.hpp"
+#include "TCP.hpp"
+#include "Relay.hpp"
+#include "MetricsExporter.hpp"
+#include "sysconf/PreflightPool.hpp"
 #include "sysconf/preflight.hpp"
+#include "sysconf/sysconf.hpp"
 
 #include <libgeneral/macros.h>
 
 #ifdef HAVE_LIBIMOBILEDEVICE
 #   include "Devices/WIFIDevice.hpp"
+#   include "Devices/HeartbeatLoop.hpp"
 #endif //HAVE_LIBIMOBILEDEVICE
 
 #ifdef HAVE_WIFI_AVAHI
@@ -30,89 +36,121 @@
 #include <algorithm>
 #include <string.h>
 
-#define MAXID (INT_MAX/2)
-#define INVALID_ID (MAXID + 1)
-
-Muxer::Muxer(bool doPreflight, bool allowHeartlessWifi)
+Muxer::Muxer(const Config *config)
 : _climgr(nullptr), _usbdevmgr(nullptr), _wifidevmgr(nullptr)
-, _doPreflight(doPreflight), _allowHeartlessWifi(allowHeartlessWifi)
-, _newid(1)
+, _preflight(nullptr), _relay(nullptr), _heartbeats(nullptr), _metrics(nullptr)
+, _doPreflight(config->doPreflight), _allowHeartlessWifi(config->allowHeartlessWifi), _wifiRemovalGrace(config->wifiRemovalGrace)
+, _wifiResolveCacheTTL(config->wifiResolveCacheTTL)
+, _ids(config->deviceIDReuseDelay)
 {
-    info("Starting Muxer: preflight=%s allowHeartlessWifi=%s", doPreflight ? "YES" : "NO"
-                                                             , allowHeartlessWifi ? "YES" : "NO");
+    info("Starting Muxer: preflight=%s allowHeartlessWifi=%s idReuseDelay=%us", _doPreflight ? "YES" : "NO"
+                                                             , _allowHeartlessWifi ? "YES" : "NO"
+                                                             , config->deviceIDReuseDelay);
+#ifdef HAVE_LIBIMOBILEDEVICE
+    if (_doPreflight) {
+        preflight_set_verified_session_ttl(config->preflightSessionCacheTTL);
+        _preflight = new PreflightPool(config->preflightWorkers);
+    }
+#endif //HAVE_LIBIMOBILEDEVICE
 }
 
 Muxer::~Muxer(){
+    safeDelete(_metrics);
     safeDelete(_climgr);
     safeDelete(_usbdevmgr);
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
     safeDelete(_wifidevmgr);
+    safeDelete(_heartbeats);
 #endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+    safeDelete(_relay);
+    safeDelete(_preflight);
 }
 
 #pragma mark Managers
-void Muxer::spawnClientManager(){
+void Muxer::spawnClientManager(int listenBacklog, const char *socketPath){
     assure(!_climgr);
-    _climgr = new ClientManager(this);
+    _climgr = new ClientManager(this, listenBacklog, socketPath);
     _climgr->startLoop();
 }
-void Muxer::spawnUSBDeviceManager(){
+void Muxer::spawnUSBDeviceManager(const SimUSBTransport::params *simulate){
     assure(!_usbdevmgr);
-    _usbdevmgr = new USBDeviceManager(this);
+    _usbdevmgr = new USBDeviceManager(this, simulate);
     _usbdevmgr->startLoop();
 }
 
 void Muxer::spawnWIFIDeviceManager(){
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
     assure(!_wifidevmgr);
-    _wifidevmgr = new WIFIDeviceManager(this);
+    if (!_relay) {
+        _relay = new Relay();
+        _relay->startLoop();
+    }
+    if (!_heartbeats) {
+        _heartbeats = new HeartbeatLoop();
+        _heartbeats->startLoop();
+    }
+    _wifidevmgr = new WIFIDeviceManager(this, _wifiRemovalGrace, _wifiResolveCacheTTL);
     _wifidevmgr->startLoop();
 #else
     reterror("Compiled without wifi support");
 #endif
 }
 
+void Muxer::spawnMetricsExporter(const char *listenOn){
+    assure(!_metrics);
+    _metrics = new MetricsExporter(this, listenOn);
+    _metrics->startLoop();
+}
+
 bool Muxer::hasDeviceManager() noexcept{
     return !!_usbdevmgr || !!_wifidevmgr;
 }
 
+void Muxer::simulate_usb_hotplug(int num, bool arrived){
+    retassure(_usbdevmgr, "no USBDeviceManager running");
+    if (arrived) {
+        _usbdevmgr->sim_attach(num);
+    }else{
+        _usbdevmgr->sim_detach(num);
+    }
+}
+
 #pragma mark Clients
 void Muxer::add_client(std::shared_ptr<Client> cli){
     debug("add_client %d",cli->_fd);
-    _clientsGuard.lockMember();
-    _clients.insert(cli);
+    _clients.update([&](std::set<std::shared_ptr<Client>> &clients){
+        return clients.insert(cli).second;
+    });
     try{
         cli->startLoop();
     }catch(tihmstar::exception &e){
-        _clientsGuard.unlockMember();
         delete_client(cli);
         throw;
     }
-    _clientsGuard.unlockMember();
 }
 
 void Muxer::delete_client(int cli_fd) noexcept{
     debug("delete_client fd %d",cli_fd);
-    _clientsGuard.lockMember();
-    for (auto c : _clients) {
-        if (c->_fd == cli_fd) {
-            _clients.erase(c);
-            _clientsGuard.unlockMember();
-            c->kill();
-            return;
+    std::shared_ptr<Client> cli;
+    _clients.update([&](std::set<std::shared_ptr<Client>> &clients){
+        for (auto c : clients) {
+            if (c->_fd == cli_fd) {
+                cli = c;
+                clients.erase(c);
+                return true;
+            }
         }
-    }
-    _clientsGuard.unlockMember();
+        return false;
+    });
+    if (cli) cli->kill();
 }
 
 void Muxer::delete_client(std::shared_ptr<Client> cli) noexcept{
     debug("delete_client %d",cli->_fd);
-    _clientsGuard.lockMember();
-    if (_clients.erase(cli)) {
-        _clientsGuard.unlockMember();
+    if (_clients.update([&](std::set<std::shared_ptr<Client>> &clients){
+        return clients.erase(cli) != 0;
+    })) {
         cli->kill();
-    }else{
-        _clientsGuard.unlockMember();
     }
 }
 
@@ -120,43 +158,38 @@ void Muxer::delete_client(std::shared_ptr<Client> cli) noexcept{
 void Muxer::add_device(std::shared_ptr<Device> dev, bool notify) noexcept {
     debug("add_device %s",dev->_serial);
 
-    //get id of already connected device but with the other connection type
-    //discard the id-based connection type information
-    dev->_id = id_for_device(dev->_serial, dev->_conntype == Device::MUXCONN_USB ? Device::MUXCONN_WIFI : Device::MUXCONN_USB) & ~1;
-
-    if (!dev->_id){
-        //there can be no device with ID 1 or 0
-        //thus if id is 0 then this is the device's first connection
-        //assign it a fresh ID
-        guardRead(_devicesGuard);
-    retryID:
-        for (auto odev : _devices) {
-            if ((odev->_id >> 1) == _newid) {
-                _newid++;
-                if (_newid>MAXID) {
-                    _newid = 1;
-                    goto retryID;
-                }
+    bool added = _devices.update([&](DeviceRegistry &devices){
+        //get id of already connected device but with the other connection type
+        //discard the id-based connection type information
+        std::shared_ptr<Device> odev = devices.findBySerial(dev->_serial, dev->_conntype == Device::MUXCONN_USB ? Device::MUXCONN_WIFI : Device::MUXCONN_USB);
+        dev->_id = odev ? (odev->_id & ~1) : 0;
+
+        if (!dev->_id){
+            //there can be no device with ID 1 or 0
+            //thus if id is 0 then this is the device's first connection
+            //assign it a fresh ID
+            uint32_t newid = _ids.allocate();
+            if (!newid) {
+                error("Muxer: out of device ids, not adding device %s",dev->_serial);
+                return false;
             }
+            dev->_id = (newid << 1);
         }
-        dev->_id = (_newid << 1);
-    }
-
-    //fixup connection information in ID
-    dev->_id |= (dev->_conntype == Device::MUXCONN_WIFI);
 
-    debug("Muxer: adding device %s assigning id %d",dev->_serial,dev->_id);
+        //fixup connection information in ID
+        dev->_id |= (dev->_conntype == Device::MUXCONN_WIFI);
 
-    {
-        guardWrite(_devicesGuard);
-        _devices.insert(dev);
-    }
+        debug("Muxer: adding device %s assigning id %d",dev->_serial,dev->_id);
+        devices.insert(dev);
+        return true;
+    });
+    if (!added) return;
 
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
     if (dev->_conntype == Device::MUXCONN_WIFI){
         std::shared_ptr<WIFIDevice> wifidev = std::static_pointer_cast<WIFIDevice>(dev);
         try{
-            wifidev->startLoop();
+            wifidev->startHeartbeat(_heartbeats);
         }catch (tihmstar::exception &e){
             error("Failed to start WIFIDevice %s with error=%d (%s)",wifidev->_serial,e.code(),e.what());
             if (!_allowHeartlessWifi){
@@ -167,86 +200,71 @@ void Muxer::add_device(std::shared_ptr<Device> dev, bool notify) noexcept {
     }
 #endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
     
-#ifdef HAVE_LIBIMOBILEDEVICE
-    if (dev->_conntype == Device::MUXCONN_USB && _doPreflight){
-        try {
-            preflight_device(dev->_serial,dev->_id);
-        } catch (tihmstar::exception &e) {
-            warning("Failed to preflight device '%s' with err:\n%s",dev->_serial,e.dumpStr().c_str());
-        }
-    }
-#endif //HAVE_LIBIMOBILEDEVICE
-    
+    //announce right away, preflight happens in the background
     if (notify) notify_device_add(dev);
+
+    if (dev->_conntype == Device::MUXCONN_USB && _preflight){
+        _preflight->enqueue(dev->_serial,dev->_id);
+    }
 }
 
 void Muxer::delete_device(std::shared_ptr<Device> dev) noexcept {
-    {
-        guardWrite(_devicesGuard);
-        _devices.erase(dev);
-    }
+    _devices.update([&](DeviceRegistry &devices){
+        if (!devices.erase(dev)) return false;
+        release_id_if_unused(devices, dev->_id);
+        return true;
+    });
+    cancel_preflight(dev);
+    if (_relay && dev->_conntype == Device::MUXCONN_WIFI) _relay->drop(dev->_id);
     notify_device_remove(dev->_id);
 }
 
 void Muxer::delete_device(uint8_t bus, uint8_t address) noexcept {
-    int devid = INVALID_ID;
-    {
-        guardWrite(_devicesGuard);
-        for (auto dev : _devices){
-            if (dev->_conntype == Device::MUXCONN_USB) {
-                USBDevice *usbdev = (USBDevice*)dev.get();
-                if (usbdev->usb_location() == (((uint16_t)bus << 16) | address)){
-                    devid = dev->_id;
-                    _devices.erase(dev);
-                    break;
-                }
-            }
-        }
+    std::shared_ptr<Device> dev;
+    _devices.update([&](DeviceRegistry &devices){
+        std::shared_ptr<Device> odev = devices.findByUSBLocation(((uint16_t)bus << 16) | address);
+        if (!odev || !devices.erase(odev)) return false;
+        release_id_if_unused(devices, odev->_id);
+        dev = odev;
+        return true;
+    });
+    if (dev) {
+        cancel_preflight(dev);
+        notify_device_remove(dev->_id);
     }
-    if (devid != INVALID_ID) notify_device_remove(devid);
 }
 
 void Muxer::delete_wifi_pairing_device_with_ip(std::vector<std::string> ipaddrs) noexcept{
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
-    guardWrite(_devicesGuard);
-    for (auto dev : _devices){
-        if (dev->_conntype == Device::MUXCONN_WIFI) {
-            WIFIDevice *wifidev = (WIFIDevice*)dev.get();
-            for (auto nip : ipaddrs) {
-                if (strncmp(wifidev->_serial, "WIFIPAIR", sizeof("WIFIPAIR")-1) == 0 &&
-                    std::find(wifidev->_ipaddr.begin(), wifidev->_ipaddr.end(), nip) != wifidev->_ipaddr.end()) {
-                    _devices.erase(dev);
-                    return;
-                }
+    _devices.update([&](DeviceRegistry &devices){
+        for (auto &nip : ipaddrs) {
+            if (std::shared_ptr<Device> dev = devices.findByIPAddr(nip, true)) {
+                if (!devices.erase(dev)) return false;
+                release_id_if_unused(devices, dev->_id);
+                return true;
             }
         }
-    }
+        return false;
+    });
 #endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
 }
 
 bool Muxer::have_usb_device(uint8_t bus, uint8_t address) noexcept {
-    guardRead(_devicesGuard);
-    for (auto dev : _devices){
-        if (dev->_conntype == Device::MUXCONN_USB) {
-            USBDevice *usbdev = (USBDevice*)dev.get();
-            if (usbdev->usb_location() == (((uint16_t)bus << 16) | address)){
-                return true;
-            }
-        }
-    }
-    return false;
+    return _devices.get()->findByUSBLocation(((uint16_t)bus << 16) | address) != nullptr;
 }
 
 bool Muxer::have_wifi_device_with_mac(std::string macaddr) noexcept{
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
-    guardRead(_devicesGuard);
-    for (auto dev : _devices){
-        if (dev->_conntype == Device::MUXCONN_WIFI) {
-            WIFIDevice *wifidev = (WIFIDevice*)dev.get();
-            if (wifidev->_serviceName.substr(0,wifidev->_serviceName.find("@")) == macaddr) {
-                return true;
-            }
-        }
+    if (_devices.get()->findByMacAddr(macaddr)) return true;
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+    return false;
+}
+
+bool Muxer::kill_wifi_device_with_service(std::string_view instance) noexcept{
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+    if (std::shared_ptr<Device> dev = _devices.get()->findByServiceInstance(instance)) {
+        dev->kill();
+        return true;
     }
 #endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
     return false;
@@ -254,16 +272,9 @@ bool Muxer::have_wifi_device_with_mac(std::string macaddr) noexcept{
 
 bool Muxer::have_wifi_device_with_ip(std::vector<std::string> ipaddrs) noexcept{
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
-    guardRead(_devicesGuard);
-    for (auto dev : _devices){
-        if (dev->_conntype == Device::MUXCONN_WIFI) {
-            WIFIDevice *wifidev = (WIFIDevice*)dev.get();
-            for (auto nip : ipaddrs) {
-                if (std::find(wifidev->_ipaddr.begin(), wifidev->_ipaddr.end(), nip) != wifidev->_ipaddr.end()) {
-                    return true;
-                }
-            }
-        }
+    std::shared_ptr<const DeviceRegistry> devices = _devices.get();
+    for (auto &nip : ipaddrs) {
+        if (devices->findByIPAddr(nip)) return true;
     }
 #endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
     return false;
@@ -271,36 +282,30 @@ bool Muxer::have_wifi_device_with_ip(std::vector<std::string> ipaddrs) noexcept{
 
 
 int Muxer::id_for_device(const char *uuid, Device::mux_conn_type type) noexcept {
-    int ret = 0;
-    guardRead(_devicesGuard);
-    for (auto dev : _devices){
-        if (dev->_conntype == type && strcmp(uuid,dev->_serial) == 0) {
-            ret = dev->_id;
-            break;
-        }
+    std::shared_ptr<Device> dev = _devices.get()->findBySerial(uuid, type);
+    return dev ? dev->_id : 0;
+}
+
+void Muxer::release_id_if_unused(const DeviceRegistry &devices, int id) noexcept{
+    //USB and WiFi connection of the same device share an id
+    if (devices.findByID(id & ~1) || devices.findByID(id | 1)) return;
+    _ids.release(id >> 1);
+}
+
+void Muxer::cancel_preflight(std::shared_ptr<Device> dev) noexcept{
+    if (dev->_conntype == Device::MUXCONN_USB && _preflight){
+        _preflight->cancel(dev->_serial, dev->_id);
     }
-    return ret;
 }
 
 size_t Muxer::devices_cnt() noexcept {
-    guardRead(_devicesGuard);
-    return _devices.size();
+    return _devices.get()->size();
 }
 
 #pragma mark Connection
 void Muxer::start_connect(int device_id, uint16_t dport, std::shared_ptr<Client> cli){
     std::shared_ptr<Device> dev;
-    {
-        guardRead(_devicesGuard);
-        for (auto d : _devices) {
-            if (d->_id == device_id) {
-                dev = d;
-                goto found_device;
-            }
-        }
-        reterror("start_connect(%d,%d,%d) failed",device_id,dport,cli->_fd);
-    found_device:;
-    }
+    retassure(dev = _devices.get()->findByID(device_id), "start_connect(%d,%d,%d) failed",device_id,dport,cli->_fd);
     try {
         dev->start_connect(dport, cli);
     } catch (...) {
@@ -309,6 +314,15 @@ void Muxer::start_connect(int device_id, uint16_t dport, std::shared_ptr<Client>
     return;
 }
 
+void Muxer::start_relay(int cfd, int dfd, int deviceID){
+    if (!_relay) {
+        safeClose(cfd);
+        safeClose(dfd);
+        reterror("No relay available");
+    }
+    _relay->add(cfd, dfd, deviceID);
+}
+
 void Muxer::send_deviceList(std::shared_ptr<Client> cli, uint32_t tag){
     plist_t p_rsp = NULL;
     plist_t p_devarr = NULL;
@@ -318,11 +332,9 @@ void Muxer::send_deviceList(std::shared_ptr<Client> cli, uint32_t tag){
     });
     assure(p_rsp = plist_new_dict());
     assure(p_devarr = plist_new_array());
-    {
-        guardRead(_devicesGuard);
-        for (auto &dev : _devices) {
-            plist_array_append_item(p_devarr, getDevicePlist(dev));
-        }
+    std::shared_ptr<const DeviceRegistry> devices = _devices.get();
+    for (auto &d : *devices) {
+        plist_array_append_item(p_devarr, getDevicePlist(d.second));
     }
     plist_dict_set_item(p_rsp, "DeviceList", p_devarr); p_devarr = NULL; //transfer ownership
 
@@ -340,18 +352,184 @@ void Muxer::send_listenerList(std::shared_ptr<Client> cli, uint32_t tag){
     assure(p_cliarr = plist_new_array());
 
 
+    std::shared_ptr<const std::set<std::shared_ptr<Client>>> clients = _clients.get();
+    for (auto &c : *clients) {
+        plist_array_append_item(p_cliarr, getClientPlist(c));
+    }
+
+    plist_dict_set_item(p_rsp, "ListenerList", p_cliarr); p_cliarr = NULL; //transfer ownership
+    cli->send_plist_pkt(tag, p_rsp);
+}
+
+static plist_t getConnectionStatsPlist(std::shared_ptr<TCP> conn) noexcept{
+    const TCP::tcpstats stats = conn->getStats();
+    plist_t p_ret = plist_new_dict();
+    plist_dict_set_item(p_ret, "SourcePort", plist_new_uint(stats.sPort));
+    plist_dict_set_item(p_ret, "DestinationPort", plist_new_uint(stats.dPort));
+    plist_dict_set_item(p_ret, "State", plist_new_string(stats.state));
+    plist_dict_set_item(p_ret, "BytesToDevice", plist_new_uint(stats.bytesToDevice));
+    plist_dict_set_item(p_ret, "BytesFromDevice", plist_new_uint(stats.bytesFromDevice));
+    plist_dict_set_item(p_ret, "WindowStalls", plist_new_uint(stats.windowStalls));
+    plist_dict_set_item(p_ret, "ACKsSent", plist_new_uint(stats.acksSent));
+    plist_dict_set_item(p_ret, "ConnectLatencyUs", plist_new_uint(stats.connectLatencyUs));
+    return p_ret;
+}
+
+static plist_t getLatencyPlist(const LatencyHistogram &hist) noexcept{
+    const LatencyHistogram::snapshot snap = hist.getSnapshot();
+    plist_t p_ret = plist_new_dict();
+    plist_dict_set_item(p_ret, "Count", plist_new_uint(snap.count));
+    plist_dict_set_item(p_ret, "P50Ns", plist_new_uint(snap.valueAtQuantile(0.5)));
+    plist_dict_set_item(p_ret, "P90Ns", plist_new_uint(snap.valueAtQuantile(0.9)));
+    plist_dict_set_item(p_ret, "P99Ns", plist_new_uint(snap.valueAtQuantile(0.99)));
+    plist_dict_set_item(p_ret, "P999Ns", plist_new_uint(snap.valueAtQuantile(0.999)));
+    plist_dict_set_item(p_ret, "MaxNs", plist_new_uint(snap.max));
+    return p_ret;
+}
+
+plist_t Muxer::getDeviceStatsPlist(std::shared_ptr<Device> dev) noexcept{
+    plist_t p_ret = plist_new_dict();
+    plist_dict_set_item(p_ret, "DeviceID", plist_new_uint(dev->_id));
+    plist_dict_set_item(p_ret, "SerialNumber", plist_new_string(dev->getSerial()));
+    if (_preflight && dev->_conntype == Device::MUXCONN_USB) {
+        uint64_t preflightLatency = _preflight->getLatency(dev->_id);
+        if (preflightLatency) plist_dict_set_item(p_ret, "PreflightLatencyUs", plist_new_uint(preflightLatency));
+    }
+    if (dev->_conntype == Device::MUXCONN_USB) {
+        std::shared_ptr<USBDevice> usbdev = std::static_pointer_cast<USBDevice>(dev);
+        const USBDevice::usbstats stats = usbdev->getStats();
+        plist_t p_conns = plist_new_array();
+        plist_dict_set_item(p_ret, "ConnectionType", plist_new_string("USB"));
+        plist_dict_set_item(p_ret, "RXBytes", plist_new_uint(stats.rxBytes));
+        plist_dict_set_item(p_ret, "RXPackets", plist_new_uint(stats.rxPackets));
+        plist_dict_set_item(p_ret, "TXBytes", plist_new_uint(stats.txBytes));
+        plist_dict_set_item(p_ret, "TXPackets", plist_new_uint(stats.txPackets));
+        plist_dict_set_item(p_ret, "SplitReassemblies", plist_new_uint(stats.splitReassemblies));
+        plist_dict_set_item(p_ret, "DuplicatePackets", plist_new_uint(stats.duplicates));
+        plist_dict_set_item(p_ret, "RXTransfersInFlight", plist_new_uint(stats.rxInFlight));
+        plist_dict_set_item(p_ret, "TXTransfersInFlight", plist_new_uint(stats.txInFlight));
+        for (auto &c : usbdev->getConnections()) {
+            plist_array_append_item(p_conns, getConnectionStatsPlist(c));
+        }
+        plist_dict_set_item(p_ret, "Connections", p_conns);
+        {
+            USBDevice::latencies &lats = usbdev->getLatencies();
+            plist_t p_lats = plist_new_dict();
+            plist_dict_set_item(p_lats, "Connect", getLatencyPlist(lats.connect));
+            plist_dict_set_item(p_lats, "RXToClient", getLatencyPlist(lats.rxToClient));
+            plist_dict_set_item(p_lats, "ClientToTX", getLatencyPlist(lats.clientToUSB));
+            plist_dict_set_item(p_lats, "TXCompletion", getLatencyPlist(lats.txCompletion));
+            plist_dict_set_item(p_ret, "Latency", p_lats);
+        }
+    }else{
+        //WiFi connections are proxied by the Relay, which only keeps global counters
+        plist_dict_set_item(p_ret, "ConnectionType", plist_new_string("Network"));
+    }
+    return p_ret;
+}
+
+void Muxer::send_statistics(std::shared_ptr<Client> cli, uint32_t tag){
+    plist_t p_rsp = NULL;
+    plist_t p_devarr = NULL;
+    plist_t p_cliarr = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_rsp, plist_free);
+        safeFreeCustom(p_devarr, plist_free);
+        safeFreeCustom(p_cliarr, plist_free);
+    });
+    assure(p_rsp = plist_new_dict());
+    assure(p_devarr = plist_new_array());
+    assure(p_cliarr = plist_new_array());
+
     {
-        guardRead(_clientsGuard);
-        for (auto &c : _clients) {
-            plist_array_append_item(p_cliarr, getClientPlist(c));
+        std::shared_ptr<const DeviceRegistry> devices = _devices.get();
+        for (auto &d : *devices) {
+            plist_array_append_item(p_devarr, getDeviceStatsPlist(d.second));
         }
     }
+    plist_dict_set_item(p_rsp, "Devices", p_devarr); p_devarr = NULL; //transfer ownership
+
+    {
+        std::shared_ptr<const std::set<std::shared_ptr<Client>>> clients = _clients.get();
+        for (auto &c : *clients) {
+            plist_t p_cli = getClientPlist(c);
+            plist_t p_msgs = plist_new_dict();
+            plist_dict_set_item(p_cli, "ClientNumber", plist_new_uint(c->_number));
+            for (size_t i = 0; i < client_command_count; i++) {
+                client_command cmd = (client_command)i;
+                plist_dict_set_item(p_msgs, client_command_name(cmd), plist_new_uint(c->getMessageCount(cmd)));
+            }
+            plist_dict_set_item(p_cli, "Messages", p_msgs);
+            plist_array_append_item(p_cliarr, p_cli);
+        }
+    }
+    plist_dict_set_item(p_rsp, "Clients", p_cliarr); p_cliarr = NULL; //transfer ownership
+
+    if (_climgr) {
+        const ClientManager::acceptstats stats = _climgr->getAcceptStats();
+        plist_t p_accept = plist_new_dict();
+        plist_dict_set_item(p_accept, "Accepted", plist_new_uint(stats.accepted));
+        plist_dict_set_item(p_accept, "Errors", plist_new_uint(stats.acceptErrors));
+        plist_dict_set_item(p_accept, "Wakeups", plist_new_uint(stats.wakeups));
+        plist_dict_set_item(p_accept, "MaxBatch", plist_new_uint(stats.maxBatch));
+        plist_dict_set_item(p_accept, "BacklogOverflows", plist_new_uint(stats.backlogOverflows));
+        plist_dict_set_item(p_accept, "LatencyTotalUs", plist_new_uint(stats.latencyTotalUs));
+        plist_dict_set_item(p_accept, "LatencyMaxUs", plist_new_uint(stats.latencyMaxUs));
+        plist_dict_set_item(p_rsp, "Accept", p_accept);
+    }
+
+    if (_preflight) {
+        const PreflightPool::preflightstats stats = _preflight->getStats();
+        plist_t p_preflight = plist_new_dict();
+        plist_dict_set_item(p_preflight, "Queued", plist_new_uint(stats.queued));
+        plist_dict_set_item(p_preflight, "Deduped", plist_new_uint(stats.deduped));
+        plist_dict_set_item(p_preflight, "Completed", plist_new_uint(stats.completed));
+        plist_dict_set_item(p_preflight, "Failed", plist_new_uint(stats.failed));
+        plist_dict_set_item(p_preflight, "Cancelled", plist_new_uint(stats.cancelled));
+        plist_dict_set_item(p_preflight, "LatencyTotalUs", plist_new_uint(stats.latencyTotalUs));
+        plist_dict_set_item(p_preflight, "LatencyMaxUs", plist_new_uint(stats.latencyMaxUs));
+        plist_dict_set_item(p_rsp, "Preflight", p_preflight);
+    }
+
+    if (_relay) {
+        const Relay::relaystats stats = _relay->getStats();
+        plist_t p_relay = plist_new_dict();
+        plist_dict_set_item(p_relay, "Opened", plist_new_uint(stats.opened));
+        plist_dict_set_item(p_relay, "Closed", plist_new_uint(stats.closed));
+        plist_dict_set_item(p_relay, "Bytes", plist_new_uint(stats.bytes));
+        plist_dict_set_item(p_relay, "Wakeups", plist_new_uint(stats.wakeups));
+        plist_dict_set_item(p_rsp, "Relay", p_relay);
+    }
 
-    plist_dict_set_item(p_rsp, "ListenerList", p_cliarr); p_cliarr = NULL; //transfer ownership
     cli->send_plist_pkt(tag, p_rsp);
 }
 
 #pragma mark Notification
+static Client::notification makeNotification(Client::notification_type type, int deviceID, plist_t p_msg){
+    char *xml = NULL;
+    cleanup([&]{
+        safeFree(xml);
+    });
+    uint32_t xmlsize = 0;
+
+    plist_to_xml(p_msg, &xml, &xmlsize);
+    retassure(xml, "Failed to serialize notification for device %d",deviceID);
+    return {type, deviceID, std::make_shared<const std::string>(xml, xmlsize)};
+}
+
+void Muxer::notify_listeners(const Client::notification &n) noexcept{
+    /*
+        Only enqueue here, the ClientNotifier drains every client's queue without blocking.
+        A stuck listener can't hold up anyone else this way.
+     */
+    std::shared_ptr<const std::set<std::shared_ptr<Client>>> clients = _clients.get();
+    for (auto &c : *clients){
+        if (c->_isListening) {
+            c->queue_notification(n);
+        }
+    }
+}
+
 void Muxer::notify_device_add(std::shared_ptr<Device> dev) noexcept{
     debug("notify_device_add(%d)",dev->_id);
     plist_t p_rsp = NULL;
@@ -361,17 +539,10 @@ void Muxer::notify_device_add(std::shared_ptr<Device> dev) noexcept{
 
     p_rsp = getDevicePlist(dev);
 
-    {
-        guardRead(_clientsGuard);
-        for (auto &c : _clients){
-            if (c->_isListening) {
-                try {
-                    c->send_plist_pkt(0, p_rsp);
-                } catch (...) {
-                    //we don't care if this fails
-                }
-            }
-        }
+    try {
+        notify_listeners(makeNotification(Client::NOTIFY_ATTACHED, dev->_id, p_rsp));
+    } catch (tihmstar::exception &e) {
+        error("notify_device_add(%d) failed with error=%d (%s)",dev->_id,e.code(),e.what());
     }
 }
 
@@ -385,17 +556,10 @@ void Muxer::notify_device_remove(int deviceID) noexcept{
     plist_dict_set_item(p_rsp, "MessageType", plist_new_string("Detached"));
     plist_dict_set_item(p_rsp, "DeviceID", plist_new_uint(deviceID));
     
-    {
-        guardRead(_clientsGuard);
-        for (auto c : _clients){
-            if (c->_isListening) {
-                try {
-                    c->send_plist_pkt(0, p_rsp);
-                } catch (...) {
-                    //we don't care if this fails
-                }
-            }
-        }
+    try {
+        notify_listeners(makeNotification(Client::NOTIFY_DETACHED, deviceID, p_rsp));
+    } catch (tihmstar::exception &e) {
+        error("notify_device_remove(%d) failed with error=%d (%s)",deviceID,e.code(),e.what());
     }
 }
 
@@ -409,17 +573,10 @@ void Muxer::notify_device_paired(int deviceID) noexcept{
     plist_dict_set_item(p_rsp, "MessageType", plist_new_string("Paired"));
     plist_dict_set_item(p_rsp, "DeviceID", plist_new_uint(deviceID));
 
-    {
-        guardRead(_clientsGuard);
-        for (auto c : _clients){
-            if (c->_isListening) {
-                try {
-                    c->send_plist_pkt(0, p_rsp);
-                } catch (...) {
-                    //we don't care if this fails
-                }
-            }
-        }
+    try {
+        notify_listeners(makeNotification(Client::NOTIFY_PAIRED, deviceID, p_rsp));
+    } catch (tihmstar::exception &e) {
+        error("notify_device_paired(%d) failed with error=%d (%s)",deviceID,e.code(),e.what());
     }
 }
 
@@ -430,19 +587,18 @@ void Muxer::notify_alldevices(std::shared_ptr<Client> cli) noexcept {
         return;
     }
     
-    {
-        guardRead(_devicesGuard);
-        for (auto &d : _devices){
-            plist_t p_rsp = NULL;
-            cleanup([&]{
-                safeFreeCustom(p_rsp, plist_free);
-            });
-            p_rsp = getDevicePlist(d);
-            try {
-                cli->send_plist_pkt(0, p_rsp);
-            } catch (...) {
-                //we don't care if this fails
-            }
+    //goes through the client's queue too, so it can't overtake a later Detached
+    std::shared_ptr<const DeviceRegistry> devices = _devices.get();
+    for (auto &d : *devices){
+        plist_t p_rsp = NULL;
+        cleanup([&]{
+            safeFreeCustom(p_rsp, plist_free);
+        });
+        p_rsp = getDevicePlist(d.second);
+        try {
+            if (!cli->queue_notification(makeNotification(Client::NOTIFY_ATTACHED, d.first, p_rsp))) break;
+        } catch (...) {
+            //we don't care if this fails
         }
     }
 }
@@ -478,9 +634,8 @@ plist_t Muxer::getDevicePlist(std::shared_ptr<Device> dev) noexcept{
         plist_dict_set_item(p_props, "ConnectionType", plist_new_string("Network"));
         plist_dict_set_item(p_props, "EscapedFullServiceName", plist_new_string(wifidev->_serviceName.c_str()));
 
-        std::string ipaddr = wifidev->_ipaddr.front();
-
-        for (auto ipaddr : wifidev->_ipaddr) {
+        //report the address most likely to work first
+        for (auto ipaddr : wifidev->ordered_addresses()) {
             char buf[0x80] = {};
             if (ipaddr.find(":") == std::string::npos){
                 //this is an IPv4 addr
@@ -530,7 +685,7 @@ plist_t Muxer::getClientPlist(std::shared_ptr<Client> cli) noexcept{
     p_ret = plist_new_dict();
 
     plist_dict_set_item(p_ret,"Blacklisted", plist_new_bool(0));
-    plist_dict_set_item(p_ret,"BundleID", plist_new_string(info.bundleID));
+    plist_dict_set_item(p_ret,"BundleID", plist_new_string(info.bundleID.c_str()));
     plist_dict_set_item(p_ret,"ConnType", plist_new_uint(0));
 
     {
@@ -540,9 +695,17 @@ plist_t Muxer::getClientPlist(std::shared_ptr<Client> cli) noexcept{
 
         plist_dict_set_item(p_ret,"ID String", plist_new_string(idstring.c_str()));
     }
-    plist_dict_set_item(p_ret,"ProgName", plist_new_string(info.progName));
+    plist_dict_set_item(p_ret,"ProgName", plist_new_string(info.progName.c_str()));
 
     plist_dict_set_item(p_ret,"kLibUSBMuxVersion", plist_new_uint(info.kLibUSBMuxVersion));
+
+    {
+        const Client::notifystats nstats = cli->getNotifyStats();
+        plist_dict_set_item(p_ret,"NotificationQueueDepth", plist_new_uint(nstats.depth));
+        plist_dict_set_item(p_ret,"NotificationQueueMaxDepth", plist_new_uint(nstats.maxDepth));
+        plist_dict_set_item(p_ret,"NotificationsSent", plist_new_uint(nstats.sent));
+        plist_dict_set_item(p_ret,"NotificationsCompacted", plist_new_uint(nstats.compacted));
+    }
     {
         plist_t ret = p_ret; p_ret = NULL;
         return ret;
@@ -9,6 +9,11 @@
 #define Muxer_hpp
 
 #include "Devices/Device.hpp"
+#include "Devices/DeviceRegistry.hpp"
+#include "Devices/DeviceIDAllocator.hpp"
+#include "Devices/SimUSBTransport.hpp"
+#include "Client.hpp"
+#include "Snapshot.hpp"
 
 #include <libgeneral/macros.h>
 #include <libgeneral/GuardAccess.hpp>
@@ -16,7 +21,12 @@
 
 #include <set>
 
+class Config;
 class ClientManager;
+class PreflightPool;
+class Relay;
+class HeartbeatLoop;
+class MetricsExporter;
 class USBDeviceManager;
 class WIFIDeviceManager;
 
@@ -25,22 +35,39 @@ class Muxer {
     USBDeviceManager *_usbdevmgr;
     WIFIDeviceManager *_wifidevmgr;
 
+    PreflightPool *_preflight;
+    Relay *_relay; //proxies connections to WiFi devices
+    HeartbeatLoop *_heartbeats; //answers heartbeats of all WiFi devices
+    MetricsExporter *_metrics;
     bool _doPreflight;
     bool _allowHeartlessWifi;
-    int _newid;
-    std::set<std::shared_ptr<Device>> _devices;
-    tihmstar::GuardAccess _devicesGuard;
-    std::set<std::shared_ptr<Client>> _clients;
-    tihmstar::GuardAccess _clientsGuard;
+    uint32_t _wifiRemovalGrace; //ms
+    uint32_t _wifiResolveCacheTTL; //seconds
+    DeviceIDAllocator _ids; //only accessed from within _devices.update
+    Snapshot<DeviceRegistry> _devices;
+    Snapshot<std::set<std::shared_ptr<Client>>> _clients;
+
+    void notify_listeners(const Client::notification &n) noexcept;
+    void release_id_if_unused(const DeviceRegistry &devices, int id) noexcept;
+    void cancel_preflight(std::shared_ptr<Device> dev) noexcept;
+    plist_t getDeviceStatsPlist(std::shared_ptr<Device> dev) noexcept;
 public:
-    Muxer(bool doPreflight = true, bool allowHeartlessWifi = false);
+    Muxer(const Config *config);
     ~Muxer();
 
 #pragma mark Managers
-    void spawnClientManager();
-    void spawnUSBDeviceManager();
+    void spawnClientManager(int listenBacklog, const char *socketPath = nullptr);
+    void spawnUSBDeviceManager(const SimUSBTransport::params *simulate = nullptr);
     void spawnWIFIDeviceManager();
+    /*
+        Serves OpenMetrics on listenOn, see MetricsExporter.
+     */
+    void spawnMetricsExporter(const char *listenOn);
     bool hasDeviceManager() noexcept;
+    /*
+        Plugs simulated USB device num in or out, needs a USBDeviceManager spawned with simulate.
+     */
+    void simulate_usb_hotplug(int num, bool arrived);
 
 #pragma mark Clients
     void add_client(std::shared_ptr<Client> cli);
@@ -55,13 +82,22 @@ public:
     bool have_usb_device(uint8_t bus, uint8_t address) noexcept;
     bool have_wifi_device_with_mac(std::string macaddr) noexcept;
     bool have_wifi_device_with_ip(std::vector<std::string> ipaddrs) noexcept;
+    /*
+        Kills the WiFi device advertised as service instance, returns false if there is none.
+     */
+    bool kill_wifi_device_with_service(std::string_view instance) noexcept;
     int id_for_device(const char *uuid, Device::mux_conn_type type) noexcept;
     size_t devices_cnt() noexcept;
 
 #pragma mark Connection
     void start_connect(int device_id, uint16_t dport, std::shared_ptr<Client> cli);
+    void start_relay(int cfd, int dfd, int deviceID);
     void send_deviceList(std::shared_ptr<Client> cli, uint32_t tag);
     void send_listenerList(std::shared_ptr<Client> cli, uint32_t tag);
+    /*
+        Replies with the runtime counters of every device, TCP connection and client.
+     */
+    void send_statistics(std::shared_ptr<Client> cli, uint32_t tag);
 
 #pragma mark Notification
     void notify_device_add(std::shared_ptr<Device> dev) noexcept;
@@ -72,6 +108,9 @@ public:
 #pragma mark Static
     static plist_t getDevicePlist(std::shared_ptr<Device> dev) noexcept;
     static plist_t getClientPlist(std::shared_ptr<Client> cli) noexcept;
+
+#pragma mark friends
+    friend MetricsExporter;
 };
 
 #endif /* Muxer_hpp */
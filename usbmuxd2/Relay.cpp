@@ -0,0 +1,263 @@
+//
+//  Relay.cpp
+//  usbmuxd2
+//
+
+#include "Relay.hpp"
+#include <libgeneral/macros.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+
+#pragma mark Relay
+Relay::Relay()
+: _wakePipe{-1,-1}, _stats{}
+{
+    assure(!pipe(_wakePipe));
+    fcntl(_wakePipe[0], F_SETFL, fcntl(_wakePipe[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(_wakePipe[1], F_SETFL, fcntl(_wakePipe[1], F_GETFL, 0) | O_NONBLOCK);
+}
+
+Relay::~Relay(){
+    info("[destroying] Relay");
+    stopLoop();
+    adopt_incoming();
+    while (_links.size()) retire_link(_links.begin());
+    safeClose(_wakePipe[0]);
+    safeClose(_wakePipe[1]);
+    {
+        relaystats stats = getStats();
+        info("[Relay] relayed %" PRIu64 " bytes over %" PRIu64 " connections",stats.bytes,stats.opened);
+    }
+}
+
+#pragma mark private
+void Relay::stopAction() noexcept{
+    safeClose(_wakePipe[1]);
+}
+
+void Relay::wakeup() noexcept{
+    char c = 0;
+    if (_wakePipe[1] != -1) write(_wakePipe[1], &c, 1);
+}
+
+void Relay::adopt_incoming() noexcept{
+    std::vector<int> dropTags;
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        for (auto &l : _incoming) {
+            _links.push_back(l);
+        }
+        _incoming.clear();
+        dropTags.swap(_dropTags);
+    }
+    for (int tag : dropTags) {
+        for (auto it = _links.begin(); it != _links.end();) {
+            if (it->tag == tag) {
+                it = retire_link(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+std::list<Relay::link>::iterator Relay::retire_link(std::list<link>::iterator it) noexcept{
+    debug("[Relay] closing connection %d<->%d",it->fds[0],it->fds[1]);
+    close_link(*it);
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _stats.closed++;
+    }
+    return _links.erase(it);
+}
+
+void Relay::close_link(link &l) noexcept{
+    for (auto &d : l.dirs) {
+#ifdef __linux__
+        safeClose(d.pipe[0]);
+        safeClose(d.pipe[1]);
+#else
+        safeFree(d.buf);
+#endif
+    }
+    safeClose(l.fds[0]);
+    safeClose(l.fds[1]);
+}
+
+bool Relay::wants_input(const direction &d) const noexcept{
+    if (d.eof) return false;
+#ifdef __linux__
+    return !d.pipeFull && d.pending < chunkSize;
+#else
+    return d.pending == 0;
+#endif
+}
+
+bool Relay::fill(direction &d, bool readable) noexcept{
+    ssize_t cnt = 0;
+    if (!wants_input(d)) return true;
+#ifdef __linux__
+    cnt = splice(d.from, NULL, d.pipe[1], NULL, chunkSize - d.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    /*
+        A pipe holds a limited number of buffers and TCP fills one per segment,
+        with small segments it can be full long before pending reaches chunkSize.
+        If 'from' was readable the EAGAIN came from the pipe, polling for input again would just spin.
+     */
+    if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && readable && d.pending) d.pipeFull = true;
+#else
+    d.off = 0;
+    cnt = read(d.from, d.buf, chunkSize);
+#endif
+    if (cnt < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if (cnt == 0) {
+        d.eof = true;
+    } else {
+        d.pending += cnt;
+    }
+    return true;
+}
+
+bool Relay::drain(direction &d) noexcept{
+    ssize_t cnt = 0;
+    if (!d.pending) return true;
+#ifdef __linux__
+    cnt = splice(d.pipe[0], NULL, d.to, NULL, d.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    cnt = write(d.to, d.buf+d.off, d.pending);
+    if (cnt > 0) d.off += cnt;
+#endif
+    if (cnt < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    d.pending -= cnt;
+#ifdef __linux__
+    if (cnt) d.pipeFull = false;
+#endif
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _stats.bytes += cnt;
+    }
+    return true;
+}
+
+bool Relay::loopEvent(){
+    adopt_incoming();
+
+    _pfds.clear();
+    _pfds.push_back({.fd = _wakePipe[0], .events = POLLIN});
+    for (auto &l : _links) {
+        for (int i = 0; i < 2; i++) {
+            //fds[i] is the source of dirs[i] and the destination of dirs[i^1]
+            short events = 0;
+            if (wants_input(l.dirs[i])) events |= POLLIN;
+            if (l.dirs[i^1].pending) events |= POLLOUT;
+            _pfds.push_back({.fd = l.fds[i], .events = events});
+        }
+    }
+
+    int pollret = poll(_pfds.data(), (nfds_t)_pfds.size(), -1);
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _stats.wakeups++;
+    }
+    if (pollret == -1) {
+        retassure(errno == EINTR, "[Relay] poll failed with error=%d (%s)",errno,strerror(errno));
+        return true;
+    }
+
+    if (_pfds[0].revents) {
+        char buf[0x100];
+        ssize_t cnt = 0;
+        while ((cnt = read(_wakePipe[0], buf, sizeof(buf))) > 0);
+        if (cnt == 0) return false; //we are being stopped
+    }
+
+    {
+        size_t i = 1;
+        for (auto it = _links.begin(); it != _links.end(); i += 2) {
+            link &l = *it;
+            bool isDead = false;
+            if (!_pfds[i].revents && !_pfds[i+1].revents) {
+                ++it;
+                continue;
+            }
+            for (int j = 0; j < 2; j++) {
+                short revents = _pfds[i+j].revents;
+                //a peer which is gone in both directions can't take the rest of the data either
+                if ((revents & POLLERR) || ((revents & POLLHUP) && !(revents & POLLIN) && l.dirs[j].eof)) isDead = true;
+            }
+            for (int j = 0; j < 2; j++) {
+                direction &d = l.dirs[j];
+                if (isDead) break;
+                if (!fill(d, _pfds[i+j].revents & POLLIN) || !drain(d)) {
+                    isDead = true;
+                    break;
+                }
+                if (d.eof && !d.pending && !d.didShutdown) {
+                    shutdown(d.to, SHUT_WR);
+                    d.didShutdown = true;
+                }
+            }
+            if (isDead || (l.dirs[0].didShutdown && l.dirs[1].didShutdown)) {
+                it = retire_link(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return true;
+}
+
+#pragma mark public
+void Relay::add(int fdA, int fdB, int tag){
+    link l = {};
+    bool didAdd = false;
+    cleanup([&]{
+        if (!didAdd) close_link(l);
+    });
+    l.fds[0] = fdA;
+    l.fds[1] = fdB;
+    l.tag = tag;
+    for (int i = 0; i < 2; i++) {
+        direction &d = l.dirs[i];
+        d.from = l.fds[i];
+        d.to = l.fds[i^1];
+#ifdef __linux__
+        d.pipe[0] = d.pipe[1] = -1;
+        d.pipeFull = false;
+#endif
+    }
+    for (int i = 0; i < 2; i++) {
+        int flags = fcntl(l.fds[i], F_GETFL, 0);
+        retassure(flags != -1 && fcntl(l.fds[i], F_SETFL, flags | O_NONBLOCK) != -1, "[Relay] failed to set O_NONBLOCK on %d",l.fds[i]);
+#ifdef __linux__
+        retassure(!pipe2(l.dirs[i].pipe, O_NONBLOCK | O_CLOEXEC), "[Relay] failed to create pipe with error=%d (%s)",errno,strerror(errno));
+#else
+        assure(l.dirs[i].buf = (char*)malloc(chunkSize));
+#endif
+    }
+
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _incoming.push_back(l);
+        _stats.opened++;
+    }
+    didAdd = true;
+    debug("[Relay] relaying %d<->%d (tag %d)",fdA,fdB,tag);
+    wakeup();
+}
+
+void Relay::drop(int tag) noexcept{
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _dropTags.push_back(tag);
+    }
+    wakeup();
+}
+
+Relay::relaystats Relay::getStats() noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    return _stats;
+}
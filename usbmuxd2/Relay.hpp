@@ -0,0 +1,88 @@
+//
+//  Relay.hpp
+//  usbmuxd2
+//
+
+#ifndef Relay_hpp
+#define Relay_hpp
+
+#include <libgeneral/Manager.hpp>
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <list>
+#include <mutex>
+#include <vector>
+#include <poll.h>
+
+/*
+    Shuttles bytes between pairs of connected sockets on a single thread.
+    On Linux the payload is moved with splice() through a pipe per direction
+    and never enters user space, elsewhere a small buffer per direction is used.
+    Each side is half-closed once its peer sent EOF and everything was delivered,
+    the pair is torn down when both directions are done or on error.
+ */
+class Relay : public tihmstar::Manager{
+public:
+    static constexpr size_t chunkSize = 0x10000;
+    struct relaystats{
+        uint64_t opened;
+        uint64_t closed;
+        uint64_t bytes;
+        uint64_t wakeups; //poll() returns of the loop thread, keeps growing if the loop spins
+    };
+private:
+    struct direction{
+        int from; //not owned
+        int to;   //not owned
+#ifdef __linux__
+        int pipe[2];
+        bool pipeFull; //splice() into the pipe would block, stop polling 'from' until drain() made room
+#else
+        char *buf;
+        size_t off;
+#endif
+        size_t pending; //read from 'from', not yet written to 'to'
+        bool eof;
+        bool didShutdown;
+    };
+    struct link{
+        int fds[2];
+        int tag;
+        direction dirs[2];
+    };
+    std::list<link> _links;         //only touched by the loop thread
+    std::vector<link> _incoming;    //added, but not yet picked up by the loop thread
+    std::vector<int> _dropTags;
+    std::mutex _lck;
+    int _wakePipe[2];
+    std::vector<struct pollfd> _pfds;
+    relaystats _stats;
+
+    virtual void stopAction() noexcept override;
+    virtual bool loopEvent() override;
+
+    void wakeup() noexcept;
+    void adopt_incoming() noexcept;
+    void close_link(link &l) noexcept;
+    std::list<link>::iterator retire_link(std::list<link>::iterator it) noexcept;
+    bool wants_input(const direction &d) const noexcept;
+    bool fill(direction &d, bool readable) noexcept;
+    bool drain(direction &d) noexcept;
+
+public:
+    Relay();
+    Relay(const Relay &) = delete;
+    virtual ~Relay() override;
+
+    /*
+        Takes ownership of both fds, they are closed when the pair is torn down.
+        tag allows dropping all pairs belonging to one device.
+     */
+    void add(int fdA, int fdB, int tag);
+    void drop(int tag) noexcept;
+
+    relaystats getStats() noexcept;
+};
+
+#endif /* Relay_hpp */
@@ -0,0 +1,61 @@
+//
+//  Snapshot.hpp
+//  usbmuxd2
+//
+
+#ifndef Snapshot_hpp
+#define Snapshot_hpp
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+/*
+    RCU-style container.
+    Readers get an immutable, reference counted version of T and may keep it
+    for as long as they like (even across socket I/O).
+    Loading it is not lock-free: std::atomic<std::shared_ptr> briefly spins on the pointer,
+    the pre C++20 fallback takes a mutex from a global pool. Either is only held for the
+    refcount increment, never for the duration of a write.
+    Writers are serialized among themselves, copy the current version,
+    modify the copy and publish it. They never wait for readers.
+ */
+template <typename T>
+class Snapshot{
+#ifdef __cpp_lib_atomic_shared_ptr
+    std::atomic<std::shared_ptr<const T>> _cur;
+#else
+    std::shared_ptr<const T> _cur; //libc++ has no std::atomic<std::shared_ptr> yet
+#endif
+    std::mutex _writeLck;
+public:
+    Snapshot() : _cur(std::make_shared<const T>()) {}
+    Snapshot(const Snapshot &) = delete;
+
+    std::shared_ptr<const T> get() const noexcept{
+#ifdef __cpp_lib_atomic_shared_ptr
+        return _cur.load(std::memory_order_acquire);
+#else
+        return std::atomic_load_explicit(&_cur, std::memory_order_acquire);
+#endif
+    }
+
+    /*
+        Calls f with a private copy of the current version.
+        The copy is published if f returns true.
+     */
+    template <typename F>
+    bool update(F f){
+        std::unique_lock<std::mutex> ul(_writeLck);
+        std::shared_ptr<T> next = std::make_shared<T>(*get());
+        if (!f(*next)) return false;
+#ifdef __cpp_lib_atomic_shared_ptr
+        _cur.store(std::shared_ptr<const T>(std::move(next)), std::memory_order_release);
+#else
+        std::atomic_store_explicit(&_cur, std::shared_ptr<const T>(std::move(next)), std::memory_order_release);
+#endif
+        return true;
+    }
+};
+
+#endif /* Snapshot_hpp */
@@ -0,0 +1,40 @@
+//
+//  StatCounter.hpp
+//  usbmuxd2
+//
+
+#ifndef StatCounter_hpp
+#define StatCounter_hpp
+
+#include <atomic>
+#include <stdint.h>
+
+/*
+    Statistics counter for the hot path.
+    Lives in the object owning the path, so it is mostly bumped by one thread and never takes a lock.
+    Relaxed ordering, readers only need every single value to be eventually consistent.
+ */
+class StatCounter{
+    std::atomic<uint64_t> _val;
+public:
+    StatCounter() : _val(0) {}
+    StatCounter(const StatCounter &) = delete;
+
+    void add(uint64_t v = 1) noexcept{
+        _val.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    void sub(uint64_t v = 1) noexcept{
+        _val.fetch_sub(v, std::memory_order_relaxed);
+    }
+
+    void set(uint64_t v) noexcept{
+        _val.store(v, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const noexcept{
+        return _val.load(std::memory_order_relaxed);
+    }
+};
+
+#endif /* StatCounter_hpp */
@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <chrono>
 
 #define MIN(a,b) ((a) > (b) ? (b) : (a))
 #define unacked ((uint64_t)((_stx.seq >= _stx.seqAcked) ? (_stx.seq - _stx.seqAcked) : ((uint32_t)(0x100000000ULL + _stx.seq - _stx.seqAcked))))
@@ -38,6 +39,7 @@ bool TCP::loopEvent(){
     int err = 0;
     bool remoteDidClose = false;
     ssize_t cnt = 0;
+    std::chrono::steady_clock::time_point receivedAt;
 
     uint32_t lseqAck = 0;
     uint32_t lseq = 0;
@@ -74,12 +76,13 @@ bool TCP::loopEvent(){
         }
         
         if (cnt == 0) break;
+        receivedAt = std::chrono::steady_clock::now();
         
         debug("[TCP CLIENT] got packet of size %zd",cnt);
 
         while (cnt>0) {
             ssize_t doSend = MIN(cnt,TCP::TCP_MTU);
-            size_t didSend = send_data(bufstart,doSend);
+            size_t didSend = send_data(bufstart,doSend,receivedAt);
             bufstart += didSend;
             cnt -= didSend;
         }
@@ -137,6 +140,7 @@ void TCP::send_ack_nolock(){
     }
     if (doSend) {
         _dev->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
+        _acksSent.add();
     }
 }
 
@@ -179,7 +183,7 @@ void TCP::send_fin(){
     _dev->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
 }
 
-size_t TCP::send_data(void *buf, size_t buflen){
+size_t TCP::send_data(void *buf, size_t buflen, std::chrono::steady_clock::time_point receivedAt){
     size_t len = buflen;
     if (!len) return 0;
     tcphdr tcp_header{};
@@ -205,6 +209,7 @@ retry:
         //at this point we *have to* wait for an ACK
         //no smaller payload is possible
         ++sendfails;
+        _windowStalls.add();
         debug("[%d] we have to wait for ACK before sending more data!",sendfails);
         
         // **** Put this thread to sleep until we can send more data **** //
@@ -237,6 +242,8 @@ cnt_label:
 
     _dev->send_packet(USBDevice::MUX_PROTO_TCP, buf, len, &tcp_header);
     _lockStx.unlock();
+    _bytesToDevice.add(len);
+    _dev->getLatencies().clientToUSB.recordSince(receivedAt); //includes time spent waiting for the window
     return len;
 }
 
@@ -296,7 +303,7 @@ void TCP::deconstruct() noexcept{
     }
 }
 
-void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_len){
+void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_len, std::chrono::steady_clock::time_point completedAt){
     uint32_t rSeq = 0;
     uint32_t rAck = 0;
     {
@@ -386,6 +393,9 @@ void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_le
             //terminate TCP instead
             error("Failed to send payload to client with didSend=%zd payload_len=%u errno=%d (%s)",didSend,payload_len,errno,strerror(errno));
             kill(__LINE__);
+        }else{
+            _bytesFromDevice.add(payload_len);
+            if (completedAt.time_since_epoch().count()) _dev->getLatencies().rxToClient.recordSince(completedAt);
         }
         _stx.pktForwarded += payload_len;
         _canClientSendEvent.notifyAll();
@@ -401,9 +411,12 @@ void TCP::connect(){
 
     {
         uint64_t wevent = _connStateDidChange.getNextEvent();
+        auto start = std::chrono::steady_clock::now();
         send_tcp(TH_SYN);
         _connStateDidChange.waitForEvent(wevent);
         retassure(_connState == CONN_CONNECTED, "Failed to establish TCP connection clifd=%d _connState=%d",_pfd.fd,_connState);
+        _connectLatencyUs.set(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+        _dev->getLatencies().connect.recordSince(start);
     }
     info("TCP Connected to device");
     _cli->send_result(_cli->_connectTag, RESULT_OK);
@@ -412,6 +425,35 @@ void TCP::connect(){
     startLoop();
 }
 
+TCP::tcpstats TCP::getStats() noexcept{
+    tcpstats ret{};
+    ret.sPort = _sPort;
+    ret.dPort = _dPort;
+    switch (_connState) {
+        case CONN_CONNECTING:
+            ret.state = "Connecting";
+            break;
+        case CONN_CONNECTED:
+            ret.state = "Connected";
+            break;
+        case CONN_REFUSED:
+            ret.state = "Refused";
+            break;
+        case CONN_DYING:
+            ret.state = "Dying";
+            break;
+        default:
+            ret.state = "Unknown";
+            break;
+    }
+    ret.bytesToDevice = _bytesToDevice.get();
+    ret.bytesFromDevice = _bytesFromDevice.get();
+    ret.windowStalls = _windowStalls.get();
+    ret.acksSent = _acksSent.get();
+    ret.connectLatencyUs = _connectLatencyUs.get();
+    return ret;
+}
+
 #pragma mark static
 void TCP::send_RST(USBDevice *dev, tcphdr *hdr){
     tcphdr tcp_header{};
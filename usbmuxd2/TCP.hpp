@@ -42,6 +42,12 @@ class TCP : public tihmstar::Manager {
     char *_payloadBuf;
     struct pollfd _pfd;
 
+    StatCounter _bytesToDevice;
+    StatCounter _bytesFromDevice;
+    StatCounter _windowStalls;  //times send_data had to wait for the device to open the window
+    StatCounter _acksSent;
+    StatCounter _connectLatencyUs;
+
 #pragma mark private
     bool loopEvent() override;
     void stopAction() noexcept override;
@@ -50,13 +56,23 @@ class TCP : public tihmstar::Manager {
     void send_rst_nolock();
     void send_rst();
     void send_fin();
-    size_t send_data(void *buf, size_t len);
+    size_t send_data(void *buf, size_t len, std::chrono::steady_clock::time_point receivedAt);
     void flush_data();
 
     
 public:
     static constexpr int bufsize = 0x80000;
     static constexpr int TCP_MTU = (USB_MTU-sizeof(tcphdr)-sizeof(USBDevice::mux_header))&0xff00;
+    struct tcpstats{
+        uint16_t sPort;
+        uint16_t dPort;
+        const char *state;
+        uint64_t bytesToDevice;
+        uint64_t bytesFromDevice;
+        uint64_t windowStalls;
+        uint64_t acksSent;
+        uint64_t connectLatencyUs;  //from SYN until the device answered with SYN/ACK
+    };
 
     TCP(uint16_t sPort, uint16_t dPort, std::shared_ptr<USBDevice> dev, std::shared_ptr<Client> cli);
     ~TCP();
@@ -66,9 +82,14 @@ public:
     void deconstruct() noexcept;
 
 #pragma mark members
-    void handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_len);
+    /*
+        completedAt is when the transport received the packet, used for latency stats if set.
+     */
+    void handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_len, std::chrono::steady_clock::time_point completedAt = {});
     void connect();
 
+    tcpstats getStats() noexcept;
+
 #pragma mark static
     static void send_RST(USBDevice *dev, tcphdr *hdr);
 };
@@ -0,0 +1,81 @@
+//
+//  TimerWheel.cpp
+//  usbmuxd2
+//
+
+#include "TimerWheel.hpp"
+#include <libgeneral/macros.h>
+
+#pragma mark TimerWheel
+TimerWheel::TimerWheel(std::chrono::milliseconds tick, size_t slots)
+: _tick(tick), _slots(slots ? slots : 1), _cur(0), _lastTick(clock::now()), _nextID(1)
+{
+    assure(_tick.count() > 0);
+}
+
+TimerWheel::~TimerWheel(){
+    //
+}
+
+#pragma mark public
+TimerWheel::timer_id TimerWheel::schedule(std::chrono::milliseconds timeout, uint64_t cookie){
+    uint64_t ticks = 0;
+    size_t slot = 0;
+    timer t = {};
+
+    //an idle wheel doesn't advance, don't make the new timer pay for ticks that passed meanwhile
+    if (!_timers.size()) _lastTick = clock::now();
+
+    //round up, and count the partial tick we are in right now
+    ticks = (timeout.count() + _tick.count() - 1) / _tick.count() + 1;
+    slot = (_cur + ticks) % _slots.size();
+    t.id = _nextID++;
+    t.cookie = cookie;
+    t.rounds = (ticks - 1) / _slots.size();
+
+    _slots[slot].push_front(t);
+    _timers[t.id] = {slot, _slots[slot].begin()};
+    return t.id;
+}
+
+bool TimerWheel::cancel(timer_id id) noexcept{
+    auto it = _timers.find(id);
+    if (it == _timers.end()) return false;
+    _slots[it->second.first].erase(it->second.second);
+    _timers.erase(it);
+    return true;
+}
+
+void TimerWheel::advance(clock::time_point now, std::vector<uint64_t> &expired){
+    while (_lastTick + _tick <= now) {
+        _lastTick += _tick;
+        _cur = (_cur + 1) % _slots.size();
+        auto &slot = _slots[_cur];
+        for (auto it = slot.begin(); it != slot.end();) {
+            if (it->rounds) {
+                it->rounds--;
+                ++it;
+                continue;
+            }
+            expired.push_back(it->cookie);
+            _timers.erase(it->id);
+            it = slot.erase(it);
+        }
+        if (!_timers.size()) {
+            //nothing left to expire, skip the remaining ticks
+            _lastTick = now;
+            break;
+        }
+    }
+}
+
+int TimerWheel::timeUntilNextTickMs(clock::time_point now) const noexcept{
+    int64_t ret = 0;
+    if (!_timers.size()) return -1;
+    ret = std::chrono::duration_cast<std::chrono::milliseconds>(_lastTick + _tick - now).count();
+    return (ret > 0) ? (int)ret : 0;
+}
+
+size_t TimerWheel::size() const noexcept{
+    return _timers.size();
+}
@@ -0,0 +1,61 @@
+//
+//  TimerWheel.hpp
+//  usbmuxd2
+//
+
+#ifndef TimerWheel_hpp
+#define TimerWheel_hpp
+
+#include <stdint.h>
+#include <chrono>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+/*
+    Hashed timer wheel.
+    Timers are hashed into slots by their expiry tick, timeouts longer than one revolution
+    carry a round counter. schedule() and cancel() are O(1), advance() only touches the slots it passes.
+    Resolution is one tick, timers never fire early.
+    Not thread safe, the owner is expected to serialize access.
+ */
+class TimerWheel{
+public:
+    typedef uint64_t timer_id;
+    typedef std::chrono::steady_clock clock;
+private:
+    struct timer{
+        timer_id id;
+        uint64_t cookie;
+        uint64_t rounds;
+    };
+    std::chrono::milliseconds _tick;
+    std::vector<std::list<timer>> _slots;
+    std::unordered_map<timer_id, std::pair<size_t, std::list<timer>::iterator>> _timers;
+    size_t _cur;
+    clock::time_point _lastTick;
+    timer_id _nextID;
+
+public:
+    TimerWheel(std::chrono::milliseconds tick, size_t slots);
+    ~TimerWheel();
+
+    /*
+        cookie is handed back by advance() once the timer expired.
+     */
+    timer_id schedule(std::chrono::milliseconds timeout, uint64_t cookie);
+    bool cancel(timer_id id) noexcept;
+
+    /*
+        Moves the wheel forward to now and appends the cookies of all expired timers to expired.
+     */
+    void advance(clock::time_point now, std::vector<uint64_t> &expired);
+
+    /*
+        Time until advance() has work to do, -1 if no timer is pending (poll() semantics).
+     */
+    int timeUntilNextTickMs(clock::time_point now) const noexcept;
+    size_t size() const noexcept;
+};
+
+#endif /* TimerWheel_hpp */
@@ -0,0 +1,169 @@
+//
+//  BenchClient.cpp
+//  usbmuxd2
+//
+
+#include "BenchClient.hpp"
+#include "../usbmuxd2-proto.h"
+
+#include <libgeneral/macros.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#define MAX_PLIST_SIZE 0x100000
+
+#pragma mark BenchClient
+BenchClient::BenchClient(const char *socketPath)
+: _fd(-1), _tag(0)
+{
+    struct sockaddr_un addr = {};
+    retassure(strlen(socketPath) < sizeof(addr.sun_path), "socket path '%s' is too long", socketPath);
+    retassure((_fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0, "socket() failed: %s", strerror(errno));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+    if (::connect(_fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        int err = errno;
+        safeClose(_fd);
+        reterror("connect(%s) failed: %s", socketPath, strerror(err));
+    }
+}
+
+BenchClient::~BenchClient(){
+    safeClose(_fd);
+}
+
+#pragma mark public
+int BenchClient::fd() const noexcept{
+    return _fd;
+}
+
+void BenchClient::send_plist(plist_t p, uint32_t tag){
+    char *xml = NULL;
+    cleanup([&]{
+        safeFree(xml);
+    });
+    uint32_t xmlsize = 0;
+    usbmuxd_header hdr = {};
+
+    plist_to_xml(p, &xml, &xmlsize);
+    retassure(xml, "failed to serialize request");
+    hdr.length = (uint32_t)(sizeof(hdr) + xmlsize);
+    hdr.version = 1;
+    hdr.message = MESSAGE_PLIST;
+    hdr.tag = tag;
+    write_all(_fd, &hdr, sizeof(hdr));
+    write_all(_fd, xml, xmlsize);
+}
+
+plist_t BenchClient::recv_plist(uint32_t *tag){
+    usbmuxd_header hdr = {};
+    std::string payload;
+    plist_t ret = NULL;
+
+    read_all(_fd, &hdr, sizeof(hdr));
+    retassure(hdr.message == MESSAGE_PLIST, "unexpected message type %u", hdr.message);
+    retassure(hdr.length >= sizeof(hdr) && hdr.length - sizeof(hdr) <= MAX_PLIST_SIZE, "bad message length %u", hdr.length);
+    payload.resize(hdr.length - sizeof(hdr));
+    read_all(_fd, payload.data(), payload.size());
+    plist_from_xml(payload.data(), (uint32_t)payload.size(), &ret);
+    retassure(ret, "failed to parse reply");
+    if (tag) *tag = hdr.tag;
+    return ret;
+}
+
+plist_t BenchClient::request(plist_t req){
+    uint32_t tag = ++_tag;
+    send_plist(req, tag);
+    while (true) {
+        uint32_t rtag = 0;
+        plist_t rsp = recv_plist(&rtag);
+        if (rtag == tag) return rsp;
+        plist_free(rsp); //notification meant for a listener
+    }
+}
+
+std::vector<std::pair<uint32_t, std::string>> BenchClient::listDevices(){
+    plist_t p_req = NULL;
+    plist_t p_rsp = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_req, plist_free);
+        safeFreeCustom(p_rsp, plist_free);
+    });
+    std::vector<std::pair<uint32_t, std::string>> ret;
+    plist_t p_devs = NULL;
+
+    p_req = new_request("ListDevices");
+    p_rsp = request(p_req);
+    retassure(p_devs = plist_dict_get_item(p_rsp, "DeviceList"), "ListDevices reply without DeviceList");
+    for (uint32_t i = 0; i < plist_array_get_size(p_devs); i++) {
+        plist_t p_dev = plist_array_get_item(p_devs, i);
+        plist_t p_id = plist_dict_get_item(p_dev, "DeviceID");
+        plist_t p_props = plist_dict_get_item(p_dev, "Properties");
+        plist_t p_serial = p_props ? plist_dict_get_item(p_props, "SerialNumber") : NULL;
+        const char *serial = NULL;
+        uint64_t id = 0;
+        if (!p_id || !p_serial) continue;
+        plist_get_uint_val(p_id, &id);
+        if (!(serial = plist_get_string_ptr(p_serial, NULL))) continue;
+        ret.push_back({(uint32_t)id, serial});
+    }
+    return ret;
+}
+
+int BenchClient::connect(uint32_t deviceID, uint16_t port){
+    plist_t p_req = NULL;
+    plist_t p_rsp = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_req, plist_free);
+        safeFreeCustom(p_rsp, plist_free);
+    });
+    plist_t p_num = NULL;
+    uint64_t result = 0;
+    int ret = -1;
+
+    p_req = new_request("Connect");
+    plist_dict_set_item(p_req, "DeviceID", plist_new_uint(deviceID));
+    plist_dict_set_item(p_req, "PortNumber", plist_new_uint(htons(port)));
+    p_rsp = request(p_req);
+    retassure(p_num = plist_dict_get_item(p_rsp, "Number"), "Connect reply without result");
+    plist_get_uint_val(p_num, &result);
+    retassure(result == RESULT_OK, "Connect to device %u port %u failed with result %llu", deviceID, port, (unsigned long long)result);
+
+    ret = _fd; _fd = -1;
+    return ret;
+}
+
+#pragma mark static
+plist_t BenchClient::new_request(const char *messageType){
+    plist_t ret = plist_new_dict();
+    plist_dict_set_item(ret, "MessageType", plist_new_string(messageType));
+    plist_dict_set_item(ret, "ClientVersionString", plist_new_string("usbmuxd-bench"));
+    plist_dict_set_item(ret, "ProgName", plist_new_string("usbmuxd-bench"));
+    plist_dict_set_item(ret, "kLibUSBMuxVersion", plist_new_uint(3));
+    return ret;
+}
+
+void BenchClient::read_all(int fd, void *buf, size_t len){
+    size_t didRead = 0;
+    while (didRead < len) {
+        ssize_t cnt = read(fd, (char*)buf + didRead, len - didRead);
+        if (cnt < 0 && errno == EINTR) continue;
+        retassure(cnt > 0, "read failed: %s", cnt ? strerror(errno) : "connection closed");
+        didRead += cnt;
+    }
+}
+
+void BenchClient::write_all(int fd, const void *buf, size_t len){
+    size_t didWrite = 0;
+    while (didWrite < len) {
+        ssize_t cnt = write(fd, (const char*)buf + didWrite, len - didWrite);
+        if (cnt < 0 && errno == EINTR) continue;
+        retassure(cnt > 0, "write failed: %s", strerror(errno));
+        didWrite += cnt;
+    }
+}
@@ -0,0 +1,52 @@
+//
+//  BenchClient.hpp
+//  usbmuxd2
+//
+
+#ifndef BenchClient_hpp
+#define BenchClient_hpp
+
+#include <plist/plist.h>
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+    Minimal usbmuxd client speaking the plist protocol over the unix socket, like libusbmuxd does.
+ */
+class BenchClient{
+    int _fd;
+    uint32_t _tag;
+
+public:
+    BenchClient(const char *socketPath);
+    BenchClient(const BenchClient &) = delete;
+    ~BenchClient();
+
+    int fd() const noexcept;
+
+    void send_plist(plist_t p, uint32_t tag);
+    /*
+        Caller owns the returned plist.
+     */
+    plist_t recv_plist(uint32_t *tag = NULL);
+    plist_t request(plist_t req);
+
+    /*
+        Returns DeviceID and SerialNumber of all attached devices.
+     */
+    std::vector<std::pair<uint32_t, std::string>> listDevices();
+
+    /*
+        On success the socket becomes a raw pipe to the device port and is handed to the caller.
+     */
+    int connect(uint32_t deviceID, uint16_t port);
+
+    static plist_t new_request(const char *messageType);
+    static void read_all(int fd, void *buf, size_t len);
+    static void write_all(int fd, const void *buf, size_t len);
+};
+
+#endif /* BenchClient_hpp */
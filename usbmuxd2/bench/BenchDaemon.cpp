@@ -0,0 +1,58 @@
+//
+//  BenchDaemon.cpp
+//  usbmuxd2
+//
+
+#include "BenchDaemon.hpp"
+#include "BenchClient.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+
+#pragma mark BenchDaemon
+BenchDaemon::BenchDaemon(const SimUSBTransport::params &simulate, int listenBacklog)
+: _mux(nullptr)
+{
+    _socketPath = "/tmp/usbmuxd-bench." + std::to_string(getpid());
+    _config.doPreflight = false;
+    _config.listenBacklog = listenBacklog;
+
+    _mux = new Muxer(&_config);
+    try {
+        _mux->spawnClientManager(listenBacklog, _socketPath.c_str());
+        _mux->spawnUSBDeviceManager(&simulate);
+    } catch (...) {
+        safeDelete(_mux);
+        unlink(_socketPath.c_str());
+        throw;
+    }
+}
+
+BenchDaemon::~BenchDaemon(){
+    safeDelete(_mux);
+    if (_socketPath.size()) unlink(_socketPath.c_str());
+}
+
+#pragma mark public
+const char *BenchDaemon::socketPath() const noexcept{
+    return _socketPath.c_str();
+}
+
+Muxer *BenchDaemon::muxer() noexcept{
+    return _mux;
+}
+
+uint32_t BenchDaemon::waitForDevice(int timeoutMs){
+    BenchClient cli(_socketPath.c_str());
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (true) {
+        for (auto &d : cli.listDevices()) {
+            if (d.second.rfind("SIMULATED", 0) == 0) return d.first;
+        }
+        retassure(std::chrono::steady_clock::now() < deadline, "no simulated device showed up within %dms", timeoutMs);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
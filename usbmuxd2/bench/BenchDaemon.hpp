@@ -0,0 +1,38 @@
+//
+//  BenchDaemon.hpp
+//  usbmuxd2
+//
+
+#ifndef BenchDaemon_hpp
+#define BenchDaemon_hpp
+
+#include "../Muxer.hpp"
+#include "../sysconf/sysconf.hpp"
+#include "../Devices/SimUSBTransport.hpp"
+
+#include <string>
+
+/*
+    The daemon without main(): a Muxer with simulated USB devices, serving clients on a private socket.
+    Doesn't touch the lockfile, config or records of a system wide usbmuxd.
+ */
+class BenchDaemon{
+    Config _config;
+    Muxer *_mux;
+    std::string _socketPath;
+
+public:
+    BenchDaemon(const SimUSBTransport::params &simulate, int listenBacklog = 0);
+    BenchDaemon(const BenchDaemon &) = delete;
+    ~BenchDaemon();
+
+    const char *socketPath() const noexcept;
+    Muxer *muxer() noexcept;
+
+    /*
+        Returns the DeviceID of the first simulated device, waits for it to show up for at most timeoutMs.
+     */
+    uint32_t waitForDevice(int timeoutMs = 5000);
+};
+
+#endif /* BenchDaemon_hpp */
@@ -0,0 +1,194 @@
+//
+//  MicroBench.cpp
+//  usbmuxd2
+//
+
+#include "MicroBench.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+using namespace microbench;
+
+static std::vector<std::pair<std::string, benchmark>> &registry(){
+    static std::vector<std::pair<std::string, benchmark>> benchmarks;
+    return benchmarks;
+}
+
+#pragma mark State
+State::State(uint64_t maxIterations)
+: _iterations(0), _maxIterations(maxIterations), _bytes(0)
+, _start{}, _elapsed(0), _running(false)
+{
+    //
+}
+
+bool State::keepRunning() noexcept{
+    if (_error.size()) return false;
+    if (!_iterations && !_running) {
+        resumeTiming();
+    }
+    if (_iterations == _maxIterations) {
+        pauseTiming();
+        return false;
+    }
+    _iterations++;
+    return true;
+}
+
+void State::pauseTiming() noexcept{
+    if (!_running) return;
+    _elapsed += std::chrono::steady_clock::now() - _start;
+    _running = false;
+}
+
+void State::resumeTiming() noexcept{
+    if (_running) return;
+    _start = std::chrono::steady_clock::now();
+    _running = true;
+}
+
+void State::setBytesProcessed(uint64_t bytes) noexcept{
+    _bytes = bytes;
+}
+
+void State::skipWithError(const char *msg){
+    pauseTiming();
+    _error = msg;
+}
+
+uint64_t State::iterations() const noexcept{
+    return _iterations;
+}
+
+uint64_t State::bytesProcessed() const noexcept{
+    return _bytes;
+}
+
+double State::seconds() const noexcept{
+    return std::chrono::duration<double>(_elapsed).count();
+}
+
+const std::string &State::errorMessage() const noexcept{
+    return _error;
+}
+
+#pragma mark runner
+void microbench::registerBenchmark(std::string name, benchmark fn){
+    registry().push_back({name, fn});
+}
+
+static void usage(const char *prog){
+    printf("Usage: %s [OPTIONS]\n", prog);
+    printf("Runs the per-packet microbenchmarks against stubbed devices and clients.\n\n");
+    printf("  -f, --filter=STR\tOnly run benchmarks whose name contains STR\n");
+    printf("  -m, --min-time=S\tMinimum seconds per benchmark (default: 0.5)\n");
+    printf("  -j, --json\t\tPrint one JSON object instead of a table\n");
+    printf("  -l, --list\t\tList benchmark names and exit\n");
+    printf("  -h, --help\t\tPrint this message\n");
+}
+
+int microbench::runBenchmarks(int argc, const char *argv[]){
+    static struct option longopts[] = {
+        {"filter",   required_argument, NULL, 'f'},
+        {"min-time", required_argument, NULL, 'm'},
+        {"json",     no_argument,       NULL, 'j'},
+        {"list",     no_argument,       NULL, 'l'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *filter = NULL;
+    double minTime = 0.5;
+    bool json = false;
+    bool list = false;
+    bool first = true;
+    int failed = 0;
+    int opt = 0;
+
+    while ((opt = getopt_long(argc, (char* const *)argv, "f:m:jlh", longopts, NULL)) >= 0) {
+        switch (opt) {
+            case 'f':
+                filter = optarg;
+                break;
+            case 'm':
+                minTime = atof(optarg);
+                break;
+            case 'j':
+                json = true;
+                break;
+            case 'l':
+                list = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (minTime <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (json) {
+        printf("{\"benchmark\":\"micro\"");
+#ifdef VERSION_STRING
+        printf(",\"version\":\"%s\"", VERSION_STRING);
+#endif
+        printf(",\"min_time_s\":%.3f,\"results\":[", minTime);
+    }else if (!list) {
+        printf("%-48s %14s %12s %12s\n", "Benchmark", "Time/op (ns)", "Iterations", "MB/s");
+    }
+
+    for (auto &b : registry()) {
+        uint64_t iterations = 1;
+        if (filter && b.first.find(filter) == std::string::npos) continue;
+        if (list) {
+            printf("%s\n", b.first.c_str());
+            continue;
+        }
+        while (true) {
+            State state(iterations);
+            try {
+                b.second(state);
+            } catch (tihmstar::exception &e) {
+                state.skipWithError(e.what());
+                failed++;
+            }
+            if (state.errorMessage().size() || state.seconds() >= minTime || iterations >= (1ULL << 40)) {
+                double nsPerOp = state.iterations() ? state.seconds() * 1e9 / state.iterations() : 0;
+                double mbps = state.seconds() ? state.bytesProcessed() / state.seconds() / 1e6 : 0;
+                if (json) {
+                    printf("%s{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f", first ? "" : ",", b.first.c_str(), (unsigned long long)state.iterations(), nsPerOp);
+                    if (state.bytesProcessed()) printf(",\"MBps\":%.2f", mbps);
+                    if (state.errorMessage().size()) printf(",\"error\":\"%s\"", state.errorMessage().c_str());
+                    printf("}");
+                }else if (state.errorMessage().size()) {
+                    printf("%-48s ERROR: %s\n", b.first.c_str(), state.errorMessage().c_str());
+                }else if (state.bytesProcessed()) {
+                    printf("%-48s %14.1f %12llu %12.1f\n", b.first.c_str(), nsPerOp, (unsigned long long)state.iterations(), mbps);
+                }else{
+                    printf("%-48s %14.1f %12llu %12s\n", b.first.c_str(), nsPerOp, (unsigned long long)state.iterations(), "");
+                }
+                first = false;
+                fflush(stdout);
+                break;
+            }
+            //same growth rule as Google Benchmark: aim 40% past the target, but never more than 10x per step
+            {
+                double multiplier = state.seconds() > 0 ? minTime * 1.4 / state.seconds() : 10;
+                if (multiplier > 10) multiplier = 10;
+                iterations = (uint64_t)(iterations * multiplier) + 1;
+            }
+        }
+    }
+    if (json) printf("]}\n");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+//
+//  MicroBench.hpp
+//  usbmuxd2
+//
+
+#ifndef MicroBench_hpp
+#define MicroBench_hpp
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <string>
+
+/*
+    Tiny Google Benchmark lookalike, so the microbenchmarks build without another dependency.
+    A benchmark loops while(state.keepRunning()), the runner grows the iteration count until a run
+    takes at least --min-time seconds and reports the time per iteration of the last run.
+ */
+namespace microbench {
+
+class State{
+    uint64_t _iterations;
+    uint64_t _maxIterations;
+    uint64_t _bytes;
+    std::chrono::steady_clock::time_point _start;
+    std::chrono::nanoseconds _elapsed;
+    bool _running;
+    std::string _error;
+
+public:
+    State(uint64_t maxIterations);
+
+    bool keepRunning() noexcept;
+    /*
+        Excludes setup work inside the loop from the measurement.
+     */
+    void pauseTiming() noexcept;
+    void resumeTiming() noexcept;
+
+    void setBytesProcessed(uint64_t bytes) noexcept;
+    void skipWithError(const char *msg);
+
+    uint64_t iterations() const noexcept;
+    uint64_t bytesProcessed() const noexcept;
+    double seconds() const noexcept;
+    const std::string &errorMessage() const noexcept;
+};
+
+typedef std::function<void(State &state)> benchmark;
+
+void registerBenchmark(std::string name, benchmark fn);
+/*
+    Runs all registered benchmarks whose name contains --filter, returns the exit code for main.
+ */
+int runBenchmarks(int argc, const char *argv[]);
+
+} // namespace microbench
+
+#endif /* MicroBench_hpp */
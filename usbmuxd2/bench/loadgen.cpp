@@ -0,0 +1,708 @@
+//
+//  loadgen.cpp
+//  usbmuxd2
+//
+
+/*
+    Control plane load generator.
+    Holds thousands of Listen subscriptions open on the client socket while workers fire a weighted mix of
+    ListDevices, ReadPairRecord, ReadBUID and short lived Listen requests at it, and plugs a simulated USB
+    device in and out to measure how long notifications take to reach every listener.
+    Prints one JSON object on stdout, progress goes to stderr.
+ */
+
+#include "BenchDaemon.hpp"
+#include "BenchClient.hpp"
+#include "../usbmuxd2-proto.h"
+
+#include <libgeneral/macros.h>
+
+#include <sys/resource.h>
+#include <poll.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock benchclock;
+
+enum loadop{
+    OP_LISTDEVICES = 0,
+    OP_READPAIRRECORD,
+    OP_READBUID,
+    OP_LISTEN,
+    OP_COUNT
+};
+
+static const char *opnames[OP_COUNT] = {"ListDevices", "ReadPairRecord", "ReadBUID", "Listen"};
+
+struct loadopts{
+    int listeners;
+    int listenerThreads;
+    int clients;
+    int workers;
+    int durationS;
+    uint64_t rate; //ops/s over all workers, 0 is unthrottled
+    int mix[OP_COUNT];
+    int hotplugs;
+    int hotplugIntervalMs;
+    int fanoutTimeoutMs;
+    int listenBacklog;
+    SimUSBTransport::params sim;
+};
+
+struct opstats{
+    std::vector<uint64_t> samples; //ns
+    uint64_t errors;
+};
+
+struct procstats{
+    int threads;
+    uint64_t rssKB;
+};
+
+/*
+    Shared between the hotplug driver and the listener threads, one event is in flight at a time.
+ */
+struct fanoutstate{
+    std::atomic<int> kind{0}; //1 attach, 2 detach
+    std::atomic<int64_t> triggerNs{0};
+    std::atomic<int64_t> completeNs{0};
+    std::atomic<uint32_t> deviceID{0};
+    std::atomic<int> delivered{0};
+    std::atomic<uint64_t> notifications{0};
+    std::atomic<uint64_t> disconnects{0};
+    int target = 0;
+    std::string serial;
+    std::mutex lck;
+    std::condition_variable done;
+};
+
+#pragma mark helpers
+static int64_t now_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(benchclock::now().time_since_epoch()).count();
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p){
+    size_t idx = 0;
+    if (!sorted.size()) return 0;
+    idx = (size_t)(p * sorted.size());
+    if (idx >= sorted.size()) idx = sorted.size()-1;
+    return sorted[idx];
+}
+
+/*
+    Threads and resident set of this process, daemon and load generator together.
+ */
+static bool proc_stats(procstats &st){
+#ifdef __linux__
+    FILE *f = NULL;
+    char line[256];
+    st = {-1, 0};
+    if (!(f = fopen("/proc/self/status", "r"))) return false;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, "Threads:", 8)) st.threads = atoi(line+8);
+        else if (!strncmp(line, "VmRSS:", 6)) st.rssKB = strtoull(line+6, NULL, 10);
+    }
+    fclose(f);
+    return st.threads >= 0;
+#else
+    st = {-1, 0};
+    return false;
+#endif
+}
+
+static uint64_t reply_number(plist_t p_rsp){
+    plist_t p_num = plist_dict_get_item(p_rsp, "Number");
+    uint64_t ret = UINT64_MAX;
+    if (p_num) plist_get_uint_val(p_num, &ret);
+    return ret;
+}
+
+static bool reply_ok(int op, plist_t p_rsp){
+    switch (op) {
+        case OP_LISTDEVICES:
+            return plist_dict_get_item(p_rsp, "DeviceList") != NULL;
+        case OP_READPAIRRECORD:
+            //simulated devices are never paired, "no such record" is the expected answer
+            return plist_dict_get_item(p_rsp, "PairRecordData") != NULL || reply_number(p_rsp) == ENOENT;
+        case OP_READBUID:
+            return plist_dict_get_item(p_rsp, "BUID") != NULL;
+        case OP_LISTEN:
+            return reply_number(p_rsp) == RESULT_OK;
+        default:
+            return false;
+    }
+}
+
+static void print_latency(const char *name, std::vector<uint64_t> &samples, uint64_t errors, double seconds, bool first){
+    std::vector<uint64_t> hist;
+    std::sort(samples.begin(), samples.end());
+    for (uint64_t s : samples) {
+        //bucket i holds [2^i, 2^(i+1)) microseconds, bucket 0 everything below 2us
+        uint64_t us = s / 1000;
+        size_t b = 0;
+        while (us > 1) { us >>= 1; b++; }
+        if (hist.size() <= b) hist.resize(b+1);
+        hist[b]++;
+    }
+    printf("%s\"%s\":{\"ops\":%zu,\"errors\":%llu,\"ops_per_s\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,\"hist_log2_us\":[",
+           first ? "" : ",", name, samples.size(), (unsigned long long)errors, seconds ? samples.size() / seconds : 0,
+           percentile(samples, 0.50) / 1e3, percentile(samples, 0.99) / 1e3, percentile(samples, 0.999) / 1e3,
+           samples.size() ? samples.back() / 1e3 : 0);
+    for (size_t i = 0; i < hist.size(); i++) {
+        printf("%s%llu", i ? "," : "", (unsigned long long)hist[i]);
+    }
+    printf("]}");
+}
+
+static void print_fanout(const char *name, std::vector<uint64_t> &delays, std::vector<uint64_t> &complete, uint64_t missed, bool first){
+    std::sort(delays.begin(), delays.end());
+    std::sort(complete.begin(), complete.end());
+    printf("%s\"%s\":{\"events\":%zu,\"delivered\":%zu,\"missed\":%llu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"all_listeners_p50_us\":%.1f,\"all_listeners_max_us\":%.1f}",
+           first ? "" : ",", name, complete.size(), delays.size(), (unsigned long long)missed,
+           percentile(delays, 0.50) / 1e3, percentile(delays, 0.99) / 1e3, delays.size() ? delays.back() / 1e3 : 0,
+           percentile(complete, 0.50) / 1e3, complete.size() ? complete.back() / 1e3 : 0);
+}
+
+#pragma mark listeners
+static void listener_loop(std::vector<std::unique_ptr<BenchClient>> &clients, size_t begin, size_t end,
+                          fanoutstate &fan, std::atomic<bool> &stop, std::vector<uint64_t> delays[2]){
+    std::vector<struct pollfd> pfds;
+    for (size_t i = begin; i < end; i++) {
+        pfds.push_back({.fd = clients[i]->fd(), .events = POLLIN});
+    }
+    while (!stop) {
+        int pr = poll(pfds.data(), pfds.size(), 100);
+        if (pr < 0 && errno == EINTR) continue;
+        if (pr <= 0) continue;
+        for (size_t i = 0; i < pfds.size(); i++) {
+            plist_t p_msg = NULL;
+            cleanup([&]{
+                safeFreeCustom(p_msg, plist_free);
+            });
+            const char *msgtype = NULL;
+            int64_t arrived = 0;
+            int kind = 0;
+            if (!pfds[i].revents) continue;
+            try {
+                retassure(!(pfds[i].revents & (POLLERR | POLLNVAL)), "socket error");
+                p_msg = clients[begin+i]->recv_plist();
+            } catch (tihmstar::exception &e) {
+                fan.disconnects++;
+                pfds[i].fd = -1; //poll skips negative fds
+                continue;
+            }
+            arrived = now_ns();
+            fan.notifications++;
+            {
+                plist_t p_type = plist_dict_get_item(p_msg, "MessageType");
+                if (!p_type || !(msgtype = plist_get_string_ptr(p_type, NULL))) continue;
+            }
+            if (!strcmp(msgtype, "Attached")) {
+                plist_t p_props = plist_dict_get_item(p_msg, "Properties");
+                plist_t p_serial = p_props ? plist_dict_get_item(p_props, "SerialNumber") : NULL;
+                plist_t p_id = plist_dict_get_item(p_msg, "DeviceID");
+                const char *serial = p_serial ? plist_get_string_ptr(p_serial, NULL) : NULL;
+                uint64_t id = 0;
+                if (!serial || fan.serial != serial || fan.kind != 1) continue;
+                if (p_id) plist_get_uint_val(p_id, &id);
+                fan.deviceID = (uint32_t)id;
+                kind = 1;
+            }else if (!strcmp(msgtype, "Detached")) {
+                plist_t p_id = plist_dict_get_item(p_msg, "DeviceID");
+                uint64_t id = 0;
+                if (!p_id || fan.kind != 2) continue;
+                plist_get_uint_val(p_id, &id);
+                if (id != fan.deviceID) continue;
+                kind = 2;
+            }else{
+                continue;
+            }
+            delays[kind-1].push_back(arrived - fan.triggerNs);
+            if (++fan.delivered == fan.target) {
+                std::unique_lock<std::mutex> ul(fan.lck);
+                fan.completeNs = arrived;
+                fan.done.notify_all();
+            }
+        }
+    }
+}
+
+#pragma mark workers
+/*
+    Keeps one request in flight on every connection it owns.
+    With a rate set, latency is taken from the scheduled send time rather than the actual one,
+    so a stalled daemon shows up as latency instead of silently lowering the offered load.
+ */
+static void worker_loop(const char *socketPath, const char *recordID, int numClients, const loadopts &opts,
+                        benchclock::time_point deadline, std::atomic<bool> &failed, opstats stats[OP_COUNT]){
+    struct conn{
+        std::unique_ptr<BenchClient> cli;
+        std::unique_ptr<BenchClient> churn; //short lived connection of a Listen op
+        int op;
+        uint32_t tag;
+        benchclock::time_point start;
+        bool busy;
+    };
+    std::vector<conn> conns(numClients);
+    std::vector<int> schedule;
+    std::vector<struct pollfd> pfds;
+    std::vector<size_t> pfdConn;
+    size_t nextOp = 0;
+    size_t nextConn = 0;
+    size_t inflight = 0;
+    uint32_t tag = 0;
+    auto interval = opts.rate ? std::chrono::nanoseconds((uint64_t)1e9 * opts.workers / opts.rate) : std::chrono::nanoseconds(0);
+    auto nextSend = benchclock::now();
+
+    for (int op = 0; op < OP_COUNT; op++) {
+        for (int w = 0; w < opts.mix[op]; w++) schedule.push_back(op);
+    }
+    for (auto &c : conns) {
+        c.cli = std::make_unique<BenchClient>(socketPath);
+        c.busy = false;
+    }
+
+    while (benchclock::now() < deadline || inflight) {
+        auto now = benchclock::now();
+        //issue
+        for (size_t n = 0; n < conns.size() && now < deadline; n++) {
+            conn &c = conns[nextConn];
+            plist_t p_req = NULL;
+            cleanup([&]{
+                safeFreeCustom(p_req, plist_free);
+            });
+            if (opts.rate && now < nextSend) break;
+            nextConn = (nextConn + 1) % conns.size();
+            if (c.busy) continue;
+            c.op = schedule[nextOp++ % schedule.size()];
+            c.tag = ++tag;
+            c.start = opts.rate ? nextSend : now;
+            if (opts.rate) nextSend += interval;
+            try {
+                switch (c.op) {
+                    case OP_LISTDEVICES:
+                        p_req = BenchClient::new_request("ListDevices");
+                        break;
+                    case OP_READPAIRRECORD:
+                        p_req = BenchClient::new_request("ReadPairRecord");
+                        plist_dict_set_item(p_req, "PairRecordID", plist_new_string(recordID));
+                        break;
+                    case OP_READBUID:
+                        p_req = BenchClient::new_request("ReadBUID");
+                        break;
+                    case OP_LISTEN:
+                        p_req = BenchClient::new_request("Listen");
+                        c.churn = std::make_unique<BenchClient>(socketPath);
+                        break;
+                }
+                (c.churn ? c.churn : c.cli)->send_plist(p_req, c.tag);
+            } catch (tihmstar::exception &e) {
+                error("%s request failed: %s", opnames[c.op], e.what());
+                stats[c.op].errors++;
+                c.churn.reset();
+                continue;
+            }
+            c.busy = true;
+            inflight++;
+        }
+
+        //collect
+        pfds.clear();
+        pfdConn.clear();
+        for (size_t i = 0; i < conns.size(); i++) {
+            if (!conns[i].busy) continue;
+            pfds.push_back({.fd = (conns[i].churn ? conns[i].churn : conns[i].cli)->fd(), .events = POLLIN});
+            pfdConn.push_back(i);
+        }
+        {
+            int timeout = 100;
+            int pr = 0;
+            if (opts.rate && inflight < conns.size() && benchclock::now() < deadline) {
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(nextSend - benchclock::now()).count();
+                timeout = (int)std::max<int64_t>(0, std::min<int64_t>(wait, timeout));
+            }
+            if (!pfds.size()) {
+                if (timeout) std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+                continue;
+            }
+            if ((pr = poll(pfds.data(), pfds.size(), timeout)) <= 0) {
+                if (pr < 0 && errno != EINTR) {
+                    error("poll failed: %s", strerror(errno));
+                    failed = true;
+                    return;
+                }
+                continue;
+            }
+        }
+        for (size_t i = 0; i < pfds.size(); i++) {
+            conn &c = conns[pfdConn[i]];
+            plist_t p_rsp = NULL;
+            cleanup([&]{
+                safeFreeCustom(p_rsp, plist_free);
+            });
+            uint32_t rtag = 0;
+            if (!pfds[i].revents) continue;
+            try {
+                p_rsp = (c.churn ? c.churn : c.cli)->recv_plist(&rtag);
+            } catch (tihmstar::exception &e) {
+                error("%s reply failed: %s", opnames[c.op], e.what());
+                failed = true;
+                return;
+            }
+            if (rtag != c.tag) continue; //notification, the reply is still coming
+            stats[c.op].samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(benchclock::now() - c.start).count());
+            if (!reply_ok(c.op, p_rsp)) stats[c.op].errors++;
+            c.churn.reset();
+            c.busy = false;
+            inflight--;
+        }
+    }
+}
+
+#pragma mark hotplug
+static void hotplug_loop(BenchDaemon &daemon, int num, const loadopts &opts, fanoutstate &fan, std::atomic<bool> &stop,
+                         std::vector<uint64_t> complete[2], uint64_t missed[2]){
+    for (int i = 0; i < opts.hotplugs * 2 && !stop; i++) {
+        int kind = (i & 1) + 1;
+        int64_t trigger = 0;
+        bool allDelivered = false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(opts.hotplugIntervalMs));
+        fan.delivered = 0;
+        fan.completeNs = 0;
+        fan.triggerNs = trigger = now_ns();
+        fan.kind = kind;
+        try {
+            //attach delay includes the simulated device answering the mux version handshake
+            daemon.muxer()->simulate_usb_hotplug(num, kind == 1);
+        } catch (tihmstar::exception &e) {
+            error("hotplug %s failed: %s", kind == 1 ? "attach" : "detach", e.what());
+            missed[kind-1] += fan.target;
+            continue;
+        }
+        {
+            std::unique_lock<std::mutex> ul(fan.lck);
+            allDelivered = fan.done.wait_for(ul, std::chrono::milliseconds(opts.fanoutTimeoutMs), [&]{
+                return fan.completeNs != 0;
+            });
+        }
+        fan.kind = 0;
+        if (allDelivered) {
+            complete[kind-1].push_back(fan.completeNs - trigger);
+        }else{
+            missed[kind-1] += fan.target - fan.delivered;
+        }
+    }
+    //never leave the device plugged in for the next run
+    if (opts.hotplugs) daemon.muxer()->simulate_usb_hotplug(num, false);
+}
+
+static void usage(const char *prog){
+    printf("Usage: %s [OPTIONS]\n", prog);
+    printf("Floods the client socket with control plane requests and measures notification fan-out.\n\n");
+    printf("  -l, --listeners=N\t\tIdle Listen connections held open (default: 1000)\n");
+    printf("      --listener-threads=N\tThreads reading notifications (default: 4)\n");
+    printf("  -c, --clients=N\t\tRequest connections (default: 200)\n");
+    printf("  -w, --workers=N\t\tThreads driving the request connections (default: 8)\n");
+    printf("  -t, --duration=S\t\tSeconds of request load (default: 5)\n");
+    printf("  -r, --rate=OPS\t\tRequests per second over all workers, 0 is unthrottled (default: 0)\n");
+    printf("      --mix=L,P,B,N\t\tWeights of ListDevices, ReadPairRecord, ReadBUID and Listen (default: 8,8,0,1)\n");
+    printf("\t\t\t\tReadBUID creates the system BUID if there is none yet\n");
+    printf("      --hotplugs=N\t\tAttach/detach cycles of a simulated device during the load (default: 20)\n");
+    printf("      --hotplug-interval=MS\tPause before every attach and detach (default: 100)\n");
+    printf("      --devices=N\t\tSimulated devices attached the whole time (default: 1)\n");
+    printf("      --listen-backlog=N\tListen backlog of the client socket (default: daemon default)\n");
+    printf("  -v, --verbose\t\t\tPrint daemon log messages\n");
+    printf("  -h, --help\t\t\tPrint this message\n");
+}
+
+#pragma mark main
+int main(int argc, const char * argv[]) {
+    static struct option longopts[] = {
+        {"listeners",        required_argument, NULL, 'l'},
+        {"listener-threads", required_argument, NULL,  0 },
+        {"clients",          required_argument, NULL, 'c'},
+        {"workers",          required_argument, NULL, 'w'},
+        {"duration",         required_argument, NULL, 't'},
+        {"rate",             required_argument, NULL, 'r'},
+        {"mix",              required_argument, NULL,  0 },
+        {"hotplugs",         required_argument, NULL,  0 },
+        {"hotplug-interval", required_argument, NULL,  0 },
+        {"devices",          required_argument, NULL,  0 },
+        {"listen-backlog",   required_argument, NULL,  0 },
+        {"verbose",          no_argument,       NULL, 'v'},
+        {"help",             no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    loadopts opts = {
+        .listeners = 1000,
+        .listenerThreads = 4,
+        .clients = 200,
+        .workers = 8,
+        .durationS = 5,
+        .rate = 0,
+        .mix = {8, 8, 0, 1},
+        .hotplugs = 20,
+        .hotplugIntervalMs = 100,
+        .fanoutTimeoutMs = 5000,
+        .listenBacklog = 0,
+        .sim = {
+            .devices = 1,
+            .version = 2,
+            .window = 0x20000,
+            .latencyUs = 0,
+            .bandwidth = 0,
+            .reorder = false,
+            .split = false,
+        },
+    };
+    int optindex = 0;
+    int opt = 0;
+    int verbose = 0;
+    int mixSum = 0;
+    std::vector<std::unique_ptr<BenchClient>> listeners;
+    std::vector<opstats> listenSetup(1);
+    std::vector<std::vector<opstats>> workerStats;
+    std::vector<std::vector<uint64_t>> listenerDelays;
+    std::vector<uint64_t> fanDelays[2];
+    std::vector<uint64_t> fanComplete[2];
+    uint64_t fanMissed[2] = {};
+    fanoutstate fan;
+    procstats idle = {};
+    procstats loaded = {};
+    procstats peak = {};
+    int generatorThreads = 0;
+    double loadSeconds = 0;
+    uint64_t totalOps = 0;
+    std::atomic<bool> failed{false};
+    std::atomic<bool> stop{false};
+
+    while ((opt = getopt_long(argc, (char* const *)argv, "l:c:w:t:r:vh", longopts, &optindex)) >= 0) {
+        switch (opt) {
+            case 0:
+            {
+                std::string curopt = longopts[optindex].name;
+                if (curopt == "listener-threads") {
+                    opts.listenerThreads = atoi(optarg);
+                }else if (curopt == "mix") {
+                    if (sscanf(optarg, "%d,%d,%d,%d", &opts.mix[0], &opts.mix[1], &opts.mix[2], &opts.mix[3]) != OP_COUNT) {
+                        usage(argv[0]);
+                        return 2;
+                    }
+                }else if (curopt == "hotplugs") {
+                    opts.hotplugs = atoi(optarg);
+                }else if (curopt == "hotplug-interval") {
+                    opts.hotplugIntervalMs = atoi(optarg);
+                }else if (curopt == "devices") {
+                    opts.sim.devices = atoi(optarg);
+                }else if (curopt == "listen-backlog") {
+                    opts.listenBacklog = atoi(optarg);
+                }
+            }
+                break;
+            case 'l':
+                opts.listeners = atoi(optarg);
+                break;
+            case 'c':
+                opts.clients = atoi(optarg);
+                break;
+            case 'w':
+                opts.workers = atoi(optarg);
+                break;
+            case 't':
+                opts.durationS = atoi(optarg);
+                break;
+            case 'r':
+                opts.rate = strtoull(optarg, NULL, 0);
+                break;
+            case 'v':
+                verbose++;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (opts.mix[i] < 0) mixSum = -1;
+        if (mixSum >= 0) mixSum += opts.mix[i];
+    }
+    if (opts.listeners < 0 || opts.listenerThreads <= 0 || opts.clients < 0 || opts.workers <= 0 || opts.durationS <= 0
+        || mixSum <= 0 || opts.hotplugs < 0 || opts.hotplugIntervalMs < 0 || opts.sim.devices < 0 || opts.sim.devices >= 0xfe) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (opts.workers > opts.clients) opts.workers = std::max(1, opts.clients);
+    if (opts.listenerThreads > opts.listeners) opts.listenerThreads = std::max(1, opts.listeners);
+
+    log_level = verbose ? LL_DEBUG : LL_ERROR;
+    signal(SIGPIPE, SIG_IGN);
+
+    //both ends of every connection live in this process
+    {
+        struct rlimit rl = {};
+        rlim_t need = 2 * (rlim_t)(opts.listeners + 2 * opts.clients) + 64;
+        getrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < need) {
+            rl.rlim_cur = std::min(need, rl.rlim_max);
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+        if (rl.rlim_cur < need) {
+            fprintf(stderr, "need %llu file descriptors but the hard limit is %llu, lower --listeners or --clients\n",
+                    (unsigned long long)need, (unsigned long long)rl.rlim_max);
+            return 1;
+        }
+    }
+
+    try {
+        BenchDaemon daemon(opts.sim, opts.listenBacklog);
+        std::string recordID = "SIMULATED-00000000000000";
+        std::vector<std::thread> listenerThreads;
+        std::vector<std::thread> workers;
+        std::thread hotplugger;
+        char serial[32] = {};
+
+        if (opts.sim.devices) {
+            daemon.waitForDevice();
+            for (auto &d : BenchClient(daemon.socketPath()).listDevices()) {
+                if (d.second.rfind("SIMULATED", 0) == 0) { recordID = d.second; break; }
+            }
+        }
+        snprintf(serial, sizeof(serial), "SIMULATED-%014d", opts.sim.devices); //first number not attached at startup
+        fan.serial = serial;
+        proc_stats(idle);
+
+        fprintf(stderr, "subscribing %d listeners\n", opts.listeners);
+        for (int i = 0; i < opts.listeners; i++) {
+            plist_t p_req = NULL;
+            plist_t p_rsp = NULL;
+            cleanup([&]{
+                safeFreeCustom(p_req, plist_free);
+                safeFreeCustom(p_rsp, plist_free);
+            });
+            auto start = benchclock::now();
+            listeners.push_back(std::make_unique<BenchClient>(daemon.socketPath()));
+            p_req = BenchClient::new_request("Listen");
+            p_rsp = listeners.back()->request(p_req);
+            listenSetup[0].samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(benchclock::now() - start).count());
+            if (reply_number(p_rsp) != RESULT_OK) listenSetup[0].errors++;
+        }
+        fan.target = opts.listeners;
+
+        listenerDelays.resize(opts.listenerThreads * 2);
+        for (int t = 0; t < opts.listenerThreads && opts.listeners; t++) {
+            size_t begin = (size_t)opts.listeners * t / opts.listenerThreads;
+            size_t end = (size_t)opts.listeners * (t+1) / opts.listenerThreads;
+            listenerThreads.emplace_back([&, begin, end, t]{
+                listener_loop(listeners, begin, end, fan, stop, &listenerDelays[t*2]);
+            });
+        }
+
+        fprintf(stderr, "load: %d clients on %d workers for %ds, %d hotplug cycles\n", opts.clients, opts.workers, opts.durationS, opts.hotplugs);
+        workerStats.resize(opts.workers, std::vector<opstats>(OP_COUNT));
+        {
+            auto start = benchclock::now();
+            auto deadline = start + std::chrono::seconds(opts.durationS);
+            for (int w = 0; w < opts.workers && opts.clients; w++) {
+                int numClients = opts.clients * (w+1) / opts.workers - opts.clients * w / opts.workers;
+                workers.emplace_back([&, w, numClients]{
+                    try {
+                        worker_loop(daemon.socketPath(), recordID.c_str(), numClients, opts, deadline, failed, workerStats[w].data());
+                    } catch (tihmstar::exception &e) {
+                        error("worker failed: %s", e.what());
+                        failed = true;
+                    }
+                });
+            }
+            if (opts.listeners && opts.hotplugs) {
+                hotplugger = std::thread([&]{
+                    try {
+                        hotplug_loop(daemon, opts.sim.devices, opts, fan, stop, fanComplete, fanMissed);
+                    } catch (tihmstar::exception &e) {
+                        error("hotplug failed: %s", e.what());
+                        failed = true;
+                    }
+                });
+            }
+            generatorThreads = 1 + (int)(listenerThreads.size() + workers.size()) + (hotplugger.joinable() ? 1 : 0);
+
+            //sample while the load runs, the daemon spawns threads per client and device
+            while (benchclock::now() < deadline) {
+                procstats st = {};
+                if (proc_stats(st)) {
+                    loaded = st;
+                    if (st.threads > peak.threads) peak.threads = st.threads;
+                    if (st.rssKB > peak.rssKB) peak.rssKB = st.rssKB;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            for (auto &t : workers) t.join();
+            loadSeconds = std::chrono::duration<double>(benchclock::now() - start).count();
+            if (hotplugger.joinable()) hotplugger.join();
+        }
+
+        stop = true;
+        for (auto &t : listenerThreads) t.join();
+        listeners.clear();
+    } catch (tihmstar::exception &e) {
+        fprintf(stderr, "load generator failed: %s\n", e.what());
+        stop = true;
+        return 1;
+    }
+
+    for (size_t i = 0; i < listenerDelays.size(); i++) {
+        fanDelays[i & 1].insert(fanDelays[i & 1].end(), listenerDelays[i].begin(), listenerDelays[i].end());
+    }
+
+    printf("{\"benchmark\":\"control-plane\"");
+#ifdef VERSION_STRING
+    printf(",\"version\":\"%s\"", VERSION_STRING);
+#endif
+    printf(",\"ok\":%s", failed ? "false" : "true");
+    printf(",\"config\":{\"listeners\":%d,\"clients\":%d,\"workers\":%d,\"duration_s\":%d,\"rate\":%llu,\"mix\":[%d,%d,%d,%d],\"hotplugs\":%d,\"devices\":%d}",
+           opts.listeners, opts.clients, opts.workers, opts.durationS, (unsigned long long)opts.rate,
+           opts.mix[0], opts.mix[1], opts.mix[2], opts.mix[3], opts.hotplugs, opts.sim.devices);
+    printf(",\"requests\":{");
+    for (int op = 0; op < OP_COUNT; op++) {
+        std::vector<uint64_t> samples;
+        uint64_t errors = 0;
+        for (auto &ws : workerStats) {
+            samples.insert(samples.end(), ws[op].samples.begin(), ws[op].samples.end());
+            errors += ws[op].errors;
+        }
+        totalOps += samples.size();
+        print_latency(opnames[op], samples, errors, loadSeconds, op == 0);
+        if (errors) failed = true;
+    }
+    printf("},\"ops_per_s\":%.1f", loadSeconds ? totalOps / loadSeconds : 0);
+    print_latency("listen_setup", listenSetup[0].samples, listenSetup[0].errors, 0, false);
+    printf(",\"fanout\":{");
+    print_fanout("attach", fanDelays[0], fanComplete[0], fanMissed[0], true);
+    print_fanout("detach", fanDelays[1], fanComplete[1], fanMissed[1], false);
+    printf(",\"notifications\":%llu,\"listener_disconnects\":%llu}",
+           (unsigned long long)fan.notifications.load(), (unsigned long long)fan.disconnects.load());
+    //daemon and load generator share the process, generator threads are subtracted, its memory is not
+    if (idle.threads >= 0) {
+        printf(",\"daemon\":{\"threads_idle\":%d,\"threads_loaded\":%d,\"threads_peak\":%d,\"rss_idle_KB\":%llu,\"rss_loaded_KB\":%llu,\"rss_peak_KB\":%llu}",
+               idle.threads - 1, loaded.threads - generatorThreads, peak.threads - generatorThreads,
+               (unsigned long long)idle.rssKB, (unsigned long long)loaded.rssKB, (unsigned long long)peak.rssKB);
+    }
+    printf("}\n");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,372 @@
+//
+//  microbench.cpp
+//  usbmuxd2
+//
+
+/*
+    Microbenchmarks for the functions every packet goes through.
+    Devices sit on a transport that drops whatever is sent to it, clients write into a socketpair
+    that is drained in the background, so each function is measured on its own without hardware.
+ */
+
+#include "MicroBench.hpp"
+#include "../Muxer.hpp"
+#include "../Client.hpp"
+#include "../TCP.hpp"
+#include "../sysconf/sysconf.hpp"
+#include "../Devices/USBDevice.hpp"
+#include "../Devices/USBTransport.hpp"
+#include "../Manager/USBDeviceManager.hpp"
+#include "../Manager/ClientManager.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_DEVICES 8
+#define BENCH_SPORT 0x100
+#define BENCH_DEVICE_SEQ 1000
+
+using namespace microbench;
+
+/*
+    Swallows all OUT transfers and never completes an IN transfer.
+ */
+class NullUSBTransport : public USBTransport{
+public:
+    uint64_t txBytes;
+
+    NullUSBTransport(USBDevice *dev) : USBTransport(dev), txBytes(0) {}
+
+    virtual int start_rx(int count) override {return 0;}
+    virtual void rx_done(rx_buffer rx) noexcept override {}
+    virtual void submit_tx(void *buf, size_t length) override {txBytes += length; free(buf);}
+    virtual void submit_zlp() override {}
+    virtual int maxPacketSize() const noexcept override {return USB_PACKET_SIZE;}
+    virtual void cancel() noexcept override {}
+    virtual bool idle() noexcept override {return true;}
+};
+
+/*
+    Reaches into USBDevice and Client to set up stubbed endpoints and call their private hot paths.
+ */
+class BenchPeer{
+public:
+    static std::shared_ptr<USBDevice> new_usb_device(Muxer *mux, USBDeviceManager *mgr, int num, int version){
+        std::shared_ptr<USBDevice> dev = std::make_shared<USBDevice>(mux, mgr, PID_RANGE_LOW);
+        USBDevice::mux_version_header vh = {.major = (uint32_t)version};
+        dev->_selfref = dev;
+        snprintf(dev->_serial, sizeof(dev->_serial), "MICROBENCH-%013d", num);
+        dev->_bus = SIM_USB_BUS;
+        dev->_address = (uint8_t)(num + 1);
+        dev->_devdesc.idVendor = VID_APPLE;
+        dev->_devdesc.idProduct = PID_RANGE_LOW;
+        dev->_speed = 480000000;
+        dev->_transport = new NullUSBTransport(dev.get());
+        //same as the device answering the version packet, registers it with the muxer
+        dev->device_version_input(&vh);
+        return dev;
+    }
+
+    static void add_connection(std::shared_ptr<USBDevice> dev, uint16_t sport, std::shared_ptr<TCP> conn){
+        guardWrite(dev->_conns_Guard);
+        dev->_conns[sport] = conn;
+    }
+
+    static void remove_connection(std::shared_ptr<USBDevice> dev, uint16_t sport){
+        guardWrite(dev->_conns_Guard);
+        dev->_conns.erase(sport);
+    }
+
+    static uint16_t next_rx_seq(std::shared_ptr<USBDevice> dev){
+        std::unique_lock<std::mutex> ul(dev->_usbLck);
+        return dev->_muxdev.rx_seq + 1;
+    }
+
+    static std::shared_ptr<Client> new_client(Muxer *mux, ClientManager *mgr, int fd){
+        std::shared_ptr<Client> cli = std::make_shared<Client>(mux, mgr, fd, 0);
+        cli->_selfref = cli;
+        cli->_proto_version = 1;
+        return cli;
+    }
+
+    static void processData(std::shared_ptr<Client> cli, const usbmuxd_header *hdr){
+        cli->processData(hdr);
+    }
+
+    static void send_plist_pkt(std::shared_ptr<Client> cli, uint32_t tag, plist_t plist){
+        cli->send_plist_pkt(tag, plist);
+    }
+};
+
+/*
+    One muxer with BENCH_DEVICES stubbed devices (the first one speaks v1, the rest v2),
+    a connected TCP session on the first two and a client whose replies go nowhere.
+ */
+struct fixture{
+    Config config;
+    std::string socketPath;
+    Muxer *mux;
+    USBDeviceManager *usbmgr;
+    ClientManager *climgr;
+    std::vector<std::shared_ptr<USBDevice>> devices;
+    std::shared_ptr<TCP> conns[2];
+    std::shared_ptr<Client> cli;
+    int peerfd;
+    std::thread drain;
+
+    fixture()
+    : mux(nullptr), usbmgr(nullptr), climgr(nullptr), peerfd(-1)
+    {
+        SimUSBTransport::params noDevices = {};
+        int fds[2] = {-1, -1};
+        socketPath = "/tmp/usbmuxd-microbench." + std::to_string(getpid());
+        config.doPreflight = false;
+        mux = new Muxer(&config);
+        usbmgr = new USBDeviceManager(mux, &noDevices);
+        climgr = new ClientManager(mux, 0, socketPath.c_str());
+
+        assure(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        peerfd = fds[1];
+        cli = BenchPeer::new_client(mux, climgr, fds[0]);
+        drain = std::thread([this]{
+            char buf[0x10000];
+            while (read(peerfd, buf, sizeof(buf)) > 0);
+        });
+
+        for (int i = 0; i < BENCH_DEVICES; i++) {
+            devices.push_back(BenchPeer::new_usb_device(mux, usbmgr, i, i ? 2 : 1));
+        }
+        for (int v = 0; v < 2; v++) {
+            tcphdr synack = {};
+            conns[v] = std::make_shared<TCP>(BENCH_SPORT, 7, devices[v], cli);
+            BenchPeer::add_connection(devices[v], BENCH_SPORT, conns[v]);
+            synack.th_sport = htons(7);
+            synack.th_dport = htons(BENCH_SPORT);
+            synack.th_seq = htonl(BENCH_DEVICE_SEQ - 1);
+            synack.th_flags = TH_SYN | TH_ACK;
+            synack.th_off = sizeof(tcphdr) / 4;
+            synack.th_win = htons(0x20000 >> 8);
+            conns[v]->handle_input(&synack, NULL, 0);
+        }
+    }
+
+    ~fixture(){
+        for (int v = 0; v < 2; v++) {
+            if (devices.size() > (size_t)v) BenchPeer::remove_connection(devices[v], BENCH_SPORT);
+            conns[v] = nullptr;
+        }
+        for (auto &d : devices) d->deconstruct();
+        devices.clear();
+        cli = nullptr;
+        if (drain.joinable()) drain.join();
+        safeClose(peerfd);
+        safeDelete(climgr);
+        safeDelete(usbmgr);
+        safeDelete(mux);
+        unlink(socketPath.c_str());
+    }
+
+    /*
+        Device side of an ACK for BENCH_SPORT, which is what most packets from a device look like.
+     */
+    static tcphdr device_ack(){
+        tcphdr ret = {};
+        ret.th_sport = htons(7);
+        ret.th_dport = htons(BENCH_SPORT);
+        ret.th_seq = htonl(BENCH_DEVICE_SEQ);
+        ret.th_ack = htonl(0);
+        ret.th_flags = TH_ACK;
+        ret.th_off = sizeof(tcphdr) / 4;
+        ret.th_win = htons(0x20000 >> 8);
+        return ret;
+    }
+};
+
+static fixture *gFixture = nullptr;
+
+static std::vector<char> client_message(const char *messageType, const char *pairRecordID = NULL){
+    plist_t p_req = NULL;
+    char *xml = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_req, plist_free);
+        safeFree(xml);
+    });
+    uint32_t xmlsize = 0;
+    usbmuxd_header hdr = {};
+    std::vector<char> ret;
+
+    p_req = plist_new_dict();
+    plist_dict_set_item(p_req, "MessageType", plist_new_string(messageType));
+    plist_dict_set_item(p_req, "ClientVersionString", plist_new_string("usbmuxd-microbench"));
+    plist_dict_set_item(p_req, "ProgName", plist_new_string("usbmuxd-microbench"));
+    plist_dict_set_item(p_req, "kLibUSBMuxVersion", plist_new_uint(3));
+    if (pairRecordID) plist_dict_set_item(p_req, "PairRecordID", plist_new_string(pairRecordID));
+    plist_to_xml(p_req, &xml, &xmlsize);
+    retassure(xml, "failed to serialize request");
+
+    hdr.length = (uint32_t)(sizeof(hdr) + xmlsize);
+    hdr.version = 1;
+    hdr.message = MESSAGE_PLIST;
+    hdr.tag = 1;
+    ret.resize(hdr.length);
+    memcpy(ret.data(), &hdr, sizeof(hdr));
+    memcpy(ret.data() + sizeof(hdr), xml, xmlsize);
+    return ret;
+}
+
+#pragma mark USBDevice::device_data_input
+static void bench_device_data_input(State &state, int version){
+    std::shared_ptr<USBDevice> dev = gFixture->devices[version == 1 ? 0 : 1];
+    size_t hdrsize = version == 1 ? sizeof(USBDevice::mux_header_v1) : sizeof(USBDevice::mux_header_v2);
+    std::vector<unsigned char> pkt(hdrsize + sizeof(tcphdr));
+    USBDevice::mux_header *mhdr = (USBDevice::mux_header *)pkt.data();
+    tcphdr ack = fixture::device_ack();
+    uint16_t seq = BenchPeer::next_rx_seq(dev);
+
+    mhdr->protocol = htonl(USBDevice::MUX_PROTO_TCP);
+    mhdr->length = htonl((uint32_t)pkt.size());
+    if (version >= 2) mhdr->v2.magic = htonl(0xfeedface);
+    memcpy(pkt.data() + hdrsize, &ack, sizeof(ack));
+
+    while (state.keepRunning()) {
+        if (version >= 2) mhdr->v2.tx_seq = htons(seq++);
+        dev->device_data_input(pkt.data(), (uint32_t)pkt.size());
+    }
+    state.setBytesProcessed(state.iterations() * pkt.size());
+}
+
+/*
+    A packet larger than one IN transfer arrives as a full USB_MRU transfer followed by the rest.
+    Uses an unknown protocol so the reassembled packet is dropped right after parsing.
+ */
+static void bench_device_data_input_split(State &state){
+    std::shared_ptr<USBDevice> dev = gFixture->devices[1];
+    const uint32_t total = USB_MRU + 0x2000;
+    std::vector<unsigned char> pkt(total, 'S');
+    USBDevice::mux_header *mhdr = (USBDevice::mux_header *)pkt.data();
+    uint16_t seq = BenchPeer::next_rx_seq(dev);
+
+    mhdr->protocol = htonl(0x42);
+    mhdr->length = htonl(total);
+    mhdr->v2.magic = htonl(0xfeedface);
+
+    while (state.keepRunning()) {
+        mhdr->v2.tx_seq = htons(seq++);
+        dev->device_data_input(pkt.data(), USB_MRU);
+        dev->device_data_input(pkt.data() + USB_MRU, total - USB_MRU);
+    }
+    state.setBytesProcessed(state.iterations() * total);
+}
+
+#pragma mark USBDevice::send_packet
+static void bench_send_packet(State &state, int version, size_t length){
+    std::shared_ptr<USBDevice> dev = gFixture->devices[version == 1 ? 0 : 1];
+    std::vector<unsigned char> payload(length, 'P');
+    tcphdr hdr = {};
+
+    hdr.th_sport = htons(BENCH_SPORT);
+    hdr.th_dport = htons(7);
+    hdr.th_flags = TH_ACK;
+    hdr.th_off = sizeof(tcphdr) / 4;
+    while (state.keepRunning()) {
+        dev->send_packet(USBDevice::MUX_PROTO_TCP, payload.data(), payload.size(), &hdr);
+    }
+    state.setBytesProcessed(state.iterations() * length);
+}
+
+#pragma mark TCP::handle_input
+static void bench_tcp_handle_ack(State &state){
+    std::shared_ptr<TCP> conn = gFixture->conns[1];
+    tcphdr ack = fixture::device_ack();
+    while (state.keepRunning()) {
+        conn->handle_input(&ack, NULL, 0);
+    }
+}
+
+#pragma mark plist encoding
+static void bench_getDevicePlist(State &state){
+    std::shared_ptr<Device> dev = gFixture->devices[1];
+    while (state.keepRunning()) {
+        plist_t p_dev = Muxer::getDevicePlist(dev);
+        plist_free(p_dev);
+    }
+}
+
+static void bench_send_plist_pkt(State &state){
+    plist_t p_rsp = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_rsp, plist_free);
+    });
+    plist_t p_devarr = NULL;
+
+    p_rsp = plist_new_dict();
+    p_devarr = plist_new_array();
+    for (auto &d : gFixture->devices) {
+        plist_array_append_item(p_devarr, Muxer::getDevicePlist(d));
+    }
+    plist_dict_set_item(p_rsp, "DeviceList", p_devarr);
+
+    while (state.keepRunning()) {
+        BenchPeer::send_plist_pkt(gFixture->cli, 1, p_rsp);
+    }
+}
+
+#pragma mark Client::processData
+static void bench_processData(State &state, const char *messageType, const char *pairRecordID){
+    std::vector<char> msg = client_message(messageType, pairRecordID);
+    while (state.keepRunning()) {
+        BenchPeer::processData(gFixture->cli, (const usbmuxd_header *)msg.data());
+    }
+    state.setBytesProcessed(state.iterations() * msg.size());
+}
+
+static void register_benchmarks(){
+    for (int version = 1; version <= 2; version++) {
+        std::string v = "/v" + std::to_string(version);
+        registerBenchmark("device_data_input" + v + "/tcp_ack", [version](State &s){bench_device_data_input(s, version);});
+    }
+    registerBenchmark("device_data_input/v2/split", bench_device_data_input_split);
+    for (int version = 1; version <= 2; version++) {
+        for (size_t length : {(size_t)0, (size_t)512, (size_t)0x4000, (size_t)TCP::TCP_MTU}) {
+            std::string name = "send_packet/v" + std::to_string(version) + "/" + std::to_string(length);
+            registerBenchmark(name, [version, length](State &s){bench_send_packet(s, version, length);});
+        }
+    }
+    registerBenchmark("TCP::handle_input/ack", bench_tcp_handle_ack);
+    registerBenchmark("Muxer::getDevicePlist", bench_getDevicePlist);
+    registerBenchmark("Client::send_plist_pkt/device_list", bench_send_plist_pkt);
+    //ListDevices takes the scanner fast path, the others build a plist tree
+    registerBenchmark("Client::processData/ListDevices", [](State &s){bench_processData(s, "ListDevices", NULL);});
+    registerBenchmark("Client::processData/ListListeners", [](State &s){bench_processData(s, "ListListeners", NULL);});
+    registerBenchmark("Client::processData/ReadPairRecord", [](State &s){bench_processData(s, "ReadPairRecord", "MICROBENCH-0000000000001");});
+}
+
+#pragma mark main
+int main(int argc, const char * argv[]) {
+    int ret = 0;
+    log_level = LL_FATAL;
+    signal(SIGPIPE, SIG_IGN);
+    register_benchmarks();
+
+    try {
+        gFixture = new fixture();
+    } catch (tihmstar::exception &e) {
+        fprintf(stderr, "failed to set up stubbed devices: %s\n", e.what());
+        return 1;
+    }
+    ret = microbench::runBenchmarks(argc, argv);
+    safeDelete(gFixture);
+    return ret;
+}
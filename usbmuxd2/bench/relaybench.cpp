@@ -0,0 +1,347 @@
+//
+//  relaybench.cpp
+//  usbmuxd2
+//
+
+/*
+    End to end relay benchmark.
+    Opens connections to a simulated USB device through the real client socket, so all data takes the
+    Client -> TCP -> USBDevice::send_packet path and back (the simulated device echoes everything).
+    Prints one JSON object on stdout, progress goes to stderr.
+ */
+
+#include "BenchDaemon.hpp"
+#include "BenchClient.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock benchclock;
+
+struct benchopts{
+    int connections;
+    int durationS;
+    int echoes;
+    size_t echoSize;
+    size_t chunkSize;
+    uint16_t port;
+    int stallTimeoutMs;
+    SimUSBTransport::params sim;
+};
+
+struct bulkresult{
+    uint64_t sent;
+    uint64_t received;
+    double seconds;
+    bool failed;
+};
+
+#pragma mark helpers
+static double cpu_seconds(const struct rusage &ru, bool sys){
+    const struct timeval &tv = sys ? ru.ru_stime : ru.ru_utime;
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p){
+    size_t idx = 0;
+    if (!sorted.size()) return 0;
+    idx = (size_t)(p * sorted.size());
+    if (idx >= sorted.size()) idx = sorted.size()-1;
+    return sorted[idx];
+}
+
+static void echo_loop(int fd, const benchopts &opts, std::vector<uint64_t> &samples){
+    std::vector<char> out(opts.echoSize, 'E');
+    std::vector<char> in(opts.echoSize);
+    samples.reserve(opts.echoes);
+    for (int i = 0; i < opts.echoes; i++) {
+        auto start = benchclock::now();
+        BenchClient::write_all(fd, out.data(), out.size());
+        BenchClient::read_all(fd, in.data(), in.size());
+        samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(benchclock::now() - start).count());
+    }
+}
+
+static void bulk_loop(int fd, const benchopts &opts, bulkresult &res){
+    std::atomic<uint64_t> sent{0};
+    std::atomic<bool> writerDone{false};
+    std::vector<char> buf(opts.chunkSize, 'B');
+    auto start = benchclock::now();
+    auto deadline = start + std::chrono::seconds(opts.durationS);
+
+    std::thread writer([&]{
+        try {
+            while (benchclock::now() < deadline) {
+                BenchClient::write_all(fd, buf.data(), buf.size());
+                sent += buf.size();
+            }
+        } catch (tihmstar::exception &e) {
+            error("bulk writer failed: %s", e.what());
+            res.failed = true;
+        }
+        writerDone = true;
+    });
+
+    {
+        std::vector<char> rbuf(0x10000);
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        while (!writerDone || res.received < sent) {
+            int pr = poll(&pfd, 1, opts.stallTimeoutMs);
+            ssize_t cnt = 0;
+            if (pr < 0 && errno == EINTR) continue;
+            if (pr <= 0) {
+                error("bulk reader stalled with %llu of %llu bytes echoed", (unsigned long long)res.received, (unsigned long long)sent.load());
+                res.failed = true;
+                shutdown(fd, SHUT_RDWR); //unblock the writer
+                break;
+            }
+            if ((cnt = read(fd, rbuf.data(), rbuf.size())) <= 0) {
+                if (cnt < 0 && errno == EINTR) continue;
+                error("bulk reader failed: %s", cnt ? strerror(errno) : "connection closed");
+                res.failed = true;
+                shutdown(fd, SHUT_RDWR);
+                break;
+            }
+            res.received += cnt;
+        }
+    }
+    writer.join();
+    res.sent = sent;
+    res.seconds = std::chrono::duration<double>(benchclock::now() - start).count();
+}
+
+static void usage(const char *prog){
+    printf("Usage: %s [OPTIONS]\n", prog);
+    printf("Measures relay throughput and latency against a simulated USB device.\n\n");
+    printf("  -c, --connections=N\tConcurrent Connect sessions (default: 4)\n");
+    printf("  -t, --duration=S\tSeconds of bulk transfer (default: 5)\n");
+    printf("  -e, --echoes=N\t\tSmall echo round trips per connection (default: 2000)\n");
+    printf("      --echo-size=B\tBytes per echo (default: 64)\n");
+    printf("      --chunk=B\t\tBytes per bulk write (default: 65536)\n");
+    printf("      --port=P\t\tDevice port to connect to (default: 7)\n");
+    printf("      --mux-version=V\tMux protocol version of the device (default: 2)\n");
+    printf("      --window=B\tTCP window advertised by the device (default: 131072)\n");
+    printf("      --latency=US\tDevice to host latency in microseconds (default: 0)\n");
+    printf("      --bandwidth=BPS\tDevice to host bytes per second, 0 is unlimited (default: 0)\n");
+    printf("      --reorder\t\tLet the device deliver packets out of order\n");
+    printf("      --split\t\tLet the device send packets larger than one IN transfer (v2 only)\n");
+    printf("  -v, --verbose\t\tPrint daemon log messages\n");
+    printf("  -h, --help\t\tPrint this message\n");
+}
+
+#pragma mark main
+int main(int argc, const char * argv[]) {
+    static struct option longopts[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"duration",    required_argument, NULL, 't'},
+        {"echoes",      required_argument, NULL, 'e'},
+        {"echo-size",   required_argument, NULL,  0 },
+        {"chunk",       required_argument, NULL,  0 },
+        {"port",        required_argument, NULL,  0 },
+        {"mux-version", required_argument, NULL,  0 },
+        {"window",      required_argument, NULL,  0 },
+        {"latency",     required_argument, NULL,  0 },
+        {"bandwidth",   required_argument, NULL,  0 },
+        {"reorder",     no_argument,       NULL,  0 },
+        {"split",       no_argument,       NULL,  0 },
+        {"verbose",     no_argument,       NULL, 'v'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    benchopts opts = {
+        .connections = 4,
+        .durationS = 5,
+        .echoes = 2000,
+        .echoSize = 64,
+        .chunkSize = 0x10000,
+        .port = 7,
+        .stallTimeoutMs = 10000,
+        .sim = {
+            .devices = 1,
+            .version = 2,
+            .window = 0x20000,
+            .latencyUs = 0,
+            .bandwidth = 0,
+            .reorder = false,
+            .split = false,
+        },
+    };
+    int optindex = 0;
+    int opt = 0;
+    int verbose = 0;
+    std::vector<int> fds;
+    std::vector<uint64_t> samples;
+    std::vector<bulkresult> bulk;
+    struct rusage ruStart = {};
+    struct rusage ruEnd = {};
+    uint64_t totalSent = 0;
+    uint64_t totalReceived = 0;
+    double bulkSeconds = 0;
+    double sumMBps = 0;
+    double sumSqMBps = 0;
+    double cpuUser = 0;
+    double cpuSys = 0;
+    std::atomic<bool> failed{false};
+
+    while ((opt = getopt_long(argc, (char* const *)argv, "c:t:e:vh", longopts, &optindex)) >= 0) {
+        switch (opt) {
+            case 0:
+            {
+                std::string curopt = longopts[optindex].name;
+                if (curopt == "echo-size") {
+                    opts.echoSize = strtoul(optarg, NULL, 0);
+                }else if (curopt == "chunk") {
+                    opts.chunkSize = strtoul(optarg, NULL, 0);
+                }else if (curopt == "port") {
+                    opts.port = (uint16_t)atoi(optarg);
+                }else if (curopt == "mux-version") {
+                    opts.sim.version = atoi(optarg);
+                }else if (curopt == "window") {
+                    opts.sim.window = (uint32_t)strtoul(optarg, NULL, 0);
+                }else if (curopt == "latency") {
+                    opts.sim.latencyUs = (uint32_t)strtoul(optarg, NULL, 0);
+                }else if (curopt == "bandwidth") {
+                    opts.sim.bandwidth = strtoull(optarg, NULL, 0);
+                }else if (curopt == "reorder") {
+                    opts.sim.reorder = true;
+                }else if (curopt == "split") {
+                    opts.sim.split = true;
+                }
+            }
+                break;
+            case 'c':
+                opts.connections = atoi(optarg);
+                break;
+            case 't':
+                opts.durationS = atoi(optarg);
+                break;
+            case 'e':
+                opts.echoes = atoi(optarg);
+                break;
+            case 'v':
+                verbose++;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (opts.connections <= 0 || opts.durationS <= 0 || opts.echoes < 0 || !opts.echoSize || !opts.chunkSize) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    log_level = verbose ? LL_DEBUG : LL_ERROR;
+    signal(SIGPIPE, SIG_IGN);
+
+    try {
+        BenchDaemon daemon(opts.sim);
+        uint32_t deviceID = daemon.waitForDevice();
+        fprintf(stderr, "device %u attached, opening %d connections\n", deviceID, opts.connections);
+
+        for (int i = 0; i < opts.connections; i++) {
+            BenchClient cli(daemon.socketPath());
+            fds.push_back(cli.connect(deviceID, opts.port));
+        }
+
+        //small request/response echoes, all connections at once
+        {
+            std::vector<std::vector<uint64_t>> perConn(fds.size());
+            std::vector<std::thread> threads;
+            fprintf(stderr, "latency: %d echoes of %zu bytes per connection\n", opts.echoes, opts.echoSize);
+            for (size_t i = 0; i < fds.size(); i++) {
+                threads.emplace_back([&, i]{
+                    try {
+                        echo_loop(fds[i], opts, perConn[i]);
+                    } catch (tihmstar::exception &e) {
+                        error("echo loop failed: %s", e.what());
+                        failed = true;
+                    }
+                });
+            }
+            for (auto &t : threads) t.join();
+            for (auto &s : perConn) samples.insert(samples.end(), s.begin(), s.end());
+            std::sort(samples.begin(), samples.end());
+        }
+
+        //bulk data both ways
+        {
+            std::vector<std::thread> threads;
+            bulk.resize(fds.size());
+            fprintf(stderr, "bulk: %ds of %zu byte writes per connection\n", opts.durationS, opts.chunkSize);
+            getrusage(RUSAGE_SELF, &ruStart);
+            for (size_t i = 0; i < fds.size(); i++) {
+                threads.emplace_back([&, i]{
+                    bulk_loop(fds[i], opts, bulk[i]);
+                });
+            }
+            for (auto &t : threads) t.join();
+            getrusage(RUSAGE_SELF, &ruEnd);
+        }
+
+        for (int fd : fds) close(fd);
+        fds.clear();
+    } catch (tihmstar::exception &e) {
+        fprintf(stderr, "benchmark failed: %s\n", e.what());
+        for (int fd : fds) close(fd);
+        return 1;
+    }
+
+    for (auto &b : bulk) {
+        double mbps = b.received / b.seconds / 1e6;
+        totalSent += b.sent;
+        totalReceived += b.received;
+        if (b.seconds > bulkSeconds) bulkSeconds = b.seconds;
+        sumMBps += mbps;
+        sumSqMBps += mbps * mbps;
+        if (b.failed) failed = true;
+    }
+    cpuUser = cpu_seconds(ruEnd, false) - cpu_seconds(ruStart, false);
+    cpuSys = cpu_seconds(ruEnd, true) - cpu_seconds(ruStart, true);
+
+    printf("{\"benchmark\":\"relay\"");
+#ifdef VERSION_STRING
+    printf(",\"version\":\"%s\"", VERSION_STRING);
+#endif
+    printf(",\"ok\":%s", failed ? "false" : "true");
+    printf(",\"config\":{\"connections\":%d,\"duration_s\":%d,\"echoes\":%d,\"echo_size\":%zu,\"chunk_size\":%zu"
+           ",\"mux_version\":%d,\"window\":%u,\"latency_us\":%u,\"bandwidth\":%llu,\"reorder\":%s,\"split\":%s}",
+           opts.connections, opts.durationS, opts.echoes, opts.echoSize, opts.chunkSize,
+           opts.sim.version, opts.sim.window, opts.sim.latencyUs, (unsigned long long)opts.sim.bandwidth, opts.sim.reorder ? "true" : "false", opts.sim.split ? "true" : "false");
+    printf(",\"bulk\":{\"seconds\":%.3f,\"tx_bytes\":%llu,\"rx_bytes\":%llu,\"tx_MBps\":%.2f,\"rx_MBps\":%.2f",
+           bulkSeconds, (unsigned long long)totalSent, (unsigned long long)totalReceived,
+           bulkSeconds ? totalSent / bulkSeconds / 1e6 : 0, bulkSeconds ? totalReceived / bulkSeconds / 1e6 : 0);
+    //Jain's fairness index, 1.0 means every connection got the same share
+    printf(",\"fairness\":%.4f,\"per_connection_MBps\":[", sumSqMBps ? (sumMBps * sumMBps) / (bulk.size() * sumSqMBps) : 0);
+    for (size_t i = 0; i < bulk.size(); i++) {
+        printf("%s%.2f", i ? "," : "", bulk[i].received / bulk[i].seconds / 1e6);
+    }
+    printf("]}");
+    printf(",\"latency_us\":{\"samples\":%zu,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+           samples.size(), percentile(samples, 0.50) / 1e3, percentile(samples, 0.99) / 1e3,
+           percentile(samples, 0.999) / 1e3, samples.size() ? samples.back() / 1e3 : 0);
+    //daemon and load generator share the process, so this is the cost of both
+    printf(",\"cpu\":{\"user_s\":%.3f,\"sys_s\":%.3f,\"s_per_GB\":%.3f}",
+           cpuUser, cpuSys, (totalSent + totalReceived) ? (cpuUser + cpuSys) / ((totalSent + totalReceived) / 1e9) : 0);
+    printf("}\n");
+    return failed ? 1 : 0;
+}
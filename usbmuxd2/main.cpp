@@ -7,6 +7,7 @@
 //
 
 #include "Muxer.hpp"
+#include "Manager/ClientManager.hpp"
 #include "sysconf/sysconf.hpp"
 
 #include <libgeneral/macros.h>
@@ -26,6 +27,8 @@
 #include <pwd.h>
 #include <grp.h>
 #include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 extern "C"{
 #ifdef HAVE_LIBIMOBILEDEVICE
@@ -45,6 +48,7 @@ static Muxer *mux = nullptr;
 static int exit_signal = 0;
 static int report_to_parent = 0;
 static int daemon_pipe = 0;
+static bool print_stats = false;
 
 #ifdef DEBUG
 static int verbose = LL_DEBUG;
@@ -161,6 +165,55 @@ static void notify_parent(int status){
     retassure(freopen("/dev/null", "w", stderr),"Redirection of stderr failed.");
 }
 
+/**
+ * ask the running instance for its runtime statistics and print them as plist
+ */
+static int print_statistics(void) noexcept{
+    int err = 0;
+    int fd = -1;
+    char *xml = NULL;
+    char *rsp = NULL;
+    uint32_t xmlsize = 0;
+    plist_t p_req = NULL;
+    struct sockaddr_un addr = {};
+    struct usbmuxd_header hdr = {};
+    const char *socket_path = ClientManager::defaultSocketPath();
+
+    cassure(p_req = plist_new_dict());
+    plist_dict_set_item(p_req, "MessageType", plist_new_string("GetStatistics"));
+    plist_dict_set_item(p_req, "ProgName", plist_new_string(PACKAGE_NAME));
+    plist_dict_set_item(p_req, "ClientVersionString", plist_new_string(VERSION_STRING));
+    plist_to_xml(p_req, &xml, &xmlsize);
+    cretassure(xml, "Failed to serialize GetStatistics request");
+
+    cretassure(strlen(socket_path) < sizeof(addr.sun_path), "socket path '%s' is too long", socket_path);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+    cretassure((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1, "socket() failed with errno=%d (%s)", errno, strerror(errno));
+    cretassure(!connect(fd, (struct sockaddr*)&addr, sizeof(addr)), "Could not connect to %s, is usbmuxd running?", socket_path);
+
+    hdr.length = sizeof(hdr) + xmlsize;
+    hdr.version = 1;
+    hdr.message = MESSAGE_PLIST;
+    hdr.tag = 1;
+    cretassure(send(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr), "Failed to send request header");
+    cretassure(send(fd, xml, xmlsize, 0) == xmlsize, "Failed to send request");
+
+    cretassure(recv(fd, &hdr, sizeof(hdr), MSG_WAITALL) == sizeof(hdr), "Failed to receive reply header");
+    cretassure(hdr.message == MESSAGE_PLIST && hdr.length > sizeof(hdr), "Running instance does not support GetStatistics");
+    hdr.length -= sizeof(hdr);
+    cretassure(rsp = (char*)malloc(hdr.length), "Failed to alloc %u bytes for reply", hdr.length);
+    cretassure(recv(fd, rsp, hdr.length, MSG_WAITALL) == hdr.length, "Failed to receive reply");
+    fwrite(rsp, 1, hdr.length, stdout);
+
+error:
+    safeFree(rsp);
+    safeFree(xml);
+    safeFreeCustom(p_req, plist_free);
+    safeClose(fd);
+    return err;
+}
+
 static void usage(){
     printf("Usage: %s [OPTIONS]\n", PACKAGE_NAME);
     printf("Expose a socket to multiplex connections from and to iOS devices.\n\n");
@@ -184,9 +237,58 @@ static void usage(){
     printf("      --allow-heartless-wifi\tAllow WIFI devices without heartbeat to be listed (needed for WIFI pairing)\n");
     printf("      --no-usb\t\t\tDo not start USBDeviceManager\n");
     printf("      --no-wifi\t\t\tDo not start WIFIDeviceManager\n");
+    printf("      --listen-backlog=N\tListen backlog for the client socket (default: 128)\n");
+    printf("      --simulate-usb=N[,OPT...]\tAttach N simulated USB devices instead of real ones (implies -p)\n");
+    printf("                   \t\tOPT: version=1|2, window=BYTES, latency=US, bandwidth=BYTES/S, reorder, split\n");
+    printf("      --stats\t\t\tPrint runtime statistics of the running instance and exit\n");
+    printf("      --metrics=PORT|PATH\tServe OpenMetrics on 127.0.0.1:PORT or the unix socket PATH\n");
     printf("\n");
 }
 
+/*
+    N[,version=1|2][,window=BYTES][,latency=US][,bandwidth=BYTES/S][,reorder][,split]
+    Test only settings, they are never written to the config.
+ */
+static bool parse_simulate_usb(char *arg){
+    enum {SIM_VERSION, SIM_WINDOW, SIM_LATENCY, SIM_BANDWIDTH, SIM_REORDER, SIM_SPLIT};
+    static char *const tokens[] = {(char*)"version", (char*)"window", (char*)"latency", (char*)"bandwidth", (char*)"reorder", (char*)"split", NULL};
+    char *value = NULL;
+    long num = strtol(arg, &arg, 10);
+
+    if (num <= 0 || (*arg && *arg != ',')) return false;
+    gConfig->simulateUSBDevices = (int)num;
+    if (*arg) arg++;
+    while (*arg) {
+        switch (getsubopt(&arg, tokens, &value)) {
+            case SIM_VERSION:
+                if (!value) return false;
+                gConfig->simUSBVersion = (uint32_t)atoi(value);
+                if (gConfig->simUSBVersion != 1 && gConfig->simUSBVersion != 2) return false;
+                break;
+            case SIM_WINDOW:
+                if (!value || !(gConfig->simUSBWindow = (uint32_t)strtoul(value, NULL, 0))) return false;
+                break;
+            case SIM_LATENCY:
+                if (!value) return false;
+                gConfig->simUSBLatency = (uint32_t)strtoul(value, NULL, 0);
+                break;
+            case SIM_BANDWIDTH:
+                if (!value) return false;
+                gConfig->simUSBBandwidth = strtoull(value, NULL, 0);
+                break;
+            case SIM_REORDER:
+                gConfig->simUSBReorder = true;
+                break;
+            case SIM_SPLIT:
+                gConfig->simUSBSplit = true;
+                break;
+            default:
+                return false;
+        }
+    }
+    return !gConfig->simUSBSplit || gConfig->simUSBVersion >= 2;
+}
+
 static void parse_opts(int argc, const char **argv){
     static struct option longopts[] = {
         {"help",                    no_argument,        NULL, 'h'},
@@ -207,6 +309,10 @@ static void parse_opts(int argc, const char **argv){
         {"debug",                   no_argument,        NULL,  0 },
         {"no-usb",                  optional_argument,  NULL,  0 },
         {"no-wifi",                 optional_argument,  NULL,  0 },
+        {"listen-backlog",          required_argument,  NULL,  0 },
+        {"simulate-usb",            required_argument,  NULL,  0 },
+        {"stats",                   no_argument,        NULL,  0 },
+        {"metrics",                 required_argument,  NULL,  0 },
         {NULL,                      0,                  NULL,  0 }
     };
     int optindex = 0;
@@ -235,6 +341,27 @@ static void parse_opts(int argc, const char **argv){
                 }else if (curopt == "no-wifi") {
                     info("Manually disabling WIFIDeviceManager");
                     gConfig->enableWifiDeviceManager = (!optarg) ? false : atoi(optarg);
+                }else if (curopt == "listen-backlog") {
+                    if ((gConfig->listenBacklog = atoi(optarg)) <= 0) {
+                        fatal("ERROR: --listen-backlog requires a positive number");
+                        usage();
+                        exit(2);
+                    }
+                }else if (curopt == "simulate-usb") {
+                    if (!parse_simulate_usb(optarg)) {
+                        fatal("ERROR: --simulate-usb requires a positive number, optionally followed by valid options");
+                        usage();
+                        exit(2);
+                    }
+                }else if (curopt == "stats") {
+                    print_stats = true;
+                }else if (curopt == "metrics") {
+                    if (!*optarg) {
+                        fatal("ERROR: --metrics requires a port or socket path");
+                        usage();
+                        exit(2);
+                    }
+                    gConfig->metricsListen = optarg;
                 }
             }
                 break;
@@ -333,6 +460,12 @@ int main(int argc, const char * argv[]) {
     log_level = verbose;
     info("starting %s", VERSION_STRING);
 
+    if (print_stats) {
+        signal(SIGPIPE, SIG_IGN);
+        err = print_statistics();
+        goto error;
+    }
+
     {
         // set number of file descriptors to higher value
         struct rlimit rlim;
@@ -384,15 +517,19 @@ int main(int argc, const char * argv[]) {
         cretassure(write(lfd, pids, strlen(pids)) == strlen(pids), "Could not write pidfile!");
     }
 
+    if (gConfig->simulateUSBDevices && gConfig->doPreflight){
+        info("Disabling preflight, simulated devices don't run lockdownd");
+        gConfig->doPreflight = false;
+    }
     if (!gConfig->doPreflight){
         info("Preflight disabled by config or commandline!");
     }
     
     //starting
-    mux = new Muxer(gConfig->doPreflight, gConfig->allowHeartlessWifi);
+    mux = new Muxer(gConfig);
 
     try{
-        mux->spawnClientManager();
+        mux->spawnClientManager(gConfig->listenBacklog);
         info("Inited ClientManager");
     }catch (tihmstar::exception &e){
         fatal("failed to spawnClientManager with error=%d (%s)",e.code(),e.what());
@@ -430,7 +567,20 @@ int main(int argc, const char * argv[]) {
 
     if (gConfig->enableUSBDeviceManager){
         try{
-            mux->spawnUSBDeviceManager();
+            if (gConfig->simulateUSBDevices) {
+                SimUSBTransport::params simulate = {
+                    .devices = gConfig->simulateUSBDevices,
+                    .version = (int)gConfig->simUSBVersion,
+                    .window = gConfig->simUSBWindow,
+                    .latencyUs = gConfig->simUSBLatency,
+                    .bandwidth = gConfig->simUSBBandwidth,
+                    .reorder = gConfig->simUSBReorder,
+                    .split = gConfig->simUSBSplit,
+                };
+                mux->spawnUSBDeviceManager(&simulate);
+            } else {
+                mux->spawnUSBDeviceManager();
+            }
             info("Inited USBDeviceManager");
         }catch (tihmstar::exception &e){
             fatal("failed to spawnUSBDeviceManager with error=%d (%s)",e.code(),e.what());
@@ -446,6 +596,15 @@ int main(int argc, const char * argv[]) {
         }
     }
     
+    if (gConfig->metricsListen.size()){
+        try{
+            mux->spawnMetricsExporter(gConfig->metricsListen.c_str());
+            info("Inited MetricsExporter");
+        }catch (tihmstar::exception &e){
+            fatal("failed to spawnMetricsExporter with error=%d (%s)",e.code(),e.what());
+        }
+    }
+
     if (!mux->hasDeviceManager()){
         fatal("failed to spawn any DeviceManager");
         fatal("Terminating since at least one DeviceManager is require to operate");
@@ -483,6 +642,7 @@ error:
     if (mux){
         delete mux;
     }
+    sysconf_flush_pending_writes();
     if (gConfig){
         Config *cfg = gConfig; gConfig = nullptr;
         delete cfg;
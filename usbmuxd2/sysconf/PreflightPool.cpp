@@ -0,0 +1,158 @@
+//
+//  PreflightPool.cpp
+//  usbmuxd2
+//
+
+#include "PreflightPool.hpp"
+#include "preflight.hpp"
+#include <libgeneral/macros.h>
+#include <inttypes.h>
+
+#pragma mark PreflightPool
+PreflightPool::PreflightPool(size_t workers)
+: _isDying(false), _stats{}
+{
+    if (!workers) workers = 1;
+    debug("[PreflightPool] starting %zu workers",workers);
+    for (size_t i = 0; i < workers; i++) {
+        _workers.push_back(std::thread([this]{
+            worker_runloop();
+        }));
+    }
+}
+
+PreflightPool::~PreflightPool(){
+    info("[destroying] PreflightPool");
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _isDying = true;
+        for (auto &p : _pending) p.second->cancelled = true;
+        _jobsEvent.notifyAll();
+    }
+    for (auto &w : _workers) {
+        w.join();
+    }
+}
+
+#pragma mark private
+void PreflightPool::worker_runloop() noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    while (true) {
+        std::shared_ptr<job> j;
+        while (!_isDying && !_queue.size()) {
+            uint64_t wevent = _jobsEvent.getNextEvent();
+            ul.unlock();
+            _jobsEvent.waitForEvent(wevent);
+            ul.lock();
+        }
+        if (_isDying) break;
+        j = _queue.front(); _queue.pop_front();
+        if (j->cancelled) {
+            debug("[PreflightPool] dropping cancelled preflight of %s (%d)",j->serial.c_str(),j->id);
+            _stats.cancelled++;
+            auto it = _pending.find(j->serial);
+            if (it != _pending.end() && it->second == j) _pending.erase(it);
+            continue;
+        }
+        ul.unlock();
+        run_job(j);
+        ul.lock();
+    }
+}
+
+void PreflightPool::run_job(std::shared_ptr<job> j) noexcept{
+    bool didFail = false;
+    uint64_t latency = 0;
+#ifdef HAVE_LIBIMOBILEDEVICE
+    try {
+        preflight_device(j->serial.c_str(), j->id, &j->cancelled);
+    } catch (tihmstar::exception &e) {
+        if (!j->cancelled) {
+            warning("Failed to preflight device '%s' with err:\n%s",j->serial.c_str(),e.dumpStr().c_str());
+            didFail = true;
+        }
+    }
+#endif //HAVE_LIBIMOBILEDEVICE
+    latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - j->queuedAt).count();
+
+    std::unique_lock<std::mutex> ul(_lck);
+    {
+        auto it = _pending.find(j->serial);
+        if (it != _pending.end() && it->second == j) _pending.erase(it);
+    }
+    if (j->cancelled) {
+        debug("[PreflightPool] preflight of %s (%d) was cancelled after %" PRIu64 "us",j->serial.c_str(),j->id,latency);
+        _stats.cancelled++;
+        return;
+    }
+    if (didFail) {
+        _stats.failed++;
+    } else {
+        _stats.completed++;
+    }
+    _stats.latencyTotalUs += latency;
+    _durations.record(latency*1000);
+    if (latency > _stats.latencyMaxUs) _stats.latencyMaxUs = latency;
+    _latencyUs[j->id] = latency;
+    info("[PreflightPool] preflight of %s (%d) %s after %" PRIu64 "ms",j->serial.c_str(),j->id,didFail ? "failed" : "finished",latency/1000);
+}
+
+#pragma mark public
+void PreflightPool::enqueue(const char *serial, int id) noexcept{
+    std::shared_ptr<job> j;
+    std::unique_lock<std::mutex> ul(_lck);
+    if (_isDying) return;
+    {
+        auto it = _pending.find(serial);
+        if (it != _pending.end()) {
+            if (it->second->id == id && !it->second->cancelled) {
+                debug("[PreflightPool] preflight of %s (%d) is already pending",serial,id);
+                _stats.deduped++;
+                return;
+            }
+            //device came back with a new id, the old preflight is pointless now
+            it->second->cancelled = true;
+            _pending.erase(it);
+        }
+    }
+    try {
+        j = std::make_shared<job>();
+        j->serial = serial;
+        j->id = id;
+        j->queuedAt = std::chrono::steady_clock::now();
+        j->cancelled = false;
+        _pending[j->serial] = j;
+        _queue.push_back(j);
+    } catch (...) {
+        error("[PreflightPool] failed to queue preflight of %s (%d)",serial,id);
+        return;
+    }
+    _stats.queued++;
+    _jobsEvent.notifyAll();
+}
+
+void PreflightPool::cancel(const char *serial, int id) noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    _latencyUs.erase(id);
+    auto it = _pending.find(serial);
+    if (it == _pending.end() || it->second->id != id) return;
+    debug("[PreflightPool] cancelling preflight of %s (%d)",serial,id);
+    it->second->cancelled = true;
+    //queued jobs are dropped by the worker which picks them up
+    _pending.erase(it);
+}
+
+PreflightPool::preflightstats PreflightPool::getStats() noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    return _stats;
+}
+
+const LatencyHistogram &PreflightPool::getDurations() noexcept{
+    return _durations;
+}
+
+uint64_t PreflightPool::getLatency(int id) noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    auto it = _latencyUs.find(id);
+    return (it != _latencyUs.end()) ? it->second : 0;
+}
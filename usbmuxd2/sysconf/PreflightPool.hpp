@@ -0,0 +1,80 @@
+//
+//  PreflightPool.hpp
+//  usbmuxd2
+//
+
+#ifndef PreflightPool_hpp
+#define PreflightPool_hpp
+
+#include <libgeneral/Event.hpp>
+#include "../LatencyHistogram.hpp"
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+    Runs preflight_device on a fixed number of worker threads,
+    so lockdown traffic never happens on a device's own USB threads.
+    At most one preflight per UDID is pending at any time.
+ */
+class PreflightPool{
+public:
+    struct preflightstats{
+        uint64_t queued;
+        uint64_t deduped;
+        uint64_t completed;
+        uint64_t failed;
+        uint64_t cancelled;
+        uint64_t latencyTotalUs;    //from enqueue until preflight finished
+        uint64_t latencyMaxUs;
+    };
+private:
+    struct job{
+        std::string serial;
+        int id;
+        std::chrono::steady_clock::time_point queuedAt;
+        std::atomic_bool cancelled;
+    };
+    std::mutex _lck;
+    tihmstar::Event _jobsEvent;
+    std::deque<std::shared_ptr<job>> _queue;
+    std::map<std::string, std::shared_ptr<job>> _pending; //queued or running, by serial
+    std::map<int, uint64_t> _latencyUs; //latency of the last finished preflight, by device id until cancel()
+    std::vector<std::thread> _workers;
+    bool _isDying;
+    preflightstats _stats;
+    LatencyHistogram _durations; //completed and failed preflights, from enqueue until finished
+
+    void worker_runloop() noexcept;
+    void run_job(std::shared_ptr<job> j) noexcept;
+
+public:
+    PreflightPool(size_t workers);
+    PreflightPool(const PreflightPool &) = delete;
+    ~PreflightPool();
+
+    void enqueue(const char *serial, int id) noexcept;
+    /*
+        Drops a queued preflight, or asks a running one to abort at the next step.
+        Only affects the preflight of the given device id, not a newer attach of the same device.
+        Called when the device goes away, which also forgets its latency.
+     */
+    void cancel(const char *serial, int id) noexcept;
+
+    preflightstats getStats() noexcept;
+    const LatencyHistogram &getDurations() noexcept;
+    /*
+        Latency of the last finished preflight of device id in us, 0 if there was none.
+     */
+    uint64_t getLatency(int id) noexcept;
+};
+
+#endif /* PreflightPool_hpp */
@@ -16,6 +16,9 @@
 #include <future>
 #include <plist/plist.h>
 #include <system_error>
+#include <chrono>
+#include <map>
+#include <mutex>
 
 
 #ifdef HAVE_LIBIMOBILEDEVICE
@@ -37,6 +40,51 @@ struct np_cb_data{
     np_client_t np;
 };
 
+#pragma mark verified session cache
+struct verified_session{
+    uint64_t recordHash;
+    std::chrono::steady_clock::time_point verifiedAt;
+};
+static std::mutex gVerifiedSessionsLck;
+static std::map<std::string, verified_session> gVerifiedSessions;
+static std::atomic<uint32_t> gVerifiedSessionTTL{0};
+
+static uint64_t pair_record_hash(const char *serial){
+    std::shared_ptr<const std::string> bin = sysconf_get_device_record_bin(serial);
+    uint64_t hash = 0xcbf29ce484222325; //FNV-1a
+
+    for (char c : *bin) {
+        hash ^= (uint8_t)c;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static bool verified_session_is_cached(const char *serial, uint64_t recordHash) noexcept{
+    uint32_t ttl = gVerifiedSessionTTL;
+    if (!ttl) return false;
+    std::unique_lock<std::mutex> ul(gVerifiedSessionsLck);
+    auto it = gVerifiedSessions.find(serial);
+    if (it == gVerifiedSessions.end()) return false;
+    if (it->second.recordHash != recordHash || std::chrono::steady_clock::now() - it->second.verifiedAt > std::chrono::seconds(ttl)) {
+        gVerifiedSessions.erase(it);
+        return false;
+    }
+    return true;
+}
+
+static void verified_session_store(const char *serial, uint64_t recordHash) noexcept{
+    if (!gVerifiedSessionTTL) return;
+    std::unique_lock<std::mutex> ul(gVerifiedSessionsLck);
+    gVerifiedSessions[serial] = {recordHash, std::chrono::steady_clock::now()};
+}
+
+static void verified_session_forget(const char *serial) noexcept{
+    std::unique_lock<std::mutex> ul(gVerifiedSessionsLck);
+    gVerifiedSessions.erase(serial);
+}
+
+#pragma mark preflight
 static void lockdownd_set_untrusted_host_buid(lockdownd_client_t lockdown){
     std::string system_buid = sysconf_get_system_buid();
     debug("%s: Setting UntrustedHostBUID to %s", __func__, system_buid.c_str());
@@ -79,7 +127,9 @@ error:
     }
 }
 
-void preflight_device(const char *serial, int id){
+#define checkCancelled() retassure(!cancelled || !*cancelled, "%s: preflight of device %s was cancelled", __func__, serial)
+
+void preflight_device(const char *serial, int id, const std::atomic_bool *cancelled){
     int version_major = 0;
     lockdownd_error_t lret = LOCKDOWN_E_SUCCESS;
     idevice_error_t iret = IDEVICE_E_SUCCESS;
@@ -87,6 +137,7 @@ void preflight_device(const char *serial, int id){
     lockdownd_client_t lockdown = NULL;
     char *lockdowntype = NULL;
     plist_t p_pairingRecord = NULL;
+    uint64_t recordHash = 0;
     plist_t pProdVers = NULL;
     char *version_str = NULL;
     lockdownd_service_descriptor_t service = NULL;
@@ -121,13 +172,30 @@ void preflight_device(const char *serial, int id){
         }
     });
 
+    try {
+        p_pairingRecord = sysconf_get_device_record(serial);
+        recordHash = pair_record_hash(serial);
+    } catch (tihmstar::exception &e) {
+        //no usable pair record, this device needs pairing
+        safeFreeCustom(p_pairingRecord, plist_free);
+    }
+
+    if (p_pairingRecord && verified_session_is_cached(serial, recordHash)) {
+        info("%s: Device %s was verified recently with the same pair record, skipping preflight", __func__, serial);
+        return;
+    }
+
     info("preflighting device %s",serial);
 
     retassure(!(iret = idevice_new_with_options(&dev,serial,IDEVICE_LOOKUP_USBMUX)), "failed to create device with iret=%d",iret);
+    checkCancelled();
 
     retassure(!(lret = lockdownd_client_new(dev, &lockdown, "usbmuxd2")),"%s: ERROR: Could not connect to lockdownd on device %s, lockdown error %d", __func__, serial, lret);
 
+    checkCancelled();
+
     retassure(!(lret = lockdownd_query_type(lockdown, &lockdowntype)),"%s: ERROR: Could not get lockdownd type from device %s, lockdown error %d", __func__, serial, lret);
+    checkCancelled();
 
     if (strcmp(lockdowntype, "com.apple.mobile.lockdown") != 0){
         //this is a restore mode device
@@ -135,9 +203,7 @@ void preflight_device(const char *serial, int id){
         return;
     }
 
-    try {
-        p_pairingRecord = sysconf_get_device_record(serial);
-    } catch (tihmstar::exception &e) {
+    if (!p_pairingRecord) {
         info("No pairing record loaded for device %s",serial);
         goto pairing_required;
     }
@@ -153,10 +219,12 @@ void preflight_device(const char *serial, int id){
         retassure((plist_get_string_val(p_hostid, &hostid_str),hostid_str), "Failed to get str ptr from HostID");
 
         if (!(lret = lockdownd_start_session(lockdown, hostid_str, NULL, NULL))){
+            verified_session_store(serial, recordHash);
             info("%s: Finished preflight on device %s", __func__, serial);
             return;
         }
     }
+    verified_session_forget(serial);
 
     error("%s: StartSession failed on device %s, lockdown error %d", __func__, serial, lret);
 
@@ -166,6 +234,7 @@ void preflight_device(const char *serial, int id){
     }
 
 pairing_required:
+    checkCancelled();
 
     assure(!(lret = lockdownd_get_value(lockdown, NULL, "ProductVersion", &pProdVers)));
     assure(pProdVers && plist_get_node_type(pProdVers) == PLIST_STRING);
@@ -177,6 +246,7 @@ pairing_required:
 
     info("%s: Found ProductVersion %s device %s", __func__, version_str, serial);
 
+    checkCancelled();
     lockdownd_set_untrusted_host_buid(lockdown);
     if ((lret = lockdownd_pair(lockdown, NULL)) == LOCKDOWN_E_SUCCESS) {
         info("%s: Pair success for device %s", __func__, serial);
@@ -205,6 +275,7 @@ pairing_required:
             reterror("%s: Device %s in unexpected pair state %d", __func__, serial,lret);
     }
 
+    checkCancelled();
     retassure((lret = lockdownd_start_service(lockdown, "com.apple.mobile.insecure_notification_proxy", &service)) == LOCKDOWN_E_SUCCESS, "%s: ERROR: Could not start insecure_notification_proxy on %s, lockdown error %d", __func__, serial, lret);
 
     assure(!(npret = np_client_new(dev, service, &np)));
@@ -227,4 +298,12 @@ pairing_required:
     cb_data = NULL; //cb_data ownership transfered to pairing_callback
     return;
 }
+
+void preflight_set_verified_session_ttl(uint32_t seconds) noexcept{
+    gVerifiedSessionTTL = seconds;
+    if (!seconds) {
+        std::unique_lock<std::mutex> ul(gVerifiedSessionsLck);
+        gVerifiedSessions.clear();
+    }
+}
 #endif
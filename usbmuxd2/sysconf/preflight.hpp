@@ -8,6 +8,18 @@
 #ifndef preflight_hpp
 #define preflight_hpp
 
-void preflight_device(const char *serial, int id);
+#include <atomic>
+
+/*
+    If cancelled is given, it is checked between lockdown steps
+    and the preflight is aborted with an exception once it is set.
+ */
+void preflight_device(const char *serial, int id, const std::atomic_bool *cancelled = nullptr);
+
+/*
+    A device which completed a lockdown session with an unchanged pair record
+    less than seconds ago is not preflighted again. 0 disables the cache.
+ */
+void preflight_set_verified_session_ttl(uint32_t seconds) noexcept;
 
 #endif /* preflight_hpp */
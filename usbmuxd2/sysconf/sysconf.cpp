@@ -16,6 +16,16 @@
 #include <dirent.h>
 #include <string.h>
 #include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <libgeneral/Event.hpp>
+
+#ifdef __linux__
+#   include <sys/inotify.h>
+#endif //__linux__
 
 #define CONFIG_DIR  "lockdown"
 #define CONFIG_FILE "SystemConfiguration"
@@ -29,8 +39,36 @@
 #   define BASE_CONFIG_DIR "/var/lib"
 #endif
 
-static std::map<std::string,std::string> gKnownMacAddrs;
-static std::mutex gKnownMacAddrsLck;
+static std::unordered_map<std::string,std::string> gKnownMacAddrs;  //macaddr -> udid
+static std::unordered_map<std::string,std::string> gMacAddrForUdid; //udid -> macaddr
+static std::shared_mutex gKnownMacAddrsLck;
+static bool gKnownMacAddrsLoaded = false;
+
+struct cached_record{
+    plist_t record;
+    std::shared_ptr<const std::string> bin;
+    //used to validate the entry when there is no directory watcher
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    cached_record() : record(NULL), ino(0), size(0), mtime{} {}
+    ~cached_record(){
+        safeFreeCustom(record, plist_free);
+    }
+};
+static std::map<std::string,std::shared_ptr<const cached_record>> gRecordCache;
+static std::mutex gRecordCacheLck;
+static uint64_t gRecordCacheGeneration = 0; //bumped on every invalidation, guarded by gRecordCacheLck
+static std::atomic_bool gRecordWatchActive{false};
+
+//write-behind, newest not yet written version of each record
+static std::map<std::string,std::shared_ptr<const cached_record>> gPendingWrites;
+static std::mutex gPendingWritesLck;
+static tihmstar::Event gPendingWritesEvent;
+static std::mutex gRecordFileLck; //serializes writing and removing record files
+static bool gBinaryRecords = false;
+static uint32_t gRecordWriteDelayMs = 0; //0 means write-through
 
 const char *sysconf_get_config_dir(){
     static bool didCheckConfigEnv = false;
@@ -70,6 +108,114 @@ static plist_t readPlist(const char *filePath){
     }
 }
 
+static void macaddr_index_reload(const std::string &udid) noexcept;
+
+#pragma mark record cache
+static void cached_record_set_stat(cached_record &rec, const struct stat &st) noexcept{
+    rec.ino = st.st_ino;
+    rec.size = st.st_size;
+#ifdef __APPLE__
+    rec.mtime = st.st_mtimespec;
+#else
+    rec.mtime = st.st_mtim;
+#endif
+}
+
+static bool cached_record_matches(const cached_record &rec, const struct stat &st) noexcept{
+    return rec.ino == st.st_ino && rec.size == st.st_size
+#ifdef __APPLE__
+        && rec.mtime.tv_sec == st.st_mtimespec.tv_sec && rec.mtime.tv_nsec == st.st_mtimespec.tv_nsec;
+#else
+        && rec.mtime.tv_sec == st.st_mtim.tv_sec && rec.mtime.tv_nsec == st.st_mtim.tv_nsec;
+#endif
+}
+
+/*
+    Our own writes wake up the watcher too, those don't need to be read back.
+ */
+static bool record_cache_is_current(const std::string &name) noexcept{
+    std::shared_ptr<const cached_record> rec;
+    std::string filepath = sysconf_get_config_dir();
+    struct stat st = {};
+    {
+        std::unique_lock<std::mutex> ul(gRecordCacheLck);
+        auto it = gRecordCache.find(name);
+        if (it != gRecordCache.end()) rec = it->second;
+    }
+    if (!rec) return false;
+    filepath += '/';
+    filepath += name;
+    filepath += ".plist";
+    if (stat(filepath.c_str(), &st)) return false;
+    return cached_record_matches(*rec, st);
+}
+
+static void record_cache_invalidate(const std::string &name) noexcept{
+    std::unique_lock<std::mutex> ul(gRecordCacheLck);
+    gRecordCacheGeneration++;
+    if (name.size()) {
+        gRecordCache.erase(name);
+    } else {
+        gRecordCache.clear();
+    }
+}
+
+#ifdef __linux__
+static void record_cache_watcher(int ifd) noexcept{
+    alignas(struct inotify_event) char buf[0x1000];
+    cleanup([&]{
+        safeClose(ifd);
+    });
+    while (true) {
+        ssize_t len = read(ifd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) continue;
+            error("record cache watcher died (%s), falling back to stat validation",strerror(errno));
+            gRecordWatchActive = false;
+            record_cache_invalidate("");
+            return;
+        }
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                record_cache_invalidate("");
+                macaddr_index_reload("");
+            } else if (ev->len) {
+                std::string name = ev->name;
+                size_t dotPos = name.rfind(".plist");
+                if (dotPos == std::string::npos || dotPos + sizeof(".plist")-1 != name.size()) continue;
+                debug("record cache: %s changed on disk",name.c_str());
+                name = name.substr(0,dotPos);
+                if (record_cache_is_current(name)) continue;
+                record_cache_invalidate(name);
+                if (name != CONFIG_FILE) macaddr_index_reload(name);
+            }
+        }
+    }
+}
+#endif //__linux__
+
+static void record_cache_start_watcher(const char *config_path) noexcept{
+#ifdef __linux__
+    static std::once_flag once;
+    std::call_once(once, [config_path]{
+        int ifd = -1;
+        if ((ifd = inotify_init1(IN_CLOEXEC)) == -1) {
+            warning("inotify_init1 failed (%s), pair records are validated with stat",strerror(errno));
+            return;
+        }
+        if (inotify_add_watch(ifd, config_path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) == -1) {
+            warning("inotify_add_watch(%s) failed (%s), pair records are validated with stat",config_path,strerror(errno));
+            close(ifd);
+            return;
+        }
+        gRecordWatchActive = true;
+        std::thread(record_cache_watcher, ifd).detach();
+    });
+#endif //__linux__
+}
+
 static void mkdir_with_parents(const char *dir, int mode){
     char *parent = NULL;
     cleanup([&]{
@@ -130,15 +276,77 @@ std::string get_device_record_path(const char *udid){
     return ret;
 }
 
-static void sysconf_load_known_macaddrs(){
-    std::unique_lock<std::mutex> ul(gKnownMacAddrsLck);
+#pragma mark macaddr index
+static bool macaddr_from_record(plist_t p_devrecord, std::string &macaddr) noexcept{
+    plist_t p_macaddr = NULL;
+    const char *str = NULL;
+    uint64_t str_len = 0;
+    if (!(p_macaddr = plist_dict_get_item(p_devrecord, "WiFiMACAddress"))) return false;
+    if (!(str = plist_get_string_ptr(p_macaddr, &str_len))) return false;
+    macaddr = std::string(str,str_len);
+    return true;
+}
+
+/*
+    Replaces whatever the index knows about udid with the macaddr from p_devrecord.
+    Pass NULL to drop udid from the index.
+    Caller must hold gKnownMacAddrsLck exclusively.
+ */
+static void macaddr_index_update_locked(const std::string &udid, plist_t p_devrecord) noexcept{
+    std::string macaddr;
+    {
+        auto old = gMacAddrForUdid.find(udid);
+        if (old != gMacAddrForUdid.end()) {
+            auto it = gKnownMacAddrs.find(old->second);
+            if (it != gKnownMacAddrs.end() && it->second == udid) gKnownMacAddrs.erase(it);
+            gMacAddrForUdid.erase(old);
+        }
+    }
+    if (!p_devrecord || !macaddr_from_record(p_devrecord, macaddr)) return;
+    debug("adding macaddr=%s for uuid=%s",macaddr.c_str(),udid.c_str());
+    gKnownMacAddrs[macaddr] = udid;
+    gMacAddrForUdid[udid] = macaddr;
+}
+
+static void macaddr_index_update(const std::string &udid, plist_t p_devrecord) noexcept{
+    std::unique_lock<std::shared_mutex> ul(gKnownMacAddrsLck);
+    if (!gKnownMacAddrsLoaded) return; //will be picked up by the initial scan
+    macaddr_index_update_locked(udid, p_devrecord);
+}
+
+/*
+    Re-reads a single record after it was changed outside of sysconf.
+    An empty udid means we lost track and the next lookup rescans everything.
+ */
+static void macaddr_index_reload(const std::string &udid) noexcept{
+    plist_t p_devrecord = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_devrecord, plist_free);
+    });
+    if (!udid.size()) {
+        std::unique_lock<std::shared_mutex> ul(gKnownMacAddrsLck);
+        gKnownMacAddrsLoaded = false;
+        return;
+    }
+    try {
+        p_devrecord = readPlist(get_device_record_path(udid.c_str()).c_str());
+    } catch (tihmstar::exception &e) {
+        //record is gone (or unreadable), drop it from the index
+    }
+    macaddr_index_update(udid, p_devrecord);
+}
+
+/*
+    Full scan of the config dir, only done once (or after the watcher lost track of changes).
+    Caller must hold gKnownMacAddrsLck exclusively.
+ */
+static void sysconf_load_known_macaddrs_locked(){
     const char *config_path = sysconf_get_config_dir();
 
     sysconf_create_config_dir();
 
     gKnownMacAddrs.clear();
-
-    std::string sysconfigpath = get_device_record_path(CONFIG_FILE);
+    gMacAddrForUdid.clear();
 
     {
         DIR *dir = NULL;
@@ -152,118 +360,349 @@ static void sysconf_load_known_macaddrs(){
         while ((ent = readdir (dir)) != NULL) {
             if (ent->d_type != DT_REG)
                 continue;
+            std::string name = ent->d_name;
+            size_t dotPos = name.find(".");
+            std::string uuid = name.substr(0,dotPos);
+
+            if (dotPos == std::string::npos || name.substr(dotPos) != ".plist")
+                continue; //ignore leftover temporary files
+
+            if (uuid == CONFIG_FILE)
+                continue; //ignore sysconfig file
+
             std::string path = config_path;
             path+= "/";
-            path+= ent->d_name;
-            
-            if (path == sysconfigpath)
-                continue; //ignore sysconfig file
-            
+            path+= name;
+
             debug("reading file=%s\n",path.c_str());
             try{ //we ignore any error happening in here
                 plist_t p_devrecord = NULL;
                 cleanup([&]{
                     safeFreeCustom(p_devrecord, plist_free);
                 });
-                plist_t p_macaddr = NULL;
-                std::string macaddr;
-
                 p_devrecord = readPlist(path.c_str());
-                
-                retassure(p_macaddr = plist_dict_get_item(p_devrecord, "WiFiMACAddress"), "Failed to read macaddr from pairing record");
-                
-                {
-                    const char *str = NULL;
-                    uint64_t str_len = 0;
-                    retassure(str = plist_get_string_ptr(p_macaddr, &str_len), "Faile to get str ptr from MacAddress");
-                    macaddr = std::string(str,str_len);
-                }
-                
-                size_t lastSlashPos = path.find_last_of("/")+1;
-                size_t dotPos = path.find(".");
-
-                std::string uuid = path.substr(lastSlashPos,dotPos-lastSlashPos);
-                debug("adding macaddr=%s for uuid=%s",macaddr.c_str(),uuid.c_str());
-                
-                gKnownMacAddrs[macaddr] = uuid;
-                
+                macaddr_index_update_locked(uuid, p_devrecord);
             } catch (tihmstar::exception &e){
                 debug("failed to read record with error=%d (%s)",e.code(),e.what());
             }
-            
         }
     }
-    
+    gKnownMacAddrsLoaded = true;
 }
 
 
-void writePlistToFile(plist_t plist, const char *dst){
+/*
+    Writes to a temporary file next to dst, syncs it and renames it over dst.
+    After a crash dst is either the old or the new version, never a partial one.
+ */
+static void writePlistToFile(plist_t plist, const char *dst){
     char *buf = NULL;
-    FILE * saveFile = NULL;
+    int fd = -1;
+    int dfd = -1;
+    std::string tmpPath; //only set once the temporary file exists, so dst is never unlinked
+    bool didRename = false;
     cleanup([&]{
         safeFree(buf);
-        safeFreeCustom(saveFile, fclose);
+        safeClose(dfd);
+        if (fd != -1) {
+            close(fd);
+        }
+        if (!didRename && tmpPath.size()) {
+            unlink(tmpPath.c_str());
+        }
     });
     uint32_t bufLen = 0;
-    plist_to_xml(plist, &buf, &bufLen);
-    
-    retassure(saveFile = fopen(dst, "w"), "Failed to write plist file to=%s",dst);
-    assure(fwrite(buf, 1, bufLen, saveFile) == bufLen);
+    std::string dir = dst;
+
+    if (gBinaryRecords) {
+        plist_to_bin(plist, &buf, &bufLen);
+    } else {
+        plist_to_xml(plist, &buf, &bufLen);
+    }
+    retassure(buf, "Failed to serialize plist for %s",dst);
+
+    {
+        std::string tmpl = dst;
+        tmpl += ".XXXXXX";
+        retassure((fd = mkstemp(&tmpl[0])) != -1, "Failed to create temporary file for %s: %s",dst,strerror(errno));
+        tmpPath = tmpl;
+    }
+    assure(!fchmod(fd, 0644));
+    for (uint32_t didWrite = 0; didWrite < bufLen;) {
+        ssize_t cnt = write(fd, buf+didWrite, bufLen-didWrite);
+        if (cnt < 0 && errno == EINTR) continue;
+        retassure(cnt > 0, "Failed to write plist file to=%s: %s",tmpPath.c_str(),strerror(errno));
+        didWrite += cnt;
+    }
+    retassure(!fsync(fd), "Failed to sync %s: %s",tmpPath.c_str(),strerror(errno));
+    {
+        int f = fd; fd = -1;
+        retassure(!close(f), "Failed to write plist file to=%s",tmpPath.c_str());
+    }
+    retassure(!rename(tmpPath.c_str(), dst), "Failed to move %s to %s: %s",tmpPath.c_str(),dst,strerror(errno));
+    didRename = true;
+
+    //make the rename itself durable
+    dir = dir.substr(0,dir.rfind('/')+1);
+    if ((dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY)) != -1) {
+        fsync(dfd);
+    }
 }
 
-plist_t sysconf_get_value(const std::string &key){
-    plist_t p_devrecord = NULL;
+/*
+    Takes ownership of record.
+ */
+static std::shared_ptr<const cached_record> make_cached_record(plist_t record, const struct stat &st){
+    std::shared_ptr<cached_record> rec;
+    char *bin = NULL;
     cleanup([&]{
-        safeFreeCustom(p_devrecord, plist_free);
+        safeFree(bin);
+        safeFreeCustom(record, plist_free);
     });
+    uint32_t binSize = 0;
+
+    rec = std::make_shared<cached_record>();
+    rec->record = record; record = NULL;
+    plist_to_bin(rec->record, &bin, &binSize);
+    retassure(bin, "Failed to serialize record");
+    rec->bin = std::make_shared<const std::string>(bin, binSize);
+    cached_record_set_stat(*rec, st);
+    return rec;
+}
+
+static std::shared_ptr<const cached_record> sysconf_get_cached_record(const char *name){
+    std::string filepath = get_device_record_path(name);
+    std::shared_ptr<const cached_record> ret;
+    uint64_t generation = 0;
+    struct stat st = {};
+
+    record_cache_start_watcher(sysconf_get_config_dir());
+
+    {
+        std::unique_lock<std::mutex> ul(gPendingWritesLck);
+        auto it = gPendingWrites.find(name);
+        if (it != gPendingWrites.end()) return it->second;
+    }
+
+    {
+        std::unique_lock<std::mutex> ul(gRecordCacheLck);
+        generation = gRecordCacheGeneration;
+        auto it = gRecordCache.find(name);
+        if (it != gRecordCache.end()) ret = it->second;
+    }
+
+    if (ret && gRecordWatchActive) return ret;
+
+    retassure(!stat(filepath.c_str(), &st), "Failed to stat record at path '%s'",filepath.c_str());
+    if (ret && cached_record_matches(*ret, st)) return ret;
+
+    ret = make_cached_record(readPlist(filepath.c_str()), st);
+
+    {
+        //don't cache something which was invalidated while we were reading it
+        std::unique_lock<std::mutex> ul(gRecordCacheLck);
+        if (generation == gRecordCacheGeneration) gRecordCache[name] = ret;
+    }
+    return ret;
+}
+
+#pragma mark write-behind
+/*
+    Caller must hold gRecordFileLck.
+    Returns false if the record couldn't be written, it then stays queued for the next flush.
+ */
+static bool record_write_locked(const std::string &name, std::shared_ptr<const cached_record> rec){
+    std::string filepath = get_device_record_path(name.c_str());
+    std::shared_ptr<cached_record> written;
+    struct stat st = {};
+    {
+        //a newer version or a removal superseded this one
+        std::unique_lock<std::mutex> ul(gPendingWritesLck);
+        auto it = gPendingWrites.find(name);
+        if (it == gPendingWrites.end() || it->second != rec) return true;
+    }
+    try {
+        writePlistToFile(rec->record, filepath.c_str());
+    } catch (tihmstar::exception &e) {
+        error("Failed to write record '%s' with error=%d (%s), keeping it queued",name.c_str(),e.code(),e.what());
+        return false;
+    }
+    //publish what we just wrote before dropping it from the queue, so lookups never have to read it back
+    record_cache_invalidate(name);
+    if (!stat(filepath.c_str(), &st)) {
+        written = std::make_shared<cached_record>();
+        written->record = plist_copy(rec->record);
+        written->bin = rec->bin;
+        cached_record_set_stat(*written, st);
+        std::unique_lock<std::mutex> cl(gRecordCacheLck);
+        gRecordCache[name] = written;
+    }
+    {
+        std::unique_lock<std::mutex> ul(gPendingWritesLck);
+        auto it = gPendingWrites.find(name);
+        if (it != gPendingWrites.end() && it->second == rec) gPendingWrites.erase(it);
+    }
+    return true;
+}
+
+/*
+    Returns false if any record is still queued because writing it failed.
+ */
+static bool record_flush() noexcept{
+    std::map<std::string,std::shared_ptr<const cached_record>> pending;
+    bool ret = true;
+    {
+        std::unique_lock<std::mutex> ul(gPendingWritesLck);
+        pending = gPendingWrites;
+    }
+    for (auto &p : pending) {
+        std::unique_lock<std::mutex> fl(gRecordFileLck);
+        if (!record_write_locked(p.first, p.second)) ret = false;
+    }
+    return ret;
+}
+
+static void record_writer_runloop() noexcept{
+    constexpr uint32_t maxRetryDelayMs = 30000;
+    uint32_t delayMs = gRecordWriteDelayMs;
+    std::unique_lock<std::mutex> ul(gPendingWritesLck);
+    while (true) {
+        while (!gPendingWrites.size()) {
+            uint64_t wevent = gPendingWritesEvent.getNextEvent();
+            ul.unlock();
+            gPendingWritesEvent.waitForEvent(wevent);
+            ul.lock();
+        }
+        ul.unlock();
+        //let the burst settle, everything queued meanwhile goes out with this flush
+        std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+        if (record_flush()) {
+            delayMs = gRecordWriteDelayMs;
+        } else if ((delayMs *= 2) > maxRetryDelayMs) {
+            //back off while the disk is full or read-only, the records stay readable from memory
+            delayMs = maxRetryDelayMs;
+        }
+        ul.lock();
+    }
+}
+
+/*
+    Takes ownership of record.
+    Readers see the new version immediately, the file is written
+    after gRecordWriteDelayMs, coalescing all updates to the same record in between.
+ */
+static void record_write(const std::string &name, plist_t record){
+    std::shared_ptr<const cached_record> rec;
+    struct stat st = {};
+
+    if (!gRecordWriteDelayMs) {
+        std::string filepath = get_device_record_path(name.c_str());
+        cleanup([&]{
+            safeFreeCustom(record, plist_free);
+        });
+        std::unique_lock<std::mutex> fl(gRecordFileLck);
+        writePlistToFile(record, filepath.c_str());
+        record_cache_invalidate(name);
+        //publish what we just wrote, so the next lookup doesn't have to read it back
+        if (!stat(filepath.c_str(), &st)) {
+            plist_t r = record; record = NULL;
+            rec = make_cached_record(r, st);
+            std::unique_lock<std::mutex> cl(gRecordCacheLck);
+            gRecordCache[name] = rec;
+        }
+        return;
+    }
+
+    rec = make_cached_record(record, st);
+    {
+        static std::once_flag once;
+        std::call_once(once, []{
+            std::thread(record_writer_runloop).detach();
+        });
+    }
+    std::unique_lock<std::mutex> ul(gPendingWritesLck);
+    gPendingWrites[name] = rec;
+    gPendingWritesEvent.notifyAll();
+}
+
+void sysconf_flush_pending_writes() noexcept{
+    if (!record_flush()) {
+        std::unique_lock<std::mutex> ul(gPendingWritesLck);
+        for (auto &p : gPendingWrites) {
+            error("Record '%s' could not be written and is lost",p.first.c_str());
+        }
+    }
+}
+
+plist_t sysconf_get_device_record(const char *udid){
+    return plist_copy(sysconf_get_cached_record(udid)->record);
+}
+
+std::shared_ptr<const std::string> sysconf_get_device_record_bin(const char *udid){
+    return sysconf_get_cached_record(udid)->bin;
+}
+
+#pragma mark SystemConfiguration
+/*
+    SystemConfiguration lives in the record cache like any pair record.
+    After the first parse lookups are served from memory,
+    external edits are picked up through the same invalidation path.
+ */
+static std::mutex gSysconfWriteLck;
+
+plist_t sysconf_get_value(const std::string &key){
+    std::shared_ptr<const cached_record> rec = sysconf_get_cached_record(CONFIG_FILE);
     plist_t p_val = NULL;
-    std::string filepath = get_device_record_path(CONFIG_FILE);
-    
-    p_devrecord = readPlist(filepath.c_str());
-    
-    retassure(p_val = plist_dict_get_item(p_devrecord, key.c_str()), "Failed to get value for key '%s'",key.c_str());
+
+    retassure(p_val = plist_dict_get_item(rec->record, key.c_str()), "Failed to get value for key '%s'",key.c_str());
 
     return plist_copy(p_val);
 }
 
 void sysconf_set_value(const std::string &key, plist_t val){
+    std::unique_lock<std::mutex> ul(gSysconfWriteLck);
     plist_t p_sysconf = NULL;
     cleanup([&]{
         safeFreeCustom(p_sysconf, plist_free);
     });
-    std::string filepath = get_device_record_path(CONFIG_FILE);
     
     try {
-        p_sysconf = readPlist(filepath.c_str());
+        p_sysconf = plist_copy(sysconf_get_cached_record(CONFIG_FILE)->record);
     } catch (tihmstar::exception &e) {
         warning("%s: Reading %s failed! Regenerating!",__func__,CONFIG_FILE);
         p_sysconf = plist_new_dict();
     }
     
     plist_dict_set_item(p_sysconf, key.c_str(), plist_copy(val));
-    writePlistToFile(p_sysconf, filepath.c_str());
-}
-
-
-plist_t sysconf_get_device_record(const char *udid){
-    std::string filepath = get_device_record_path(udid);
-    return readPlist(filepath.c_str());
+    {
+        plist_t p = p_sysconf; p_sysconf = NULL;
+        record_write(CONFIG_FILE, p);
+    }
 }
 
 void sysconf_set_device_record(const char *udid, const plist_t record){
     assure(udid);
     assure(record);
-    std::string filepath = get_device_record_path(udid);
     
-    writePlistToFile(record, filepath.c_str());
-    sysconf_load_known_macaddrs();
+    record_write(udid, plist_copy(record));
+    macaddr_index_update(udid, record);
 }
 
 void sysconf_remove_device_record(const char *udid){
     std::string filepath = get_device_record_path(udid);
+    bool wasPending = false;
     
-    retassure(!remove(filepath.c_str()), "could not remove %s: %s", filepath.c_str(), strerror(errno));
-    sysconf_load_known_macaddrs();
+    {
+        std::unique_lock<std::mutex> fl(gRecordFileLck);
+        {
+            std::unique_lock<std::mutex> ul(gPendingWritesLck);
+            wasPending = gPendingWrites.erase(udid);
+        }
+        //a record which was only ever pending has no file yet
+        retassure(!remove(filepath.c_str()) || (wasPending && errno == ENOENT), "could not remove %s: %s", filepath.c_str(), strerror(errno));
+    }
+    record_cache_invalidate(udid);
+    macaddr_index_update(udid, NULL);
 }
 
 
@@ -294,13 +733,20 @@ std::string sysconf_get_system_buid(){
 }
 
 std::string sysconf_udid_for_macaddr(std::string macaddr){
-    if (!gKnownMacAddrs.size()){
-        sysconf_load_known_macaddrs();
+    {
+        std::shared_lock<std::shared_mutex> sl(gKnownMacAddrsLck);
+        if (gKnownMacAddrsLoaded) {
+            auto it = gKnownMacAddrs.find(macaddr);
+            retassure(it != gKnownMacAddrs.end(), "macaddr=%s is not paired",macaddr.c_str());
+            return it->second;
+        }
     }
-    try{
-        return gKnownMacAddrs.at(macaddr);
-    }catch (...){
-        reterror("macaddr=%s is not paired",macaddr.c_str());
+    {
+        std::unique_lock<std::shared_mutex> ul(gKnownMacAddrsLck);
+        if (!gKnownMacAddrsLoaded) sysconf_load_known_macaddrs_locked();
+        auto it = gKnownMacAddrs.find(macaddr);
+        retassure(it != gKnownMacAddrs.end(), "macaddr=%s is not paired",macaddr.c_str());
+        return it->second;
     }
 }
 
@@ -348,17 +794,51 @@ bool sysconf_try_getconfig_bool(std::string key, bool defaultValue){
     }
 }
 
+uint64_t sysconf_try_getconfig_uint(std::string key, uint64_t defaultValue){
+    plist_t p_intVal = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_intVal, plist_free);
+    });
+    try {
+        uint64_t ret = 0;
+        p_intVal = sysconf_get_value(key);
+        assure(plist_get_node_type(p_intVal) == PLIST_UINT);
+        plist_get_uint_val(p_intVal, &ret);
+        return ret;
+    } catch (tihmstar::exception &e) {
+        warning("Failed to get %s! setting it to default val",key.c_str());
+        p_intVal = plist_new_uint(defaultValue);
+        sysconf_set_value(key, p_intVal);
+        return defaultValue;
+    }
+}
+
 Config::Config() :
 //config
 doPreflight(false),
 allowHeartlessWifi(false),
 enableWifiDeviceManager(false),
 enableUSBDeviceManager(false),
+listenBacklog(0),
+deviceIDReuseDelay(0),
+preflightWorkers(0),
+preflightSessionCacheTTL(0),
+binaryRecords(false),
+recordWriteDelay(0),
+wifiRemovalGrace(0),
+wifiResolveCacheTTL(0),
 //commandline
 enableExit(false),
 daemonize(false),
 useLogfile(false),
-debugLevel(0)
+debugLevel(0),
+simulateUSBDevices(0),
+simUSBVersion(2),
+simUSBWindow(0x20000),
+simUSBLatency(0),
+simUSBBandwidth(0),
+simUSBReorder(false),
+simUSBSplit(false)
 {
     //empty
 }
@@ -368,5 +848,16 @@ void Config::load(){
     doPreflight = sysconf_try_getconfig_bool("doPreflight",true);
     enableWifiDeviceManager = sysconf_try_getconfig_bool("enableWifiDeviceManager",true);
     enableUSBDeviceManager = sysconf_try_getconfig_bool("enableUSBDeviceManager",true);
+    listenBacklog = (int)sysconf_try_getconfig_uint("listenBacklog",128);
+    deviceIDReuseDelay = (uint32_t)sysconf_try_getconfig_uint("deviceIDReuseDelay",30);
+    preflightWorkers = (uint32_t)sysconf_try_getconfig_uint("preflightWorkers",4);
+    preflightSessionCacheTTL = (uint32_t)sysconf_try_getconfig_uint("preflightSessionCacheTTL",120);
+    binaryRecords = sysconf_try_getconfig_bool("binaryRecords",false);
+    recordWriteDelay = (uint32_t)sysconf_try_getconfig_uint("recordWriteDelay",50);
+    wifiRemovalGrace = (uint32_t)sysconf_try_getconfig_uint("wifiRemovalGrace",500);
+    wifiResolveCacheTTL = (uint32_t)sysconf_try_getconfig_uint("wifiResolveCacheTTL",120);
+
+    gBinaryRecords = binaryRecords;
+    gRecordWriteDelayMs = recordWriteDelay;
     info("Loaded config");
 }
@@ -10,10 +10,19 @@
 
 #include <plist/plist.h>
 #include <iostream>
+#include <memory>
 
 plist_t sysconf_get_device_record(const char *udid);
+/*
+    Binary plist encoding of the record, served from memory when cached.
+ */
+std::shared_ptr<const std::string> sysconf_get_device_record_bin(const char *udid);
 void sysconf_set_device_record(const char *udid, const plist_t record);
 void sysconf_remove_device_record(const char *udid);
+/*
+    Writes all records queued by the write-behind to disk.
+ */
+void sysconf_flush_pending_writes() noexcept;
 
 std::string sysconf_get_system_buid();
 std::string sysconf_udid_for_macaddr(std::string macaddr);
@@ -27,6 +36,14 @@ public:
     bool allowHeartlessWifi;
     bool enableWifiDeviceManager;
     bool enableUSBDeviceManager;
+    int listenBacklog;
+    uint32_t deviceIDReuseDelay;
+    uint32_t preflightWorkers;
+    uint32_t preflightSessionCacheTTL;
+    bool binaryRecords;         //store records as binary plists
+    uint32_t recordWriteDelay;  //ms to coalesce record writes, 0 writes through
+    uint32_t wifiRemovalGrace;  //ms a vanished WiFi service may take to come back before its device is removed
+    uint32_t wifiResolveCacheTTL; //upper bound in seconds for reusing resolved WiFi services, 0 disables
 
     //commandline
     bool enableExit;
@@ -34,6 +51,14 @@ public:
     bool useLogfile;
     int debugLevel;
     std::string dropUser;
+    int simulateUSBDevices;     //replace real USB devices with this many simulated ones
+    uint32_t simUSBVersion;     //mux version of simulated USB devices
+    uint32_t simUSBWindow;      //TCP window in bytes advertised by simulated USB devices
+    uint32_t simUSBLatency;     //us each packet from a simulated USB device is delayed
+    uint64_t simUSBBandwidth;   //bytes per second a simulated USB device can send, 0 is unlimited
+    bool simUSBReorder;         //let simulated USB devices deliver packets out of order
+    bool simUSBSplit;           //let simulated USB devices send packets larger than one IN transfer
+    std::string metricsListen;  //port on 127.0.0.1 or unix socket path to serve OpenMetrics on, empty disables
     
     Config();
     void load();
@@ -0,0 +1,227 @@
+//
+//  relaytest.cpp
+//  usbmuxd2
+//
+
+/*
+    Relay tests, run by 'make check'.
+    Each case relays between one end of a unix socketpair, which stands in for the client,
+    and a TCP connection to a server on 127.0.0.1, which stands in for the network device.
+ */
+
+#include "../Relay.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <chrono>
+#include <functional>
+#include <thread>
+
+#define BULK_SIZE       (3*1024*1024)
+#define SLOW_SEGMENT    100
+#define SLOW_SIZE       (10240*SLOW_SEGMENT)
+#define SLOW_PACE_US    100
+#define SLOW_STALL_MS   1000
+#define SLOW_MAX_WAKEUPS 100
+
+#pragma mark helpers
+static uint8_t pattern(size_t off){
+    return (uint8_t)(off*7 + (off>>12));
+}
+
+static void write_all(int fd, const uint8_t *buf, size_t len){
+    while (len) {
+        ssize_t cnt = write(fd, buf, len);
+        if (cnt < 0 && errno == EINTR) continue;
+        retassure(cnt > 0, "write failed with error=%d (%s)",errno,strerror(errno));
+        buf += cnt;
+        len -= cnt;
+    }
+}
+
+/*
+    Reads until EOF and checks every byte against pattern(), returns the number of bytes read.
+ */
+static size_t read_and_verify(int fd){
+    uint8_t buf[0x4000];
+    size_t total = 0;
+    while (true) {
+        ssize_t cnt = read(fd, buf, sizeof(buf));
+        if (cnt < 0 && errno == EINTR) continue;
+        retassure(cnt >= 0, "read failed with error=%d (%s)",errno,strerror(errno));
+        if (cnt == 0) break;
+        for (ssize_t i = 0; i < cnt; i++) {
+            retassure(buf[i] == pattern(total+i), "byte %zu differs (got 0x%02x, expected 0x%02x)",total+i,buf[i],pattern(total+i));
+        }
+        total += cnt;
+    }
+    return total;
+}
+
+/*
+    Runs serve() on the accepted end of a TCP connection on 127.0.0.1 and hands out the connecting end.
+ */
+class TCPServer{
+    int _listenfd;
+    int _connfd;
+    std::thread _thread;
+public:
+    TCPServer(std::function<void(int fd)> serve)
+    : _listenfd(-1), _connfd(-1)
+    {
+        struct sockaddr_in addr = {};
+        socklen_t addrlen = sizeof(addr);
+        int one = 1;
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        retassure((_listenfd = socket(AF_INET, SOCK_STREAM, 0)) != -1, "failed to create listen socket");
+        retassure(!bind(_listenfd, (struct sockaddr*)&addr, sizeof(addr)), "failed to bind with error=%d (%s)",errno,strerror(errno));
+        retassure(!listen(_listenfd, 1), "failed to listen with error=%d (%s)",errno,strerror(errno));
+        retassure(!getsockname(_listenfd, (struct sockaddr*)&addr, &addrlen), "failed to get listen address");
+        retassure((_connfd = socket(AF_INET, SOCK_STREAM, 0)) != -1, "failed to create socket");
+        retassure(!connect(_connfd, (struct sockaddr*)&addr, sizeof(addr)), "failed to connect with error=%d (%s)",errno,strerror(errno));
+        setsockopt(_connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        _thread = std::thread([this, serve]{
+            int fd = accept(_listenfd, NULL, NULL);
+            if (fd == -1) return;
+            try {
+                serve(fd);
+            } catch (tihmstar::exception &e) {
+                fprintf(stderr, "server failed: %s\n", e.what());
+            }
+            close(fd);
+        });
+    }
+    ~TCPServer(){
+        if (_listenfd != -1) shutdown(_listenfd, SHUT_RDWR);
+        _thread.join();
+        safeClose(_listenfd);
+        safeClose(_connfd);
+    }
+    /*
+        Passes ownership of the connecting end to the caller.
+     */
+    int takeConnection() noexcept{
+        int fd = _connfd;
+        _connfd = -1;
+        return fd;
+    }
+};
+
+#pragma mark tests
+/*
+    Echoes BULK_SIZE bytes through the relay and checks they come back unchanged.
+ */
+static void test_bulk_echo(){
+    TCPServer server([](int fd){
+        uint8_t buf[0x4000];
+        ssize_t cnt = 0;
+        while ((cnt = read(fd, buf, sizeof(buf))) > 0) write_all(fd, buf, cnt);
+        shutdown(fd, SHUT_WR);
+    });
+    Relay relay;
+    int sv[2] = {-1,-1};
+    std::thread writer;
+    cleanup([&]{
+        //on failure this unblocks the writer, tearing down the relay then unblocks the server
+        if (sv[0] != -1) shutdown(sv[0], SHUT_RDWR);
+        if (writer.joinable()) writer.join();
+        safeClose(sv[0]);
+    });
+
+    retassure(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv), "socketpair failed with error=%d (%s)",errno,strerror(errno));
+    relay.startLoop();
+    relay.add(sv[1], server.takeConnection(), 1);
+
+    writer = std::thread([&]{
+        uint8_t *buf = (uint8_t*)malloc(BULK_SIZE);
+        for (size_t i = 0; i < BULK_SIZE; i++) buf[i] = pattern(i);
+        try {
+            write_all(sv[0], buf, BULK_SIZE);
+        } catch (tihmstar::exception &e) {
+            fprintf(stderr, "client writer failed: %s\n", e.what());
+        }
+        shutdown(sv[0], SHUT_WR);
+        free(buf);
+    });
+
+    size_t got = read_and_verify(sv[0]);
+    retassure(got == BULK_SIZE, "received %zu bytes, expected %d",got,BULK_SIZE);
+}
+
+/*
+    The device sends small segments while the client doesn't read.
+    Segments are paced so each one ends up in a pipe buffer of its own, the pipe then fills up long before chunkSize.
+    Once the client's socket is full the relay must go to sleep instead of spinning on the readable device socket.
+ */
+static void test_slow_reader(){
+    TCPServer server([](int fd){
+        uint8_t buf[SLOW_SEGMENT];
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        for (size_t off = 0; off < SLOW_SIZE; off += SLOW_SEGMENT) {
+            for (size_t i = 0; i < SLOW_SEGMENT; i++) buf[i] = pattern(off+i);
+            write_all(fd, buf, SLOW_SEGMENT);
+            usleep(SLOW_PACE_US);
+        }
+        shutdown(fd, SHUT_WR);
+    });
+    Relay relay;
+    int sv[2] = {-1,-1};
+    cleanup([&]{
+        safeClose(sv[0]);
+    });
+
+    retassure(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv), "socketpair failed with error=%d (%s)",errno,strerror(errno));
+    relay.startLoop();
+    relay.add(sv[1], server.takeConnection(), 1);
+
+    //let the buffers fill up
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    {
+        uint64_t before = relay.getStats().wakeups;
+        std::this_thread::sleep_for(std::chrono::milliseconds(SLOW_STALL_MS));
+        uint64_t wakeups = relay.getStats().wakeups - before;
+        retassure(wakeups <= SLOW_MAX_WAKEUPS, "relay woke up %" PRIu64 " times in %dms while the client wasn't reading",wakeups,SLOW_STALL_MS);
+    }
+
+    size_t got = read_and_verify(sv[0]);
+    retassure(got == SLOW_SIZE, "received %zu bytes, expected %d",got,SLOW_SIZE);
+}
+
+#pragma mark main
+int main(int argc, const char * argv[]) {
+    static const struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"bulk_echo", test_bulk_echo},
+        {"slow_reader", test_slow_reader},
+    };
+    int failed = 0;
+    log_level = LL_ERROR;
+    signal(SIGPIPE, SIG_IGN);
+
+    for (auto &t : tests) {
+        try {
+            t.run();
+            printf("PASS: %s\n", t.name);
+        } catch (tihmstar::exception &e) {
+            printf("FAIL: %s: %s\n", t.name, e.what());
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}